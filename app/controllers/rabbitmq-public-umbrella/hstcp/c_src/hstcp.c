@@ -54,10 +54,21 @@
 #define DATA_SPEC_LEN          18
 #define SMALL_DATA_SPEC_LEN    17
 #define WATERMARK_SPEC_LEN     16
+#define TIMEOUT_SPEC_LEN       16
 
 #define WRITE_COMMAND_PREFIX_LENGTH 9
 #define DEFAULT_IOV_MAX 16
 
+#define SLAB_BATCH          32
+#define SLAB_CACHE_MAX      128
+#define SLAB_DEPOT_MAX      1024
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  4
+
 #ifndef SOL_TCP
 # define SOL_TCP IPPROTO_TCP
 #endif
@@ -65,14 +76,39 @@
 #define MIN(x,y) (x)<(y)?(x):(y)
 #define MAX(x,y) (x)>(y)?(x):(y)
 
+typedef struct _FreeObject {
+  struct _FreeObject *next;
+} FreeObject;
+
 typedef struct {
-  ErlDrvPort     port;               /* driver port                                    */
-  ErlDrvTermData pid;                /* driver pid                                     */
+  FreeObject *head;
+  int64_t     count;
+} FreeList;
 
-  ErlDrvTermData event;              /* 'hstcp_event'                                  */
-  ErlDrvTermData reply;              /* 'hstcp_reply'                                  */
-  ErlDrvMutex *  send_term_mutex;    /* mutex for safely sending back to Erlang        */
+typedef struct {
+  size_t       size;                 /* size of the objects in this slab              */
+  ErlDrvMutex *mutex;                /* protects depot                                */
+  FreeList     depot;                /* objects being passed between threads          */
+} Slab;
+
+typedef struct _WheelTimer {
+  struct _WheelTimer *next;          /* NULL when not in the wheel                     */
+  struct _WheelTimer *prev;
+  uint64_t            expires;       /* absolute tick at which the timer fires         */
+  int                 fd;
+  TimerType           type;
+} WheelTimer;
 
+typedef struct {
+  uint64_t   now;                    /* next tick to be processed                      */
+  int64_t    count;                  /* number of timers in the wheel                  */
+  WheelTimer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE]; /* list heads                */
+} TimerWheel;
+
+/* Each thread that sends terms back to Erlang has its own set of
+   specs, which it patches in place whilst sending. Thus no locking is
+   needed so long as no two threads share a set. */
+typedef struct {
   /* {'hstcp_event', {Port, Fd}, 'no_such_command'}                                    */
   ErlDrvTermData *no_such_command_spec;
 
@@ -106,6 +142,20 @@ typedef struct {
   /* {'hstcp_event', {Port, Fd}, {'high_watermark', High}}                             */
   ErlDrvTermData *high_watermark_spec;
 
+  /* {'hstcp_event', {Port, Fd}, {'timeout', Interval}}                                */
+  ErlDrvTermData *timeout_spec;
+} TermSpecs;
+
+typedef struct {
+  ErlDrvPort     port;               /* driver port                                    */
+  ErlDrvTermData pid;                /* driver pid                                     */
+
+  ErlDrvTermData event;              /* 'hstcp_event'                                  */
+  ErlDrvTermData reply;              /* 'hstcp_reply'                                  */
+
+  TermSpecs      driver_specs;       /* only used by the emulator, under the port lock */
+  TermSpecs      loop_specs;         /* only used by our ev loop thread                */
+
   struct ev_loop *epoller;           /* our ev loop                                    */
   ErlDrvTid      tid;                /* the thread running our ev loop                 */
   ev_async *     async_watcher;      /* the async watcher used to talk to our thread   */
@@ -115,6 +165,13 @@ typedef struct {
   Pvoid_t        sockets;            /* the Judy array to store state of FDs in        */
   ErlDrvMutex *  sockets_mutex;      /* mutex for safely accessing sockets             */
   ErlDrvCond *   cond;               /* conditional for signalling from thread to drv  */
+  Slab           action_slab;        /* SocketActions                                  */
+  FreeList       driver_actions;     /* only used by the emulator, under the port lock */
+  FreeList       loop_actions;       /* only used by our ev loop thread                */
+  Slab           entry_slab;         /* SocketEntries, only used by our ev loop thread */
+  FreeList       loop_entries;
+  TimerWheel *   wheel;              /* heartbeat timers, only touched by our thread   */
+  ev_timer *     wheel_watcher;      /* drives the wheel whilst it has timers in it    */
   int            iov_max;
   int            socket_entry_serial;
 } HstcpData;
@@ -134,11 +191,18 @@ typedef struct {
   int64_t        quota;
   int64_t        pending_writes;
   ErlDrvMutex *  mutex;
-  ErlIOVec *     ev;
-  ev_io *        watcher;
+  ErlIOVec       ev;
+  ev_io          watcher;            /* the write watcher                           */
   int64_t        low;
   int64_t        high;
   WatermarkLevel watermark;
+  int64_t        send_interval;      /* heartbeat intervals in ms, -1 when disabled */
+  int64_t        recv_interval;
+  ErlDrvBinary * heartbeat;          /* the frame to send, or NULL                  */
+  ev_tstamp      last_send;
+  ev_tstamp      last_recv;
+  WheelTimer     send_timer;
+  WheelTimer     recv_timer;
 } ConnectedSocket;
 
 typedef union {
@@ -149,7 +213,7 @@ typedef union {
 typedef struct {
   SocketType     type;
   int            fd;
-  ev_io *        watcher;
+  ev_io          watcher;
   ErlDrvTermData pid;
   Socket         socket;
   int            serial;
@@ -166,10 +230,18 @@ typedef struct {
   ErlDrvCond *     cond;
   ErlDrvMutex *    mutex;
   ErlDrvTermData   pid;
+  const int64_t *  fds;              /* targets of HSTCP_ASYNC_WRITE_MULTI */
 } SocketAction;
 
 uint8_t hstcp_invalid_command = HSTCP_INVALID_COMMAND;
 
+/* Terms are only ever sent from the emulator (which holds the port
+   lock whilst in our callbacks) or from our ev loop thread. */
+TermSpecs *term_specs(HstcpData *const sd) {
+  return erl_drv_equal_tids(erl_drv_thread_self(), sd->tid) ?
+    &(sd->loop_specs) : &(sd->driver_specs);
+}
+
 
 /**********************
  *  Reader Functions  *
@@ -283,13 +355,107 @@ void return_reader_error(HstcpData *const sd, const Reader *const reader) {
       error_str = "Unknown error";
     }
   }
-  erl_drv_mutex_lock(sd->send_term_mutex);
-  sd->reader_error_spec[11] = (ErlDrvTermData)error_str;
-  sd->reader_error_spec[12] = (ErlDrvUInt)strlen(error_str);
-  driver_send_term(sd->port, sd->pid, sd->reader_error_spec, STRING_ERROR_SPEC_LEN);
-  sd->reader_error_spec[11] = (ErlDrvTermData)NULL;
-  sd->reader_error_spec[12] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
+  ts->reader_error_spec[11] = (ErlDrvTermData)error_str;
+  ts->reader_error_spec[12] = (ErlDrvUInt)strlen(error_str);
+  driver_send_term(sd->port, sd->pid, ts->reader_error_spec, STRING_ERROR_SPEC_LEN);
+  ts->reader_error_spec[11] = (ErlDrvTermData)NULL;
+  ts->reader_error_spec[12] = 0;
+}
+
+
+/********************
+ *  Slab Functions  *
+ ********************/
+
+/* Fixed size objects are recycled through free lists rather than
+   going back to driver_alloc every time. A FreeList is only ever used
+   by one thread (or only under the port lock, for the emulator) and
+   so needs no locking. Objects freed on one thread and needed on
+   another are passed in batches through the slab's depot, which is
+   locked. Passing a NULL FreeList uses the depot directly. */
+
+void free_list_init(FreeList *const fl) {
+  fl->head = NULL;
+  fl->count = 0;
+}
+
+void free_list_push(FreeList *const fl, void *const obj) {
+  FreeObject *const fo = (FreeObject *)obj;
+  fo->next = fl->head;
+  fl->head = fo;
+  ++(fl->count);
+}
+
+void *free_list_pop(FreeList *const fl) {
+  FreeObject *const fo = fl->head;
+  if (NULL != fo) {
+    fl->head = fo->next;
+    --(fl->count);
+  }
+  return fo;
+}
+
+void free_list_move(FreeList *const dest, FreeList *const src, int64_t n) {
+  while (0 < n-- && NULL != src->head)
+    free_list_push(dest, free_list_pop(src));
+}
+
+void free_list_clear(FreeList *const fl) {
+  void *obj = NULL;
+  while (NULL != (obj = free_list_pop(fl)))
+    driver_free(obj);
+}
+
+int slab_init(Slab *const slab, const size_t size, char *const name) {
+  slab->size = size;
+  free_list_init(&(slab->depot));
+  slab->mutex = erl_drv_mutex_create(name);
+  return NULL != slab->mutex;
+}
+
+void slab_destroy(Slab *const slab) {
+  free_list_clear(&(slab->depot));
+  erl_drv_mutex_destroy(slab->mutex);
+}
+
+void *slab_alloc(Slab *const slab, FreeList *const cache,
+                 const ErlDrvPort port) {
+  void *obj = NULL;
+  if (NULL == cache) {
+    erl_drv_mutex_lock(slab->mutex);
+    obj = free_list_pop(&(slab->depot));
+    erl_drv_mutex_unlock(slab->mutex);
+  } else {
+    if (0 == cache->count) {
+      erl_drv_mutex_lock(slab->mutex);
+      free_list_move(cache, &(slab->depot), SLAB_BATCH);
+      erl_drv_mutex_unlock(slab->mutex);
+    }
+    obj = free_list_pop(cache);
+  }
+  if (NULL == obj) {
+    obj = driver_alloc(slab->size);
+    if (NULL == obj)
+      driver_failure(port, -1);
+  }
+  return obj;
+}
+
+void slab_free(Slab *const slab, FreeList *const cache, void *const obj) {
+  if (NULL != cache) {
+    free_list_push(cache, obj);
+    if (SLAB_CACHE_MAX >= cache->count)
+      return;
+  }
+  erl_drv_mutex_lock(slab->mutex);
+  if (NULL == cache)
+    free_list_push(&(slab->depot), obj);
+  else
+    free_list_move(&(slab->depot), cache, SLAB_BATCH);
+  while (SLAB_DEPOT_MAX < slab->depot.count)
+    driver_free(free_list_pop(&(slab->depot)));
+  erl_drv_mutex_unlock(slab->mutex);
 }
 
 
@@ -308,8 +474,10 @@ void await_epoller(HstcpData *const sd) {
   await_non_null((const void const* const*)&(sd->epoller), sd);
 }
 
+/* Only called from our ev loop thread. */
 void mark_done_and_signal(SocketAction *sa) {
   ErlDrvMutex *const mutex = sa->mutex;
+  HstcpData *const sd = sa->sd;
   if (NULL != mutex) {
     erl_drv_mutex_lock(mutex);
   }
@@ -325,7 +493,7 @@ void mark_done_and_signal(SocketAction *sa) {
     erl_drv_mutex_unlock(mutex);
   }
   if (free_when_done)
-    driver_free(sa);
+    slab_free(&(sd->action_slab), &(sd->loop_actions), sa);
 }
 
 void await_done(SocketAction *sa) {
@@ -356,15 +524,16 @@ void socket_action_new(SocketAction *const sa,
   sa->cond = cond;
   sa->mutex = mutex;
   sa->pid = pid;
+  sa->fds = NULL;
 }
 
 SocketAction *socket_action_alloc(const uint8_t type, const int fd,
                                   ErlDrvCond *const cond,
                                   ErlDrvMutex *const mutex,
-                                  ErlDrvTermData pid, HstcpData *const sd) {
-  SocketAction *sa = (SocketAction *)driver_alloc(sizeof(SocketAction));
-  if (NULL == sa)
-    driver_failure(sd->port, -1);
+                                  ErlDrvTermData pid, HstcpData *const sd,
+                                  FreeList *const cache) {
+  SocketAction *sa =
+    (SocketAction *)slab_alloc(&(sd->action_slab), cache, sd->port);
   socket_action_new(sa, type, fd, cond, mutex, pid, sd);
   sa->free_when_done = TRUE;
   return sa;
@@ -403,98 +572,208 @@ void command_dequeue(SocketAction **sa, HstcpData *const sd) {
 }
 
 
+/***************************
+ *  Timer Wheel Functions  *
+ ***************************/
+
+/* The wheel is only ever touched from the ev loop thread, so needs no
+   locking. Level 0 has one slot per tick. Each slot at level n covers
+   TIMER_WHEEL_SIZE slots of level n-1, and is cascaded down into the
+   lower levels each time level n-1 wraps around. Thus adding and
+   removing a timer is O(1), and a tick only ever looks at the timers
+   that are (nearly) due. */
+
+uint64_t timer_wheel_tick(const ev_tstamp now) {
+  return (uint64_t)(now * 1000.0) / TIMER_WHEEL_TICK_MS;
+}
+
+void timer_wheel_init(TimerWheel *const tw) {
+  tw->now = 0;
+  tw->count = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+    for (int idx = 0; idx < TIMER_WHEEL_SIZE; ++idx) {
+      tw->slots[level][idx].next = &(tw->slots[level][idx]);
+      tw->slots[level][idx].prev = &(tw->slots[level][idx]);
+    }
+  }
+}
+
+void timer_init(WheelTimer *const timer, const int fd, const TimerType type) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->fd = fd;
+  timer->type = type;
+}
+
+void timer_wheel_link(TimerWheel *const tw, WheelTimer *const timer) {
+  const uint64_t max_delta =
+    ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  uint64_t expires = timer->expires;
+  int level = 0;
+
+  if (expires < tw->now) {
+    /* already overdue: fire on the next tick processed */
+    expires = tw->now;
+  } else if (expires - tw->now > max_delta) {
+    expires = tw->now + max_delta;
+  }
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         expires - tw->now >=
+         ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+    ++level;
+  }
+
+  WheelTimer *const head =
+    &(tw->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) &
+                       TIMER_WHEEL_MASK]);
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void timer_wheel_unlink(WheelTimer *const timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+static void hstcp_ev_wheel_cb(EV_P_ ev_timer *, int);
+
+void timer_wheel_add(HstcpData *const sd, WheelTimer *const timer,
+                     const uint64_t expires) {
+  TimerWheel *const tw = sd->wheel;
+  if (NULL != timer->next)
+    timer_wheel_unlink(timer);
+  else
+    ++(tw->count);
+
+  if (! ev_is_active(sd->wheel_watcher)) {
+    /* the wheel has been idle, so there's nothing in it to be
+       disturbed by fast-forwarding it to the current time */
+    tw->now = timer_wheel_tick(ev_now(sd->epoller));
+    ev_timer_start(sd->epoller, sd->wheel_watcher);
+  }
+
+  timer->expires = expires;
+  timer_wheel_link(tw, timer);
+}
+
+void timer_wheel_del(HstcpData *const sd, WheelTimer *const timer) {
+  if (NULL != timer->next) {
+    timer_wheel_unlink(timer);
+    --(sd->wheel->count);
+  }
+}
+
+int timer_wheel_cascade(TimerWheel *const tw, const int level, const int idx) {
+  WheelTimer *const head = &(tw->slots[level][idx]);
+  while (head->next != head) {
+    WheelTimer *const timer = head->next;
+    timer_wheel_unlink(timer);
+    timer_wheel_link(tw, timer);
+  }
+  return idx;
+}
+
+
 /****************************
  *  Sending back to Erlang  *
  ****************************/
 
 void return_socket_low_watermark(HstcpData *const sd, const int fd,
                                  ErlDrvTermData pid, const int64_t low) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
-  sd->low_watermark_spec[5] = (ErlDrvSInt)fd;
-  sd->low_watermark_spec[11] = (ErlDrvSInt)low;
-  driver_send_term(sd->port, pid, sd->low_watermark_spec, WATERMARK_SPEC_LEN);
-  sd->low_watermark_spec[5] = 0;
-  sd->low_watermark_spec[11] = (ErlDrvSInt)0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
+  ts->low_watermark_spec[5] = (ErlDrvSInt)fd;
+  ts->low_watermark_spec[11] = (ErlDrvSInt)low;
+  driver_send_term(sd->port, pid, ts->low_watermark_spec, WATERMARK_SPEC_LEN);
+  ts->low_watermark_spec[5] = 0;
+  ts->low_watermark_spec[11] = (ErlDrvSInt)0;
 }
 
 void return_socket_high_watermark(HstcpData *const sd, const int fd,
                                   ErlDrvTermData pid, const int64_t high) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
-  sd->high_watermark_spec[5] = (ErlDrvSInt)fd;
-  sd->high_watermark_spec[11] = (ErlDrvSInt)high;
-  driver_send_term(sd->port, pid, sd->high_watermark_spec, WATERMARK_SPEC_LEN);
-  sd->high_watermark_spec[5] = 0;
-  sd->high_watermark_spec[11] = (ErlDrvSInt)0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
+  ts->high_watermark_spec[5] = (ErlDrvSInt)fd;
+  ts->high_watermark_spec[11] = (ErlDrvSInt)high;
+  driver_send_term(sd->port, pid, ts->high_watermark_spec, WATERMARK_SPEC_LEN);
+  ts->high_watermark_spec[5] = 0;
+  ts->high_watermark_spec[11] = (ErlDrvSInt)0;
+}
+
+void return_socket_timeout(HstcpData *const sd, const int fd,
+                           ErlDrvTermData pid, const int64_t interval) {
+  TermSpecs *const ts = term_specs(sd);
+  ts->timeout_spec[5] = (ErlDrvSInt)fd;
+  ts->timeout_spec[11] = (ErlDrvSInt)interval;
+  driver_send_term(sd->port, pid, ts->timeout_spec, TIMEOUT_SPEC_LEN);
+  ts->timeout_spec[5] = 0;
+  ts->timeout_spec[11] = (ErlDrvSInt)0;
 }
 
 void return_socket_closed_pid(HstcpData *const sd, const int fd,
                               ErlDrvTermData pid, const SendType type) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
   if (REPLY == type)
-    sd->closed_spec[1] = sd->reply;
+    ts->closed_spec[1] = sd->reply;
   else
-    sd->closed_spec[1] = sd->event;
-  sd->closed_spec[5] = (ErlDrvSInt)fd;
-  driver_send_term(sd->port, pid, sd->closed_spec, ATOM_SPEC_LEN);
-  sd->closed_spec[5] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+    ts->closed_spec[1] = sd->event;
+  ts->closed_spec[5] = (ErlDrvSInt)fd;
+  driver_send_term(sd->port, pid, ts->closed_spec, ATOM_SPEC_LEN);
+  ts->closed_spec[5] = 0;
 }
 
 void return_badarg_pid(HstcpData *const sd, const int fd,
                        ErlDrvTermData pid, const SendType type) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
   if (REPLY == type)
-    sd->badarg_spec[1] = sd->reply;
+    ts->badarg_spec[1] = sd->reply;
   else
-    sd->badarg_spec[1] = sd->event;
-  sd->badarg_spec[5] = (ErlDrvSInt)fd;
-  driver_send_term(sd->port, pid, sd->badarg_spec, ATOM_SPEC_LEN);
-  sd->badarg_spec[5] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+    ts->badarg_spec[1] = sd->event;
+  ts->badarg_spec[5] = (ErlDrvSInt)fd;
+  driver_send_term(sd->port, pid, ts->badarg_spec, ATOM_SPEC_LEN);
+  ts->badarg_spec[5] = 0;
 }
 
 void return_socket_error_pid(HstcpData *const sd, const int fd, const int error,
                              ErlDrvTermData pid, const SendType type) {
   const char* error_str = strerror(error);
-  erl_drv_mutex_lock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
   if (REPLY == type)
-    sd->socket_error_spec[1] = sd->reply;
+    ts->socket_error_spec[1] = sd->reply;
   else
-    sd->socket_error_spec[1] = sd->event;
-  sd->socket_error_spec[5] = (ErlDrvSInt)fd;
-  sd->socket_error_spec[11] = (ErlDrvTermData)error_str;
-  sd->socket_error_spec[12] = (ErlDrvUInt)strlen(error_str);
-  driver_send_term(sd->port, pid, sd->socket_error_spec, STRING_ERROR_SPEC_LEN);
-  sd->socket_error_spec[5] = (ErlDrvSInt)0;
-  sd->socket_error_spec[11] = (ErlDrvTermData)NULL;
-  sd->socket_error_spec[12] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+    ts->socket_error_spec[1] = sd->event;
+  ts->socket_error_spec[5] = (ErlDrvSInt)fd;
+  ts->socket_error_spec[11] = (ErlDrvTermData)error_str;
+  ts->socket_error_spec[12] = (ErlDrvUInt)strlen(error_str);
+  driver_send_term(sd->port, pid, ts->socket_error_spec, STRING_ERROR_SPEC_LEN);
+  ts->socket_error_spec[5] = (ErlDrvSInt)0;
+  ts->socket_error_spec[11] = (ErlDrvTermData)NULL;
+  ts->socket_error_spec[12] = 0;
 }
 
 void return_ok_pid(HstcpData *const sd, const int fd,
                    const ErlDrvTermData pid) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
-  sd->ok_spec[5] = fd;
-  driver_send_term(sd->port, pid, sd->ok_spec, ATOM_SPEC_LEN);
-  sd->ok_spec[5] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
+  ts->ok_spec[5] = fd;
+  driver_send_term(sd->port, pid, ts->ok_spec, ATOM_SPEC_LEN);
+  ts->ok_spec[5] = 0;
 }
 
 void return_new_fd(HstcpData *const sd, ErlDrvTermData pid,
                    const int old_fd, const int new_fd, const SendType type) {
-  erl_drv_mutex_lock(sd->send_term_mutex);
+  TermSpecs *const ts = term_specs(sd);
   if (REPLY == type)
-    sd->new_fd_spec[1] = sd->reply;
+    ts->new_fd_spec[1] = sd->reply;
   else
-    sd->new_fd_spec[1] = sd->event;
-  sd->new_fd_spec[5] = old_fd;
-  sd->new_fd_spec[13] = new_fd;
-  driver_send_term(sd->port, pid, sd->new_fd_spec, NEW_FD_SPEC_LEN);
-  sd->new_fd_spec[5] = 0;
-  sd->new_fd_spec[13] = 0;
-  erl_drv_mutex_unlock(sd->send_term_mutex);
+    ts->new_fd_spec[1] = sd->event;
+  ts->new_fd_spec[5] = old_fd;
+  ts->new_fd_spec[13] = new_fd;
+  driver_send_term(sd->port, pid, ts->new_fd_spec, NEW_FD_SPEC_LEN);
+  ts->new_fd_spec[5] = 0;
+  ts->new_fd_spec[13] = 0;
 }
 
 
@@ -605,7 +884,8 @@ void socket_connect(HstcpData *const sd, Reader *const reader) {
   }
 
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_SOCKET, connect_fd,
-                                         NULL, NULL, sd->pid, sd);
+                                         NULL, NULL, sd->pid, sd,
+                                         &(sd->driver_actions));
   sa->value = CONNECTED_SOCKET;
   command_enqueue_and_notify(sa, sd);
 }
@@ -659,7 +939,8 @@ void socket_listen(HstcpData *const sd, Reader *const reader) {
   }
 
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_SOCKET, listen_fd,
-                                         NULL, NULL, sd->pid, sd);
+                                         NULL, NULL, sd->pid, sd,
+                                         &(sd->driver_actions));
   sa->value = LISTEN_SOCKET;
   command_enqueue_and_notify(sa, sd);
 }
@@ -671,7 +952,8 @@ void socket_close(HstcpData *const sd, Reader *const reader) {
     return;
   }
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_CLOSE, (int)*fd64_ptr,
-                                         NULL, NULL, sd->pid, sd);
+                                         NULL, NULL, sd->pid, sd,
+                                         &(sd->driver_actions));
   command_enqueue_and_notify(sa, sd);
 }
 
@@ -682,7 +964,8 @@ void socket_accept(HstcpData *const sd, Reader *const reader) {
     return;
   }
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_ACCEPT, (int)*fd64_ptr,
-                                         NULL, NULL, sd->pid, sd);
+                                         NULL, NULL, sd->pid, sd,
+                                         &(sd->driver_actions));
   command_enqueue_and_notify(sa, sd);
 }
 
@@ -694,7 +977,8 @@ void socket_recv(HstcpData *const sd, Reader *const reader) {
     return;
   }
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_RECV, (int)*fd64_ptr,
-                                         NULL, NULL, sd->pid, sd);
+                                         NULL, NULL, sd->pid, sd,
+                                         &(sd->driver_actions));
   sa->value = *bytes_ptr;
   command_enqueue_and_notify(sa, sd);
 }
@@ -702,7 +986,8 @@ void socket_recv(HstcpData *const sd, Reader *const reader) {
 void async_socket_write(SocketAction *const sa) {
   const int fd = sa->fd;
   HstcpData *const sd = sa->sd;
-  mark_done_and_signal(sa);
+  /* we're on an async thread, so sa goes back via the depot */
+  slab_free(&(sd->action_slab), NULL, sa);
 
   SocketEntry **se_ptr = NULL;
   SocketEntry *se = NULL;
@@ -721,7 +1006,7 @@ void async_socket_write(SocketAction *const sa) {
       /* huh, nothing to write after all. Oh well */
       erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
     } else {
-      ErlIOVec *ev_ptr = se->socket.connected_socket.ev;
+      ErlIOVec *ev_ptr = &(se->socket.connected_socket.ev);
       int err = 0;
       /* printf("before:\r\n"); */
       /* dump_ev(ev_ptr); */
@@ -737,17 +1022,19 @@ void async_socket_write(SocketAction *const sa) {
         erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
 
         SocketAction *sa1 = socket_action_alloc(HSTCP_ASYNC_INCOMPLETE_WRITE, fd,
-                                                NULL, NULL, pid, sd);
+                                                NULL, NULL, pid, sd, NULL);
         command_enqueue_and_notify(sa1, sd);
 
       } else if (0 > written) {
-        return_socket_error_pid(sd, fd, err, pid, EVENT);
         erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
 
         close(fd);
 
+        /* we have no term specs of our own in the async threads, so
+           the ev loop thread reports the error for us */
         SocketAction *sa1 = socket_action_alloc(HSTCP_ASYNC_DESTROY_SOCKET, fd,
-                                                NULL, NULL, pid, sd);
+                                                NULL, NULL, pid, sd, NULL);
+        sa1->value = err;
         command_enqueue_and_notify(sa1, sd);
 
       } else if (written == ready) {
@@ -763,7 +1050,8 @@ void async_socket_write(SocketAction *const sa) {
         erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
 
         SocketAction *sa1 = socket_action_alloc(HSTCP_ASYNC_CHECK_WATERMARKS,
-                                                fd, NULL, NULL, pid, sd);
+                                                fd, NULL, NULL, pid, sd,
+                                                NULL);
         command_enqueue_and_notify(sa1, sd);
 
       } else {
@@ -824,7 +1112,7 @@ void async_socket_write(SocketAction *const sa) {
         erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
 
         SocketAction *sa1 = socket_action_alloc(HSTCP_ASYNC_INCOMPLETE_WRITE, fd,
-                                                NULL, NULL, pid, sd);
+                                                NULL, NULL, pid, sd, NULL);
         command_enqueue_and_notify(sa1, sd);
       }
     }
@@ -855,6 +1143,52 @@ void socket_write(HstcpData *const sd, Reader *const reader) {
   await_done(&sa);
 }
 
+void socket_write_multi(HstcpData *const sd, Reader *const reader) {
+  const uint64_t *count_ptr = NULL;
+  const char *fds = NULL;
+  if (! (read_uint64(reader, &count_ptr) &&
+         (0 == *count_ptr ||
+          read_simple_thing(reader, &fds, *count_ptr * sizeof(int64_t))))) {
+    return_reader_error(sd, reader);
+    return;
+  }
+  return_ok_pid(sd, 0, sd->pid);
+  /* failures for individual targets are sent as events */
+
+  if (0 == *count_ptr)
+    return;
+
+  /* The payload starts wherever the reader stopped. Present it to the
+     libev thread as an ErlIOVec of its own, sharing the iov and binv
+     of ev. As with socket_write, ev must stay put until the libev
+     thread is done with it. */
+  ErlIOVec *const ev = reader->ev;
+  size_t row = reader->row;
+  size_t column = reader->column;
+  if (ev->binv[row]->orig_size == column) {
+    ++row;
+    column = 0;
+  }
+  ErlIOVec payload;
+  payload.vsize = ev->vsize - row;
+  payload.size = 0;
+  payload.iov = &(ev->iov[row]);
+  payload.binv = &(ev->binv[row]);
+  if (0 < payload.vsize) {
+    payload.iov[0].iov_len -= column;
+    payload.iov[0].iov_base = (char *)payload.iov[0].iov_base + column;
+  }
+
+  SocketAction sa;
+  socket_action_new(&sa, HSTCP_ASYNC_WRITE_MULTI, 0,
+                    sd->cond, sd->command_mutex, sd->pid, sd);
+  sa.ev = &payload;
+  sa.value = (int64_t)*count_ptr;
+  sa.fds = (const int64_t *)fds;
+  command_enqueue_and_notify(&sa, sd);
+  await_done(&sa);
+}
+
 void socket_set_options(HstcpData *const sd, Reader *const reader) {
   const ErlDrvTermData pid = sd->pid;
   const int64_t *fd64_ptr = NULL;
@@ -881,7 +1215,8 @@ void socket_set_options(HstcpData *const sd, Reader *const reader) {
     erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
     return_ok_pid(sd, fd, pid);
     SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_CHECK_WATERMARKS, fd,
-                                           NULL, NULL, pid, sd);
+                                           NULL, NULL, pid, sd,
+                                           &(sd->driver_actions));
     command_enqueue_and_notify(sa, sd);
   } else {
     erl_drv_mutex_unlock(sd->sockets_mutex);
@@ -889,6 +1224,60 @@ void socket_set_options(HstcpData *const sd, Reader *const reader) {
   }
 }
 
+void socket_set_heartbeat(HstcpData *const sd, Reader *const reader) {
+  const ErlDrvTermData pid = sd->pid;
+  const int64_t *fd64_ptr = NULL;
+  const int64_t *send_ptr = NULL;
+  const int64_t *recv_ptr = NULL;
+  const char *frame = NULL;
+  const uint64_t *frame_len = NULL;
+  if (! (read_int64(reader, &fd64_ptr) &&
+         read_int64(reader, &send_ptr) &&
+         read_int64(reader, &recv_ptr) &&
+         read_binary(reader, &frame, &frame_len))) {
+    return_reader_error(sd, reader);
+    return;
+  }
+  int fd = (int)*fd64_ptr;
+
+  /* copy the frame out now, whilst we're not holding any locks */
+  ErlDrvBinary *heartbeat = NULL;
+  if (0 < *frame_len) {
+    heartbeat = driver_alloc_binary(*frame_len);
+    if (NULL == heartbeat)
+      driver_failure(sd->port, -1);
+    memcpy(heartbeat->orig_bytes, frame, *frame_len);
+  }
+
+  erl_drv_mutex_lock(sd->sockets_mutex);
+  SocketEntry **se_ptr = NULL;
+  JLG(se_ptr, sd->sockets, fd);
+  if (NULL != se_ptr && NULL != *se_ptr &&
+      pid == (*se_ptr)->pid && CONNECTED_SOCKET == (*se_ptr)->type) {
+    SocketEntry *se = *se_ptr;
+    erl_drv_mutex_lock(se->socket.connected_socket.mutex);
+    erl_drv_mutex_unlock(sd->sockets_mutex);
+    se->socket.connected_socket.send_interval = *send_ptr;
+    se->socket.connected_socket.recv_interval = *recv_ptr;
+    /* any heartbeat already in the write queue holds its own ref */
+    if (NULL != se->socket.connected_socket.heartbeat)
+      driver_free_binary(se->socket.connected_socket.heartbeat);
+    se->socket.connected_socket.heartbeat = heartbeat;
+    erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
+    return_ok_pid(sd, fd, pid);
+    /* the timers themselves belong to the ev loop thread */
+    SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_HEARTBEAT, fd,
+                                           NULL, NULL, pid, sd,
+                                           &(sd->driver_actions));
+    command_enqueue_and_notify(sa, sd);
+  } else {
+    erl_drv_mutex_unlock(sd->sockets_mutex);
+    if (NULL != heartbeat)
+      driver_free_binary(heartbeat);
+    return_badarg_pid(sd, fd, pid, REPLY); /* programmer messed up */
+  }
+}
+
 /***********************
  *  ev_loop callbacks  *
  ***********************/
@@ -938,24 +1327,60 @@ void check_watermarks(const int fd, HstcpData *const sd) {
   }
 }
 
+/* Must be called from the ev loop thread, holding the socket's
+   mutex. Takes a ref on each of the binaries. Returns TRUE if the
+   socket's write queue was empty, in which case the caller must call
+   socket_start_writer once it has released the mutex. */
+int socket_enqueue_writes(HstcpData *const sd, SocketEntry *const se,
+                          const SysIOVec *const iov,
+                          ErlDrvBinary *const *const binv, const int count) {
+  ErlIOVec *ev_ptr = &(se->socket.connected_socket.ev);
+  const int old_offset = ev_ptr->vsize;
+  const int total_length = old_offset + count;
+
+  ev_ptr->iov = driver_realloc(ev_ptr->iov, total_length * sizeof(SysIOVec));
+  if (NULL == ev_ptr->iov)
+    driver_failure(sd->port, -1);
+
+  ev_ptr->binv = driver_realloc(ev_ptr->binv,
+                                total_length * sizeof(ErlDrvBinary *));
+  if (NULL == ev_ptr->binv)
+    driver_failure(sd->port, -1);
+
+  for (int idx = 0; idx < count; ++idx) {
+    driver_binary_inc_refc(binv[idx]);
+    ev_ptr->iov[old_offset + idx] = iov[idx];
+    ev_ptr->binv[old_offset + idx] = binv[idx];
+    se->socket.connected_socket.pending_writes += (int64_t)iov[idx].iov_len;
+  }
+  ev_ptr->vsize = total_length;
+  se->socket.connected_socket.last_send = ev_now(sd->epoller);
+
+  return 0 == old_offset;
+}
+
+void socket_start_writer(HstcpData *const sd, const int fd,
+                         const ErlDrvTermData pid) {
+  SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_WRITE, fd,
+                                         NULL, NULL, pid, sd,
+                                         &(sd->loop_actions));
+  driver_async(sd->port, (unsigned int *)&(sa->fd),
+               (void (*)(void *))async_socket_write, sa, NULL);
+}
+
 static void hstcp_ev_socket_write_cb(EV_P_ ev_io *, int);
 static void hstcp_ev_socket_read_cb(EV_P_ ev_io *, int);
 static void hstcp_ev_listen_cb(EV_P_ ev_io *, int);
 
 SocketEntry *socket_entry_alloc(const int fd, ErlDrvTermData pid,
                                 HstcpData *const sd) {
-  SocketEntry *const se = (SocketEntry*)driver_alloc(sizeof(SocketEntry));
-  if (NULL == se)
-    driver_failure(sd->port, -1);
+  SocketEntry *const se =
+    (SocketEntry*)slab_alloc(&(sd->entry_slab), &(sd->loop_entries), sd->port);
 
   se->serial = ++(sd->socket_entry_serial);
   se->fd = fd;
   se->pid = pid;
 
-  se->watcher = (ev_io*)driver_alloc(sizeof(ev_io));
-  if (NULL == se->watcher)
-    driver_failure(sd->port, -1);
-
   return se;
 }
 
@@ -964,8 +1389,8 @@ SocketEntry *listen_socket_create(const int fd, ErlDrvTermData pid,
   SocketEntry *const se = socket_entry_alloc(fd, pid, sd);
   se->type = LISTEN_SOCKET;
   se->socket.listen_socket.acceptors = (Pvoid_t)NULL;
-  ev_io_init(se->watcher, hstcp_ev_listen_cb, fd, EV_READ);
-  se->watcher->data = sd;
+  ev_io_init(&(se->watcher), hstcp_ev_listen_cb, fd, EV_READ);
+  se->watcher.data = sd;
 
   return se;
 }
@@ -979,31 +1404,32 @@ SocketEntry *connected_socket_create(const int fd, ErlDrvTermData pid,
   se->socket.connected_socket.high = -1;
   se->socket.connected_socket.low = -1;
   se->socket.connected_socket.watermark = UNKNOWN_WATERMARK;
-  se->socket.connected_socket.ev =
-    (ErlIOVec *)driver_alloc(sizeof(ErlIOVec));
-  if (NULL == se->socket.connected_socket.ev)
-    driver_failure(sd->port, -1);
-  se->socket.connected_socket.ev->vsize = 0;
+  se->socket.connected_socket.send_interval = -1;
+  se->socket.connected_socket.recv_interval = -1;
+  se->socket.connected_socket.heartbeat = NULL;
+  se->socket.connected_socket.last_send = ev_now(sd->epoller);
+  se->socket.connected_socket.last_recv = ev_now(sd->epoller);
+  timer_init(&(se->socket.connected_socket.send_timer), fd,
+             HEARTBEAT_SEND_TIMER);
+  timer_init(&(se->socket.connected_socket.recv_timer), fd,
+             HEARTBEAT_RECV_TIMER);
+  se->socket.connected_socket.ev.vsize = 0;
   /* although size isn't even used as it's too small */
-  se->socket.connected_socket.ev->size = 0;
-  se->socket.connected_socket.ev->iov = NULL;
-  se->socket.connected_socket.ev->binv = NULL;
+  se->socket.connected_socket.ev.size = 0;
+  se->socket.connected_socket.ev.iov = NULL;
+  se->socket.connected_socket.ev.binv = NULL;
   se->socket.connected_socket.mutex = erl_drv_mutex_create("hstcp socket mutex");
   if (NULL == se->socket.connected_socket.mutex)
     driver_failure(sd->port, -1);
 
-  /* create the write watcher */
-  se->socket.connected_socket.watcher = (ev_io*)driver_alloc(sizeof(ev_io));
-  if (NULL == se->socket.connected_socket.watcher)
-    driver_failure(sd->port, -1);
-
-  ev_io_init(se->socket.connected_socket.watcher, hstcp_ev_socket_write_cb, fd,
-             EV_WRITE);
-  se->socket.connected_socket.watcher->data = sd;
+  /* setup the write watcher */
+  ev_io_init(&(se->socket.connected_socket.watcher), hstcp_ev_socket_write_cb,
+             fd, EV_WRITE);
+  se->socket.connected_socket.watcher.data = sd;
 
-  /* setup the read watcher (alloc'd in socket_entry_alloc) */
-  ev_io_init(se->watcher, hstcp_ev_socket_read_cb, fd, EV_READ);
-  se->watcher->data = sd;
+  /* setup the read watcher */
+  ev_io_init(&(se->watcher), hstcp_ev_socket_read_cb, fd, EV_READ);
+  se->watcher.data = sd;
 
   return se;
 }
@@ -1030,8 +1456,7 @@ int socket_entry_destroy(SocketEntry *se, HstcpData *const sd) {
        unlock */
     JLD(rc, sd->sockets, fd);
 
-    ev_io_stop(sd->epoller, se->watcher);
-    driver_free(se->watcher);
+    ev_io_stop(sd->epoller, &(se->watcher));
 
     switch (se->type) {
 
@@ -1052,22 +1477,24 @@ int socket_entry_destroy(SocketEntry *se, HstcpData *const sd) {
     case CONNECTED_SOCKET:
       {
         /* TODO - maybe warn if the write queue's not empty? */
-        ev_io_stop(sd->epoller, se->socket.connected_socket.watcher);
-        driver_free(se->socket.connected_socket.watcher);
+        ev_io_stop(sd->epoller, &(se->socket.connected_socket.watcher));
+        timer_wheel_del(sd, &(se->socket.connected_socket.send_timer));
+        timer_wheel_del(sd, &(se->socket.connected_socket.recv_timer));
 
         erl_drv_mutex_lock(se->socket.connected_socket.mutex);
         erl_drv_mutex_unlock(sd->sockets_mutex);
-        free_binaries(se->socket.connected_socket.ev);
-        driver_free(se->socket.connected_socket.ev->iov);
-        driver_free(se->socket.connected_socket.ev->binv);
-        driver_free(se->socket.connected_socket.ev);
+        free_binaries(&(se->socket.connected_socket.ev));
+        driver_free(se->socket.connected_socket.ev.iov);
+        driver_free(se->socket.connected_socket.ev.binv);
+        if (NULL != se->socket.connected_socket.heartbeat)
+          driver_free_binary(se->socket.connected_socket.heartbeat);
         erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
         erl_drv_mutex_destroy(se->socket.connected_socket.mutex);
         break;
       }
 
     }
-    driver_free(se);
+    slab_free(&(sd->entry_slab), &(sd->loop_entries), se);
     return TRUE;
   } else {
     erl_drv_mutex_unlock(sd->sockets_mutex);
@@ -1088,16 +1515,15 @@ static void hstcp_ev_socket_write_cb(EV_P_ ev_io *w, int revents) {
   if (NULL != se_ptr && NULL != *se_ptr &&
       CONNECTED_SOCKET == (*se_ptr)->type) {
     se = *se_ptr;
-    ErlIOVec *ev_ptr = NULL;
     erl_drv_mutex_lock(se->socket.connected_socket.mutex);
     erl_drv_mutex_unlock(sd->sockets_mutex);
     /* do we really have work to do? */
-    ev_ptr = se->socket.connected_socket.ev;
-    if (NULL != ev_ptr && se->socket.connected_socket.pending_writes > 0) {
+    if (se->socket.connected_socket.pending_writes > 0) {
       /* definitely have data to write, so call driver_async */
       erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
       SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_WRITE, fd,
-                                              NULL, NULL, se->pid, sd);
+                                              NULL, NULL, se->pid, sd,
+                                              &(sd->loop_actions));
       driver_async(sd->port, (unsigned int *)&(sa->fd),
                    (void (*)(void *))async_socket_write, sa, NULL);
     } else {
@@ -1141,6 +1567,7 @@ static void hstcp_ev_socket_read_cb(EV_P_ ev_io *w, int revents) {
       }
 
     } else {
+      se->socket.connected_socket.last_recv = ev_now(EV_A);
       int64_t quota = se->socket.connected_socket.quota;
       int64_t requested = (0 <= quota && quota < bytes_ready) ? quota : bytes_ready;
       requested = MIN(requested, SIZE_MAX);
@@ -1159,15 +1586,14 @@ static void hstcp_ev_socket_read_cb(EV_P_ ev_io *w, int revents) {
           return;
         }
 
-        erl_drv_mutex_lock(sd->send_term_mutex);
-        sd->data_spec[5] = fd;
-        sd->data_spec[11] = (ErlDrvTermData)binary;
-        sd->data_spec[12] = (ErlDrvUInt)achieved;
-        driver_send_term(sd->port, pid, sd->data_spec, DATA_SPEC_LEN);
-        sd->data_spec[5] = 0;
-        sd->data_spec[11] = (ErlDrvTermData)NULL;
-        sd->data_spec[12] = (ErlDrvUInt)0;
-        erl_drv_mutex_unlock(sd->send_term_mutex);
+        TermSpecs *const ts = &(sd->loop_specs);
+        ts->data_spec[5] = fd;
+        ts->data_spec[11] = (ErlDrvTermData)binary;
+        ts->data_spec[12] = (ErlDrvUInt)achieved;
+        driver_send_term(sd->port, pid, ts->data_spec, DATA_SPEC_LEN);
+        ts->data_spec[5] = 0;
+        ts->data_spec[11] = (ErlDrvTermData)NULL;
+        ts->data_spec[12] = (ErlDrvUInt)0;
         driver_free_binary(binary);
 
       } else {
@@ -1183,16 +1609,15 @@ static void hstcp_ev_socket_read_cb(EV_P_ ev_io *w, int revents) {
           return;
         }
 
-        erl_drv_mutex_lock(sd->send_term_mutex);
-        sd->small_data_spec[5] = fd;
-        sd->small_data_spec[11] = (ErlDrvTermData)buf;
-        sd->small_data_spec[12] = (ErlDrvUInt)achieved;
-        driver_send_term(sd->port, pid, sd->small_data_spec,
+        TermSpecs *const ts = &(sd->loop_specs);
+        ts->small_data_spec[5] = fd;
+        ts->small_data_spec[11] = (ErlDrvTermData)buf;
+        ts->small_data_spec[12] = (ErlDrvUInt)achieved;
+        driver_send_term(sd->port, pid, ts->small_data_spec,
                          SMALL_DATA_SPEC_LEN);
-        sd->small_data_spec[5] = 0;
-        sd->small_data_spec[11] = (ErlDrvTermData)NULL;
-        sd->small_data_spec[12] = (ErlDrvUInt)0;
-        erl_drv_mutex_unlock(sd->send_term_mutex);
+        ts->small_data_spec[5] = 0;
+        ts->small_data_spec[11] = (ErlDrvTermData)NULL;
+        ts->small_data_spec[12] = (ErlDrvUInt)0;
         driver_free(buf);
       }
 
@@ -1283,6 +1708,140 @@ static void hstcp_ev_listen_cb(EV_P_ ev_io *w, int revents) {
   }
 }
 
+void heartbeat_arm(HstcpData *const sd, SocketEntry *const se) {
+  const ev_tstamp now = ev_now(sd->epoller);
+  timer_wheel_del(sd, &(se->socket.connected_socket.send_timer));
+  timer_wheel_del(sd, &(se->socket.connected_socket.recv_timer));
+  /* don't punish the peer for any silence before it was asked to
+     heartbeat */
+  se->socket.connected_socket.last_recv = now;
+  if (0 < se->socket.connected_socket.send_interval &&
+      NULL != se->socket.connected_socket.heartbeat)
+    timer_wheel_add(sd, &(se->socket.connected_socket.send_timer),
+                    timer_wheel_tick(now + se->socket.connected_socket.
+                                     send_interval / 1000.0) + 1);
+  if (0 < se->socket.connected_socket.recv_interval)
+    timer_wheel_add(sd, &(se->socket.connected_socket.recv_timer),
+                    timer_wheel_tick(now + se->socket.connected_socket.
+                                     recv_interval / 1000.0) + 1);
+}
+
+void heartbeat_fire(HstcpData *const sd, WheelTimer *const timer) {
+  const int fd = timer->fd;
+  SocketEntry **se_ptr = NULL;
+
+  erl_drv_mutex_lock(sd->sockets_mutex);
+  JLG(se_ptr, sd->sockets, fd);
+  if (NULL == se_ptr || NULL == *se_ptr ||
+      CONNECTED_SOCKET != (*se_ptr)->type) {
+    /* can't happen: destroying a socket removes its timers */
+    erl_drv_mutex_unlock(sd->sockets_mutex);
+    return;
+  }
+  SocketEntry *const se = *se_ptr;
+  const ErlDrvTermData pid = se->pid;
+  erl_drv_mutex_lock(se->socket.connected_socket.mutex);
+  erl_drv_mutex_unlock(sd->sockets_mutex);
+
+  const ev_tstamp now = ev_now(sd->epoller);
+  int start_writer = FALSE;
+  int64_t timed_out = -1;
+
+  switch (timer->type) {
+
+  case HEARTBEAT_SEND_TIMER:
+    {
+      const int64_t interval = se->socket.connected_socket.send_interval;
+      ErlDrvBinary *const heartbeat = se->socket.connected_socket.heartbeat;
+      if (0 >= interval || NULL == heartbeat)
+        break;
+      ev_tstamp due = se->socket.connected_socket.last_send + interval / 1000.0;
+      if (due <= now) {
+        /* nothing has been sent for a whole interval */
+        SysIOVec iov;
+        iov.iov_base = heartbeat->orig_bytes;
+        iov.iov_len = heartbeat->orig_size;
+        start_writer = socket_enqueue_writes(sd, se, &iov, &heartbeat, 1);
+        due = now + interval / 1000.0;
+      }
+      timer_wheel_add(sd, timer, timer_wheel_tick(due) + 1);
+      break;
+    }
+
+  case HEARTBEAT_RECV_TIMER:
+    {
+      const int64_t interval = se->socket.connected_socket.recv_interval;
+      if (0 >= interval)
+        break;
+      ev_tstamp due = se->socket.connected_socket.last_recv + interval / 1000.0;
+      if (due <= now) {
+        /* if we're not reading then data may be sat in the kernel
+           which still proves the peer to be alive */
+        int bytes_ready = 0;
+        if (0 == se->socket.connected_socket.quota &&
+            0 == ioctl(fd, FIONREAD, &bytes_ready) && 0 < bytes_ready) {
+          se->socket.connected_socket.last_recv = now;
+          due = now + interval / 1000.0;
+        } else {
+          timed_out = interval;
+          break; /* don't rearm: the owner will decide what to do */
+        }
+      }
+      timer_wheel_add(sd, timer, timer_wheel_tick(due) + 1);
+      break;
+    }
+
+  }
+
+  erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
+
+  if (start_writer)
+    socket_start_writer(sd, fd, pid);
+  if (0 < timed_out)
+    return_socket_timeout(sd, fd, pid, timed_out);
+}
+
+static void hstcp_ev_wheel_cb(EV_P_ ev_timer *w, int revents) {
+  HstcpData *const sd = (HstcpData *const)(w->data);
+  TimerWheel *const tw = sd->wheel;
+  const uint64_t target = timer_wheel_tick(ev_now(EV_A));
+
+  while (tw->now <= target) {
+    const int idx = tw->now & TIMER_WHEEL_MASK;
+    /* when a level wraps, pull the next slot of the level above down */
+    for (int level = 1, cascaded = idx;
+         0 == cascaded && level < TIMER_WHEEL_LEVELS; ++level) {
+      cascaded =
+        timer_wheel_cascade(tw, level, (tw->now >> (TIMER_WHEEL_BITS * level))
+                            & TIMER_WHEEL_MASK);
+    }
+    ++(tw->now);
+
+    /* splice the due timers out first: firing may re-add timers to
+       the very slot we're working through */
+    WheelTimer due;
+    WheelTimer *const head = &(tw->slots[0][idx]);
+    if (head->next == head)
+      continue;
+    due.next = head->next;
+    due.prev = head->prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head->next = head;
+    head->prev = head;
+
+    while (due.next != &due) {
+      WheelTimer *const timer = due.next;
+      timer_wheel_unlink(timer);
+      --(tw->count);
+      heartbeat_fire(sd, timer);
+    }
+  }
+
+  if (0 == tw->count)
+    ev_timer_stop(EV_A_ w);
+}
+
 static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
   HstcpData *const sd = (HstcpData *const)(w->data);
   SocketAction *sa = NULL;
@@ -1291,11 +1850,12 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
     switch (sa->type) {
 
     case HSTCP_ASYNC_START:
-      mark_done_and_signal(sa);
-      erl_drv_mutex_lock(sd->send_term_mutex);
-      driver_send_term(sd->port, sa->pid, sd->ok_spec, ATOM_SPEC_LEN);
-      erl_drv_mutex_unlock(sd->send_term_mutex);
-      break;
+      {
+        const ErlDrvTermData pid = sa->pid;
+        mark_done_and_signal(sa);
+        driver_send_term(sd->port, pid, sd->loop_specs.ok_spec, ATOM_SPEC_LEN);
+        break;
+      }
 
     case HSTCP_ASYNC_EXIT:
       {
@@ -1412,7 +1972,7 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
 
           if (0 == index) /* if we're the first acceptor, enable the
                              watcher */
-            ev_io_start(sd->epoller, se->watcher);
+            ev_io_start(sd->epoller, &(se->watcher));
           return_ok_pid(sd, fd, pid);
 
         } else {
@@ -1441,9 +2001,9 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
           int64_t old_quota = se->socket.connected_socket.quota;
           se->socket.connected_socket.quota = new_quota;
           if (0 == new_quota && 0 != old_quota)
-            ev_io_stop(sd->epoller, se->watcher);
+            ev_io_stop(sd->epoller, &(se->watcher));
           else if (0 != new_quota && 0 == old_quota) {
-            ev_io_start(sd->epoller, se->watcher);
+            ev_io_start(sd->epoller, &(se->watcher));
           }
           return_ok_pid(sd, fd, pid);
         } else {
@@ -1466,7 +2026,6 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
           SocketEntry *se = *se_ptr;
           erl_drv_mutex_lock(se->socket.connected_socket.mutex);
           erl_drv_mutex_unlock(sd->sockets_mutex);
-          ErlIOVec *ev_ptr = se->socket.connected_socket.ev;
 
           int new_offset = 1;
           if (sa->ev->iov[1].iov_len == WRITE_COMMAND_PREFIX_LENGTH) {
@@ -1477,40 +2036,17 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
             sa->ev->iov[1].iov_len -= WRITE_COMMAND_PREFIX_LENGTH;
             sa->ev->iov[1].iov_base += WRITE_COMMAND_PREFIX_LENGTH;
           }
-          int length = sa->ev->vsize - new_offset;
-          int total_length = length + ev_ptr->vsize;
-
-          ev_ptr->iov = driver_realloc(ev_ptr->iov,
-                                       total_length * sizeof(SysIOVec));
-          if (NULL == ev_ptr->iov)
-            driver_failure(sd->port, -1);
-
-          ev_ptr->binv = driver_realloc(ev_ptr->binv,
-                                        total_length * sizeof(ErlDrvBinary *));
-          if (NULL == ev_ptr->binv)
-            driver_failure(sd->port, -1);
-
-          int old_offset = ev_ptr->vsize;
-          for (int idx = 0; idx + new_offset < sa->ev->vsize; ++idx) {
-            driver_binary_inc_refc(sa->ev->binv[new_offset + idx]);
-            ev_ptr->iov[old_offset + idx] = sa->ev->iov[new_offset + idx];
-            ev_ptr->binv[old_offset + idx] = sa->ev->binv[new_offset + idx];
-            se->socket.connected_socket.pending_writes +=
-              (int64_t)sa->ev->iov[new_offset + idx].iov_len;
-          }
-          ev_ptr->vsize = total_length;
+          const int start_writer =
+            socket_enqueue_writes(sd, se, &(sa->ev->iov[new_offset]),
+                                  &(sa->ev->binv[new_offset]),
+                                  sa->ev->vsize - new_offset);
 
           erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
 
-          if (0 == old_offset) {
-            SocketAction *sa1 = socket_action_alloc(HSTCP_ASYNC_WRITE, fd,
-                                                    NULL, NULL, sa->pid, sd);
-            mark_done_and_signal(sa);
-            driver_async(sd->port, (unsigned int *)&(sa1->fd),
-                         (void (*)(void *))async_socket_write, sa1, NULL);
-          } else {
-            mark_done_and_signal(sa);
-          }
+          const ErlDrvTermData pid = sa->pid;
+          mark_done_and_signal(sa);
+          if (start_writer)
+            socket_start_writer(sd, fd, pid);
 
           check_watermarks(fd, sd);
         } else {
@@ -1520,6 +2056,38 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
         break;
       }
 
+    case HSTCP_ASYNC_WRITE_MULTI:
+      {
+        /* the payload is only borrowed from the emulator, so every
+           target has to have taken its refs before we release it */
+        const ErlDrvTermData pid = sa->pid;
+        for (int64_t idx = 0; idx < sa->value; ++idx) {
+          const int fd = (int)sa->fds[idx];
+          erl_drv_mutex_lock(sd->sockets_mutex);
+          SocketEntry **se_ptr = NULL;
+          JLG(se_ptr, sd->sockets, fd);
+          if (NULL != se_ptr && NULL != *se_ptr &&
+              CONNECTED_SOCKET == (*se_ptr)->type) {
+            SocketEntry *se = *se_ptr;
+            const ErlDrvTermData owner = se->pid;
+            erl_drv_mutex_lock(se->socket.connected_socket.mutex);
+            erl_drv_mutex_unlock(sd->sockets_mutex);
+            const int start_writer = (0 < sa->ev->vsize) &&
+              socket_enqueue_writes(sd, se, sa->ev->iov, sa->ev->binv,
+                                    sa->ev->vsize);
+            erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
+            if (start_writer)
+              socket_start_writer(sd, fd, owner);
+            check_watermarks(fd, sd);
+          } else {
+            erl_drv_mutex_unlock(sd->sockets_mutex);
+            return_badarg_pid(sd, fd, pid, EVENT);
+          }
+        }
+        mark_done_and_signal(sa);
+        break;
+      }
+
     case HSTCP_ASYNC_INCOMPLETE_WRITE:
       {
         const int fd = sa->fd;
@@ -1529,7 +2097,8 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
         JLG(se_ptr, sd->sockets, fd);
         if (NULL != se_ptr && NULL != *se_ptr &&
             CONNECTED_SOCKET == (*se_ptr)->type)
-          ev_io_start(sd->epoller, (*se_ptr)->socket.connected_socket.watcher);
+          ev_io_start(sd->epoller,
+                      &((*se_ptr)->socket.connected_socket.watcher));
         erl_drv_mutex_unlock(sd->sockets_mutex);
         check_watermarks(fd, sd);
         break;
@@ -1539,7 +2108,10 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
       {
         const int fd = sa->fd;
         const ErlDrvTermData pid = sa->pid;
+        const int error = (int)sa->value;
         mark_done_and_signal(sa);
+        if (0 != error)
+          return_socket_error_pid(sd, fd, error, pid, EVENT);
         erl_drv_mutex_lock(sd->sockets_mutex);
         SocketEntry **se_ptr = NULL;
         SocketEntry *se = NULL;
@@ -1565,6 +2137,26 @@ static void hstcp_ev_async_cb(EV_P_ ev_async *w, int revents) {
         break;
       }
 
+    case HSTCP_ASYNC_HEARTBEAT:
+      {
+        const int fd = sa->fd;
+        mark_done_and_signal(sa);
+        erl_drv_mutex_lock(sd->sockets_mutex);
+        SocketEntry **se_ptr = NULL;
+        JLG(se_ptr, sd->sockets, fd);
+        if (NULL != se_ptr && NULL != *se_ptr &&
+            CONNECTED_SOCKET == (*se_ptr)->type) {
+          SocketEntry *se = *se_ptr;
+          erl_drv_mutex_lock(se->socket.connected_socket.mutex);
+          erl_drv_mutex_unlock(sd->sockets_mutex);
+          heartbeat_arm(sd, se);
+          erl_drv_mutex_unlock(se->socket.connected_socket.mutex);
+        } else {
+          erl_drv_mutex_unlock(sd->sockets_mutex);
+        }
+        break;
+      }
+
     }
 
     command_dequeue(&sa, sd);
@@ -1593,6 +2185,20 @@ static void *hstcp_ev_start(void *arg) {
   sd->async_watcher->data = sd;
   ev_async_start(sd->epoller, sd->async_watcher);
 
+  sd->wheel = (TimerWheel*)driver_alloc(sizeof(TimerWheel));
+  if (NULL == sd->wheel)
+    driver_failure(sd->port, -1);
+  timer_wheel_init(sd->wheel);
+
+  sd->wheel_watcher = (ev_timer*)driver_alloc(sizeof(ev_timer));
+  if (NULL == sd->wheel_watcher)
+    driver_failure(sd->port, -1);
+
+  /* only started once the wheel has a timer in it */
+  ev_timer_init(sd->wheel_watcher, &hstcp_ev_wheel_cb,
+                TIMER_WHEEL_TICK_MS / 1000.0, TIMER_WHEEL_TICK_MS / 1000.0);
+  sd->wheel_watcher->data = sd;
+
   erl_drv_cond_signal(sd->cond);
   erl_drv_mutex_unlock(sd->command_mutex);
 
@@ -1646,6 +2252,133 @@ int prepare_spec(const ErlDrvPort port, ErlDrvTermData **spec, const int len) {
   return TRUE;
 }
 
+int term_specs_init(HstcpData *const sd, TermSpecs *const ts) {
+  if (! prepare_spec(sd->port, &(ts->no_such_command_spec), ATOM_SPEC_LEN))
+    return FALSE;
+  ts->no_such_command_spec[8] = ERL_DRV_ATOM;
+  ts->no_such_command_spec[9] = driver_mk_atom("no_such_command");
+
+  if (! prepare_spec(sd->port, &(ts->ok_spec), ATOM_SPEC_LEN))
+    return FALSE;
+  ts->ok_spec[1] = sd->reply;
+  ts->ok_spec[8] = ERL_DRV_ATOM;
+  ts->ok_spec[9] = driver_mk_atom("ok");
+
+  if (! prepare_spec(sd->port, &(ts->reader_error_spec), STRING_ERROR_SPEC_LEN))
+    return FALSE;
+  ts->reader_error_spec[1] = sd->reply;
+  ts->reader_error_spec[8] = ERL_DRV_ATOM;
+  ts->reader_error_spec[9] = driver_mk_atom("reader_error");
+  ts->reader_error_spec[10] = ERL_DRV_STRING;
+  ts->reader_error_spec[11] = (ErlDrvTermData)NULL;
+  ts->reader_error_spec[12] = 0;
+  ts->reader_error_spec[13] = ERL_DRV_TUPLE;
+  ts->reader_error_spec[14] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->socket_error_spec), STRING_ERROR_SPEC_LEN))
+    return FALSE;
+  ts->socket_error_spec[8] = ERL_DRV_ATOM;
+  ts->socket_error_spec[9] = driver_mk_atom("socket_error");
+  ts->socket_error_spec[10] = ERL_DRV_STRING;
+  ts->socket_error_spec[11] = (ErlDrvTermData)NULL;
+  ts->socket_error_spec[12] = 0;
+  ts->socket_error_spec[13] = ERL_DRV_TUPLE;
+  ts->socket_error_spec[14] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->new_fd_spec), NEW_FD_SPEC_LEN))
+    return FALSE;
+  ts->new_fd_spec[8] = ERL_DRV_ATOM;
+  ts->new_fd_spec[9] = driver_mk_atom("new_fd");
+  ts->new_fd_spec[10] = ERL_DRV_PORT;
+  ts->new_fd_spec[11] = driver_mk_port(sd->port);
+  ts->new_fd_spec[12] = ERL_DRV_INT;
+  ts->new_fd_spec[13] = (ErlDrvSInt)0;
+  ts->new_fd_spec[14] = ERL_DRV_TUPLE;
+  ts->new_fd_spec[15] = 2;
+  ts->new_fd_spec[16] = ERL_DRV_TUPLE;
+  ts->new_fd_spec[17] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->data_spec), DATA_SPEC_LEN))
+    return FALSE;
+  ts->data_spec[1] = sd->event;
+  ts->data_spec[8] = ERL_DRV_ATOM;
+  ts->data_spec[9] = driver_mk_atom("data");
+  ts->data_spec[10] = ERL_DRV_BINARY;
+  ts->data_spec[11] = (ErlDrvTermData)NULL;
+  ts->data_spec[12] = (ErlDrvUInt)0;
+  ts->data_spec[13] = (ErlDrvUInt)0;
+  ts->data_spec[14] = ERL_DRV_TUPLE;
+  ts->data_spec[15] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->small_data_spec), SMALL_DATA_SPEC_LEN))
+    return FALSE;
+  ts->small_data_spec[1] = sd->event;
+  ts->small_data_spec[8] = ERL_DRV_ATOM;
+  ts->small_data_spec[9] = driver_mk_atom("data");
+  ts->small_data_spec[10] = ERL_DRV_BUF2BINARY;
+  ts->small_data_spec[11] = (ErlDrvTermData)NULL;
+  ts->small_data_spec[12] = (ErlDrvUInt)0;
+  ts->small_data_spec[13] = ERL_DRV_TUPLE;
+  ts->small_data_spec[14] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->closed_spec), ATOM_SPEC_LEN))
+    return FALSE;
+  ts->closed_spec[8] = ERL_DRV_ATOM;
+  ts->closed_spec[9] = driver_mk_atom("closed");
+
+  if (! prepare_spec(sd->port, &(ts->badarg_spec), ATOM_SPEC_LEN))
+    return FALSE;
+  ts->badarg_spec[8] = ERL_DRV_ATOM;
+  ts->badarg_spec[9] = driver_mk_atom("badarg");
+
+  if (! prepare_spec(sd->port, &(ts->low_watermark_spec), WATERMARK_SPEC_LEN))
+    return FALSE;
+  ts->low_watermark_spec[1] = sd->event;
+  ts->low_watermark_spec[8] = ERL_DRV_ATOM;
+  ts->low_watermark_spec[9] = driver_mk_atom("low_watermark");
+  ts->low_watermark_spec[10] = ERL_DRV_INT;
+  ts->low_watermark_spec[11] = (ErlDrvSInt)0;
+  ts->low_watermark_spec[12] = ERL_DRV_TUPLE;
+  ts->low_watermark_spec[13] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->high_watermark_spec), WATERMARK_SPEC_LEN))
+    return FALSE;
+  ts->high_watermark_spec[1] = sd->event;
+  ts->high_watermark_spec[8] = ERL_DRV_ATOM;
+  ts->high_watermark_spec[9] = driver_mk_atom("high_watermark");
+  ts->high_watermark_spec[10] = ERL_DRV_INT;
+  ts->high_watermark_spec[11] = (ErlDrvSInt)0;
+  ts->high_watermark_spec[12] = ERL_DRV_TUPLE;
+  ts->high_watermark_spec[13] = 2;
+
+  if (! prepare_spec(sd->port, &(ts->timeout_spec), TIMEOUT_SPEC_LEN))
+    return FALSE;
+  ts->timeout_spec[1] = sd->event;
+  ts->timeout_spec[8] = ERL_DRV_ATOM;
+  ts->timeout_spec[9] = driver_mk_atom("timeout");
+  ts->timeout_spec[10] = ERL_DRV_INT;
+  ts->timeout_spec[11] = (ErlDrvSInt)0;
+  ts->timeout_spec[12] = ERL_DRV_TUPLE;
+  ts->timeout_spec[13] = 2;
+
+  return TRUE;
+}
+
+void term_specs_free(TermSpecs *const ts) {
+  driver_free((char*)ts->no_such_command_spec);
+  driver_free((char*)ts->ok_spec);
+  driver_free((char*)ts->reader_error_spec);
+  driver_free((char*)ts->socket_error_spec);
+  driver_free((char*)ts->new_fd_spec);
+  driver_free((char*)ts->data_spec);
+  driver_free((char*)ts->small_data_spec);
+  driver_free((char*)ts->closed_spec);
+  driver_free((char*)ts->badarg_spec);
+  driver_free((char*)ts->low_watermark_spec);
+  driver_free((char*)ts->high_watermark_spec);
+  driver_free((char*)ts->timeout_spec);
+}
+
 static ErlDrvData hstcp_start(const ErlDrvPort port, char *const buff) {
   HstcpData *const sd = (HstcpData*)driver_alloc(sizeof(HstcpData));
 
@@ -1657,107 +2390,9 @@ static ErlDrvData hstcp_start(const ErlDrvPort port, char *const buff) {
   sd->event = driver_mk_atom("hstcp_event");
   sd->reply = driver_mk_atom("hstcp_reply");
 
-  sd->send_term_mutex = erl_drv_mutex_create("hstcp send term mutex");
-  if (NULL == sd->send_term_mutex)
-    return ERL_DRV_ERROR_GENERAL;
-
-  if (! prepare_spec(port, &(sd->no_such_command_spec), ATOM_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->no_such_command_spec[8] = ERL_DRV_ATOM;
-  sd->no_such_command_spec[9] = driver_mk_atom("no_such_command");
-
-  if (! prepare_spec(port, &(sd->ok_spec), ATOM_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->ok_spec[1] = sd->reply;
-  sd->ok_spec[8] = ERL_DRV_ATOM;
-  sd->ok_spec[9] = driver_mk_atom("ok");
-
-  if (! prepare_spec(port, &(sd->reader_error_spec), STRING_ERROR_SPEC_LEN))
+  if (! (term_specs_init(sd, &(sd->driver_specs)) &&
+         term_specs_init(sd, &(sd->loop_specs))))
     return ERL_DRV_ERROR_GENERAL;
-  sd->reader_error_spec[1] = sd->reply;
-  sd->reader_error_spec[8] = ERL_DRV_ATOM;
-  sd->reader_error_spec[9] = driver_mk_atom("reader_error");
-  sd->reader_error_spec[10] = ERL_DRV_STRING;
-  sd->reader_error_spec[11] = (ErlDrvTermData)NULL;
-  sd->reader_error_spec[12] = 0;
-  sd->reader_error_spec[13] = ERL_DRV_TUPLE;
-  sd->reader_error_spec[14] = 2;
-
-  if (! prepare_spec(port, &(sd->socket_error_spec), STRING_ERROR_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->socket_error_spec[8] = ERL_DRV_ATOM;
-  sd->socket_error_spec[9] = driver_mk_atom("socket_error");
-  sd->socket_error_spec[10] = ERL_DRV_STRING;
-  sd->socket_error_spec[11] = (ErlDrvTermData)NULL;
-  sd->socket_error_spec[12] = 0;
-  sd->socket_error_spec[13] = ERL_DRV_TUPLE;
-  sd->socket_error_spec[14] = 2;
-
-  if (! prepare_spec(port, &(sd->new_fd_spec), NEW_FD_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->new_fd_spec[8] = ERL_DRV_ATOM;
-  sd->new_fd_spec[9] = driver_mk_atom("new_fd");
-  sd->new_fd_spec[10] = ERL_DRV_PORT;
-  sd->new_fd_spec[11] = driver_mk_port(port);
-  sd->new_fd_spec[12] = ERL_DRV_INT;
-  sd->new_fd_spec[13] = (ErlDrvSInt)0;
-  sd->new_fd_spec[14] = ERL_DRV_TUPLE;
-  sd->new_fd_spec[15] = 2;
-  sd->new_fd_spec[16] = ERL_DRV_TUPLE;
-  sd->new_fd_spec[17] = 2;
-
-  if (! prepare_spec(port, &(sd->data_spec), DATA_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->data_spec[1] = sd->event;
-  sd->data_spec[8] = ERL_DRV_ATOM;
-  sd->data_spec[9] = driver_mk_atom("data");
-  sd->data_spec[10] = ERL_DRV_BINARY;
-  sd->data_spec[11] = (ErlDrvTermData)NULL;
-  sd->data_spec[12] = (ErlDrvUInt)0;
-  sd->data_spec[13] = (ErlDrvUInt)0;
-  sd->data_spec[14] = ERL_DRV_TUPLE;
-  sd->data_spec[15] = 2;
-
-  if (! prepare_spec(port, &(sd->small_data_spec), SMALL_DATA_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->small_data_spec[1] = sd->event;
-  sd->small_data_spec[8] = ERL_DRV_ATOM;
-  sd->small_data_spec[9] = driver_mk_atom("data");
-  sd->small_data_spec[10] = ERL_DRV_BUF2BINARY;
-  sd->small_data_spec[11] = (ErlDrvTermData)NULL;
-  sd->small_data_spec[12] = (ErlDrvUInt)0;
-  sd->small_data_spec[13] = ERL_DRV_TUPLE;
-  sd->small_data_spec[14] = 2;
-
-  if (! prepare_spec(port, &(sd->closed_spec), ATOM_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->closed_spec[8] = ERL_DRV_ATOM;
-  sd->closed_spec[9] = driver_mk_atom("closed");
-
-  if (! prepare_spec(port, &(sd->badarg_spec), ATOM_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->badarg_spec[8] = ERL_DRV_ATOM;
-  sd->badarg_spec[9] = driver_mk_atom("badarg");
-
-  if (! prepare_spec(port, &(sd->low_watermark_spec), WATERMARK_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->low_watermark_spec[1] = sd->event;
-  sd->low_watermark_spec[8] = ERL_DRV_ATOM;
-  sd->low_watermark_spec[9] = driver_mk_atom("low_watermark");
-  sd->low_watermark_spec[10] = ERL_DRV_INT;
-  sd->low_watermark_spec[11] = (ErlDrvSInt)0;
-  sd->low_watermark_spec[12] = ERL_DRV_TUPLE;
-  sd->low_watermark_spec[13] = 2;
-
-  if (! prepare_spec(port, &(sd->high_watermark_spec), WATERMARK_SPEC_LEN))
-    return ERL_DRV_ERROR_GENERAL;
-  sd->high_watermark_spec[1] = sd->event;
-  sd->high_watermark_spec[8] = ERL_DRV_ATOM;
-  sd->high_watermark_spec[9] = driver_mk_atom("high_watermark");
-  sd->high_watermark_spec[10] = ERL_DRV_INT;
-  sd->high_watermark_spec[11] = (ErlDrvSInt)0;
-  sd->high_watermark_spec[12] = ERL_DRV_TUPLE;
-  sd->high_watermark_spec[13] = 2;
 
   /* Note that startup here is a bit surprising: we don't want to
      create the epoller in this thread because if we do then we'll
@@ -1800,12 +2435,22 @@ static ErlDrvData hstcp_start(const ErlDrvPort port, char *const buff) {
 
   sd->socket_entry_serial = 0;
 
+  if (! (slab_init(&(sd->action_slab), sizeof(SocketAction),
+                   "hstcp action slab mutex") &&
+         slab_init(&(sd->entry_slab), sizeof(SocketEntry),
+                   "hstcp entry slab mutex")))
+    return ERL_DRV_ERROR_GENERAL;
+  free_list_init(&(sd->driver_actions));
+  free_list_init(&(sd->loop_actions));
+  free_list_init(&(sd->loop_entries));
+
   if (0 != erl_drv_thread_create("hstcp", &(sd->tid), &hstcp_ev_start, sd, NULL))
     return ERL_DRV_ERROR_GENERAL;
 
   await_epoller(sd);
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_START, 0, NULL, NULL,
-                                         sd->pid, sd);
+                                         sd->pid, sd,
+                                         &(sd->driver_actions));
   command_enqueue_and_notify(sa, sd);
 
   return (ErlDrvData)sd;
@@ -1815,23 +2460,16 @@ static void hstcp_stop(const ErlDrvData drv_data) {
   HstcpData *const sd = (HstcpData*)drv_data;
 
   SocketAction *sa = socket_action_alloc(HSTCP_ASYNC_EXIT, 0, NULL, NULL,
-                                         sd->pid, sd);
+                                         sd->pid, sd,
+                                         &(sd->driver_actions));
   command_enqueue_and_notify(sa, sd);
   erl_drv_thread_join(sd->tid, NULL);
 
-  erl_drv_mutex_destroy(sd->send_term_mutex);
-  driver_free((char*)sd->no_such_command_spec);
-  driver_free((char*)sd->ok_spec);
-  driver_free((char*)sd->reader_error_spec);
-  driver_free((char*)sd->socket_error_spec);
-  driver_free((char*)sd->new_fd_spec);
-  driver_free((char*)sd->data_spec);
-  driver_free((char*)sd->small_data_spec);
-  driver_free((char*)sd->closed_spec);
-  driver_free((char*)sd->badarg_spec);
-  driver_free((char*)sd->low_watermark_spec);
-  driver_free((char*)sd->high_watermark_spec);
+  term_specs_free(&(sd->driver_specs));
+  term_specs_free(&(sd->loop_specs));
   driver_free((char*)sd->async_watcher);
+  driver_free((char*)sd->wheel_watcher);
+  driver_free((char*)sd->wheel);
 
   erl_drv_mutex_destroy(sd->command_mutex);
   erl_drv_mutex_destroy(sd->queue_mutex);
@@ -1842,6 +2480,12 @@ static void hstcp_stop(const ErlDrvData drv_data) {
   JLFA(freed, sd->sockets);
   JLFA(freed, sd->command_queue);
 
+  free_list_clear(&(sd->driver_actions));
+  free_list_clear(&(sd->loop_actions));
+  free_list_clear(&(sd->loop_entries));
+  slab_destroy(&(sd->action_slab));
+  slab_destroy(&(sd->entry_slab));
+
   driver_free((char*)drv_data);
 }
 
@@ -1883,6 +2527,14 @@ static void hstcp_outputv(ErlDrvData drv_data, ErlIOVec *const ev) {
       socket_set_options(sd, &reader);
       break;
 
+    case HSTCP_SET_HEARTBEAT:
+      socket_set_heartbeat(sd, &reader);
+      break;
+
+    case HSTCP_WRITE_MULTI:
+      socket_write_multi(sd, &reader);
+      break;
+
     }
   }
 }
@@ -28,7 +28,9 @@ enum _CommandType {
   HSTCP_ACCEPT          = 3,
   HSTCP_RECV            = 4,
   HSTCP_WRITE           = 5,
-  HSTCP_SET_OPTIONS     = 6
+  HSTCP_SET_OPTIONS     = 6,
+  HSTCP_SET_HEARTBEAT   = 7,
+  HSTCP_WRITE_MULTI     = 8
 };
 typedef enum _CommandType CommandType;
 
@@ -49,7 +51,9 @@ enum _AsyncCommandType {
   HSTCP_ASYNC_WRITE            = 6,
   HSTCP_ASYNC_INCOMPLETE_WRITE = 7,
   HSTCP_ASYNC_DESTROY_SOCKET   = 8,
-  HSTCP_ASYNC_CHECK_WATERMARKS = 9
+  HSTCP_ASYNC_CHECK_WATERMARKS = 9,
+  HSTCP_ASYNC_HEARTBEAT        = 10,
+  HSTCP_ASYNC_WRITE_MULTI      = 11
 };
 typedef enum _AsyncCommandType AsyncCommandType;
 
@@ -72,4 +76,10 @@ enum _WatermarkLevel {
 };
 typedef enum _WatermarkLevel WatermarkLevel;
 
+enum _TimerType {
+  HEARTBEAT_SEND_TIMER = 1,
+  HEARTBEAT_RECV_TIMER = 2
+};
+typedef enum _TimerType TimerType;
+
 #endif
@@ -0,0 +1,715 @@
+/* ------------------------------------------------------------------------- */
+/*                                                                           */
+/*   The contents of this file are subject to the Mozilla Public License     */
+/*   Version 1.1 (the "License"); you may not use this file except in        */
+/*   compliance with the License. You may obtain a copy of the License at    */
+/*   http://www.mozilla.org/MPL/                                             */
+/*                                                                           */
+/*   Software distributed under the License is distributed on an "AS IS"     */
+/*   basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the */
+/*   License for the specific language governing rights and limitations      */
+/*   under the License.                                                      */
+/*                                                                           */
+/*   The Original Code is HSTCP.                                             */
+/*                                                                           */
+/*   The Initial Developers of the Original Code are VMware, Inc.            */
+/*   Copyright (c) 2011-2011 VMware, Inc.  All rights reserved.              */
+/*                                                                           */
+/* ------------------------------------------------------------------------- */
+
+/* The NIF front end to hstcp. There is no ev loop thread here: the
+   calling Erlang process does the syscalls itself, and when one would
+   block, the fd is handed to the emulator's own poller with
+   enif_select and the process waits for the {select, ...} message
+   before trying again. That waiting is done in hstcp_nif.erl. */
+
+#define _BSD_SOURCE
+
+#include <arpa/inet.h>
+#include <erl_nif.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "hstcp.h"
+
+#define FALSE                  0
+#define TRUE                   1
+
+#define DEFAULT_IOV_MAX        16
+#define RECV_ONCE_SIZE         65536
+#define MAX_ADDRESS_LEN        64
+
+typedef struct {
+  int            waiting;            /* pid is waiting for a select message        */
+  ErlNifPid      pid;
+  ErlNifEnv *    env;                /* holds ref                                  */
+  ERL_NIF_TERM   ref;
+} NifWaiter;
+
+typedef struct {
+  int            fd;                 /* -1 once closed                             */
+  SocketType     type;
+  ErlNifMutex *  mutex;              /* protects everything below                  */
+  ErlNifPid      owner;              /* gets the watermark events                  */
+  ErlNifMonitor  monitor;            /* closes the socket if the owner dies        */
+  int            selected;           /* fd has been given to enif_select           */
+  int            writing;            /* some process is flushing the queue         */
+  NifWaiter      reader;             /* blocked in accept or recv                  */
+  NifWaiter      flusher;            /* blocked in write or flush                  */
+  int            watching;           /* flusher_monitor is set                     */
+  ErlNifMonitor  flusher_monitor;    /* clears writing if the flusher dies         */
+  ErlNifIOQueue *queue;              /* data the kernel hasn't yet accepted        */
+  int64_t        low;
+  int64_t        high;
+  WatermarkLevel watermark;
+} NifSocket;
+
+typedef struct {
+  ErlNifResourceType *socket_type;
+  int                 iov_max;
+} NifData;
+
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_wait;
+static ERL_NIF_TERM atom_closed;
+static ERL_NIF_TERM atom_error;
+static ERL_NIF_TERM atom_hstcp_closed;
+static ERL_NIF_TERM atom_badarg;
+static ERL_NIF_TERM atom_undefined;
+static ERL_NIF_TERM atom_new_fd;
+static ERL_NIF_TERM atom_data;
+static ERL_NIF_TERM atom_socket_error;
+static ERL_NIF_TERM atom_hstcp_event;
+static ERL_NIF_TERM atom_low_watermark;
+static ERL_NIF_TERM atom_high_watermark;
+
+
+/**********************
+ *  Socket Functions  *
+ **********************/
+
+int setnonblock(const int fd) { /* and turn off nagle */
+  int flags = fcntl(fd, F_GETFL);
+  flags |= O_NONBLOCK;
+  flags |= O_NDELAY;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+int setreuse(const int fd) {
+  const int reuse = 1;
+  /* turn on reuseaddr */
+  return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+}
+
+int setnodelay(const int fd) {
+  const int nodelay = 1;
+  /* turn on nodelay */
+  return setsockopt(fd, SOL_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+ERL_NIF_TERM make_socket_error(ErlNifEnv *const env, const int error) {
+  return enif_make_tuple2(env, atom_socket_error,
+                          enif_make_string(env, strerror(error),
+                                           ERL_NIF_LATIN1));
+}
+
+int get_socket(ErlNifEnv *const env, const ERL_NIF_TERM term,
+               NifSocket **const sock) {
+  const NifData *const nd = (NifData *)enif_priv_data(env);
+  return enif_get_resource(env, term, nd->socket_type, (void **)sock);
+}
+
+int get_address(ErlNifEnv *const env, const ERL_NIF_TERM address_term,
+                const ERL_NIF_TERM port_term,
+                struct sockaddr_in *const address) {
+  ErlNifBinary bin;
+  unsigned int port = 0;
+  char address_str[MAX_ADDRESS_LEN];
+
+  if (! (enif_inspect_binary(env, address_term, &bin) &&
+         bin.size < MAX_ADDRESS_LEN &&
+         enif_get_uint(env, port_term, &port) && port <= UINT16_MAX))
+    return FALSE;
+
+  /* strings coming from Erlang are not zero terminated */
+  memcpy(address_str, bin.data, bin.size);
+  address_str[bin.size] = '\0';
+
+  memset(address, 0, sizeof(*address));
+  address->sin_family = AF_INET;
+  address->sin_port = htons((uint16_t)port);
+  /* why does inet_aton return 0 on FAILURE?! */
+  return 0 != inet_aton(address_str, &(address->sin_addr));
+}
+
+ERL_NIF_TERM socket_create(ErlNifEnv *const env, const int fd,
+                           const SocketType type) {
+  const NifData *const nd = (NifData *)enif_priv_data(env);
+  NifSocket *const sock =
+    (NifSocket *)enif_alloc_resource(nd->socket_type, sizeof(NifSocket));
+  if (NULL == sock) {
+    close(fd);
+    return make_socket_error(env, ENOMEM);
+  }
+
+  sock->fd = fd;
+  sock->type = type;
+  sock->selected = FALSE;
+  sock->writing = FALSE;
+  sock->watching = FALSE;
+  sock->reader.waiting = FALSE;
+  sock->reader.env = enif_alloc_env();
+  sock->flusher.waiting = FALSE;
+  sock->flusher.env = enif_alloc_env();
+  sock->low = -1;
+  sock->high = -1;
+  sock->watermark = UNKNOWN_WATERMARK;
+  sock->queue = enif_ioq_create(ERL_NIF_IOQ_NORMAL);
+  sock->mutex = enif_mutex_create("hstcp_nif socket mutex");
+  enif_self(env, &(sock->owner));
+
+  /* releasing sock runs socket_dtor, which closes fd */
+  int err = 0;
+  if (NULL == sock->queue || NULL == sock->mutex ||
+      NULL == sock->reader.env || NULL == sock->flusher.env)
+    err = ENOMEM;
+  else if (0 != enif_monitor_process(env, sock, &(sock->owner),
+                                     &(sock->monitor)))
+    err = ESRCH; /* the owner has already gone */
+  if (0 != err) {
+    enif_release_resource(sock);
+    return make_socket_error(env, err);
+  }
+
+  const ERL_NIF_TERM term = enif_make_resource(env, sock);
+  enif_release_resource(sock);
+  return enif_make_tuple2(env, atom_new_fd, term);
+}
+
+/* Returns 0 if sock is open and of type. Otherwise returns the
+   reply, having released the socket's mutex, which must be held. */
+ERL_NIF_TERM socket_check(ErlNifEnv *const env, NifSocket *const sock,
+                          const SocketType type) {
+  ERL_NIF_TERM result = 0;
+  if (0 > sock->fd)
+    result = enif_make_tuple2(env, atom_error, atom_closed);
+  else if (type != sock->type)
+    result = atom_badarg; /* programmer messed up */
+  if (0 != result)
+    enif_mutex_unlock(sock->mutex);
+  return result;
+}
+
+/* Hands fd over to the emulator's poller. The calling process gets
+   {select, Sock, Ref, ready_input | ready_output} once it's ready,
+   or {hstcp_closed, Sock, Ref} if the socket's closed first. Must
+   hold the socket's mutex. */
+ERL_NIF_TERM socket_select(ErlNifEnv *const env, NifSocket *const sock,
+                           const enum ErlNifSelectFlags mode,
+                           NifWaiter *const waiter, const ERL_NIF_TERM ref) {
+  const int rc = enif_select(env, (ErlNifEvent)sock->fd, mode, sock, NULL, ref);
+  if (0 > rc)
+    return make_socket_error(env, EBADF);
+  sock->selected = TRUE;
+  enif_self(env, &(waiter->pid));
+  enif_clear_env(waiter->env);
+  waiter->ref = enif_make_copy(waiter->env, ref);
+  waiter->waiting = TRUE;
+  return atom_wait;
+}
+
+/* Tells a process still waiting on the socket that it's been closed.
+   Must hold the socket's mutex. */
+void socket_wake(ErlNifEnv *const env, NifSocket *const sock,
+                 NifWaiter *const waiter) {
+  if (! waiter->waiting)
+    return;
+  waiter->waiting = FALSE;
+  /* sending clears the env, ref and all */
+  enif_send(env, &(waiter->pid), waiter->env,
+            enif_make_tuple3(waiter->env, atom_hstcp_closed,
+                             enif_make_resource(waiter->env, sock),
+                             waiter->ref));
+}
+
+/* Only the emulator's poller may close a selected fd, which it does
+   via socket_stop. Must hold the socket's mutex. */
+void socket_close_fd(ErlNifEnv *const env, NifSocket *const sock) {
+  const int fd = sock->fd;
+  sock->fd = -1;
+  if (sock->selected)
+    enif_select(env, (ErlNifEvent)fd, ERL_NIF_SELECT_STOP, sock, NULL,
+                atom_undefined);
+  else
+    close(fd);
+  socket_wake(env, sock, &(sock->reader));
+  socket_wake(env, sock, &(sock->flusher));
+}
+
+/* Must hold the socket's mutex. */
+void check_watermarks(ErlNifEnv *const env, NifSocket *const sock,
+                      const ERL_NIF_TERM sock_term) {
+  const int64_t pending = (int64_t)enif_ioq_size(sock->queue);
+  ERL_NIF_TERM event = 0;
+
+  if (HIGH_WATERMARK != sock->watermark &&
+      -1 < sock->high && pending >= sock->high) {
+    sock->watermark = HIGH_WATERMARK;
+    event = enif_make_tuple2(env, atom_high_watermark,
+                             enif_make_int64(env, sock->high));
+
+  } else if (LOW_WATERMARK != sock->watermark &&
+             -1 < sock->low && pending <= sock->low) {
+    sock->watermark = LOW_WATERMARK;
+    event = enif_make_tuple2(env, atom_low_watermark,
+                             enif_make_int64(env, sock->low));
+
+  } else if (HIGH_WATERMARK == sock->watermark &&
+             -1 < sock->high && pending < sock->high) {
+    sock->watermark = UNKNOWN_WATERMARK;
+
+  } else if (LOW_WATERMARK == sock->watermark &&
+             -1 < sock->low && pending > sock->low) {
+    sock->watermark = UNKNOWN_WATERMARK;
+  }
+
+  if (0 != event)
+    enif_send(env, &(sock->owner), NULL,
+              enif_make_tuple3(env, atom_hstcp_event, sock_term, event));
+}
+
+/* Writes out as much of the queue as the kernel will take. Returns 0,
+   EAGAIN if there's more to go, or the errno of a failed write, in
+   which case the queue has been discarded. Must hold the socket's
+   mutex. */
+int socket_flush(ErlNifEnv *const env, NifSocket *const sock) {
+  const NifData *const nd = (NifData *)enif_priv_data(env);
+  size_t total = 0;
+
+  while (0 < enif_ioq_size(sock->queue)) {
+    int iovcnt = 0;
+    SysIOVec *const iov = enif_ioq_peek(sock->queue, &iovcnt);
+    iovcnt = iovcnt < nd->iov_max ? iovcnt : nd->iov_max;
+    const ssize_t written =
+      writev(sock->fd, (const struct iovec *)iov, iovcnt);
+    if (0 > written) {
+      const int err = errno;
+      if (EAGAIN == err || EWOULDBLOCK == err)
+        break;
+      if (EINTR == err)
+        continue;
+      enif_ioq_deq(sock->queue, enif_ioq_size(sock->queue), NULL);
+      return err;
+    }
+    enif_ioq_deq(sock->queue, (size_t)written, NULL);
+    total += (size_t)written;
+  }
+
+  if (0 < total) {
+    /* one reduction per 4kB written, capped at a full timeslice */
+    const size_t percent = total / 4096;
+    enif_consume_timeslice(env, percent > 100 ? 100 : (int)percent);
+  }
+
+  return 0 == enif_ioq_size(sock->queue) ? 0 : EAGAIN;
+}
+
+/* Stops watching for the flusher dying, once it's done. Must hold the
+   socket's mutex. */
+void socket_unwatch(ErlNifEnv *const env, NifSocket *const sock) {
+  if (sock->watching)
+    enif_demonitor_process(env, sock, &(sock->flusher_monitor));
+  sock->watching = FALSE;
+}
+
+/* Shared tail of write and flush, once socket_flush has run. Must
+   hold the socket's mutex, which is released. */
+ERL_NIF_TERM socket_write_result(ErlNifEnv *const env, NifSocket *const sock,
+                                 const ERL_NIF_TERM sock_term,
+                                 const ERL_NIF_TERM ref, const int err) {
+  ERL_NIF_TERM result = atom_ok;
+  if (EAGAIN == err)
+    result = socket_select(env, sock, ERL_NIF_SELECT_WRITE,
+                           &(sock->flusher), ref);
+  else if (0 != err)
+    result = make_socket_error(env, err);
+  /* other processes' writes are left to the flusher, so if it dies
+     first, writing must be cleared for the next write to flush */
+  if (atom_wait != result)
+    socket_unwatch(env, sock);
+  else if (! sock->watching)
+    sock->watching =
+      0 == enif_monitor_process(env, sock, &(sock->flusher.pid),
+                                &(sock->flusher_monitor));
+  sock->writing = atom_wait == result;
+  check_watermarks(env, sock, sock_term);
+  enif_mutex_unlock(sock->mutex);
+  return result;
+}
+
+
+/*******************
+ *  NIF Functions  *
+ *******************/
+
+static ERL_NIF_TERM nif_listen(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  struct sockaddr_in listen_address;
+  if (! get_address(env, argv[0], argv[1], &listen_address))
+    return enif_make_badarg(env);
+
+  const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    return make_socket_error(env, errno);
+
+  if (0 > setreuse(listen_fd) ||
+      0 > bind(listen_fd,
+               (struct sockaddr *)&listen_address,
+               sizeof(listen_address)) ||
+      0 > listen(listen_fd, 128) ||
+      0 > setnodelay(listen_fd) ||
+      0 > setnonblock(listen_fd)) {
+    const int err = errno;
+    close(listen_fd);
+    return make_socket_error(env, err);
+  }
+
+  return socket_create(env, listen_fd, LISTEN_SOCKET);
+}
+
+/* Runs on a dirty IO scheduler: just like the driver, connect is
+   blocking. */
+static ERL_NIF_TERM nif_connect(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  struct sockaddr_in connect_address;
+  if (! get_address(env, argv[0], argv[1], &connect_address))
+    return enif_make_badarg(env);
+
+  const int connect_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect_fd < 0)
+    return make_socket_error(env, errno);
+
+  if (0 > connect(connect_fd,
+                  (struct sockaddr *)&connect_address,
+                  sizeof(connect_address)) ||
+      0 > setnodelay(connect_fd) ||
+      0 > setnonblock(connect_fd)) {
+    const int err = errno;
+    close(connect_fd);
+    return make_socket_error(env, err);
+  }
+
+  return socket_create(env, connect_fd, CONNECTED_SOCKET);
+}
+
+static ERL_NIF_TERM nif_close(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  if (! get_socket(env, argv[0], &sock))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  if (0 > sock->fd) {
+    enif_mutex_unlock(sock->mutex);
+    return atom_badarg; /* someone else has already closed it */
+  }
+  enif_demonitor_process(env, sock, &(sock->monitor));
+  /* anything unwritten is lost, as with the driver */
+  enif_ioq_deq(sock->queue, enif_ioq_size(sock->queue), NULL);
+  socket_unwatch(env, sock);
+  sock->writing = FALSE;
+  socket_close_fd(env, sock);
+  enif_mutex_unlock(sock->mutex);
+  return atom_closed;
+}
+
+/* Returns {new_fd, Sock}, or wait if there's nothing to accept yet. */
+static ERL_NIF_TERM nif_accept(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  if (! get_socket(env, argv[0], &sock))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  const ERL_NIF_TERM unusable = socket_check(env, sock, LISTEN_SOCKET);
+  if (0 != unusable)
+    return unusable;
+  sock->reader.waiting = FALSE; /* not any more */
+
+  const int accepted_fd = accept(sock->fd, NULL, NULL);
+  if (0 > accepted_fd) {
+    const int err = errno;
+    ERL_NIF_TERM result = 0;
+    if (EAGAIN == err || EWOULDBLOCK == err || EINTR == err)
+      result = socket_select(env, sock, ERL_NIF_SELECT_READ,
+                             &(sock->reader), argv[1]);
+    else
+      result = make_socket_error(env, err);
+    enif_mutex_unlock(sock->mutex);
+    return result;
+  }
+  enif_mutex_unlock(sock->mutex);
+
+  if (0 > setnodelay(accepted_fd) || 0 > setnonblock(accepted_fd)) {
+    const int err = errno;
+    close(accepted_fd);
+    return make_socket_error(env, err);
+  }
+
+  return socket_create(env, accepted_fd, CONNECTED_SOCKET);
+}
+
+/* Reads up to Bytes. Returns {data, Bin}, closed, or wait if nothing
+   is available yet. */
+static ERL_NIF_TERM nif_recv(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  ErlNifUInt64 bytes = 0;
+  if (! (get_socket(env, argv[0], &sock) &&
+         enif_get_uint64(env, argv[1], &bytes) && 0 < bytes))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  const ERL_NIF_TERM unusable = socket_check(env, sock, CONNECTED_SOCKET);
+  if (0 != unusable)
+    return unusable;
+  sock->reader.waiting = FALSE; /* not any more */
+
+  ErlNifBinary bin;
+  if (! enif_alloc_binary(bytes < RECV_ONCE_SIZE ? bytes : RECV_ONCE_SIZE,
+                          &bin)) {
+    enif_mutex_unlock(sock->mutex);
+    return enif_raise_exception(env, enif_make_atom(env, "enomem"));
+  }
+
+  ssize_t got = 0;
+  do {
+    got = read(sock->fd, bin.data, bin.size);
+  } while (0 > got && EINTR == errno);
+
+  ERL_NIF_TERM result = 0;
+  if (0 < got) {
+    enif_mutex_unlock(sock->mutex);
+    if ((size_t)got < bin.size)
+      enif_realloc_binary(&bin, (size_t)got);
+    return enif_make_tuple2(env, atom_data, enif_make_binary(env, &bin));
+  } else if (0 == got) {
+    result = atom_closed;
+  } else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+    result = socket_select(env, sock, ERL_NIF_SELECT_READ, &(sock->reader),
+                           argv[2]);
+  } else {
+    result = make_socket_error(env, errno);
+  }
+  enif_mutex_unlock(sock->mutex);
+  enif_release_binary(&bin);
+  return result;
+}
+
+/* Returns ok if the data went straight out (or has been queued behind
+   another process's write, which will flush it), or wait if the
+   caller must wait for ready_output and then call flush. */
+static ERL_NIF_TERM nif_write(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  if (! get_socket(env, argv[0], &sock))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  const ERL_NIF_TERM unusable = socket_check(env, sock, CONNECTED_SOCKET);
+  if (0 != unusable)
+    return unusable;
+
+  /* enqueue first: the queue just takes refs on the binaries. The
+     whole iolist is inspected at once, so that a bad one enqueues
+     none of it. */
+  ErlNifIOVec vec, *iovec = &vec;
+  ERL_NIF_TERM tail;
+  if (! enif_inspect_iovec(env, SIZE_MAX, argv[1], &tail, &iovec)) {
+    enif_mutex_unlock(sock->mutex);
+    return enif_make_badarg(env);
+  }
+  const int enqueued =
+    enif_is_empty_list(env, tail) && enif_ioq_enqv(sock->queue, iovec, 0);
+  enif_free_iovec(iovec);
+  if (! enqueued) {
+    enif_mutex_unlock(sock->mutex);
+    return enif_make_badarg(env);
+  }
+
+  if (sock->writing) {
+    check_watermarks(env, sock, argv[0]);
+    enif_mutex_unlock(sock->mutex);
+    return atom_ok;
+  }
+
+  return socket_write_result(env, sock, argv[0], argv[2],
+                             socket_flush(env, sock));
+}
+
+/* Called by the process that got wait from write, once the socket
+   is writable again. */
+static ERL_NIF_TERM nif_flush(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  if (! get_socket(env, argv[0], &sock))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  const ERL_NIF_TERM unusable = socket_check(env, sock, CONNECTED_SOCKET);
+  if (0 != unusable)
+    return unusable;
+  sock->flusher.waiting = FALSE; /* not any more */
+
+  return socket_write_result(env, sock, argv[0], argv[1],
+                             socket_flush(env, sock));
+}
+
+static ERL_NIF_TERM nif_set_options(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  NifSocket *sock = NULL;
+  ErlNifSInt64 low = 0;
+  ErlNifSInt64 high = 0;
+  if (! (get_socket(env, argv[0], &sock) &&
+         enif_get_int64(env, argv[1], &low) &&
+         enif_get_int64(env, argv[2], &high)))
+    return enif_make_badarg(env);
+
+  enif_mutex_lock(sock->mutex);
+  if (0 > sock->fd || CONNECTED_SOCKET != sock->type) {
+    enif_mutex_unlock(sock->mutex);
+    return atom_badarg; /* programmer messed up */
+  }
+  sock->low = low;
+  sock->high = high;
+  sock->watermark = UNKNOWN_WATERMARK;
+  enif_self(env, &(sock->owner));
+  check_watermarks(env, sock, argv[0]);
+  enif_mutex_unlock(sock->mutex);
+  return atom_ok;
+}
+
+
+/*****************************
+ *  Resource Type Callbacks  *
+ *****************************/
+
+static void socket_dtor(ErlNifEnv *env, void *obj) {
+  NifSocket *const sock = (NifSocket *)obj;
+  /* a selected fd keeps its resource alive until socket_stop has
+     run, so anything still open here was never selected */
+  if (0 <= sock->fd && ! sock->selected)
+    close(sock->fd);
+  /* either may be missing if socket_create failed part way */
+  if (NULL != sock->queue)
+    enif_ioq_destroy(sock->queue);
+  if (NULL != sock->mutex)
+    enif_mutex_destroy(sock->mutex);
+  if (NULL != sock->reader.env)
+    enif_free_env(sock->reader.env);
+  if (NULL != sock->flusher.env)
+    enif_free_env(sock->flusher.env);
+}
+
+static void socket_stop(ErlNifEnv *env, void *obj, ErlNifEvent fd,
+                        int is_direct_call) {
+  close((int)fd);
+}
+
+static void socket_down(ErlNifEnv *env, void *obj, ErlNifPid *pid,
+                        ErlNifMonitor *monitor) {
+  NifSocket *const sock = (NifSocket *)obj;
+  enif_mutex_lock(sock->mutex);
+  if (sock->watching &&
+      0 == enif_compare_monitors(monitor, &(sock->flusher_monitor))) {
+    /* the flusher: the next write flushes what it left */
+    sock->watching = FALSE;
+    sock->writing = FALSE;
+    sock->flusher.waiting = FALSE;
+  } else if (0 <= sock->fd) { /* the owner */
+    enif_ioq_deq(sock->queue, enif_ioq_size(sock->queue), NULL);
+    socket_unwatch(env, sock);
+    sock->writing = FALSE;
+    socket_close_fd(env, sock);
+  }
+  enif_mutex_unlock(sock->mutex);
+}
+
+
+/************************
+ *  NIF Load Callbacks  *
+ ************************/
+
+static int hstcp_nif_load(ErlNifEnv *env, void **priv_data,
+                          ERL_NIF_TERM load_info) {
+  NifData *const nd = (NifData *)enif_alloc(sizeof(NifData));
+  if (NULL == nd)
+    return -1;
+
+  ErlNifResourceTypeInit init;
+  memset(&init, 0, sizeof(init));
+  init.dtor = socket_dtor;
+  init.stop = socket_stop;
+  init.down = socket_down;
+  nd->socket_type =
+    enif_open_resource_type_x(env, "hstcp_socket", &init,
+                              ERL_NIF_RT_CREATE, NULL);
+  if (NULL == nd->socket_type) {
+    enif_free(nd);
+    return -1;
+  }
+
+  nd->iov_max = 0;
+#if defined(_SC_IOV_MAX) /* IRIX, MacOS X, FreeBSD, Solaris, QNX, ... */
+  nd->iov_max = sysconf(_SC_IOV_MAX);
+#elif defined(IOV_MAX)
+  nd->iov_max = IOV_MAX;
+#endif
+  nd->iov_max = nd->iov_max <= 0 ? DEFAULT_IOV_MAX : nd->iov_max;
+
+  atom_ok             = enif_make_atom(env, "ok");
+  atom_wait           = enif_make_atom(env, "wait");
+  atom_closed         = enif_make_atom(env, "closed");
+  atom_error          = enif_make_atom(env, "error");
+  atom_hstcp_closed   = enif_make_atom(env, "hstcp_closed");
+  atom_badarg         = enif_make_atom(env, "badarg");
+  atom_undefined      = enif_make_atom(env, "undefined");
+  atom_new_fd         = enif_make_atom(env, "new_fd");
+  atom_data           = enif_make_atom(env, "data");
+  atom_socket_error   = enif_make_atom(env, "socket_error");
+  atom_hstcp_event    = enif_make_atom(env, "hstcp_event");
+  atom_low_watermark  = enif_make_atom(env, "low_watermark");
+  atom_high_watermark = enif_make_atom(env, "high_watermark");
+
+  *priv_data = nd;
+  return 0;
+}
+
+static void hstcp_nif_unload(ErlNifEnv *env, void *priv_data) {
+  enif_free(priv_data);
+}
+
+static ErlNifFunc hstcp_nif_funcs[] = {
+  {"nif_listen",      2, nif_listen,      0},
+  {"nif_connect",     2, nif_connect,     ERL_NIF_DIRTY_JOB_IO_BOUND},
+  {"nif_close",       1, nif_close,       0},
+  {"nif_accept",      2, nif_accept,      0},
+  {"nif_recv",        3, nif_recv,        0},
+  {"nif_write",       3, nif_write,       0},
+  {"nif_flush",       2, nif_flush,       0},
+  {"nif_set_options", 3, nif_set_options, 0}
+};
+
+ERL_NIF_INIT(hstcp_nif, hstcp_nif_funcs, hstcp_nif_load, NULL, NULL,
+             hstcp_nif_unload)
@@ -4,17 +4,20 @@ STANDALONE_TEST_COMMANDS:=test_hstcp:test()
 
 C_SOURCE_DIR:=$(PACKAGE_DIR)/c_src
 LIBRARY:=$(C_SOURCE_DIR)/libhstcp.so
-C_SOURCE:=$(wildcard $(C_SOURCE_DIR)/*.c)
+NIF_LIBRARY:=$(C_SOURCE_DIR)/libhstcp_nif.so
+NIF_SOURCE:=$(C_SOURCE_DIR)/hstcp_nif.c
+C_SOURCE:=$(filter-out $(NIF_SOURCE),$(wildcard $(C_SOURCE_DIR)/*.c))
 C_HEADERS:=$(wildcard $(C_SOURCE_DIR)/*.h)
 
 CC ?= gcc
 CFLAGS ?=
 CC_OPTS:=-Wall -pedantic -std=c99 -O2 -shared -fpic -lev -lJudy $(CFLAGS)
+NIF_CC_OPTS:=-Wall -pedantic -std=c99 -O2 -shared -fpic $(CFLAGS)
 
-CONSTRUCT_APP_PREREQS:=$(LIBRARY)
+CONSTRUCT_APP_PREREQS:=$(LIBRARY) $(NIF_LIBRARY)
 define construct_app_commands
 	mkdir -p $(APP_DIR)/priv
-	cp $(LIBRARY) $(APP_DIR)/priv
+	cp $(LIBRARY) $(NIF_LIBRARY) $(APP_DIR)/priv
 endef
 
 define package_rules
@@ -22,8 +25,11 @@ define package_rules
 $(LIBRARY): $(C_SOURCE) $(C_HEADERS)
 	$(CC) $(CC_OPTS) -o $$@ $(C_SOURCE)
 
+$(NIF_LIBRARY): $(NIF_SOURCE) $(C_HEADERS)
+	$(CC) $(NIF_CC_OPTS) -o $$@ $(NIF_SOURCE)
+
 $(PACKAGE_DIR)+clean::
-	rm -rf $(LIBRARY)
+	rm -rf $(LIBRARY) $(NIF_LIBRARY)
 
 # This is disgusting. Why can't I just depend on _and_ unpack
 # $(EZ_FILE) ? Instead we have .done. targets to confuse matters...
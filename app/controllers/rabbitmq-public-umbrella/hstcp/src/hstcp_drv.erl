@@ -17,7 +17,7 @@
 -module(hstcp_drv).
 
 -export([start/0, stop/1, listen/3, connect/3, close/1, accept/1,
-         recv/2, write/2, set_options/3]).
+         recv/2, write/2, write_multi/2, set_options/3, set_heartbeat/4]).
 
 -define(LIBNAME, "libhstcp").
 
@@ -28,8 +28,11 @@
 -define(HSTCP_RECV,         4).
 -define(HSTCP_WRITE,        5).
 -define(HSTCP_SET_OPTIONS,  6).
+-define(HSTCP_SET_HEARTBEAT, 7).
+-define(HSTCP_WRITE_MULTI,  8).
 
 -define(IS_WATERMARK(WM), WM =:= none orelse (is_integer(WM) andalso 0 =< WM)).
+-define(IS_INTERVAL(I), I =:= none orelse (is_integer(I) andalso 0 < I)).
 
 start() ->
     erl_ddll:start(),
@@ -74,6 +77,19 @@ write({Port, Fd}, Data) when Fd > 0 ->
              Port, [<<?HSTCP_WRITE, Fd:64/native-signed>>, Data]),
     simple_reply(Port, Fd).
 
+%% All the sockets must belong to the same Port. Any that can't be
+%% written to result in a {hstcp_event, Sock, badarg} to the caller.
+write_multi([], _Data) ->
+    ok;
+write_multi(Socks = [{Port, _Fd} | _], Data) ->
+    Fds = << <<Fd:64/native-signed>> || {Port1, Fd} <- Socks,
+                                        Port1 =:= Port andalso Fd > 0 >>,
+    true = size(Fds) =:= 8 * length(Socks),
+    true = port_command(
+             Port, [<<?HSTCP_WRITE_MULTI, (length(Socks)):64/native,
+                      Fds/binary>>, Data]),
+    simple_reply(Port, 0).
+
 set_options({Port, Fd}, LowWatermark, HighWatermark)
   when ?IS_WATERMARK(LowWatermark) andalso ?IS_WATERMARK(HighWatermark) ->
     true = port_command(
@@ -82,6 +98,19 @@ set_options({Port, Fd}, LowWatermark, HighWatermark)
                      (watermark_to_number(HighWatermark)):64/native-signed>>),
     simple_reply(Port, Fd).
 
+%% Intervals are in milliseconds. Frame is written whenever nothing
+%% else has been written for SendInterval; {timeout, RecvInterval} is
+%% sent to the owner if nothing is received for RecvInterval.
+set_heartbeat({Port, Fd}, SendInterval, RecvInterval, Frame)
+  when ?IS_INTERVAL(SendInterval) andalso ?IS_INTERVAL(RecvInterval)
+       andalso is_binary(Frame) ->
+    true = port_command(
+             Port, <<?HSTCP_SET_HEARTBEAT, Fd:64/native-signed,
+                     (interval_to_number(SendInterval)):64/native-signed,
+                     (interval_to_number(RecvInterval)):64/native-signed,
+                     (size(Frame)):64/native, Frame/binary>>),
+    simple_reply(Port, Fd).
+
 %% ---------------------------------------------------------------------------
 
 simple_reply(Port, Fd) ->
@@ -109,3 +138,6 @@ recv1(Port, Fd, N) ->
 
 watermark_to_number(none) -> -1;
 watermark_to_number(N)    -> N.
+
+interval_to_number(none) -> -1;
+interval_to_number(N)    -> N.
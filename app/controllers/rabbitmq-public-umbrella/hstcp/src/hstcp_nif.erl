@@ -0,0 +1,136 @@
+%%  The contents of this file are subject to the Mozilla Public License
+%%  Version 1.1 (the "License"); you may not use this file except in
+%%  compliance with the License. You may obtain a copy of the License
+%%  at http://www.mozilla.org/MPL/
+%%
+%%  Software distributed under the License is distributed on an "AS IS"
+%%  basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+%%  the License for the specific language governing rights and
+%%  limitations under the License.
+%%
+%%  The Original Code is HSTCP.
+%%
+%%  The Initial Developer of the Original Code is VMware, Inc.
+%%  Copyright (c) 2009-2011 VMware, Inc.  All rights reserved.
+%%
+
+-module(hstcp_nif).
+
+%% The NIF front end to hstcp. Sockets are resources rather than
+%% {Port, Fd} pairs, and there's no port to start. Rather than
+%% sending hstcp_events, accept/1 and recv/2 block the calling
+%% process until they have a result, and write/2 returns as soon as
+%% the data is written, or is queued behind another process's write
+%% which will flush it. Should that process die first, what it left
+%% goes out with the next write. Only watermark events are sent, to
+%% the process that last called set_options/3.
+%%
+%% Whilst blocked, the calling process waits for the select message
+%% from the emulator's poller. Closing a socket that another process
+%% is blocked on, or its owner dying, wakes that process with
+%% {error, closed}, as does using a socket that's already been
+%% closed. Only one process at a time should block reading a socket,
+%% and only one writing it.
+
+-export([listen/2, connect/2, close/1, accept/1, recv/2, write/2,
+         set_options/3]).
+
+-on_load(init/0).
+
+-define(LIBNAME, "libhstcp_nif").
+-define(RECV_ONCE, 65536).
+
+-define(IS_WATERMARK(WM), WM =:= none orelse (is_integer(WM) andalso 0 =< WM)).
+
+init() ->
+    Dir = case code:priv_dir(hstcp) of
+              {error, bad_name} ->
+                  filename:join(filename:dirname(code:which(?MODULE)),
+                                "../priv");
+              PrivDir ->
+                  PrivDir
+          end,
+    erlang:load_nif(filename:join(Dir, ?LIBNAME), 0).
+
+listen(IpAddress, IpPort) ->
+    nif_listen(list_to_binary(address_str(IpAddress)), IpPort).
+
+connect(IpAddress, IpPort) ->
+    nif_connect(list_to_binary(address_str(IpAddress)), IpPort).
+
+close(Sock) ->
+    nif_close(Sock).
+
+accept(Sock) ->
+    Ref = make_ref(),
+    Retry = fun () -> nif_accept(Sock, Ref) end,
+    wait_for(Sock, Ref, ready_input, Retry(), Retry).
+
+%% once returns whatever is available (up to 64kB); Bytes waits for
+%% exactly that many.
+recv(Sock, once) ->
+    recv1(Sock, ?RECV_ONCE);
+recv(Sock, Bytes) when is_integer(Bytes) andalso Bytes > 0 ->
+    recv_exactly(Sock, Bytes, []).
+
+write(Sock, Data) ->
+    Ref = make_ref(),
+    wait_for(Sock, Ref, ready_output, nif_write(Sock, Data, Ref),
+             fun () -> nif_flush(Sock, Ref) end).
+
+set_options(Sock, LowWatermark, HighWatermark)
+  when ?IS_WATERMARK(LowWatermark) andalso ?IS_WATERMARK(HighWatermark) ->
+    nif_set_options(Sock, watermark_to_number(LowWatermark),
+                    watermark_to_number(HighWatermark)).
+
+%% ---------------------------------------------------------------------------
+
+address_str({A,B,C,D}) ->
+    tl(lists:flatten([[$., integer_to_list(X)] || X <- [A,B,C,D]]));
+address_str(List) when is_list(List) ->
+    List.
+
+recv1(Sock, N) ->
+    Ref = make_ref(),
+    Retry = fun () -> nif_recv(Sock, N, Ref) end,
+    wait_for(Sock, Ref, ready_input, Retry(), Retry).
+
+recv_exactly(_Sock, 0, Acc) ->
+    {data, list_to_binary(lists:reverse(Acc))};
+recv_exactly(Sock, N, Acc) ->
+    case recv1(Sock, N) of
+        {data, Data} -> recv_exactly(Sock, N - size(Data), [Data | Acc]);
+        Other        -> Other
+    end.
+
+%% Retries until it gets something other than wait. A socket closed
+%% between the select message and the retry has sent hstcp_closed
+%% too, which mustn't be left behind.
+wait_for(Sock, Ref, Ready, wait, Retry) ->
+    receive
+        {select, Sock, Ref, Ready} ->
+            case Retry() of
+                {error, closed} ->
+                    receive {hstcp_closed, Sock, Ref} -> {error, closed} end;
+                Result ->
+                    wait_for(Sock, Ref, Ready, Result, Retry)
+            end;
+        {hstcp_closed, Sock, Ref} ->
+            {error, closed}
+    end;
+wait_for(_Sock, _Ref, _Ready, Result, _Retry) ->
+    Result.
+
+watermark_to_number(none) -> -1;
+watermark_to_number(N)    -> N.
+
+%% ---------------------------------------------------------------------------
+
+nif_listen(_Address, _Port)            -> erlang:nif_error(not_loaded).
+nif_connect(_Address, _Port)           -> erlang:nif_error(not_loaded).
+nif_close(_Sock)                       -> erlang:nif_error(not_loaded).
+nif_accept(_Sock, _Ref)                -> erlang:nif_error(not_loaded).
+nif_recv(_Sock, _Bytes, _Ref)          -> erlang:nif_error(not_loaded).
+nif_write(_Sock, _Data, _Ref)          -> erlang:nif_error(not_loaded).
+nif_flush(_Sock, _Ref)                 -> erlang:nif_error(not_loaded).
+nif_set_options(_Sock, _Low, _High)    -> erlang:nif_error(not_loaded).
@@ -30,7 +30,12 @@ test() ->
                           write_server_client,
                           write_server_client_variations,
                           write_server_client_one_big,
-                          write_server_client_streaming]}],
+                          write_server_client_streaming,
+                          write_multi,
+                          heartbeat_send,
+                          heartbeat_timeout,
+                          nif_round_trip,
+                          nif_close_wakes_waiters]}],
               [report, {name, ?MODULE}]).
 
 start_stop() ->
@@ -201,6 +206,112 @@ write_server_client_streaming() ->
                 fun (_Sock, _Sock1) -> passed end)
       end).
 
+write_multi() ->
+    twice(fun () ->
+                  with_connection(
+                    fun (Sock, Sock1 = {Port, _Fd}) ->
+                            Bin = <<"Hello World">>,
+                            Bogus = {Port, 65535},
+                            ok = hstcp_drv:write_multi([Sock1, Bogus, Sock1],
+                                                       [Bin]),
+                            receive {hstcp_event, Bogus, badarg} -> ok end,
+                            Twice = <<Bin/binary, Bin/binary>>,
+                            {ok, Twice} = gen_tcp:recv(Sock, size(Twice)),
+                            gen_tcp:close(Sock),
+                            passed
+                    end,
+                    fun (_Sock, _Sock1) -> passed end)
+          end).
+
+heartbeat_send() ->
+    Frame = <<8, 0:16, 0:32, 206>>, %% AMQP heartbeat frame
+    twice(fun () ->
+                  with_connection(
+                    fun (Sock, Sock1) ->
+                            ok = hstcp_drv:set_heartbeat(Sock1, 100, none,
+                                                         Frame),
+                            {ok, Frame} = gen_tcp:recv(Sock, size(Frame)),
+                            {ok, Frame} = gen_tcp:recv(Sock, size(Frame)),
+                            gen_tcp:close(Sock),
+                            passed
+                    end,
+                    fun (_Sock, _Sock1) -> passed end)
+          end).
+
+heartbeat_timeout() ->
+    twice(fun () ->
+                  with_connection(
+                    fun (Sock, Sock1) ->
+                            ok = hstcp_drv:set_heartbeat(Sock1, none, 200,
+                                                         <<>>),
+                            receive
+                                {hstcp_event, Sock1, {timeout, 200}} -> ok
+                            end,
+                            gen_tcp:close(Sock),
+                            passed
+                    end,
+                    fun (_Sock, _Sock1) -> passed end)
+          end).
+
+nif_round_trip() ->
+    twice(fun () ->
+                  {new_fd, Sock} = hstcp_nif:listen("0.0.0.0", ?PORT),
+                  {ok, Client} = gen_tcp:connect(
+                                   "localhost", ?PORT,
+                                   [binary, {active, false}, {nodelay, true}]),
+                  {new_fd, Sock1} = hstcp_nif:accept(Sock),
+                  Bin = <<"Hello World">>,
+                  ok = gen_tcp:send(Client, Bin),
+                  {data, Bin} = hstcp_nif:recv(Sock1, size(Bin)),
+                  ok = hstcp_nif:write(Sock1, [Bin, Bin]),
+                  Twice = <<Bin/binary, Bin/binary>>,
+                  {ok, Twice} = gen_tcp:recv(Client, size(Twice)),
+                  ok = gen_tcp:close(Client),
+                  closed = hstcp_nif:recv(Sock1, once),
+                  closed = hstcp_nif:close(Sock1),
+                  badarg = hstcp_nif:close(Sock1),
+                  closed = hstcp_nif:close(Sock),
+                  passed
+          end).
+
+nif_close_wakes_waiters() ->
+    twice(fun () ->
+                  {new_fd, Sock} = hstcp_nif:listen("0.0.0.0", ?PORT),
+                  {ok, Client} = gen_tcp:connect(
+                                   "localhost", ?PORT,
+                                   [binary, {active, false}, {nodelay, true}]),
+                  {new_fd, Sock1} = hstcp_nif:accept(Sock),
+                  Reader = blocked(fun () -> hstcp_nif:recv(Sock1, once) end),
+                  closed = hstcp_nif:close(Sock1),
+                  {error, closed} = unblocked(Reader),
+                  {error, closed} = hstcp_nif:recv(Sock1, once),
+                  ok = gen_tcp:close(Client),
+                  Acceptor = blocked(fun () -> hstcp_nif:accept(Sock) end),
+                  closed = hstcp_nif:close(Sock),
+                  {error, closed} = unblocked(Acceptor),
+                  passed
+          end).
+
+%% Runs Fun in a new process, returning once that's waiting in a
+%% receive, or has finished.
+blocked(Fun) ->
+    Me = self(),
+    Pid = spawn_link(fun () -> Me ! {self(), Fun()} end),
+    blocked1(Pid).
+
+blocked1(Pid) ->
+    case erlang:process_info(Pid, status) of
+        {status, waiting} -> Pid;
+        undefined         -> Pid;
+        _                 -> timer:sleep(10),
+                             blocked1(Pid)
+    end.
+
+unblocked(Pid) ->
+    receive {Pid, Result} -> Result
+    after 5000 -> exit({still_blocked, Pid})
+    end.
+
 repeat_write(_Sock, _List, 0) ->
     ok;
 repeat_write(Sock, List, N) when N > 0 ->
@@ -31,70 +31,99 @@
 -include_lib("rabbit_common/include/rabbit_msg_store_index.hrl").
 
 -define(FILENAME, "msg_store_toke.tch").
+-define(SHARDS, 4).
+-define(MEMTABLE_BYTES, 16777216).
+-define(MEMTABLE_INTERVAL, 1000). %% ms
+-define(BLOOM_BITS_PER_KEY, 10).
+-define(BLOOM_REBUILD_PERCENT, 50).
+-define(MIN_RECORDS, 20000000).
+-define(EXPECTED_MSG_BYTES, 1024).
+-define(MAINTENANCE_INTERVAL, 1000). %% ms
+-define(MAINTENANCE_STEP, 1000).
+-define(MAX_FRAGMENTATION_PERCENT, 30).
 
 new(Dir) ->
     {Toke, Path} = init(Dir),
-    ok = toke_drv:open(Toke, Path, [read, write, create, truncate, no_lock]),
+    ok = delete_unsharded(Path),
+    ok = toke_shards:bulk_begin(Toke, expected_records(Dir)),
+    ok = toke_shards:open(Toke, Path, [read, write, create, truncate, no_lock]),
+    %% the sizing is done by open, and the index is then filled by
+    %% ordinary inserts, there being no word of when the load is over
+    ok = toke_shards:bulk_end(Toke),
     Toke.
 
 recover(Dir) ->
     {Toke, Path} = init(Dir),
-    case toke_drv:open(Toke, Path, [read, write, no_lock]) of
+    case toke_shards:open(Toke, Path, [read, write, no_lock]) of
         ok  -> {ok, Toke};
         Err -> {error, Err}
     end.
 
 init(Dir) ->
-    {ok, Toke} = toke_drv:start_link(),
-    ok = toke_drv:new(Toke),
-    ok = toke_drv:set_cache(Toke, 1000000),
-    ok = toke_drv:set_df_unit(Toke, 0),
-    ok = toke_drv:tune(Toke, 40000000, -1, 15, [large]),
+    {ok, Toke} = toke_shards:start_link(?SHARDS),
+    ok = toke_shards:new(Toke),
+    ok = toke_shards:set_cache(Toke, 1000000),
+    ok = toke_shards:set_df_unit(Toke, 0),
+    ok = toke_shards:tune(Toke, 40000000, -1, 15, [large]),
+    ok = toke_shards:set_secondary(Toke, #msg_location.file),
+    %% the index is only recovered after a clean shutdown, which
+    %% flushes the memtable
+    ok = toke_shards:set_memtable(Toke, ?MEMTABLE_BYTES, ?MEMTABLE_INTERVAL),
+    %% many lookups are for messages that aren't in the index
+    ok = toke_shards:set_bloom(Toke, ?BLOOM_BITS_PER_KEY,
+                               ?BLOOM_REBUILD_PERCENT),
+    %% auto defrag is off, so reclaim the space of deleted entries
+    %% when the index is idle
+    ok = toke_shards:set_maintenance(Toke, ?MAINTENANCE_INTERVAL,
+                                     ?MAINTENANCE_STEP,
+                                     ?MAX_FRAGMENTATION_PERCENT),
     {Toke, filename:join(Dir, ?FILENAME)}.
 
+%% Before the index was sharded it was the single file at Path, which
+%% the shards, at Path.I, would otherwise leave behind.
+delete_unsharded(Path) ->
+    case file:delete(Path) of
+        ok              -> ok;
+        {error, enoent} -> ok
+    end.
+
+%% A new index is about to be rebuilt from the store's files, if there
+%% are any, so size it for the messages they might hold.
+expected_records(Dir) ->
+    Files = filelib:wildcard(filename:join(Dir, "*.rdq")),
+    Bytes = lists:sum([filelib:file_size(File) || File <- Files]),
+    lists:max([?MIN_RECORDS, Bytes div ?EXPECTED_MSG_BYTES]).
+
 lookup(Key, Toke) -> %% Key is MsgId which is binary already
-    case toke_drv:get(Toke, Key) of
+    case toke_shards:get(Toke, Key) of
         not_found -> not_found;
         Entry     -> #msg_location {} = binary_to_term(Entry)
     end.
 
 insert(Obj = #msg_location { msg_id = MsgId }, Toke) ->
-    ok = toke_drv:insert_async(Toke, MsgId, term_to_binary(Obj)).
+    ok = toke_shards:insert_async(Toke, MsgId, term_to_binary(Obj)).
 
 update(Obj, Toke) ->
     insert(Obj, Toke).
 
-update_fun({Position, NewValue}, ObjAcc) ->
-    setelement(Position, ObjAcc, NewValue).
-
-update_fields(Key, Updates, Toke) ->
-    Fun = fun (ObjBin) ->
-                  Obj = #msg_location {} = binary_to_term(ObjBin),
-                  term_to_binary(
-                    case is_list(Updates) of
-                        true  -> lists:foldl(fun update_fun/2, Obj, Updates);
-                        false -> update_fun(Updates, Obj)
-                    end)
-          end,
-    ok = toke_drv:update_atomically(Toke, Key, Fun).
+update_fields(Key, Updates, Toke) when is_list(Updates) ->
+    case toke_shards:merge(Toke, Key, [{replace, Position, NewValue} ||
+                                       {Position, NewValue} <- Updates]) of
+        ok        -> ok;
+        not_found -> ok
+    end;
+update_fields(Key, Update, Toke) ->
+    update_fields(Key, [Update], Toke).
 
 delete(Key, Toke) ->
-    ok = toke_drv:delete(Toke, Key).
+    ok = toke_shards:delete(Toke, Key).
 
 delete_object(Obj = #msg_location { msg_id = MsgId }, Toke) ->
-    ok = toke_drv:delete_if_value_eq(Toke, MsgId, term_to_binary(Obj)).
+    ok = toke_shards:delete_if_value_eq(Toke, MsgId, term_to_binary(Obj)).
 
 delete_by_file(File, Toke) ->
-    DeleteMe = toke_drv:fold(
-                 fun (Key, Obj, Acc) ->
-                         case (binary_to_term(Obj))#msg_location.file of
-                             File -> [Key | Acc];
-                             _    -> Acc
-                         end
-                 end, [], Toke),
-    [ok = toke_drv:delete(Toke, Key) || Key <- DeleteMe],
-    ok.
+    ok = toke_shards:delete_by_secondary(Toke, File).
 
 terminate(Toke) ->
-    ok = toke_drv:close(Toke),
-    ok = toke_drv:stop(Toke).
+    ok = toke_shards:close(Toke),
+    ok = toke_shards:stop(Toke).
@@ -17,20 +17,37 @@
 /*                                                                           */
 /* ------------------------------------------------------------------------- */
 
+#define _POSIX_C_SOURCE 200112L /* fileno and fsync, under -std=c99 */
+
 #include <erl_driver.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/uio.h>
+#include <unistd.h>
 #include <tcutil.h>
 #include <tchdb.h>
+#include <tcbdb.h>
+#include <tcfdb.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include "toke.h"
 
+/* erl_driver.h only has these from R15B */
+#if ERL_DRV_EXTENDED_MAJOR_VERSION < 2
+typedef int ErlDrvSizeT;
+typedef int ErlDrvSSizeT;
+#endif
+
 #define FALSE                  0
 #define TRUE                   1
 
@@ -39,20 +56,397 @@
 #define READER_ERROR          -2
 
 #define ATOM_SPEC_LEN          6
-#define GET_RESULT_SPEC_LEN    7
+#define GET_RESULT_SPEC_LEN    8
 #define ITER_RESULT_SPEC_LEN   10
 #define READER_ERROR_SPEC_LEN  11
 #define TOKYO_ERROR_SPEC_LEN   11
+#define CAS_CHANGED_SPEC_LEN   11
+
+#define REPLY_SPEC_LEN         11 /* the longest of the specs above */
+#define CALL_REPLY_SIZE        256   /* to start with; it grows */
+#define CALL_HEADER_SIZE       6     /* term_to_binary's, of a binary */
+
+/* {toke_reply, [Value | not_found, ...]} for n keys */
+#define GET_MULTI_SPEC_LEN(n)  ((4 * (n)) + 7)
+/* {toke_reply, [{Key, Value}, ...]} for n records */
+#define ITER_NEXT_SPEC_LEN(n)  ((10 * (n)) + 7)
+#define CURSOR_SPEC_LEN        6
+#define HANDLE_SPEC_LEN        6
+#define ITER_NEXT_MAX          16384
+#define MERGE_OPS_MAX          16
+#define LATENCY_BUCKETS        24    /* log2 us, the last from 4s up */
+/* {Command, Count, [N, ...]} */
+#define LATENCY_ENTRY_LEN      ((2 * LATENCY_BUCKETS) + 9)
+/* {latency, [Entry, ...]} for every command */
+#define LATENCY_SPEC_LEN       ((COMMAND_COUNT * LATENCY_ENTRY_LEN) + 7)
+/* {toke_reply, [{Name, N}, ..., Latency]} */
+#define STATS_SPEC_LEN         ((6 * STAT_COUNT) + 7 + LATENCY_SPEC_LEN)
+#define BLOOM_BLOCK_BITS       512   /* a cache line of bits */
+#define BLOOM_BLOCK_WORDS      (BLOOM_BLOCK_BITS / 64)
+#define BLOOM_MAX_HASHES       16
+#define BLOOM_MIN_KEYS         65536
+#define BLOOM_REBUILD_MS       100   /* from going stale to the rebuild */
+#define HDB_HEADER_SIZE        256   /* before TC's bucket array */
+#define MAINTENANCE_MIN_RECORDS 1024 /* before fragmentation means much */
+#define OPTIMIZE_SUFFIX        ".optimize"
+#define LZ_HASH_BITS           10    /* records are small */
+#define LZ_HEADER_SIZE         5     /* the length, then the format */
+#define LZ_MIN_MATCH           4
+#define LZ_MAX_OFFSET          65535
+#define LZ_LAST_LITERALS       5     /* as LZ4 has it */
+#define LZ_MATCH_LIMIT         12    /* no match starts nearer the end */
+#define TREE_LEAF_MEMBERS      128   /* TC's default */
+#define FIXED_KEY_SIZE         8     /* a big-endian id */
+#define FIXED_HEADER_SIZE      256   /* before TC's array of records */
+#define FIXED_RECORD_SIZE      4     /* the most TC adds for the size */
+#define MEM_KEY_SIZE           16    /* a msg id */
+#define MEM_INLINE_VALUE       104   /* so that a slot is 2 cache lines */
+#define MEM_GROUP              16    /* control bytes compared at once */
+#define MEM_MIN_CAPACITY       64
+#define MEM_MAX_CAPACITY       (((uint64_t)1) << 48) /* slots, say */
+#define MEM_CACHE_LINE         64
+#define MEM_EMPTY              0x80
+#define MEM_DELETED            0xfe
+#define MEM_SNAPSHOT_MAGIC     "tokemem1"
+#define MEM_MAGIC_SIZE         8
+#define MEM_SNAPSHOT_SUFFIX    ".snapshot"
+
+/* how the excodec stored a record */
+#define LZ_STORED              0
+#define LZ_PACKED              1
+
+/* memtable entries are tagged */
+#define MEMTABLE_MISS          0
+#define MEMTABLE_PUT           'p'
+#define MEMTABLE_DELETE        'd'
+
+/* external term format tags, for extracting secondary keys */
+enum {
+  ETF_VERSION         = 131,
+  ETF_NEW_FLOAT       = 70,
+  ETF_SMALL_INTEGER   = 97,
+  ETF_INTEGER         = 98,
+  ETF_FLOAT           = 99,
+  ETF_ATOM            = 100,
+  ETF_SMALL_TUPLE     = 104,
+  ETF_LARGE_TUPLE     = 105,
+  ETF_NIL             = 106,
+  ETF_STRING          = 107,
+  ETF_LIST            = 108,
+  ETF_BINARY          = 109,
+  ETF_SMALL_BIG       = 110,
+  ETF_LARGE_BIG       = 111,
+  ETF_SMALL_ATOM      = 115,
+  ETF_ATOM_UTF8       = 118,
+  ETF_SMALL_ATOM_UTF8 = 119,
+  ETF_INT_MAX_LEN     = 11   /* an int64_t as a SMALL_BIG */
+};
+
+/* the stats, in the order TOKE_STATS reports them */
+enum {
+  STAT_BLOOM_BITS,
+  STAT_BLOOM_HASHES,
+  STAT_BLOOM_KEYS,
+  STAT_BLOOM_LOOKUPS,
+  STAT_BLOOM_NEGATIVES,
+  STAT_BLOOM_FALSE_POSITIVES,
+  STAT_FILE_SIZE,
+  STAT_FRAGMENTATION,
+  STAT_DEFRAG_STEPS,
+  STAT_OPTIMIZES,
+  STAT_RECORDS,
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_QUEUED_JOBS,
+  STAT_MEMTABLE_RECORDS,
+  STAT_COUNT
+};
+
+const char *const stat_names[STAT_COUNT] = {
+  "bloom_bits",
+  "bloom_hashes",
+  "bloom_keys",
+  "bloom_lookups",
+  "bloom_negatives",
+  "bloom_false_positives",
+  "file_size",
+  "fragmentation",
+  "defrag_steps",
+  "optimizes",
+  "records",
+  "bytes_read",
+  "bytes_written",
+  "queued_jobs",
+  "memtable_records"
+};
+
+#define COMMAND_COUNT          (TOKE_ITER_RANGE + 1)
+
+/* as TOKE_STATS reports their latencies */
+const char *const command_names[COMMAND_COUNT] = {
+  "new",
+  "del",
+  "tune",
+  "set_cache",
+  "set_xm_size",
+  "set_df_unit",
+  "open",
+  "close",
+  "insert",
+  "insert_new",
+  "insert_concat",
+  "insert_async",
+  "delete",
+  "delete_if_eq",
+  "get",
+  "get_all",
+  "get_multi",
+  "insert_multi",
+  "delete_multi",
+  "iter_open",
+  "iter_next",
+  "iter_close",
+  "set_secondary",
+  "delete_by_secondary",
+  "cas",
+  "merge",
+  "tran_begin",
+  "tran_commit",
+  "tran_abort",
+  "set_group_commit",
+  "set_memtable",
+  "set_bloom",
+  "stats",
+  "bulk_begin",
+  "bulk_insert",
+  "bulk_end",
+  "set_maintenance",
+  "optimize",
+  "add_handle",
+  "remove_handle",
+  "share",
+  "attach",
+  "iter_range"
+};
+
+typedef struct TokeJob TokeJob;
 
 typedef struct {
-  ErlDrvPort port;
-  TCHDB *hdb;
-  ErlDrvTermData* get_result_spec;   /* store these in here so that */
-  ErlDrvTermData* iter_result_spec;  /* they're not shared between  */
-  ErlDrvTermData* reader_error_spec; /* threads                     */
-  ErlDrvTermData* tokyo_error_spec;
+  uint64_t *bits;                    /* NULL if not built               */
+  uint64_t blocks;                   /* a power of 2                    */
+  uint32_t hashes;                   /* bits set per key, in one block  */
+  uint64_t keys;                     /* added since the last build      */
+  uint64_t capacity;                 /* keys before a rebuild           */
+  uint64_t deletes;                  /* since the last build            */
+  uint64_t lookups;                  /* gets that consulted the filter  */
+  uint64_t negatives;                /* answered by the filter alone    */
+  uint64_t false_positives;          /* passed it, but weren't there    */
+  int stale;                         /* to be rebuilt at the next tick  */
+} Bloom;
+
+typedef struct {
+  uint32_t interval;                 /* ms between idle steps, 0 off    */
+  uint32_t step;                     /* records per step: the I/O budget */
+  uint32_t target;                   /* fragmentation % to defrag to    */
+  uint64_t baseline;                 /* record bytes per record, compact */
+  uint64_t stalled;                  /* records defragged, no shrinking */
+  uint64_t defrag_steps;
+  uint64_t optimizes;
+  TCHDB *copy;                       /* an online optimize's new file,  */
+  char *copy_path;                   /* NULL if there's none under way  */
+  TCMAP *dirty;                      /* keys written since it began     */
+  int copy_started;                  /* the iterator is the copy's      */
+  int copy_done;                     /* every record has been seen      */
+  int lost;                          /* TC's error if a swap lost the db */
+} Maintenance;
+
+/* From when a command reaches the driver until it has run, so
+   including its wait behind the port's earlier commands. Bucket n
+   counts latencies of under 2^n us. */
+typedef struct {
+  uint64_t count;
+  uint64_t buckets[LATENCY_BUCKETS];
+} Latency;
+
+/* What a handle's db is: one of TC's hash, B+ tree and fixed-length
+   databases, or the driver's own in-memory table. The operations are
+   TCHDB's, and behave as TCHDB's do, error codes included. */
+typedef struct {
+  void *(*create)(void);
+  void (*destroy)(void *db);
+  int (*ecode)(void *db);
+  bool (*tune)(void *db, int64_t bnum, int8_t apow, int8_t fpow,
+               uint8_t opts);
+  bool (*setcache)(void *db, int32_t rcnum);
+  bool (*setxmsiz)(void *db, int64_t xmsiz);
+  bool (*setdfunit)(void *db, int32_t dfunit);
+  bool (*setmutex)(void *db);        /* NULL if it can't be shared      */
+  bool (*open)(void *db, const char *path, int omode);
+  bool (*close)(void *db);
+  bool (*put)(void *db, const void *kbuf, int ksiz, const void *vbuf,
+              int vsiz);
+  bool (*putkeep)(void *db, const void *kbuf, int ksiz, const void *vbuf,
+                  int vsiz);
+  bool (*putcat)(void *db, const void *kbuf, int ksiz, const void *vbuf,
+                 int vsiz);
+  bool (*putasync)(void *db, const void *kbuf, int ksiz, const void *vbuf,
+                   int vsiz);
+  bool (*putproc)(void *db, const void *kbuf, int ksiz, const void *vbuf,
+                  int vsiz, TCPDPROC proc, void *op);
+  bool (*out)(void *db, const void *kbuf, int ksiz);
+  void *(*get)(void *db, const void *kbuf, int ksiz, int *sp);
+  int (*get3)(void *db, const void *kbuf, int ksiz, void *vbuf, int max);
+  int (*vsiz)(void *db, const void *kbuf, int ksiz);
+  bool (*iterinit)(void *db);
+  /* to the first key not less than kbuf, NULL if keys aren't ordered */
+  bool (*iterjump)(void *db, const void *kbuf, int ksiz);
+  /* to kbuf, which it gives next, or where it would be if ordered */
+  bool (*iterseek)(void *db, const void *kbuf, int ksiz);
+  /* changes whenever the order does, NULL if it's kept across writes */
+  uint64_t (*iterorder)(void *db);
+  bool (*iternext3)(void *db, TCXSTR *kxstr, TCXSTR *vxstr);
+  uint64_t (*rnum)(void *db);
+  uint64_t (*fsiz)(void *db);
+  bool (*sync)(void *db);
+  bool (*tranbegin)(void *db);
+  bool (*trancommit)(void *db);
+  bool (*tranabort)(void *db);
+  bool (*idle)(void *db);            /* from maintenance ticks, if any  */
+  bool (*optimize)(void *db);        /* at once, if not maintained      */
+  int maintained;                    /* by the Maintenance Functions    */
+} Backend;
+
+typedef struct TokePort TokePort;
+typedef struct SharedDb SharedDb;
+
+/* An open cursor. TC has one iterator per db, so a cursor that finds
+   something else has moved it seeks back to its place first. */
+typedef struct Cursor {
+  uint64_t id;
+  TCXSTR *at;                        /* its place, NULL for the start   */
+  int after;                         /* at has already been given       */
+  TCXSTR *end;                       /* a range's end, NULL if unbounded */
+  uint64_t order;                    /* the db's iterorder when placed   */
+  struct Cursor *next;
+} Cursor;
+
+/* One db handle. A port has any number of them, each with its own
+   db, and every command names the handle it's for. */
+typedef struct {
+  TokePort *tp;
+  uint32_t id;
+  const Backend *be;
+  void *db;                          /* NULL if there's none            */
+  Cursor *cursors;                   /* the open ones, newest first      */
+  uint64_t cursor;                   /* whose place TC's iterator is at  */
+  uint64_t cursor_serial;            /* 0 for none of them               */
+  uint8_t secondary_position;        /* tuple element indexed, 0 if none */
+  TCMAP *by_secondary;               /* secondary -> TCMAP* of primaries */
+  TCMAP *by_primary;                 /* primary -> secondary             */
+  int in_transaction;                /* an explicit transaction is open  */
+  int in_group;                      /* in the port's group transaction  */
+  TCMAP *memtable;                   /* async writes yet to reach TC     */
+  uint64_t memtable_max;             /* bytes before a flush, 0 off      */
+  uint32_t memtable_interval;        /* ms between flushes, 0 if none    */
+  uint32_t bloom_bits_per_key;       /* 0 if there's no filter           */
+  uint32_t bloom_rebuild_percent;    /* of keys deleted, 0 never         */
+  Bloom bloom;
+  int8_t tune_apow;                  /* as last tuned, so that bulk_begin */
+  int8_t tune_fpow;                  /* can change just bnum             */
+  int tune_opts;
+  uint64_t bulk_records;             /* expected, 0 if not bulk loading  */
+  int32_t df_unit;                   /* TC's auto defrag, 0 if off       */
+  char *path;                        /* as opened, NULL if not open      */
+  int open_mode;
+  Maintenance maint;
+  uint64_t bytes_read;               /* of values got, records iterated  */
+  uint64_t bytes_written;            /* of records put                   */
+  Latency latency[COMMAND_COUNT];
+  SharedDb *shared;                  /* NULL if the db isn't shared      */
+  int reader;                        /* attached to another's shared db  */
 } TokeData;
 
+/* A db shared between ports. It's in shared_dbs, for readers to
+   attach to, until its owner lets go of it. */
+struct SharedDb {
+  char *name;
+  uint64_t name_size;
+  const Backend *be;
+  void *db;
+  uint32_t refs;                     /* the owner and each reader       */
+  SharedDb *next;
+};
+
+/* Group commit spans the port: one group transaction is a TC
+   transaction on each handle written to, and they're committed
+   together. */
+struct TokePort {
+  ErlDrvPort port;
+  ErlDrvTermData owner;              /* the process that opened the port */
+  unsigned int async_key;            /* keeps this port's jobs in order  */
+  ErlDrvMutex *mutex;                /* protects outstanding             */
+  ErlDrvCond *cond;
+  int64_t outstanding;               /* jobs that have yet to run        */
+  TokeData **handles;                /* by id, NULL if free. Handle 0    */
+  uint32_t handle_slots;             /* is always there                  */
+  ErlDrvTermData* get_result_spec;   /* templates, which are copied into */
+  ErlDrvTermData* iter_result_spec;  /* each job before being filled in, */
+  ErlDrvTermData* reader_error_spec; /* because replies for one job are  */
+  ErlDrvTermData* tokyo_error_spec;  /* sent while the next one runs     */
+  ErlDrvTermData* cas_changed_spec;
+  int group_open;                    /* a group transaction is open      */
+  uint32_t group_max;                /* writes per group commit, 0 off   */
+  uint32_t group_window;             /* ms to wait for more writes       */
+  uint32_t group_writes;             /* in the open group transaction    */
+  int timer_armed;                   /* these four are only touched by   */
+  uint32_t timer_ms;                 /* the emulator thread. The timer   */
+  TokeJob *held_head;                /* serves the memtable too. Jobs    */
+  TokeJob *held_tail;                /* whose replies await the commit   */
+};
+
+/* Every command runs as a job on an async thread. All of a port's
+   jobs share its async_key, so they run one at a time, in order. The
+   reply is left in the job for toke_ready_async to send. */
+struct TokeJob {
+  TokePort *tp;
+  TokeData *td;                      /* the handle, once the job runs   */
+  ErlIOVec ev;                       /* our copy of the command         */
+  ErlDrvTermData *spec;              /* the reply, if any               */
+  int spec_len;
+  ErlDrvTermData reply[REPLY_SPEC_LEN]; /* spec, for the fixed replies  */
+  ErlDrvTermData *dynamic_spec;      /* spec, for the variable replies  */
+  char *value;                       /* referenced by spec, from get    */
+  ErlDrvBinary *binary;              /* referenced by spec, and handed   */
+  ErlDrvBinary **binaries;           /* to the emulator by ERL_DRV_BINARY */
+  uint64_t binary_count;
+  int failed;                        /* out of memory                   */
+  int deferred;                      /* reply waits for the group commit */
+  int committed;                     /* a group commit ran in this job  */
+  const char *commit_error;          /* why it failed, NULL if it didn't */
+  int opened_group;                  /* began a group transaction       */
+  int filled_memtable;               /* wrote to an empty memtable      */
+  TokeJob *next;                     /* in tp's held list               */
+  uint32_t wake_ms;                  /* when a tick is next due, 0 never */
+  TokeData *removed;                 /* a handle to free once it's run  */
+  uint64_t queued;                   /* us, when it reached the driver   */
+};
+
+/* One field update of a TOKE_MERGE */
+typedef struct {
+  uint8_t op;
+  uint8_t position;                  /* as for element/2                */
+  int64_t delta;                     /* for TOKE_MERGE_ADD              */
+  const char *term;                  /* for TOKE_MERGE_REPLACE, encoded */
+  uint64_t term_size;                /* without the version byte        */
+} MergeOp;
+
+typedef struct {
+  const MergeOp *ops;
+  uint64_t count;
+  int failed;                        /* the stored value didn't fit     */
+  int merged_size;
+} MergeContext;
+
 typedef struct {
   ErlIOVec *ev;
   size_t row;
@@ -63,12 +457,26 @@ typedef struct {
 ErlDrvTermData* no_command_atom_spec      = NULL;
 ErlDrvTermData* invalid_command_atom_spec = NULL;
 ErlDrvTermData* no_such_command_atom_spec = NULL;
+ErlDrvTermData* no_such_handle_atom_spec  = NULL;
 ErlDrvTermData* ok_atom_spec              = NULL;
 ErlDrvTermData* invalid_state_atom_spec   = NULL;
 ErlDrvTermData* not_found_atom_spec       = NULL;
+ErlDrvTermData* bad_value_atom_spec       = NULL;
+ErlDrvTermData* unsupported_atom_spec     = NULL;
+
+ErlDrvTermData toke_reply_atom = 0;
+ErlDrvTermData not_found_atom  = 0;
+ErlDrvTermData stat_atoms[STAT_COUNT];
+ErlDrvTermData command_atoms[COMMAND_COUNT];
+ErlDrvTermData latency_atom    = 0;
 
 uint8_t toke_invalid_command = TOKE_INVALID_COMMAND;
 
+ErlDrvMutex *shared_mutex = NULL;    /* protects shared_dbs and refs    */
+SharedDb *shared_dbs = NULL;
+
+static uint32_t toke_crc32_table[256];
+
 /* only used in debugging */
 void dump_ev(const ErlIOVec *const ev) {
   printf("total size: %d\r\nvec len: %d\r\n", ev->size, ev->vsize);
@@ -135,6 +543,11 @@ int read_int32(Reader *const reader, const int32_t **const result) {
   return read_simple_thing(reader, (const char **const)result, sizeof(int32_t));
 }
 
+int read_uint32(Reader *const reader, const uint32_t **const result) {
+  return
+    read_simple_thing(reader, (const char **const)result, sizeof(uint32_t));
+}
+
 int read_uint64(Reader *const reader, const uint64_t **const result) {
   return
     read_simple_thing(reader, (const char **const)result, sizeof(uint64_t));
@@ -149,11 +562,42 @@ int read_binary(Reader *const reader, const char **const result,
   if (read_simple_thing(reader, (const char **const)binlen, sizeof(uint64_t))) {
     return read_simple_thing(reader, result, **binlen);
   } else {
-    return 1;
+    return FALSE;
+  }
+}
+
+/* Reads the element count of a multi command. Every element carries
+   at least a 64-bit length, so a count the data can't possibly hold
+   is a packing error rather than an enormous allocation. */
+int read_count(Reader *const reader, const uint64_t **const count) {
+  if (! read_uint64(reader, count))
+    return FALSE;
+  if (**count > (uint64_t)reader->ev->size / sizeof(uint64_t)) {
+    reader->last_error = READER_PACKING_ERROR;
+    return FALSE;
   }
+  return TRUE;
 }
 
-void return_reader_error(TokeData *const td, const ErlDrvPort port,
+/* For the global atom specs, which are never written to after
+   toke_init. */
+void job_reply(TokeJob *const job, ErlDrvTermData *const spec) {
+  job->spec = spec;
+  job->spec_len = ATOM_SPEC_LEN;
+}
+
+/* For the port's template specs, which must be copied before being
+   filled in. */
+ErlDrvTermData *job_reply_template(TokeJob *const job,
+                                   const ErlDrvTermData *const template,
+                                   const int len) {
+  memcpy(job->reply, template, len * sizeof(ErlDrvTermData));
+  job->spec = job->reply;
+  job->spec_len = len;
+  return job->reply;
+}
+
+void return_reader_error(TokeData *const td, TokeJob *const job,
                          const Reader *const reader) {
   const char* error_str;
   if (NULL == reader) {
@@ -173,544 +617,5329 @@ void return_reader_error(TokeData *const td, const ErlDrvPort port,
       error_str = "Unknown error";
     }
   }
-  td->reader_error_spec[5] = (ErlDrvTermData)error_str;
-  td->reader_error_spec[6] = (ErlDrvUInt)strlen(error_str);
-  driver_output_term(port, td->reader_error_spec, READER_ERROR_SPEC_LEN);
-  td->reader_error_spec[5] = (ErlDrvTermData)NULL;
-  td->reader_error_spec[6] = 0;
+  ErlDrvTermData *const spec =
+    job_reply_template(job, job->tp->reader_error_spec, READER_ERROR_SPEC_LEN);
+  spec[5] = (ErlDrvTermData)error_str;
+  spec[6] = (ErlDrvUInt)strlen(error_str);
 }
 
-void return_tokyo_error(TokeData *const td, const ErlDrvPort port,
-                        TCHDB *const hdb) {
-  if (NULL == hdb) {
-    driver_output_term(port, invalid_state_atom_spec, ATOM_SPEC_LEN);
-  } else {
-    const int ecode = tchdbecode(hdb);
-    const char *const error_str = tchdberrmsg(ecode);
-    td->tokyo_error_spec[5] = (ErlDrvTermData)error_str;
-    td->tokyo_error_spec[6] = (ErlDrvUInt)strlen(error_str),
-    driver_output_term(port, td->tokyo_error_spec, TOKYO_ERROR_SPEC_LEN);
-    td->tokyo_error_spec[5] = (ErlDrvTermData)NULL;
-    td->tokyo_error_spec[6] = 0;
-  }
+void return_tokyo_ecode(TokeJob *const job, const int ecode) {
+  const char *const error_str = tcerrmsg(ecode);
+  ErlDrvTermData *const spec =
+    job_reply_template(job, job->tp->tokyo_error_spec, TOKYO_ERROR_SPEC_LEN);
+  spec[5] = (ErlDrvTermData)error_str;
+  spec[6] = (ErlDrvUInt)strlen(error_str);
 }
 
-static int toke_init() {
-  no_command_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
-
-  if (NULL == no_command_atom_spec)
-    return -1;
-
-  no_command_atom_spec[0] = ERL_DRV_ATOM;
-  no_command_atom_spec[1] = driver_mk_atom("toke_reply");
-  no_command_atom_spec[2] = ERL_DRV_ATOM;
-  no_command_atom_spec[3] = driver_mk_atom("no_command");
-  no_command_atom_spec[4] = ERL_DRV_TUPLE;
-  no_command_atom_spec[5] = 2;
-
-  invalid_command_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+void return_tokyo_error(TokeData *const td, TokeJob *const job,
+                        void *const db) {
+  if (NULL == db)
+    job_reply(job, invalid_state_atom_spec);
+  else
+    return_tokyo_ecode(job, td->be->ecode(db));
+}
 
-  if (NULL == invalid_command_atom_spec)
-    return -1;
+/* The same CRC-32 as erlang:crc32/1, so that CAS callers can send a
+   checksum of the value they expect rather than the value itself. */
+static void toke_crc32_init() {
+  for (uint32_t idx = 0; idx < 256; ++idx) {
+    uint32_t crc = idx;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+    toke_crc32_table[idx] = crc;
+  }
+}
 
-  invalid_command_atom_spec[0] = ERL_DRV_ATOM;
-  invalid_command_atom_spec[1] = driver_mk_atom("toke_reply");
-  invalid_command_atom_spec[2] = ERL_DRV_ATOM;
-  invalid_command_atom_spec[3] = driver_mk_atom("invalid_command");
-  invalid_command_atom_spec[4] = ERL_DRV_TUPLE;
-  invalid_command_atom_spec[5] = 2;
+static uint32_t toke_crc32(const char *const buf, const int size) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (int idx = 0; idx < size; ++idx)
+    crc = toke_crc32_table[(crc ^ (uint8_t)buf[idx]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
 
-  no_such_command_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+/************************************
+ *  External Term Format Functions  *
+ ************************************/
 
-  if (NULL == no_such_command_atom_spec)
-    return -1;
+uint32_t etf_uint32(const unsigned char *const p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
 
-  no_such_command_atom_spec[0] = ERL_DRV_ATOM;
-  no_such_command_atom_spec[1] = driver_mk_atom("toke_reply");
-  no_such_command_atom_spec[2] = ERL_DRV_ATOM;
-  no_such_command_atom_spec[3] = driver_mk_atom("no_such_command");
-  no_such_command_atom_spec[4] = ERL_DRV_TUPLE;
-  no_such_command_atom_spec[5] = 2;
+/* Returns the end of the term starting at p, or NULL if it's
+   malformed, or of a type that has no business being in a value. */
+const unsigned char *etf_skip(const unsigned char *p,
+                              const unsigned char *const end) {
+  uint64_t len = 0;
+  uint64_t elements = 0;
+  if (p >= end)
+    return NULL;
+  const size_t left = end - p - 1;
+  const unsigned char tag = *p++;
+  switch (tag) {
+  case ETF_NIL:
+    return p;
+  case ETF_SMALL_INTEGER:
+    len = 1;
+    break;
+  case ETF_INTEGER:
+    len = 4;
+    break;
+  case ETF_NEW_FLOAT:
+    len = 8;
+    break;
+  case ETF_FLOAT:
+    len = 31;
+    break;
+  case ETF_SMALL_ATOM:
+  case ETF_SMALL_ATOM_UTF8:
+    if (left < 1)
+      return NULL;
+    len = 1 + p[0];
+    break;
+  case ETF_ATOM:
+  case ETF_ATOM_UTF8:
+  case ETF_STRING:
+    if (left < 2)
+      return NULL;
+    len = 2 + ((p[0] << 8) | p[1]);
+    break;
+  case ETF_BINARY:
+    if (left < 4)
+      return NULL;
+    len = 4 + (uint64_t)etf_uint32(p);
+    break;
+  case ETF_SMALL_BIG:
+    if (left < 1)
+      return NULL;
+    len = 2 + p[0];
+    break;
+  case ETF_LARGE_BIG:
+    if (left < 4)
+      return NULL;
+    len = 5 + (uint64_t)etf_uint32(p);
+    break;
+  case ETF_SMALL_TUPLE:
+    if (left < 1)
+      return NULL;
+    elements = p[0];
+    ++p;
+    for (; 0 < elements && NULL != p; --elements)
+      p = etf_skip(p, end);
+    return p;
+  case ETF_LARGE_TUPLE:
+  case ETF_LIST:
+    if (left < 4)
+      return NULL;
+    /* a list is followed by its tail */
+    elements = (uint64_t)etf_uint32(p) + (ETF_LIST == tag ? 1 : 0);
+    p += 4;
+    for (; 0 < elements && NULL != p; --elements)
+      p = etf_skip(p, end);
+    return p;
+  default:
+    return NULL;
+  }
+  return (len <= left) ? p + len : NULL;
+}
 
-  ok_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+/* Finds element position (counting from 1, as element/2 does) of the
+   tuple encoded in value. Returns FALSE if value isn't a tuple with
+   that many elements. */
+int etf_element(const char *const value, const int valuesize,
+                const int position, const unsigned char **const start,
+                const unsigned char **const finish) {
+  const unsigned char *p = (const unsigned char *)value;
+  const unsigned char *const end = p + valuesize;
+  uint32_t arity = 0;
+  if (valuesize < 3 || ETF_VERSION != p[0] || position < 1)
+    return FALSE;
+  if (ETF_SMALL_TUPLE == p[1]) {
+    arity = p[2];
+    p += 3;
+  } else if (ETF_LARGE_TUPLE == p[1] && valuesize >= 6) {
+    arity = etf_uint32(p + 2);
+    p += 6;
+  } else {
+    return FALSE;
+  }
+  if ((uint32_t)position > arity)
+    return FALSE;
 
-  if (NULL == ok_atom_spec)
-    return -1;
+  for (int idx = 1; idx < position && NULL != p; ++idx)
+    p = etf_skip(p, end);
+  const unsigned char *const next = (NULL == p) ? NULL : etf_skip(p, end);
+  if (NULL == next)
+    return FALSE;
+  *start = p;
+  *finish = next;
+  return TRUE;
+}
 
-  ok_atom_spec[0] = ERL_DRV_ATOM;
-  ok_atom_spec[1] = driver_mk_atom("toke_reply");
-  ok_atom_spec[2] = ERL_DRV_ATOM;
-  ok_atom_spec[3] = driver_mk_atom("ok");
-  ok_atom_spec[4] = ERL_DRV_TUPLE;
-  ok_atom_spec[5] = 2;
+/* Decodes the integer at p, which etf_skip has checked. Returns FALSE
+   if it isn't an integer, or won't fit in an int64_t. */
+int etf_get_int(const unsigned char *const p, int64_t *const result) {
+  switch (p[0]) {
+  case ETF_SMALL_INTEGER:
+    *result = p[1];
+    return TRUE;
+  case ETF_INTEGER:
+    *result = (int32_t)etf_uint32(p + 1);
+    return TRUE;
+  case ETF_SMALL_BIG: {
+    const int digits = p[1];
+    uint64_t magnitude = 0;
+    if (digits > 8)
+      return FALSE;
+    for (int idx = digits - 1; idx >= 0; --idx)
+      magnitude = (magnitude << 8) | p[3 + idx];
+    if (0 == p[2] && magnitude <= (uint64_t)INT64_MAX)
+      *result = (int64_t)magnitude;
+    else if (0 != p[2] && magnitude <= (uint64_t)INT64_MAX + 1)
+      *result = (int64_t)(0 - magnitude);
+    else
+      return FALSE;
+    return TRUE;
+  }
+  default:
+    return FALSE;
+  }
+}
 
-  invalid_state_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+/* Encodes n into buf, which must have room for ETF_INT_MAX_LEN, just
+   as term_to_binary would, so that encoded values still compare equal
+   byte for byte. Returns the length. */
+int etf_put_int(const int64_t n, unsigned char *const buf) {
+  if (0 <= n && n <= 255) {
+    buf[0] = ETF_SMALL_INTEGER;
+    buf[1] = (unsigned char)n;
+    return 2;
+  } else if (INT32_MIN <= n && n <= INT32_MAX) {
+    const uint32_t u = (uint32_t)n;
+    buf[0] = ETF_INTEGER;
+    buf[1] = u >> 24;
+    buf[2] = u >> 16;
+    buf[3] = u >> 8;
+    buf[4] = u;
+    return 5;
+  } else {
+    uint64_t magnitude = (n < 0) ? 0 - (uint64_t)n : (uint64_t)n;
+    int digits = 0;
+    buf[0] = ETF_SMALL_BIG;
+    buf[2] = (n < 0) ? 1 : 0;
+    for (; 0 != magnitude; magnitude >>= 8)
+      buf[3 + digits++] = magnitude & 0xFF;
+    buf[1] = digits;
+    return 3 + digits;
+  }
+}
 
-  if (NULL == invalid_state_atom_spec)
-    return -1;
+/* A growing buffer of terms, for port_call's replies. */
+typedef struct {
+  char *buf;                         /* driver_alloc'd                  */
+  size_t size;
+  size_t len;
+  int failed;                        /* out of memory                   */
+} EtfBuffer;
 
-  invalid_state_atom_spec[0] = ERL_DRV_ATOM;
-  invalid_state_atom_spec[1] = driver_mk_atom("toke_reply");
-  invalid_state_atom_spec[2] = ERL_DRV_ATOM;
-  invalid_state_atom_spec[3] = driver_mk_atom("invalid_state");
-  invalid_state_atom_spec[4] = ERL_DRV_TUPLE;
-  invalid_state_atom_spec[5] = 2;
+void etf_write(EtfBuffer *const eb, const void *const data,
+               const size_t size) {
+  if (eb->failed)
+    return;
+  if (eb->len + size > eb->size) {
+    size_t want = eb->size * 2;
+    while (want < eb->len + size)
+      want *= 2;
+    char *const buf = (char *)driver_realloc(eb->buf, want);
+    if (NULL == buf) {
+      eb->failed = TRUE;
+      return;
+    }
+    eb->buf = buf;
+    eb->size = want;
+  }
+  memcpy(eb->buf + eb->len, data, size);
+  eb->len += size;
+}
 
-  not_found_atom_spec =
-    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+/* A tag, then a length or arity of bytes bytes, big-endian. */
+void etf_write_header(EtfBuffer *const eb, const unsigned char tag,
+                      const uint32_t length, const int bytes) {
+  unsigned char header[5];
+  header[0] = tag;
+  for (int idx = 0; idx < bytes; ++idx)
+    header[1 + idx] = (unsigned char)(length >> (8 * (bytes - 1 - idx)));
+  etf_write(eb, header, 1 + bytes);
+}
 
-  if (NULL == not_found_atom_spec)
-    return -1;
+void etf_write_atom(EtfBuffer *const eb, const char *const name) {
+  const size_t len = strlen(name);
+  etf_write_header(eb, ETF_ATOM, len, 2);
+  etf_write(eb, name, len);
+}
 
-  not_found_atom_spec[0] = ERL_DRV_ATOM;
-  not_found_atom_spec[1] = driver_mk_atom("toke_reply");
-  not_found_atom_spec[2] = ERL_DRV_ATOM;
-  not_found_atom_spec[3] = driver_mk_atom("not_found");
-  not_found_atom_spec[4] = ERL_DRV_TUPLE;
-  not_found_atom_spec[5] = 2;
+void etf_write_binary(EtfBuffer *const eb, const char *const data,
+                      const uint32_t size) {
+  etf_write_header(eb, ETF_BINARY, size, 4);
+  etf_write(eb, data, size);
+}
 
-  return 0;
+void etf_write_uint(EtfBuffer *const eb, const uint64_t n) {
+  unsigned char buf[ETF_INT_MAX_LEN];
+  etf_write(eb, buf,
+            etf_put_int((n > INT64_MAX) ? INT64_MAX : (int64_t)n, buf));
 }
 
-static ErlDrvData toke_start(const ErlDrvPort port, char *const buff) {
-  TokeData *const td = (TokeData*)driver_alloc(sizeof(TokeData));
+/*******************************
+ *  Secondary Index Functions  *
+ *******************************/
 
-  if (NULL == td)
-    return ERL_DRV_ERROR_GENERAL;
+/* A record's secondary key is one element of its value, which must be
+   a tuple in external term format; the key is that element's encoding.
+   The index is two maps: secondary -> the set of primary keys, each
+   set a TCMAP of its own; and primary -> secondary, so that
+   overwriting or deleting a record needn't read its old value. The
+   index lives only in memory, and is rebuilt when the db is opened. */
 
-  td->port = port;
-  td->hdb = NULL;
+/* Finds the secondary key in value. Returns FALSE if value isn't a
+   tuple with enough elements. */
+int secondary_extract(const TokeData *const td, const char *const value,
+                      const int valuesize, const char **const sec,
+                      int *const secsize) {
+  const unsigned char *start = NULL;
+  const unsigned char *finish = NULL;
+  if (! etf_element(value, valuesize, td->secondary_position,
+                    &start, &finish))
+    return FALSE;
+  *sec = (const char *)start;
+  *secsize = finish - start;
+  return TRUE;
+}
 
-  td->get_result_spec = (ErlDrvTermData*)
-    driver_alloc(GET_RESULT_SPEC_LEN * sizeof(ErlDrvTermData));
+/* The set of primary keys with this secondary key, or NULL. */
+TCMAP *secondary_keys(const TokeData *const td, const void *const sec,
+                      const int secsize) {
+  int size = 0;
+  TCMAP *keys = NULL;
+  const void *const value = tcmapget(td->by_secondary, sec, secsize, &size);
+  if (NULL != value)
+    memcpy(&keys, value, sizeof(keys));
+  return keys;
+}
 
-  if (NULL == td->get_result_spec)
-    return ERL_DRV_ERROR_GENERAL;
+void secondary_remove(TokeData *const td, const char *const key,
+                      const int keysize) {
+  int secsize = 0;
+  const void *const sec = tcmapget(td->by_primary, key, keysize, &secsize);
+  if (NULL == sec)
+    return;
+  TCMAP *const keys = secondary_keys(td, sec, secsize);
+  if (NULL != keys) {
+    tcmapout(keys, key, keysize);
+    if (0 == tcmaprnum(keys)) {
+      tcmapdel(keys);
+      tcmapout(td->by_secondary, sec, secsize);
+    }
+  }
+  tcmapout(td->by_primary, key, keysize); /* sec is gone now */
+}
 
-  td->get_result_spec[0] = ERL_DRV_ATOM;
-  td->get_result_spec[1] = driver_mk_atom("toke_reply");
-  td->get_result_spec[2] = ERL_DRV_BUF2BINARY;
-  td->get_result_spec[3] = (ErlDrvTermData)NULL;
-  td->get_result_spec[4] = 0;
-  td->get_result_spec[5] = ERL_DRV_TUPLE;
-  td->get_result_spec[6] = 2;
+void secondary_add(TokeData *const td, const char *const key,
+                   const int keysize, const char *const value,
+                   const int valuesize) {
+  const char *sec = NULL;
+  int secsize = 0;
+  if (! secondary_extract(td, value, valuesize, &sec, &secsize)) {
+    secondary_remove(td, key, keysize);
+    return;
+  }
 
-  td->iter_result_spec = (ErlDrvTermData*)
-    driver_alloc(ITER_RESULT_SPEC_LEN * sizeof(ErlDrvTermData));
+  int oldsize = 0;
+  const void *const old = tcmapget(td->by_primary, key, keysize, &oldsize);
+  if (NULL != old) {
+    if (oldsize == secsize && 0 == memcmp(old, sec, secsize))
+      return; /* most updates leave the secondary key alone */
+    secondary_remove(td, key, keysize);
+  }
 
-  if (NULL == td->iter_result_spec)
-    return ERL_DRV_ERROR_GENERAL;
+  TCMAP *keys = secondary_keys(td, sec, secsize);
+  if (NULL == keys) {
+    keys = tcmapnew();
+    tcmapput(td->by_secondary, sec, secsize, &keys, sizeof(keys));
+  }
+  tcmapput(keys, key, keysize, "", 0);
+  tcmapput(td->by_primary, key, keysize, sec, secsize);
+}
 
-  td->iter_result_spec[0] = ERL_DRV_ATOM;
-  td->iter_result_spec[1] = driver_mk_atom("toke_reply");
-  td->iter_result_spec[2] = ERL_DRV_BUF2BINARY;
-  td->iter_result_spec[3] = (ErlDrvTermData)NULL;
-  td->iter_result_spec[4] = 0;
-  td->iter_result_spec[5] = ERL_DRV_BUF2BINARY;
-  td->iter_result_spec[6] = (ErlDrvTermData)NULL;
-  td->iter_result_spec[7] = 0;
-  td->iter_result_spec[8] = ERL_DRV_TUPLE;
-  td->iter_result_spec[9] = 3;
-
-  td->reader_error_spec = (ErlDrvTermData*)
-    driver_alloc(READER_ERROR_SPEC_LEN * sizeof(ErlDrvTermData));
+/* Called after func has written value, to index what's now stored. */
+void secondary_insert(TokeData *const td,
+                      bool (*func)(void *db, const void *kbuf, int ksiz,
+                                   const void *vbuf, int vsiz),
+                      const char *const key, const int keysize,
+                      const char *const value, const int valuesize) {
+  if (td->be->putcat == func) {
+    int wholesize = 0;
+    char *const whole = td->be->get(td->db, key, keysize, &wholesize);
+    if (NULL != whole) {
+      secondary_add(td, key, keysize, whole, wholesize);
+      free(whole);
+    }
+  } else {
+    secondary_add(td, key, keysize, value, valuesize);
+  }
+}
 
-  if (NULL == td->reader_error_spec)
-    return ERL_DRV_ERROR_GENERAL;
+void secondary_clear(TokeData *const td) {
+  const void *sec = NULL;
+  int secsize = 0;
+  tcmapiterinit(td->by_secondary);
+  while (NULL != (sec = tcmapiternext(td->by_secondary, &secsize)))
+    tcmapdel(secondary_keys(td, sec, secsize));
+  tcmapclear(td->by_secondary);
+  tcmapclear(td->by_primary);
+}
 
-  td->reader_error_spec[0] = ERL_DRV_ATOM;
-  td->reader_error_spec[1] = driver_mk_atom("toke_reply");
-  td->reader_error_spec[2] = ERL_DRV_ATOM;
-  td->reader_error_spec[3] = driver_mk_atom("reader_error");
-  td->reader_error_spec[4] = ERL_DRV_STRING;
-  td->reader_error_spec[5] = (ErlDrvTermData)NULL;
-  td->reader_error_spec[6] = 0;
-  td->reader_error_spec[7] = ERL_DRV_TUPLE;
-  td->reader_error_spec[8] = 2;
-  td->reader_error_spec[9] = ERL_DRV_TUPLE;
-  td->reader_error_spec[10] = 2;
-
-  td->tokyo_error_spec = (ErlDrvTermData*)
-    driver_alloc(TOKYO_ERROR_SPEC_LEN * sizeof(ErlDrvTermData));
+int secondary_build(TokeData *const td) {
+  secondary_clear(td);
+  td->cursor = 0; /* we're about to move the iterator from under it */
+  if (! td->be->iterinit(td->db))
+    return TOKYO_ERROR;
+  TCXSTR *const key = tcxstrnew();
+  TCXSTR *const value = tcxstrnew();
+  while (td->be->iternext3(td->db, key, value))
+    secondary_add(td, tcxstrptr(key), tcxstrsize(key),
+                  tcxstrptr(value), tcxstrsize(value));
+  tcxstrdel(value);
+  tcxstrdel(key);
+  return OK;
+}
 
-  if (NULL == td->tokyo_error_spec)
-    return ERL_DRV_ERROR_GENERAL;
+/************************
+ *  Memtable Functions  *
+ ************************/
 
-  td->tokyo_error_spec[0] = ERL_DRV_ATOM;
-  td->tokyo_error_spec[1] = driver_mk_atom("toke_reply");
-  td->tokyo_error_spec[2] = ERL_DRV_ATOM;
-  td->tokyo_error_spec[3] = driver_mk_atom("error_from_tokyo_cabinet");
-  td->tokyo_error_spec[4] = ERL_DRV_STRING;
-  td->tokyo_error_spec[5] = (ErlDrvTermData)NULL;
-  td->tokyo_error_spec[6] = 0;
-  td->tokyo_error_spec[7] = ERL_DRV_TUPLE;
-  td->tokyo_error_spec[8] = 2;
-  td->tokyo_error_spec[9] = ERL_DRV_TUPLE;
-  td->tokyo_error_spec[10] = 2;
+/* The memtable absorbs insert_async, and deletes of the keys it
+   holds, so that a record that's rewritten or deleted soon after
+   being written reaches TC at most once, or not at all. Each entry is
+   a tag (put or delete) then the value. Gets, inserts, deletes and
+   merges look in it; every other command flushes it first. */
 
-  return (ErlDrvData)td;
+int memtable_aware(const uint8_t command) {
+  switch (command) {
+  case TOKE_INSERT:
+  case TOKE_INSERT_ASYNC:
+  case TOKE_INSERT_MULTI:
+  case TOKE_BULK_INSERT:
+  case TOKE_DELETE:
+  case TOKE_DELETE_MULTI:
+  case TOKE_GET:
+  case TOKE_GET_MULTI:
+  case TOKE_DELETE_IF_EQ:
+  case TOKE_MERGE:
+  case TOKE_STATS:
+    return TRUE;
+  default:
+    return FALSE;
+  }
 }
 
-static void toke_stop(const ErlDrvData drv_data) {
-  TokeData *const td = (TokeData*)drv_data;
-  if (NULL != td->hdb) {
-    tchdbclose(td->hdb);
-    driver_free((char*)td->get_result_spec);
-    driver_free((char*)td->iter_result_spec);
-    driver_free((char*)td->reader_error_spec);
-    driver_free((char*)td->tokyo_error_spec);
+/* Returns MEMTABLE_MISS if key isn't in the memtable, otherwise its
+   tag, and for a put, a malloc'd copy of the value. */
+int memtable_lookup(const TokeData *const td, const char *const key,
+                    const int keysize, char **const value,
+                    int *const valuesize) {
+  int size = 0;
+  const char *const entry =
+    (NULL == td->memtable) ? NULL :
+    (const char *)tcmapget(td->memtable, key, keysize, &size);
+  if (NULL == entry)
+    return MEMTABLE_MISS;
+  if (MEMTABLE_PUT == entry[0]) {
+    *value = (char *)tcmemdup(entry + 1, size - 1); /* aborts on OOM, as TC */
+    *valuesize = size - 1;
   }
-  driver_free((char*)drv_data);
+  return entry[0];
 }
 
-void toke_new(TokeData *const td, ErlDrvTermData **const spec,
-              Reader *const reader, const ErlDrvPort port) {
-  if (NULL == td->hdb) {
-    td->hdb = tchdbnew();
-    *spec = ok_atom_spec;
-  } else {
-    *spec = invalid_state_atom_spec;
-  }
+void memtable_put(TokeData *const td, TokeJob *const job,
+                  const char *const key, const int keysize,
+                  const char tag, const char *const value,
+                  const int valuesize) {
+  if (0 == tcmaprnum(td->memtable))
+    job->filled_memtable = TRUE;
+  if (MEMTABLE_PUT == tag)
+    td->bytes_written += keysize + valuesize;
+  tcmapput4(td->memtable, key, keysize, &tag, 1, value, valuesize);
 }
 
-void toke_del(TokeData *const td, ErlDrvTermData **const spec,
-              Reader *const reader, const ErlDrvPort port) {
-  if (NULL != td->hdb) {
-    tchdbdel(td->hdb);
-    td->hdb = NULL;
+void optimize_dirty(TokeData *const td, const char *const key,
+                    const int keysize);
+
+/* Errors from the puts are thrown away, as they were when insert_async
+   went straight to TC. */
+void memtable_flush(TokeData *const td) {
+  const char *key = NULL;
+  int keysize = 0;
+  if (NULL == td->memtable || 0 == tcmaprnum(td->memtable))
+    return;
+  tcmapiterinit(td->memtable);
+  while (NULL != (key = tcmapiternext(td->memtable, &keysize))) {
+    int size = 0;
+    const char *const entry = tcmapiterval(key, &size);
+    optimize_dirty(td, key, keysize);
+    if (MEMTABLE_PUT == entry[0])
+      td->be->putasync(td->db, key, keysize, entry + 1, size - 1);
+    else
+      td->be->out(td->db, key, keysize);
   }
-  *spec = ok_atom_spec;
+  tcmapclear(td->memtable);
 }
 
-void toke_with_hdb(TokeData *const td, ErlDrvTermData **const spec,
-                   Reader *const reader, const ErlDrvPort port,
-                   int (*const func)(TokeData *const td, Reader *const reader,
-                               const ErlDrvPort port)) {
-  if (NULL == td->hdb) {
-    *spec = invalid_state_atom_spec;
-  } else {
-    switch (func(td, reader, port)) {
-    case OK:
-      *spec = ok_atom_spec;
-      break;
-    case TOKYO_ERROR:
-      return_tokyo_error(td, port, td->hdb);
-      break;
-    case READER_ERROR:
-      return_reader_error(td, port, reader);
-      break;
-    }
-  }
+void memtable_before(TokeData *const td, const uint8_t command) {
+  if (! memtable_aware(command))
+    memtable_flush(td);
 }
 
-int toke_tune(TokeData *const td, Reader *const reader, const ErlDrvPort port) {
-  const int64_t *bnum = NULL;
-  const int8_t *apow = NULL;
-  const int8_t *fpow = NULL;
-  const uint8_t *opts = NULL;
-  if (read_int64(reader, &bnum) && read_int8(reader, &apow) &&
-      read_int8(reader, &fpow) && read_uint8(reader, &opts)) {
+/****************************
+ *  Bloom Filter Functions  *
+ ****************************/
 
-    int tkopts = 0;
-    if (*opts & TOKE_TUNE_LARGE)
-      tkopts |= HDBTLARGE;
-    if (*opts & TOKE_TUNE_DEFLATE)
-      tkopts |= HDBTDEFLATE;
-    if (*opts & TOKE_TUNE_BZIP)
-      tkopts |= HDBTBZIP;
-    if (*opts & TOKE_TUNE_TCBS)
-      tkopts |= HDBTTCBS;
-    if (*opts & TOKE_TUNE_EXCODEC)
-      tkopts |= HDBTEXCODEC;
+/* A blocked Bloom filter over the keys, so that gets of missing keys
+   needn't reach TC. All of a key's bits are in one block, the size of
+   a cache line. Deletes can't clear bits, so they're counted, and the
+   filter goes stale once enough keys have gone, as it does when it
+   fills and when a transaction aborts. A stale filter still answers,
+   with more false positives, until a tick rebuilds it from TC, so no
+   command waits on the rebuild; only open builds it outright.
+   Rebuilding moves TC's iterator, so it waits while a cursor is
+   open. */
 
-    return (tchdbtune(td->hdb, *bnum, *apow, *fpow, tkopts)) ? OK : TOKYO_ERROR;
-  } else {
-    return READER_ERROR;
+/* Whether anything has TC's iterator: a cursor or an optimize. */
+int iterator_free(const TokeData *const td) {
+  return NULL == td->cursors && NULL == td->maint.copy;
+}
+
+uint64_t bloom_hash(const char *const key, const int keysize) {
+  uint64_t h = 14695981039346656037ULL; /* FNV-1a, then mixed */
+  for (int idx = 0; idx < keysize; ++idx)
+    h = (h ^ (unsigned char)key[idx]) * 1099511628211ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+/* Calls func on each of key's bits, until it returns FALSE. */
+int bloom_probe(const Bloom *const bloom, const char *const key,
+                const int keysize,
+                int (*func)(uint64_t *word, const uint64_t mask)) {
+  const uint64_t h = bloom_hash(key, keysize);
+  uint64_t *const block =
+    bloom->bits + ((h & (bloom->blocks - 1)) * BLOOM_BLOCK_WORDS);
+  uint32_t bit = (uint32_t)(h >> 32);
+  const uint32_t step = ((uint32_t)(h >> 16)) | 1;
+  for (uint32_t idx = 0; idx < bloom->hashes; ++idx, bit += step) {
+    const uint32_t n = bit % BLOOM_BLOCK_BITS;
+    if (! func(block + (n / 64), ((uint64_t)1) << (n % 64)))
+      return FALSE;
   }
+  return TRUE;
 }
 
-int toke_set_cache(TokeData *const td, Reader *const reader,
-                   const ErlDrvPort port) {
-  const int32_t *rcnum = NULL;
-  return (read_int32(reader, &rcnum)) ?
-    ((tchdbsetcache(td->hdb, *rcnum)) ? OK : TOKYO_ERROR) : READER_ERROR;
+int bloom_set_bit(uint64_t *const word, const uint64_t mask) {
+  *word |= mask;
+  return TRUE;
 }
 
-int toke_set_xm_size(TokeData *const td, Reader *const reader,
-                     const ErlDrvPort port) {
-  const int64_t *xmsize = NULL;
-  return (read_int64(reader, &xmsize)) ?
-    ((tchdbsetxmsiz(td->hdb, *xmsize)) ? OK : TOKYO_ERROR) : READER_ERROR;
+int bloom_test_bit(uint64_t *const word, const uint64_t mask) {
+  return 0 != (*word & mask);
 }
 
-int toke_set_df_unit(TokeData *const td, Reader *const reader,
-                     const ErlDrvPort port) {
-  const int32_t *dfunit = NULL;
-  return (read_int32(reader, &dfunit)) ?
-    ((tchdbsetdfunit(td->hdb, *dfunit)) ? OK : TOKYO_ERROR) : READER_ERROR;
+void bloom_clear(TokeData *const td) {
+  if (NULL != td->bloom.bits)
+    driver_free(td->bloom.bits);
+  td->bloom.bits = NULL;
+  td->bloom.keys = 0;
+  td->bloom.deletes = 0;
+  td->bloom.stale = FALSE;
 }
 
-int toke_open(TokeData *const td, Reader *const reader, const ErlDrvPort port) {
-  const char *path = NULL;
-  const uint64_t *path_len = NULL;
-  const uint8_t *mode = NULL;
-  if (read_binary(reader, &path, &path_len) && read_uint8(reader, &mode)) {
-    /* strings coming from Erlang are not zero terminated, and the
-       length won't include the 0 stop byte, so copy into a new array,
-       ensuring we have a stop byte at the end. */
-    char *const path2 = (char*) driver_alloc((*path_len)+1);
+void bloom_put(TokeData *const td, const char *const key,
+               const int keysize) {
+  bloom_probe(&(td->bloom), key, keysize, bloom_set_bit);
+  ++(td->bloom.keys);
+}
 
-    if (NULL == path2)
-      return READER_ERROR;
+/* Sized for twice the keys there are now, or for a bulk load. If
+   there's no memory for it, there's no filter until the next build. */
+void bloom_build(TokeData *const td) {
+  bloom_clear(td);
+  const uint64_t records = td->be->rnum(td->db) +
+    ((NULL == td->memtable) ? 0 : tcmaprnum(td->memtable));
+  td->bloom.capacity =
+    (records < BLOOM_MIN_KEYS / 2) ? BLOOM_MIN_KEYS : records * 2;
+  if (td->bloom.capacity < td->bulk_records)
+    td->bloom.capacity = td->bulk_records;
+  const uint64_t wanted =
+    (td->bloom.capacity * td->bloom_bits_per_key) / BLOOM_BLOCK_BITS;
+  td->bloom.blocks = 1;
+  while (td->bloom.blocks < wanted)
+    td->bloom.blocks <<= 1;
+  /* k = ln 2 * bits per key */
+  td->bloom.hashes = (td->bloom_bits_per_key * 69 + 50) / 100;
+  if (0 == td->bloom.hashes)
+    td->bloom.hashes = 1;
+  else if (BLOOM_MAX_HASHES < td->bloom.hashes)
+    td->bloom.hashes = BLOOM_MAX_HASHES;
 
-    path2[(*path_len)] = '\0';
-    strncpy(path2, path, *path_len);
+  const size_t size = td->bloom.blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+  td->bloom.bits = (uint64_t *)driver_alloc(size);
+  if (NULL == td->bloom.bits)
+    return;
+  memset(td->bloom.bits, 0, size);
 
-    int tkmode = 0;
-    if (*mode & TOKE_OPEN_READER)
-      tkmode |= HDBOREADER;
-    if (*mode & TOKE_OPEN_WRITER)
-      tkmode |= HDBOWRITER;
-    if (*mode & TOKE_OPEN_CREAT)
-      tkmode |= HDBOCREAT;
-    if (*mode & TOKE_OPEN_TRUNC)
-      tkmode |= HDBOTRUNC;
-    if (*mode & TOKE_OPEN_NOLCK)
+  td->cursor = 0; /* we're about to move the iterator from under it */
+  if (! td->be->iterinit(td->db)) {
+    bloom_clear(td);
+    return;
+  }
+  TCXSTR *const key = tcxstrnew();
+  TCXSTR *const value = tcxstrnew();
+  while (td->be->iternext3(td->db, key, value))
+    bloom_put(td, tcxstrptr(key), tcxstrsize(key));
+  tcxstrdel(value);
+  tcxstrdel(key);
+
+  if (NULL != td->memtable) {
+    const char *mkey = NULL;
+    int mkeysize = 0;
+    tcmapiterinit(td->memtable);
+    while (NULL != (mkey = tcmapiternext(td->memtable, &mkeysize)))
+      bloom_put(td, mkey, mkeysize);
+  }
+}
+
+/* Called after key is written. */
+void bloom_add(TokeData *const td, const char *const key,
+               const int keysize) {
+  if (NULL == td->bloom.bits)
+    return;
+  bloom_put(td, key, keysize);
+  if (td->bloom.keys >= td->bloom.capacity)
+    td->bloom.stale = TRUE;
+}
+
+/* Called after count keys are deleted. */
+void bloom_deleted(TokeData *const td, const uint64_t count) {
+  if (NULL == td->bloom.bits)
+    return;
+  td->bloom.deletes += count;
+  if (0 != td->bloom_rebuild_percent && 0 != td->bloom.keys &&
+      td->bloom.deletes * 100 >= td->bloom.keys * td->bloom_rebuild_percent)
+    td->bloom.stale = TRUE;
+}
+
+/* Called from a tick, when no command is waiting. */
+void bloom_step(TokeData *const td) {
+  if (td->bloom.stale && iterator_free(td))
+    bloom_build(td);
+}
+
+/* FALSE if key is certainly not in the db. */
+int bloom_may_contain(TokeData *const td, const char *const key,
+                      const int keysize) {
+  if (NULL == td->bloom.bits)
+    return TRUE;
+  ++(td->bloom.lookups);
+  if (bloom_probe(&(td->bloom), key, keysize, bloom_test_bit))
+    return TRUE;
+  ++(td->bloom.negatives);
+  return FALSE;
+}
+
+void optimize_restart(TokeData *const td);
+
+/* TC has rolled a transaction back, but the secondary index and the
+   Bloom filter still have its writes. The index is rebuilt from TC,
+   and the filter, which can only give false positives for them, goes
+   stale.
+   The memtable has none of them: tran_abort isn't memtable_aware, so
+   it flushes the memtable into the transaction first, and writes it
+   takes whilst a group is open aren't part of the group. */
+void tran_aborted(TokeData *const td) {
+  if (0 != td->secondary_position) {
+    optimize_restart(td);
+    secondary_build(td);
+  }
+  if (NULL != td->bloom.bits)
+    td->bloom.stale = TRUE;
+}
+
+/*********************
+ *  Codec Functions  *
+ *********************/
+
+/* TOKE_TUNE_EXCODEC's codec: LZ77 in LZ4's block format, trading
+   compression for speed as LZ4 does. A record starts with its
+   length, little-endian, and whether it's packed; one that doesn't
+   shrink is stored as it is. A sequence is a token holding the
+   literals' length and the match's, less LZ_MIN_MATCH, 4 bits each,
+   then the literals, the match's 2 byte offset back, and the rest of
+   the match's length. Lengths of 15 or more carry on in the bytes
+   after the token's nibble: 255s and then one less. The last
+   sequence is only literals. TC frees what these return, so they
+   malloc. */
+
+uint32_t lz_read32(const uint8_t *const ptr) {
+  uint32_t value = 0;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+uint32_t lz_hash(const uint32_t value) {
+  return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+uint8_t *lz_write_length(uint8_t *out, uint64_t length) {
+  for (; length >= 255; length -= 255)
+    *out++ = 255;
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+/* A match_len of 0 for the last sequence. */
+uint8_t *lz_write_sequence(uint8_t *out, const uint8_t *const literals,
+                           const uint64_t literals_len,
+                           const uint64_t match_len, const uint32_t offset) {
+  const uint64_t stored = (0 == match_len) ? 0 : match_len - LZ_MIN_MATCH;
+  *out++ = (uint8_t)((((literals_len < 15) ? literals_len : 15) << 4) |
+                     ((stored < 15) ? stored : 15));
+  if (literals_len >= 15)
+    out = lz_write_length(out, literals_len - 15);
+  memcpy(out, literals, literals_len);
+  out += literals_len;
+  if (0 != match_len) {
+    *out++ = (uint8_t)(offset & 0xff);
+    *out++ = (uint8_t)(offset >> 8);
+    if (stored >= 15)
+      out = lz_write_length(out, stored - 15);
+  }
+  return out;
+}
+
+void *lz_encode(const void *const ptr, const int size, int *const sp,
+                void *const op) {
+  const uint8_t *const src = (const uint8_t *)ptr;
+  /* LZ4's bound, for incompressible input */
+  uint8_t *const dst =
+    (uint8_t *)malloc(LZ_HEADER_SIZE + size + (size / 255) + 16);
+  if (NULL == dst)
+    return NULL;
+  for (int idx = 0; idx < 4; ++idx)
+    dst[idx] = (uint8_t)((uint32_t)size >> (8 * idx));
+  uint8_t *out = dst + LZ_HEADER_SIZE;
+  const uint8_t *anchor = src;
+
+  if (size > LZ_MATCH_LIMIT) {
+    int32_t table[1 << LZ_HASH_BITS]; /* positions, by hash of 4 bytes */
+    for (int idx = 0; idx < (1 << LZ_HASH_BITS); ++idx)
+      table[idx] = -1;
+    const uint8_t *const match_limit = src + size - LZ_MATCH_LIMIT;
+    const uint8_t *const end_limit = src + size - LZ_LAST_LITERALS;
+    const uint8_t *in = src;
+    while (in < match_limit) {
+      const int32_t pos = (int32_t)(in - src);
+      const uint32_t seq = lz_read32(in);
+      const uint32_t hash = lz_hash(seq);
+      const int32_t candidate = table[hash];
+      table[hash] = pos;
+      if (0 > candidate || LZ_MAX_OFFSET < pos - candidate ||
+          seq != lz_read32(src + candidate)) {
+        ++in;
+        continue;
+      }
+      const uint8_t *ref = src + candidate + LZ_MIN_MATCH;
+      const uint8_t *end = in + LZ_MIN_MATCH;
+      while (end < end_limit && *end == *ref) {
+        ++end;
+        ++ref;
+      }
+      out = lz_write_sequence(out, anchor, in - anchor, end - in,
+                              (uint32_t)(pos - candidate));
+      in = anchor = end;
+    }
+  }
+  out = lz_write_sequence(out, anchor, (src + size) - anchor, 0, 0);
+
+  if (out - dst < LZ_HEADER_SIZE + size) {
+    dst[4] = LZ_PACKED;
+    *sp = (int)(out - dst);
+  } else {
+    dst[4] = LZ_STORED;
+    memcpy(dst + LZ_HEADER_SIZE, src, size);
+    *sp = LZ_HEADER_SIZE + size;
+  }
+  return dst;
+}
+
+/* FALSE if the input runs out first. */
+int lz_read_length(const uint8_t **const in, const uint8_t *const end,
+                   uint64_t *const length) {
+  uint8_t byte = 255;
+  while (255 == byte) {
+    if (*in == end)
+      return FALSE;
+    byte = *(*in)++;
+    *length += byte;
+  }
+  return TRUE;
+}
+
+/* FALSE if the sequences don't make exactly dst_size bytes. */
+int lz_unpack(const uint8_t *in, const uint8_t *const end,
+              uint8_t *const dst, const uint64_t dst_size) {
+  uint8_t *out = dst;
+  uint8_t *const out_end = dst + dst_size;
+  while (in < end) {
+    const uint8_t token = *in++;
+    uint64_t literals_len = token >> 4;
+    if (15 == literals_len && ! lz_read_length(&in, end, &literals_len))
+      return FALSE;
+    if (literals_len > (uint64_t)(end - in) ||
+        literals_len > (uint64_t)(out_end - out))
+      return FALSE;
+    memcpy(out, in, literals_len);
+    in += literals_len;
+    out += literals_len;
+    if (in == end) /* the last sequence */
+      break;
+
+    if (2 > end - in)
+      return FALSE;
+    const uint32_t offset = in[0] | ((uint32_t)in[1] << 8);
+    in += 2;
+    uint64_t match_len = token & 15;
+    if (15 == match_len && ! lz_read_length(&in, end, &match_len))
+      return FALSE;
+    match_len += LZ_MIN_MATCH;
+    if (0 == offset || offset > (uint64_t)(out - dst) ||
+        match_len > (uint64_t)(out_end - out))
+      return FALSE;
+    /* byte by byte, as the match can overlap what it copies */
+    for (const uint8_t *ref = out - offset; 0 < match_len; --match_len)
+      *out++ = *ref++;
+  }
+  return out == out_end;
+}
+
+/* NULL if the record's corrupt. Like TC's own decoders, it appends a
+   0, so that values can be used as strings. */
+void *lz_decode(const void *const ptr, const int size, int *const sp,
+                void *const op) {
+  const uint8_t *const in = (const uint8_t *)ptr;
+  if (size < LZ_HEADER_SIZE)
+    return NULL;
+  uint64_t raw_size = 0;
+  for (int idx = 0; idx < 4; ++idx)
+    raw_size |= (uint64_t)in[idx] << (8 * idx);
+  const uint8_t format = in[4];
+  const uint64_t packed_size = size - LZ_HEADER_SIZE;
+  if (raw_size > INT_MAX - 1 ||
+      (LZ_STORED == format && raw_size != packed_size) ||
+      (LZ_STORED != format && LZ_PACKED != format))
+    return NULL;
+  uint8_t *const dst = (uint8_t *)malloc(raw_size + 1);
+  if (NULL == dst)
+    return NULL;
+  if (LZ_STORED == format) {
+    memcpy(dst, in + LZ_HEADER_SIZE, raw_size);
+  } else if (! lz_unpack(in + LZ_HEADER_SIZE, in + size, dst, raw_size)) {
+    free(dst);
+    return NULL;
+  }
+  dst[raw_size] = 0;
+  *sp = (int)raw_size;
+  return dst;
+}
+
+/****************************
+ *  Hash Backend Functions  *
+ ****************************/
+
+/* TC's hash database, which the rest of the backends mimic. */
+
+void *hash_create(void) {
+  TCHDB *const hdb = tchdbnew();
+  /* only used if the db's tuned, or was created, with excodec */
+  tchdbsetcodecfunc(hdb, lz_encode, NULL, lz_decode, NULL);
+  return hdb;
+}
+
+void hash_destroy(void *const db) {
+  tchdbdel(db);
+}
+
+int hash_ecode(void *const db) {
+  return tchdbecode(db);
+}
+
+bool hash_tune(void *const db, const int64_t bnum, const int8_t apow,
+               const int8_t fpow, const uint8_t opts) {
+  return tchdbtune(db, bnum, apow, fpow, opts);
+}
+
+bool hash_setcache(void *const db, const int32_t rcnum) {
+  return tchdbsetcache(db, rcnum);
+}
+
+bool hash_setxmsiz(void *const db, const int64_t xmsiz) {
+  return tchdbsetxmsiz(db, xmsiz);
+}
+
+bool hash_setdfunit(void *const db, const int32_t dfunit) {
+  return tchdbsetdfunit(db, dfunit);
+}
+
+bool hash_setmutex(void *const db) {
+  return tchdbsetmutex(db);
+}
+
+bool hash_open(void *const db, const char *const path, const int omode) {
+  return tchdbopen(db, path, omode);
+}
+
+bool hash_close(void *const db) {
+  return tchdbclose(db);
+}
+
+bool hash_put(void *const db, const void *const kbuf, const int ksiz,
+              const void *const vbuf, const int vsiz) {
+  return tchdbput(db, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool hash_putkeep(void *const db, const void *const kbuf, const int ksiz,
+                  const void *const vbuf, const int vsiz) {
+  return tchdbputkeep(db, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool hash_putcat(void *const db, const void *const kbuf, const int ksiz,
+                 const void *const vbuf, const int vsiz) {
+  return tchdbputcat(db, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool hash_putasync(void *const db, const void *const kbuf, const int ksiz,
+                   const void *const vbuf, const int vsiz) {
+  return tchdbputasync(db, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool hash_putproc(void *const db, const void *const kbuf, const int ksiz,
+                  const void *const vbuf, const int vsiz, TCPDPROC proc,
+                  void *const op) {
+  return tchdbputproc(db, kbuf, ksiz, vbuf, vsiz, proc, op);
+}
+
+bool hash_out(void *const db, const void *const kbuf, const int ksiz) {
+  return tchdbout(db, kbuf, ksiz);
+}
+
+void *hash_get(void *const db, const void *const kbuf, const int ksiz,
+               int *const sp) {
+  return tchdbget(db, kbuf, ksiz, sp);
+}
+
+int hash_get3(void *const db, const void *const kbuf, const int ksiz,
+              void *const vbuf, const int max) {
+  return tchdbget3(db, kbuf, ksiz, vbuf, max);
+}
+
+int hash_vsiz(void *const db, const void *const kbuf, const int ksiz) {
+  return tchdbvsiz(db, kbuf, ksiz);
+}
+
+bool hash_iterinit(void *const db) {
+  return tchdbiterinit(db);
+}
+
+bool hash_iterseek(void *const db, const void *const kbuf, const int ksiz) {
+  return tchdbiterinit2(db, kbuf, ksiz);
+}
+
+bool hash_iternext3(void *const db, TCXSTR *const kxstr,
+                    TCXSTR *const vxstr) {
+  return tchdbiternext3(db, kxstr, vxstr);
+}
+
+uint64_t hash_rnum(void *const db) {
+  return tchdbrnum(db);
+}
+
+uint64_t hash_fsiz(void *const db) {
+  return tchdbfsiz(db);
+}
+
+bool hash_sync(void *const db) {
+  return tchdbsync(db);
+}
+
+bool hash_tranbegin(void *const db) {
+  return tchdbtranbegin(db);
+}
+
+bool hash_trancommit(void *const db) {
+  return tchdbtrancommit(db);
+}
+
+bool hash_tranabort(void *const db) {
+  return tchdbtranabort(db);
+}
+
+const Backend hash_backend = {
+  .create = hash_create,
+  .destroy = hash_destroy,
+  .ecode = hash_ecode,
+  .tune = hash_tune,
+  .setcache = hash_setcache,
+  .setxmsiz = hash_setxmsiz,
+  .setdfunit = hash_setdfunit,
+  .setmutex = hash_setmutex,
+  .open = hash_open,
+  .close = hash_close,
+  .put = hash_put,
+  .putkeep = hash_putkeep,
+  .putcat = hash_putcat,
+  .putasync = hash_putasync,
+  .putproc = hash_putproc,
+  .out = hash_out,
+  .get = hash_get,
+  .get3 = hash_get3,
+  .vsiz = hash_vsiz,
+  .iterinit = hash_iterinit,
+  .iterjump = NULL,
+  .iterseek = hash_iterseek,
+  .iterorder = NULL,
+  .iternext3 = hash_iternext3,
+  .rnum = hash_rnum,
+  .fsiz = hash_fsiz,
+  .sync = hash_sync,
+  .tranbegin = hash_tranbegin,
+  .trancommit = hash_trancommit,
+  .tranabort = hash_tranabort,
+  .idle = NULL,
+  .optimize = NULL,
+  .maintained = TRUE
+};
+
+/****************************
+ *  Tree Backend Functions  *
+ ****************************/
+
+/* TC's B+ tree database. It keeps keys in order, so iterating walks
+   them in order, and can start from any key. TC gives it cursors
+   rather than an iterator, so the db carries one cursor to be its
+   iterator. Its open modes and tuning options have TCHDB's bits. */
+
+typedef struct {
+  TCBDB *bdb;
+  BDBCUR *cur;
+} TreeDb;
+
+void *tree_create(void) {
+  TreeDb *const tdb = (TreeDb *)driver_alloc(sizeof(TreeDb));
+  if (NULL == tdb)
+    return NULL;
+  tdb->bdb = tcbdbnew();
+  tcbdbsetcodecfunc(tdb->bdb, lz_encode, NULL, lz_decode, NULL);
+  tdb->cur = tcbdbcurnew(tdb->bdb);
+  return tdb;
+}
+
+void tree_destroy(void *const db) {
+  TreeDb *const tdb = (TreeDb *)db;
+  tcbdbcurdel(tdb->cur);
+  tcbdbdel(tdb->bdb);
+  driver_free(tdb);
+}
+
+int tree_ecode(void *const db) {
+  return tcbdbecode(((TreeDb *)db)->bdb);
+}
+
+/* bnum is the records to size for. TC suggests as many buckets as
+   there'll be leaves, up to 4 times as many. */
+bool tree_tune(void *const db, const int64_t bnum, const int8_t apow,
+               const int8_t fpow, const uint8_t opts) {
+  const int64_t buckets =
+    (0 < bnum) ? 1 + (bnum * 2) / TREE_LEAF_MEMBERS : bnum;
+  return tcbdbtune(((TreeDb *)db)->bdb, -1, -1, buckets, apow, fpow, opts);
+}
+
+/* rcnum is the records to cache, so whole leaves of them. */
+bool tree_setcache(void *const db, const int32_t rcnum) {
+  const int32_t leaves = (0 < rcnum) ? 1 + rcnum / TREE_LEAF_MEMBERS : 0;
+  return tcbdbsetcache(((TreeDb *)db)->bdb, leaves, 0);
+}
+
+bool tree_setxmsiz(void *const db, const int64_t xmsiz) {
+  return tcbdbsetxmsiz(((TreeDb *)db)->bdb, xmsiz);
+}
+
+bool tree_setdfunit(void *const db, const int32_t dfunit) {
+  return tcbdbsetdfunit(((TreeDb *)db)->bdb, dfunit);
+}
+
+bool tree_setmutex(void *const db) {
+  return tcbdbsetmutex(((TreeDb *)db)->bdb);
+}
+
+bool tree_open(void *const db, const char *const path, const int omode) {
+  return tcbdbopen(((TreeDb *)db)->bdb, path, omode);
+}
+
+bool tree_close(void *const db) {
+  return tcbdbclose(((TreeDb *)db)->bdb);
+}
+
+bool tree_put(void *const db, const void *const kbuf, const int ksiz,
+              const void *const vbuf, const int vsiz) {
+  return tcbdbput(((TreeDb *)db)->bdb, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool tree_putkeep(void *const db, const void *const kbuf, const int ksiz,
+                  const void *const vbuf, const int vsiz) {
+  return tcbdbputkeep(((TreeDb *)db)->bdb, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool tree_putcat(void *const db, const void *const kbuf, const int ksiz,
+                 const void *const vbuf, const int vsiz) {
+  return tcbdbputcat(((TreeDb *)db)->bdb, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool tree_putproc(void *const db, const void *const kbuf, const int ksiz,
+                  const void *const vbuf, const int vsiz, TCPDPROC proc,
+                  void *const op) {
+  return tcbdbputproc(((TreeDb *)db)->bdb, kbuf, ksiz, vbuf, vsiz, proc, op);
+}
+
+bool tree_out(void *const db, const void *const kbuf, const int ksiz) {
+  return tcbdbout(((TreeDb *)db)->bdb, kbuf, ksiz);
+}
+
+void *tree_get(void *const db, const void *const kbuf, const int ksiz,
+               int *const sp) {
+  return tcbdbget(((TreeDb *)db)->bdb, kbuf, ksiz, sp);
+}
+
+/* tcbdbget3 would save the copy, but what it returns is only good
+   until the next write, which a shared db's owner can make at any
+   time. */
+int tree_get3(void *const db, const void *const kbuf, const int ksiz,
+              void *const vbuf, const int max) {
+  int size = 0;
+  void *const value = tcbdbget(((TreeDb *)db)->bdb, kbuf, ksiz, &size);
+  if (NULL == value)
+    return -1;
+  memcpy(vbuf, value, (size < max) ? size : max);
+  free(value);
+  return size;
+}
+
+int tree_vsiz(void *const db, const void *const kbuf, const int ksiz) {
+  return tcbdbvsiz(((TreeDb *)db)->bdb, kbuf, ksiz);
+}
+
+/* Running off the end, or starting on an empty db, is TCENOREC,
+   which iternext3 then gives too. */
+bool tree_iterinit(void *const db) {
+  TreeDb *const tdb = (TreeDb *)db;
+  return tcbdbcurfirst(tdb->cur) || TCENOREC == tcbdbecode(tdb->bdb);
+}
+
+bool tree_iterjump(void *const db, const void *const kbuf, const int ksiz) {
+  TreeDb *const tdb = (TreeDb *)db;
+  return tcbdbcurjump(tdb->cur, kbuf, ksiz) ||
+    TCENOREC == tcbdbecode(tdb->bdb);
+}
+
+bool tree_iternext3(void *const db, TCXSTR *const kxstr,
+                    TCXSTR *const vxstr) {
+  TreeDb *const tdb = (TreeDb *)db;
+  if (! tcbdbcurrec(tdb->cur, kxstr, vxstr))
+    return false;
+  tcbdbcurnext(tdb->cur);
+  return true;
+}
+
+uint64_t tree_rnum(void *const db) {
+  return tcbdbrnum(((TreeDb *)db)->bdb);
+}
+
+uint64_t tree_fsiz(void *const db) {
+  return tcbdbfsiz(((TreeDb *)db)->bdb);
+}
+
+bool tree_sync(void *const db) {
+  return tcbdbsync(((TreeDb *)db)->bdb);
+}
+
+bool tree_tranbegin(void *const db) {
+  return tcbdbtranbegin(((TreeDb *)db)->bdb);
+}
+
+bool tree_trancommit(void *const db) {
+  return tcbdbtrancommit(((TreeDb *)db)->bdb);
+}
+
+bool tree_tranabort(void *const db) {
+  return tcbdbtranabort(((TreeDb *)db)->bdb);
+}
+
+/* TC has no async put for it: writes go to the leaf cache anyway. */
+const Backend tree_backend = {
+  .create = tree_create,
+  .destroy = tree_destroy,
+  .ecode = tree_ecode,
+  .tune = tree_tune,
+  .setcache = tree_setcache,
+  .setxmsiz = tree_setxmsiz,
+  .setdfunit = tree_setdfunit,
+  .setmutex = tree_setmutex,
+  .open = tree_open,
+  .close = tree_close,
+  .put = tree_put,
+  .putkeep = tree_putkeep,
+  .putcat = tree_putcat,
+  .putasync = tree_put,
+  .putproc = tree_putproc,
+  .out = tree_out,
+  .get = tree_get,
+  .get3 = tree_get3,
+  .vsiz = tree_vsiz,
+  .iterinit = tree_iterinit,
+  .iterjump = tree_iterjump,
+  .iterseek = tree_iterjump,
+  .iterorder = NULL,
+  .iternext3 = tree_iternext3,
+  .rnum = tree_rnum,
+  .fsiz = tree_fsiz,
+  .sync = tree_sync,
+  .tranbegin = tree_tranbegin,
+  .trancommit = tree_trancommit,
+  .tranabort = tree_tranabort,
+  .idle = NULL,
+  .optimize = NULL,
+  .maintained = FALSE
+};
+
+/*****************************
+ *  Fixed Backend Functions  *
+ *****************************/
+
+/* TC's fixed-length database: an array of values of up to width
+   bytes each, indexed by id, so there's no hashing, and no record
+   headers to read past. Keys are the ids, as 8 byte big-endian
+   integers from 1 up, so that they sort as the ids do. TC truncates
+   values that are too wide; these refuse them instead. Its open modes
+   have TCHDB's bits too. */
+
+typedef struct {
+  TCFDB *fdb;
+  int32_t width;                     /* the most a value can be         */
+  int exhausted;                     /* jumped past the last id         */
+} FixedDb;
+
+/* For putproc, to catch the proc making the value too wide. */
+typedef struct {
+  TCPDPROC proc;
+  void *op;
+  int32_t width;
+  int too_wide;
+} FixedProc;
+
+bool fixed_error(FixedDb *const fdb, const int ecode) {
+  tcfdbsetecode(fdb->fdb, ecode, __FILE__, __LINE__, __func__);
+  return false;
+}
+
+/* 0 if it's not an id. */
+int64_t fixed_id(const void *const kbuf, const int ksiz) {
+  if (FIXED_KEY_SIZE != ksiz)
+    return 0;
+  const uint8_t *const key = (const uint8_t *)kbuf;
+  uint64_t id = 0;
+  for (int idx = 0; idx < FIXED_KEY_SIZE; ++idx)
+    id = (id << 8) | key[idx];
+  return (INT64_MAX < id) ? 0 : (int64_t)id;
+}
+
+void *fixed_create(void) {
+  FixedDb *const fdb = (FixedDb *)driver_alloc(sizeof(FixedDb));
+  if (NULL == fdb)
+    return NULL;
+  fdb->fdb = tcfdbnew();
+  fdb->width = 0;                    /* until fixed_setwidth */
+  fdb->exhausted = FALSE;
+  return fdb;
+}
+
+/* Before tuning or opening. TOKE_NEW's, as the records depend on it. */
+bool fixed_setwidth(void *const db, const int32_t width) {
+  FixedDb *const fdb = (FixedDb *)db;
+  fdb->width = width;
+  return tcfdbtune(fdb->fdb, width, 0);
+}
+
+void fixed_destroy(void *const db) {
+  tcfdbdel(((FixedDb *)db)->fdb);
+  driver_free(db);
+}
+
+int fixed_ecode(void *const db) {
+  return tcfdbecode(((FixedDb *)db)->fdb);
+}
+
+/* bnum is the records to size for, which TC takes as a limit on the
+   file's size. The rest don't apply. */
+bool fixed_tune(void *const db, const int64_t bnum, const int8_t apow,
+                const int8_t fpow, const uint8_t opts) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t limit = (0 < bnum) ?
+    FIXED_HEADER_SIZE + bnum * (fdb->width + FIXED_RECORD_SIZE) : 0;
+  return tcfdbtune(fdb->fdb, fdb->width, limit);
+}
+
+/* The file's mapped whole, so there's nothing for these to do. */
+bool fixed_setcache(void *const db, const int32_t rcnum) {
+  return true;
+}
+
+bool fixed_setxmsiz(void *const db, const int64_t xmsiz) {
+  return true;
+}
+
+bool fixed_setdfunit(void *const db, const int32_t dfunit) {
+  return true;
+}
+
+bool fixed_setmutex(void *const db) {
+  return tcfdbsetmutex(((FixedDb *)db)->fdb);
+}
+
+bool fixed_open(void *const db, const char *const path, const int omode) {
+  return tcfdbopen(((FixedDb *)db)->fdb, path, omode);
+}
+
+bool fixed_close(void *const db) {
+  return tcfdbclose(((FixedDb *)db)->fdb);
+}
+
+bool fixed_put(void *const db, const void *const kbuf, const int ksiz,
+               const void *const vbuf, const int vsiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id || vsiz > fdb->width)
+    return fixed_error(fdb, TCEINVALID);
+  return tcfdbput(fdb->fdb, id, vbuf, vsiz);
+}
+
+bool fixed_putkeep(void *const db, const void *const kbuf, const int ksiz,
+                   const void *const vbuf, const int vsiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id || vsiz > fdb->width)
+    return fixed_error(fdb, TCEINVALID);
+  return tcfdbputkeep(fdb->fdb, id, vbuf, vsiz);
+}
+
+bool fixed_putcat(void *const db, const void *const kbuf, const int ksiz,
+                  const void *const vbuf, const int vsiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id)
+    return fixed_error(fdb, TCEINVALID);
+  const int had = tcfdbvsiz(fdb->fdb, id);
+  if (((0 < had) ? had : 0) + (int64_t)vsiz > fdb->width)
+    return fixed_error(fdb, TCEINVALID);
+  return tcfdbputcat(fdb->fdb, id, vbuf, vsiz);
+}
+
+void *fixed_proc(const void *const vbuf, const int vsiz, int *const sp,
+                 void *const op) {
+  FixedProc *const fp = (FixedProc *)op;
+  void *const result = fp->proc(vbuf, vsiz, sp, fp->op);
+  if (NULL != result && (void *)-1 != result && *sp > fp->width) {
+    free(result);
+    fp->too_wide = TRUE;
+    return NULL;
+  }
+  return result;
+}
+
+bool fixed_putproc(void *const db, const void *const kbuf, const int ksiz,
+                   const void *const vbuf, const int vsiz, TCPDPROC proc,
+                   void *const op) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id || (NULL != vbuf && vsiz > fdb->width))
+    return fixed_error(fdb, TCEINVALID);
+  FixedProc fp = { proc, op, fdb->width, FALSE };
+  const bool ok = tcfdbputproc(fdb->fdb, id, vbuf, vsiz, fixed_proc, &fp);
+  /* a result too wide is refused as if proc had kept the value, and
+     TC says TCEKEEP, so this is checked first */
+  if (fp.too_wide)
+    return fixed_error(fdb, TCEINVALID);
+  return ok;
+}
+
+bool fixed_out(void *const db, const void *const kbuf, const int ksiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  return (0 == id) ? fixed_error(fdb, TCENOREC) : tcfdbout(fdb->fdb, id);
+}
+
+void *fixed_get(void *const db, const void *const kbuf, const int ksiz,
+                int *const sp) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id) {
+    fixed_error(fdb, TCENOREC);
+    return NULL;
+  }
+  return tcfdbget(fdb->fdb, id, sp);
+}
+
+/* tcfdbget4 gives the size it copied, not the value's. */
+int fixed_get3(void *const db, const void *const kbuf, const int ksiz,
+               void *const vbuf, const int max) {
+  int size = 0;
+  void *const value = fixed_get(db, kbuf, ksiz, &size);
+  if (NULL == value)
+    return -1;
+  memcpy(vbuf, value, (size < max) ? size : max);
+  free(value);
+  return size;
+}
+
+int fixed_vsiz(void *const db, const void *const kbuf, const int ksiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const int64_t id = fixed_id(kbuf, ksiz);
+  if (0 == id) {
+    fixed_error(fdb, TCENOREC);
+    return -1;
+  }
+  return tcfdbvsiz(fdb->fdb, id);
+}
+
+bool fixed_iterinit(void *const db) {
+  FixedDb *const fdb = (FixedDb *)db;
+  fdb->exhausted = FALSE;
+  return tcfdbiterinit(fdb->fdb);
+}
+
+/* To the first id whose key isn't less than kbuf. TC won't start
+   past its highest id, so that's left to iternext3. */
+bool fixed_iterjump(void *const db, const void *const kbuf, const int ksiz) {
+  FixedDb *const fdb = (FixedDb *)db;
+  const uint8_t *const key = (const uint8_t *)kbuf;
+  uint64_t id = 0;
+  for (int idx = 0; idx < FIXED_KEY_SIZE; ++idx)
+    id = (id << 8) | ((idx < ksiz) ? key[idx] : 0);
+  const uint64_t max = tcfdbmax(fdb->fdb);
+  /* a longer key is past the id it starts with */
+  fdb->exhausted = id > max || (id == max && FIXED_KEY_SIZE < ksiz);
+  if (fdb->exhausted)
+    return true;
+  if (FIXED_KEY_SIZE < ksiz)
+    ++id;
+  return tcfdbiterinit2(fdb->fdb, (0 == id) ? 1 : (int64_t)id);
+}
+
+bool fixed_iternext3(void *const db, TCXSTR *const kxstr,
+                     TCXSTR *const vxstr) {
+  if (((FixedDb *)db)->exhausted)
+    return false;
+  TCFDB *const fdb = ((FixedDb *)db)->fdb;
+  const uint64_t id = tcfdbiternext(fdb);
+  int size = 0;
+  void *const value = (0 == id) ? NULL : tcfdbget(fdb, id, &size);
+  if (NULL == value)
+    return false;
+  uint8_t key[FIXED_KEY_SIZE];
+  for (int idx = 0; idx < FIXED_KEY_SIZE; ++idx)
+    key[idx] = (uint8_t)(id >> (8 * (FIXED_KEY_SIZE - 1 - idx)));
+  tcxstrclear(kxstr);
+  tcxstrcat(kxstr, key, FIXED_KEY_SIZE);
+  tcxstrclear(vxstr);
+  tcxstrcat(vxstr, value, size);
+  free(value);
+  return true;
+}
+
+uint64_t fixed_rnum(void *const db) {
+  return tcfdbrnum(((FixedDb *)db)->fdb);
+}
+
+uint64_t fixed_fsiz(void *const db) {
+  return tcfdbfsiz(((FixedDb *)db)->fdb);
+}
+
+bool fixed_sync(void *const db) {
+  return tcfdbsync(((FixedDb *)db)->fdb);
+}
+
+bool fixed_tranbegin(void *const db) {
+  return tcfdbtranbegin(((FixedDb *)db)->fdb);
+}
+
+bool fixed_trancommit(void *const db) {
+  return tcfdbtrancommit(((FixedDb *)db)->fdb);
+}
+
+bool fixed_tranabort(void *const db) {
+  return tcfdbtranabort(((FixedDb *)db)->fdb);
+}
+
+const Backend fixed_backend = {
+  .create = fixed_create,
+  .destroy = fixed_destroy,
+  .ecode = fixed_ecode,
+  .tune = fixed_tune,
+  .setcache = fixed_setcache,
+  .setxmsiz = fixed_setxmsiz,
+  .setdfunit = fixed_setdfunit,
+  .setmutex = fixed_setmutex,
+  .open = fixed_open,
+  .close = fixed_close,
+  .put = fixed_put,
+  .putkeep = fixed_putkeep,
+  .putcat = fixed_putcat,
+  .putasync = fixed_put,
+  .putproc = fixed_putproc,
+  .out = fixed_out,
+  .get = fixed_get,
+  .get3 = fixed_get3,
+  .vsiz = fixed_vsiz,
+  .iterinit = fixed_iterinit,
+  .iterjump = fixed_iterjump,
+  .iterseek = fixed_iterjump,
+  .iterorder = NULL,
+  .iternext3 = fixed_iternext3,
+  .rnum = fixed_rnum,
+  .fsiz = fixed_fsiz,
+  .sync = fixed_sync,
+  .tranbegin = fixed_tranbegin,
+  .trancommit = fixed_trancommit,
+  .tranabort = fixed_tranabort,
+  .idle = NULL,
+  .optimize = NULL,
+  .maintained = FALSE
+};
+
+/******************************
+ *  Memory Backend Functions  *
+ ******************************/
+
+/* For indexes that fit in RAM: an open addressing table, laid out for
+   the msg store's 16 byte msg ids. Keys of up to MEM_KEY_SIZE bytes
+   are kept inline in the slots, as are values of up to
+   MEM_INLINE_VALUE bytes, which the msg store's all are. Each slot
+   also has a control byte, apart from the slots: MEM_EMPTY,
+   MEM_DELETED, or 7 bits of the key's hash. A lookup compares the 16
+   control bytes of a group at once (with SSE2, where there is it), so
+   usually it's one cache line of control bytes and then the slot
+   itself, with no allocation beyond the copy out. The table grows at
+   7/8 full. Growing rehashes, as does optimizing, which reorders the
+   records, so a cursor that has begun can't carry on across it.
+   There's no lock, so it can't be shared, and no key order, so it
+   can't iterate a range. Transactions keep the old values of the keys
+   they write, to put back on abort. The records are kept on disk as a
+   snapshot at path, written on close and sync, and from idle ticks
+   every maintenance interval if there have been writes since the
+   last, then swapped in by rename; open loads it. */
+
+typedef struct {
+  uint8_t key[MEM_KEY_SIZE];
+  uint32_t value_size;
+  uint8_t key_size;
+  uint8_t padding[3];
+  union {
+    char bytes[MEM_INLINE_VALUE];
+    char *spilled;                   /* driver_alloc'd, if too big     */
+  } value;
+} MemSlot;
+
+typedef struct {
+  uint8_t *ctrl;                     /* a byte a slot, NULL until open */
+  MemSlot *slots;                    /* cache line aligned, in          */
+  char *slots_block;                 /* slots_block                     */
+  uint64_t capacity;                 /* slots, a power of 2             */
+  uint64_t used;                     /* records                         */
+  uint64_t deleted;                  /* MEM_DELETED slots               */
+  uint64_t iter;                     /* the next slot to iterate        */
+  uint64_t resizes;                  /* each one reorders the records   */
+  uint64_t reserve;                  /* records to size for, as tuned   */
+  int ecode;
+  char *path;                        /* NULL if not open                */
+  int writable;
+  int dirty;                         /* written since the last snapshot */
+  uint64_t snapshot_size;
+  TCMAP *undo;                       /* key -> old value, in a tran     */
+} MemDb;
+
+uint64_t mem_hash(const void *const key, const int size) {
+  uint64_t words[2] = {0, 0};
+  memcpy(words, key, size);
+  uint64_t hash = (words[0] ^ (words[1] * 0x9e3779b97f4a7c15ULL)) + size;
+  hash ^= hash >> 33; /* MurmurHash3's finalizer */
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/* Bit n is set if control byte n of the group is byte. */
+uint32_t mem_group_match(const uint8_t *const group, const uint8_t byte) {
+#ifdef __SSE2__
+  const __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+    _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int idx = 0; idx < MEM_GROUP; ++idx)
+    if (byte == group[idx])
+      mask |= 1U << idx;
+  return mask;
+#endif
+}
+
+int mem_lowest_bit(const uint32_t mask) {
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while (0 == (mask & (1U << bit)))
+    ++bit;
+  return bit;
+#endif
+}
+
+/* The groups to probe, in turn: triangular steps visit them all. */
+uint64_t mem_first_group(const MemDb *const mdb, const uint64_t hash) {
+  return (hash >> 7) & ((mdb->capacity / MEM_GROUP) - 1);
+}
+
+uint64_t mem_next_group(const MemDb *const mdb, const uint64_t group,
+                        const uint64_t probe) {
+  return (group + probe + 1) & ((mdb->capacity / MEM_GROUP) - 1);
+}
+
+/* The key's slot, or -1. If deleted, a deleted key's slot is found
+   too, until it's reused. */
+int64_t mem_probe(const MemDb *const mdb, const void *const key,
+                  const int size, const int deleted) {
+  if (0 == mdb->capacity)
+    return -1;
+  const uint64_t hash = mem_hash(key, size);
+  const uint8_t tag = (uint8_t)(hash & 0x7f);
+  uint64_t group = mem_first_group(mdb, hash);
+  for (uint64_t probe = 0; probe < mdb->capacity / MEM_GROUP; ++probe) {
+    const uint8_t *const ctrl = mdb->ctrl + (group * MEM_GROUP);
+    uint32_t mask = mem_group_match(ctrl, tag);
+    if (deleted)
+      mask |= mem_group_match(ctrl, MEM_DELETED);
+    for (; 0 != mask; mask &= mask - 1) {
+      const uint64_t slot = (group * MEM_GROUP) + mem_lowest_bit(mask);
+      const MemSlot *const ms = &(mdb->slots[slot]);
+      if (size == ms->key_size && 0 == memcmp(key, ms->key, size))
+        return (int64_t)slot;
+    }
+    if (0 != mem_group_match(ctrl, MEM_EMPTY))
+      return -1;
+    group = mem_next_group(mdb, group, probe);
+  }
+  return -1;
+}
+
+int64_t mem_find(const MemDb *const mdb, const void *const key,
+                 const int size) {
+  return mem_probe(mdb, key, size, FALSE);
+}
+
+/* A slot for a key that isn't there. There is one, below 7/8 full. */
+uint64_t mem_free_slot(const MemDb *const mdb, const uint64_t hash) {
+  uint64_t group = mem_first_group(mdb, hash);
+  for (uint64_t probe = 0; ; ++probe) {
+    const uint8_t *const ctrl = mdb->ctrl + (group * MEM_GROUP);
+    const uint32_t mask =
+      mem_group_match(ctrl, MEM_EMPTY) | mem_group_match(ctrl, MEM_DELETED);
+    if (0 != mask)
+      return (group * MEM_GROUP) + mem_lowest_bit(mask);
+    group = mem_next_group(mdb, group, probe);
+  }
+}
+
+const char *mem_value(const MemSlot *const ms) {
+  return (ms->value_size <= MEM_INLINE_VALUE) ?
+    ms->value.bytes : ms->value.spilled;
+}
+
+void mem_free_value(MemSlot *const ms) {
+  if (ms->value_size > MEM_INLINE_VALUE)
+    driver_free(ms->value.spilled);
+}
+
+void mem_free_table(MemDb *const mdb) {
+  for (uint64_t slot = 0; slot < mdb->capacity; ++slot)
+    if (0 == (mdb->ctrl[slot] & 0x80))
+      mem_free_value(&(mdb->slots[slot]));
+  if (0 != mdb->capacity) {
+    driver_free(mdb->ctrl);
+    driver_free(mdb->slots_block);
+  }
+  mdb->ctrl = NULL;
+  mdb->slots = NULL;
+  mdb->slots_block = NULL;
+  mdb->capacity = 0;
+  mdb->used = 0;
+  mdb->deleted = 0;
+  mdb->iter = 0;
+}
+
+/* Rehashes into capacity slots, which must fit the records. Values
+   aren't copied, only the slots. */
+int mem_resize(MemDb *const mdb, const uint64_t capacity) {
+  if (0 == capacity) {
+    mdb->ecode = TCEMISC;
+    return FALSE;
+  }
+  uint8_t *const ctrl = (uint8_t *)driver_alloc(capacity);
+  char *const block =
+    (char *)driver_alloc((capacity * sizeof(MemSlot)) + MEM_CACHE_LINE);
+  if (NULL == ctrl || NULL == block) {
+    if (NULL != ctrl)
+      driver_free(ctrl);
+    if (NULL != block)
+      driver_free(block);
+    mdb->ecode = TCEMISC;
+    return FALSE;
+  }
+  memset(ctrl, MEM_EMPTY, capacity);
+  MemSlot *const slots = (MemSlot *)
+    (block + (MEM_CACHE_LINE - ((uintptr_t)block % MEM_CACHE_LINE)));
+
+  MemDb old = *mdb;
+  mdb->ctrl = ctrl;
+  mdb->slots = slots;
+  mdb->slots_block = block;
+  mdb->capacity = capacity;
+  mdb->deleted = 0;
+  mdb->iter = capacity;
+  ++(mdb->resizes);
+  for (uint64_t slot = 0; slot < old.capacity; ++slot) {
+    if (0 != (old.ctrl[slot] & 0x80))
+      continue;
+    const MemSlot *const ms = &(old.slots[slot]);
+    const uint64_t hash = mem_hash(ms->key, ms->key_size);
+    const uint64_t to = mem_free_slot(mdb, hash);
+    ctrl[to] = (uint8_t)(hash & 0x7f);
+    slots[to] = *ms;
+  }
+  if (0 != old.capacity) {
+    driver_free(old.ctrl);
+    driver_free(old.slots_block);
+  }
+  return TRUE;
+}
+
+/* 0 if there could be no such table. */
+uint64_t mem_capacity_for(const uint64_t records) {
+  uint64_t capacity = MEM_MIN_CAPACITY;
+  while (capacity - (capacity / 8) <= records) {
+    if (MEM_MAX_CAPACITY == capacity)
+      return 0;
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+/* Makes room for one more record. */
+int mem_reserve(MemDb *const mdb) {
+  if (mdb->used + mdb->deleted + 1 < mdb->capacity - (mdb->capacity / 8))
+    return TRUE;
+  return mem_resize(mdb, mem_capacity_for(2 * (mdb->used + 1)));
+}
+
+/* Stores a copy of the value, at the key's slot, or a new one. */
+int mem_store(MemDb *const mdb, const void *const key, const int ksiz,
+              const void *const value, const int vsiz) {
+  int64_t slot = mem_find(mdb, key, ksiz);
+  if (0 > slot && ! mem_reserve(mdb))
+    return FALSE;
+  char *spilled = NULL;
+  if (vsiz > MEM_INLINE_VALUE && NULL == (spilled = driver_alloc(vsiz))) {
+    mdb->ecode = TCEMISC;
+    return FALSE;
+  }
+  MemSlot *ms = NULL;
+  if (0 <= slot) {
+    ms = &(mdb->slots[slot]);
+    mem_free_value(ms);
+  } else {
+    const uint64_t hash = mem_hash(key, ksiz);
+    slot = (int64_t)mem_free_slot(mdb, hash);
+    if (MEM_DELETED == mdb->ctrl[slot])
+      --(mdb->deleted);
+    mdb->ctrl[slot] = (uint8_t)(hash & 0x7f);
+    ++(mdb->used);
+    ms = &(mdb->slots[slot]);
+    memcpy(ms->key, key, ksiz);
+    ms->key_size = (uint8_t)ksiz;
+  }
+  ms->value_size = (uint32_t)vsiz;
+  if (NULL != spilled)
+    ms->value.spilled = spilled;
+  memcpy((char *)mem_value(ms), value, vsiz);
+  mdb->dirty = TRUE;
+  return TRUE;
+}
+
+void mem_remove(MemDb *const mdb, const uint64_t slot) {
+  mem_free_value(&(mdb->slots[slot]));
+  mdb->ctrl[slot] = MEM_DELETED;
+  --(mdb->used);
+  ++(mdb->deleted);
+  mdb->dirty = TRUE;
+}
+
+/* In a transaction, keeps the key's value from before it, once. The
+   first byte says whether there was one. */
+int mem_remember(MemDb *const mdb, const void *const key, const int ksiz) {
+  int size = 0;
+  if (NULL == mdb->undo || NULL != tcmapget(mdb->undo, key, ksiz, &size))
+    return TRUE;
+  const int64_t slot = mem_find(mdb, key, ksiz);
+  if (0 > slot) {
+    tcmapput(mdb->undo, key, ksiz, "", 1);
+    return TRUE;
+  }
+  const MemSlot *const ms = &(mdb->slots[slot]);
+  tcmapput4(mdb->undo, key, ksiz, "\1", 1, mem_value(ms), ms->value_size);
+  return TRUE;
+}
+
+/* FALSE, with TC's code, if it can't be written to now. */
+int mem_writable(MemDb *const mdb, const int ksiz) {
+  if (NULL == mdb->path || ! mdb->writable || ksiz > MEM_KEY_SIZE) {
+    mdb->ecode = TCEINVALID;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int mem_write_all(FILE *const file, const void *const buf,
+                  const size_t size) {
+  return 0 == size || 1 == fwrite(buf, size, 1, file);
+}
+
+/* Syncs the directory holding path, so that a rename into it lasts. */
+int mem_sync_dir(const char *const path) {
+  const char *const slash = strrchr(path, '/');
+  char *const dir = (char *)driver_alloc(strlen(path) + 2);
+  if (NULL == dir)
+    return FALSE;
+  if (NULL == slash) {
+    strcpy(dir, ".");
+  } else {
+    const size_t size = (slash == path) ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, size);
+    dir[size] = '\0';
+  }
+  const int fd = open(dir, O_RDONLY);
+  driver_free(dir);
+  if (0 > fd)
+    return FALSE;
+  const int ok = 0 == fsync(fd);
+  close(fd);
+  return ok;
+}
+
+/* Writes the records to a new file, which then replaces the old. The
+   file is synced before the rename, and the directory after it, so
+   that a crash leaves one snapshot or the other, whole. */
+int mem_snapshot(MemDb *const mdb) {
+  char *const tmp = (char *)
+    driver_alloc(strlen(mdb->path) + sizeof(MEM_SNAPSHOT_SUFFIX));
+  if (NULL == tmp) {
+    mdb->ecode = TCEMISC;
+    return FALSE;
+  }
+  strcpy(tmp, mdb->path);
+  strcat(tmp, MEM_SNAPSHOT_SUFFIX);
+  FILE *const file = fopen(tmp, "wb");
+  if (NULL == file) {
+    driver_free(tmp);
+    mdb->ecode = TCEOPEN;
+    return FALSE;
+  }
+
+  int ok = mem_write_all(file, MEM_SNAPSHOT_MAGIC, MEM_MAGIC_SIZE) &&
+    mem_write_all(file, &(mdb->used), sizeof(mdb->used));
+  uint64_t size = MEM_MAGIC_SIZE + sizeof(mdb->used);
+  for (uint64_t slot = 0; ok && slot < mdb->capacity; ++slot) {
+    if (0 != (mdb->ctrl[slot] & 0x80))
+      continue;
+    const MemSlot *const ms = &(mdb->slots[slot]);
+    ok = mem_write_all(file, &(ms->key_size), sizeof(ms->key_size)) &&
+      mem_write_all(file, &(ms->value_size), sizeof(ms->value_size)) &&
+      mem_write_all(file, ms->key, ms->key_size) &&
+      mem_write_all(file, mem_value(ms), ms->value_size);
+    size += sizeof(ms->key_size) + sizeof(ms->value_size) +
+      ms->key_size + ms->value_size;
+  }
+  ok = ok && 0 == fflush(file) && 0 == fsync(fileno(file));
+  ok = (0 == fclose(file)) && ok;
+  if (ok && 0 != rename(tmp, mdb->path)) {
+    mdb->ecode = TCERENAME;
+    ok = FALSE;
+  } else if (! ok) {
+    mdb->ecode = TCEWRITE;
+  } else if (! mem_sync_dir(mdb->path)) {
+    mdb->ecode = TCESYNC; /* it's in place, but mightn't survive */
+    ok = FALSE;
+  }
+  if (! ok)
+    remove(tmp);
+  driver_free(tmp);
+  if (ok) {
+    mdb->snapshot_size = size;
+    mdb->dirty = FALSE;
+  }
+  return ok;
+}
+
+/* Loads the records of the snapshot at path. The count of records
+   is checked against the file's size, a record taking at least its
+   two sizes, so a corrupt one can't ask for a vast table. */
+int mem_load(MemDb *const mdb, FILE *const file) {
+  char magic[MEM_MAGIC_SIZE];
+  uint64_t records = 0;
+  struct stat st;
+  const uint64_t header = MEM_MAGIC_SIZE + sizeof(records);
+  const uint64_t record_min = sizeof(uint8_t) + sizeof(uint32_t);
+  if (0 != fstat(fileno(file), &st) || (uint64_t)st.st_size < header ||
+      1 != fread(magic, MEM_MAGIC_SIZE, 1, file) ||
+      0 != memcmp(magic, MEM_SNAPSHOT_MAGIC, MEM_MAGIC_SIZE) ||
+      1 != fread(&records, sizeof(records), 1, file) ||
+      records > ((uint64_t)st.st_size - header) / record_min) {
+    mdb->ecode = TCEMETA;
+    return FALSE;
+  }
+  if (mem_capacity_for(records) > mdb->capacity &&
+      ! mem_resize(mdb, mem_capacity_for(records)))
+    return FALSE;
+
+  uint64_t size = MEM_MAGIC_SIZE + sizeof(records);
+  char *value = NULL;
+  uint32_t value_max = 0;
+  int ok = TRUE;
+  for (uint64_t record = 0; ok && record < records; ++record) {
+    uint8_t key_size = 0;
+    uint32_t value_size = 0;
+    uint8_t key[MEM_KEY_SIZE];
+    ok = 1 == fread(&key_size, sizeof(key_size), 1, file) &&
+      1 == fread(&value_size, sizeof(value_size), 1, file) &&
+      key_size <= MEM_KEY_SIZE && value_size <= INT_MAX &&
+      (0 == key_size || 1 == fread(key, key_size, 1, file));
+    if (ok && value_size > value_max) {
+      if (NULL != value)
+        driver_free(value);
+      value_max = value_size;
+      ok = NULL != (value = (char *)driver_alloc(value_max));
+    }
+    ok = ok && (0 == value_size || 1 == fread(value, value_size, 1, file)) &&
+      mem_store(mdb, key, key_size, value, value_size);
+    size += sizeof(key_size) + sizeof(value_size) + key_size + value_size;
+  }
+  if (NULL != value)
+    driver_free(value);
+  if (! ok) {
+    if (TCEMISC != mdb->ecode)
+      mdb->ecode = TCEREAD;
+    return FALSE;
+  }
+  mdb->snapshot_size = size;
+  return TRUE;
+}
+
+void *mem_create(void) {
+  MemDb *const mdb = (MemDb *)driver_alloc(sizeof(MemDb));
+  if (NULL == mdb)
+    return NULL;
+  memset(mdb, 0, sizeof(MemDb));
+  return mdb;
+}
+
+bool mem_close(void *const db);
+
+void mem_destroy(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL != mdb->path)
+    mem_close(mdb);
+  driver_free(mdb);
+}
+
+int mem_ecode(void *const db) {
+  return ((MemDb *)db)->ecode;
+}
+
+/* bnum is taken as the records to size the table for. */
+bool mem_tune(void *const db, const int64_t bnum, const int8_t apow,
+              const int8_t fpow, const uint8_t opts) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL != mdb->path) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  mdb->reserve = (0 < bnum) ? (uint64_t)bnum : 0;
+  return true;
+}
+
+/* There's no cache, mapping or defrag to set, so these just
+   succeed. */
+bool mem_setcache(void *const db, const int32_t rcnum) {
+  return true;
+}
+
+bool mem_setxmsiz(void *const db, const int64_t xmsiz) {
+  return true;
+}
+
+bool mem_setdfunit(void *const db, const int32_t dfunit) {
+  return true;
+}
+
+bool mem_open(void *const db, const char *const path, const int omode) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL != mdb->path) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  if (! mem_resize(mdb, mem_capacity_for(mdb->reserve)))
+    return false;
+  FILE *const file = (omode & HDBOTRUNC) ? NULL : fopen(path, "rb");
+  if (NULL != file) {
+    const int loaded = mem_load(mdb, file);
+    fclose(file);
+    if (! loaded) {
+      mem_free_table(mdb);
+      return false;
+    }
+  } else if (! (omode & HDBOTRUNC) &&
+             ! ((omode & HDBOWRITER) && (omode & HDBOCREAT))) {
+    mem_free_table(mdb);
+    mdb->ecode = TCENOFILE;
+    return false;
+  }
+  if (NULL == (mdb->path = (char *)driver_alloc(strlen(path) + 1))) {
+    mem_free_table(mdb);
+    mdb->ecode = TCEMISC;
+    return false;
+  }
+  strcpy(mdb->path, path);
+  mdb->writable = 0 != (omode & HDBOWRITER);
+  mdb->dirty = mdb->writable && NULL == file; /* so it's created */
+  mdb->iter = mdb->capacity;
+  return true;
+}
+
+bool mem_tranabort(void *const db);
+
+/* As TC does, aborts any transaction, and closes even if the
+   snapshot can't be written. */
+bool mem_close(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->path) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  if (NULL != mdb->undo)
+    mem_tranabort(mdb);
+  const int ok = ! (mdb->writable && mdb->dirty) || mem_snapshot(mdb);
+  mem_free_table(mdb);
+  driver_free(mdb->path);
+  mdb->path = NULL;
+  return ok;
+}
+
+bool mem_put(void *const db, const void *const kbuf, const int ksiz,
+             const void *const vbuf, const int vsiz) {
+  MemDb *const mdb = (MemDb *)db;
+  return mem_writable(mdb, ksiz) && mem_remember(mdb, kbuf, ksiz) &&
+    mem_store(mdb, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool mem_putkeep(void *const db, const void *const kbuf, const int ksiz,
+                 const void *const vbuf, const int vsiz) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, ksiz))
+    return false;
+  if (0 <= mem_find(mdb, kbuf, ksiz)) {
+    mdb->ecode = TCEKEEP;
+    return false;
+  }
+  return mem_remember(mdb, kbuf, ksiz) &&
+    mem_store(mdb, kbuf, ksiz, vbuf, vsiz);
+}
+
+bool mem_putcat(void *const db, const void *const kbuf, const int ksiz,
+                const void *const vbuf, const int vsiz) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, ksiz))
+    return false;
+  const int64_t slot = mem_find(mdb, kbuf, ksiz);
+  if (0 > slot)
+    return mem_remember(mdb, kbuf, ksiz) &&
+      mem_store(mdb, kbuf, ksiz, vbuf, vsiz);
+  const MemSlot *const ms = &(mdb->slots[slot]);
+  const int oldsiz = ms->value_size;
+  char *const whole = (char *)driver_alloc(oldsiz + vsiz);
+  if (NULL == whole) {
+    mdb->ecode = TCEMISC;
+    return false;
+  }
+  memcpy(whole, mem_value(ms), oldsiz);
+  memcpy(whole + oldsiz, vbuf, vsiz);
+  const int ok = mem_remember(mdb, kbuf, ksiz) &&
+    mem_store(mdb, kbuf, ksiz, whole, oldsiz + vsiz);
+  driver_free(whole);
+  return ok;
+}
+
+/* As TC's: proc's result replaces the value, unless it's NULL, which
+   leaves it, or -1, which removes it. vbuf is stored if there's no
+   record, unless it's NULL. */
+bool mem_putproc(void *const db, const void *const kbuf, const int ksiz,
+                 const void *const vbuf, const int vsiz, TCPDPROC proc,
+                 void *const op) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, ksiz))
+    return false;
+  const int64_t slot = mem_find(mdb, kbuf, ksiz);
+  if (0 > slot) {
+    if (NULL == vbuf) {
+      mdb->ecode = TCENOREC;
+      return false;
+    }
+    return mem_remember(mdb, kbuf, ksiz) &&
+      mem_store(mdb, kbuf, ksiz, vbuf, vsiz);
+  }
+  const MemSlot *const ms = &(mdb->slots[slot]);
+  int newsiz = 0;
+  char *const value = proc(mem_value(ms), ms->value_size, &newsiz, op);
+  if (NULL == value) {
+    mdb->ecode = TCEKEEP;
+    return false;
+  }
+  mem_remember(mdb, kbuf, ksiz);
+  if ((char *)-1 == value) {
+    mem_remove(mdb, slot);
+    return true;
+  }
+  const int ok = mem_store(mdb, kbuf, ksiz, value, newsiz);
+  free(value);
+  return ok;
+}
+
+bool mem_out(void *const db, const void *const kbuf, const int ksiz) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, ksiz))
+    return false;
+  const int64_t slot = mem_find(mdb, kbuf, ksiz);
+  if (0 > slot) {
+    mdb->ecode = TCENOREC;
+    return false;
+  }
+  mem_remember(mdb, kbuf, ksiz);
+  mem_remove(mdb, slot);
+  return true;
+}
+
+/* The key's slot, or NULL with TC's code. */
+const MemSlot *mem_lookup(MemDb *const mdb, const void *const kbuf,
+                          const int ksiz) {
+  const int64_t slot = (ksiz > MEM_KEY_SIZE) ? -1 : mem_find(mdb, kbuf, ksiz);
+  if (0 > slot) {
+    mdb->ecode = TCENOREC;
+    return NULL;
+  }
+  return &(mdb->slots[slot]);
+}
+
+/* malloc'd, and with a 0 after, as TC's are. */
+void *mem_get(void *const db, const void *const kbuf, const int ksiz,
+              int *const sp) {
+  MemDb *const mdb = (MemDb *)db;
+  const MemSlot *const ms = mem_lookup(mdb, kbuf, ksiz);
+  if (NULL == ms)
+    return NULL;
+  char *const value = (char *)malloc(ms->value_size + 1);
+  if (NULL == value) {
+    mdb->ecode = TCEMISC;
+    return NULL;
+  }
+  memcpy(value, mem_value(ms), ms->value_size);
+  value[ms->value_size] = 0;
+  *sp = (int)ms->value_size;
+  return value;
+}
+
+int mem_get3(void *const db, const void *const kbuf, const int ksiz,
+             void *const vbuf, const int max) {
+  const MemSlot *const ms = mem_lookup((MemDb *)db, kbuf, ksiz);
+  if (NULL == ms)
+    return -1;
+  memcpy(vbuf, mem_value(ms),
+         ((int)ms->value_size < max) ? (int)ms->value_size : max);
+  return (int)ms->value_size;
+}
+
+int mem_vsiz(void *const db, const void *const kbuf, const int ksiz) {
+  const MemSlot *const ms = mem_lookup((MemDb *)db, kbuf, ksiz);
+  return (NULL == ms) ? -1 : (int)ms->value_size;
+}
+
+bool mem_iterinit(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->path) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  mdb->iter = 0;
+  return true;
+}
+
+uint64_t mem_iterorder(void *const db) {
+  return ((MemDb *)db)->resizes;
+}
+
+/* A deleted key's slot is skipped by iternext3. */
+bool mem_iterseek(void *const db, const void *const kbuf, const int ksiz) {
+  MemDb *const mdb = (MemDb *)db;
+  const int64_t slot = (ksiz > MEM_KEY_SIZE) ? -1 :
+    mem_probe(mdb, kbuf, ksiz, TRUE);
+  if (NULL == mdb->path || 0 > slot) {
+    mdb->ecode = (NULL == mdb->path) ? TCEINVALID : TCENOREC;
+    return false;
+  }
+  mdb->iter = (uint64_t)slot;
+  return true;
+}
+
+bool mem_iternext3(void *const db, TCXSTR *const kxstr,
+                   TCXSTR *const vxstr) {
+  MemDb *const mdb = (MemDb *)db;
+  while (mdb->iter < mdb->capacity && 0 != (mdb->ctrl[mdb->iter] & 0x80))
+    ++(mdb->iter);
+  if (mdb->iter >= mdb->capacity) {
+    mdb->ecode = TCENOREC;
+    return false;
+  }
+  const MemSlot *const ms = &(mdb->slots[(mdb->iter)++]);
+  tcxstrclear(kxstr);
+  tcxstrcat(kxstr, ms->key, ms->key_size);
+  tcxstrclear(vxstr);
+  tcxstrcat(vxstr, mem_value(ms), ms->value_size);
+  return true;
+}
+
+uint64_t mem_rnum(void *const db) {
+  return ((MemDb *)db)->used;
+}
+
+/* Of the last snapshot. */
+uint64_t mem_fsiz(void *const db) {
+  return ((MemDb *)db)->snapshot_size;
+}
+
+bool mem_sync(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->path || ! mdb->writable || NULL != mdb->undo) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  return ! mdb->dirty || mem_snapshot(mdb);
+}
+
+bool mem_tranbegin(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, 0) || NULL != mdb->undo) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  mdb->undo = tcmapnew();
+  return true;
+}
+
+bool mem_trancommit(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->undo) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  tcmapdel(mdb->undo);
+  mdb->undo = NULL;
+  return true;
+}
+
+/* Puts back what the transaction's writes replaced. */
+bool mem_tranabort(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->undo) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  TCMAP *const undo = mdb->undo;
+  mdb->undo = NULL;
+  int ok = TRUE;
+  const char *key = NULL;
+  int keysize = 0;
+  tcmapiterinit(undo);
+  while (NULL != (key = tcmapiternext(undo, &keysize))) {
+    int size = 0;
+    const char *const old = tcmapiterval(key, &size);
+    const int64_t slot = mem_find(mdb, key, keysize);
+    if (0 != old[0])
+      ok = mem_store(mdb, key, keysize, old + 1, size - 1) && ok;
+    else if (0 <= slot)
+      mem_remove(mdb, slot);
+  }
+  tcmapdel(undo);
+  return ok;
+}
+
+/* Snapshots if there have been writes since the last. */
+bool mem_idle(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (NULL == mdb->path || ! mdb->writable || ! mdb->dirty ||
+      NULL != mdb->undo)
+    return false;
+  mem_snapshot(mdb);
+  return true;
+}
+
+/* Rehashes to drop the deleted slots, which is all the table's
+   fragmentation, then writes the snapshot whole, as it always is. */
+bool mem_optimize(void *const db) {
+  MemDb *const mdb = (MemDb *)db;
+  if (! mem_writable(mdb, 0) || NULL != mdb->undo) {
+    mdb->ecode = TCEINVALID;
+    return false;
+  }
+  if (0 != mdb->deleted && ! mem_resize(mdb, mdb->capacity))
+    return false;
+  return mem_snapshot(mdb);
+}
+
+const Backend memory_backend = {
+  .create = mem_create,
+  .destroy = mem_destroy,
+  .ecode = mem_ecode,
+  .tune = mem_tune,
+  .setcache = mem_setcache,
+  .setxmsiz = mem_setxmsiz,
+  .setdfunit = mem_setdfunit,
+  .setmutex = NULL,
+  .open = mem_open,
+  .close = mem_close,
+  .put = mem_put,
+  .putkeep = mem_putkeep,
+  .putcat = mem_putcat,
+  .putasync = mem_put,
+  .putproc = mem_putproc,
+  .out = mem_out,
+  .get = mem_get,
+  .get3 = mem_get3,
+  .vsiz = mem_vsiz,
+  .iterinit = mem_iterinit,
+  .iterjump = NULL,
+  .iterseek = mem_iterseek,
+  .iterorder = mem_iterorder,
+  .iternext3 = mem_iternext3,
+  .rnum = mem_rnum,
+  .fsiz = mem_fsiz,
+  .sync = mem_sync,
+  .tranbegin = mem_tranbegin,
+  .trancommit = mem_trancommit,
+  .tranabort = mem_tranabort,
+  .idle = mem_idle,
+  .optimize = mem_optimize,
+  .maintained = FALSE
+};
+
+/***************************
+ *  Maintenance Functions  *
+ ***************************/
+
+/* With auto defrag off, as the msg store has it, the file only grows
+   with churn. So when the timer ticks and no command is waiting, a
+   step of at most step records is taken: defragging in place whilst
+   fragmentation is above target, or an online optimize, which copies
+   the records into a new file and swaps it for the old one. Writes
+   made during the copy are noted, and replayed into the new file
+   before the swap. An optimize runs when asked, or once the bucket
+   array is overloaded. TC has no measure of fragmentation, so it's
+   estimated from how far the bytes per record have grown since the
+   file was last compact. All of this is for TC's hash database; the
+   other backends' maintenance, if any, is their idle operation. */
+
+uint64_t maintenance_record_bytes(TCHDB *const hdb) {
+  const uint64_t width = (tchdbopts(hdb) & HDBTLARGE) ? 8 : 4;
+  const uint64_t head = HDB_HEADER_SIZE + tchdbbnum(hdb) * width;
+  const uint64_t size = tchdbfsiz(hdb);
+  return (size > head) ? size - head : 0;
+}
+
+/* Takes the file to be as compact as it'll get. */
+void maintenance_rebase(TokeData *const td) {
+  if (! td->be->maintained)
+    return;
+  const uint64_t records = td->be->rnum(td->db);
+  td->maint.baseline = (records < MAINTENANCE_MIN_RECORDS) ? 0 :
+    maintenance_record_bytes(td->db) / records;
+  td->maint.stalled = 0;
+}
+
+uint32_t maintenance_fragmentation(TokeData *const td) {
+  const uint64_t records = td->be->rnum(td->db);
+  if (! td->be->maintained || records < MAINTENANCE_MIN_RECORDS)
+    return 0;
+  if (0 == td->maint.baseline) { /* it's only now big enough to tell */
+    maintenance_rebase(td);
+    return 0;
+  }
+  const uint64_t per_record = maintenance_record_bytes(td->db) / records;
+  return (per_record <= td->maint.baseline) ? 0 :
+    (uint32_t)(((per_record - td->maint.baseline) * 100) / per_record);
+}
+
+void optimize_dirty(TokeData *const td, const char *const key,
+                    const int keysize) {
+  if (NULL != td->maint.copy)
+    tcmapput(td->maint.dirty, key, keysize, "", 0);
+}
+
+/* Forgets the optimize, and deletes its new file if that's still
+   there. */
+void optimize_end(TokeData *const td) {
+  if (NULL == td->maint.copy)
+    return;
+  tchdbdel(td->maint.copy);
+  remove(td->maint.copy_path);
+  driver_free(td->maint.copy_path);
+  tcmapdel(td->maint.dirty);
+  td->maint.copy = NULL;
+  td->maint.copy_path = NULL;
+  td->maint.dirty = NULL;
+}
+
+/* Something else has moved TC's iterator, so the copy starts over. */
+void optimize_restart(TokeData *const td) {
+  if (NULL == td->maint.copy)
+    return;
+  tchdbvanish(td->maint.copy);
+  tcmapclear(td->maint.dirty);
+  td->maint.copy_started = FALSE;
+  td->maint.copy_done = FALSE;
+}
+
+/* Whether the handle has a db, and it's open: a delete drops the db
+   whether or not it was closed first. */
+int handle_open(const TokeData *const td) {
+  return NULL != td->db && NULL != td->path;
+}
+
+/* FALSE if the db can't be optimized: it must be open for writing,
+   and TC's auto defrag must be off, as it moves records without our
+   noticing. Nor can a shared db be, as its readers would find it
+   closed during the swap. */
+int optimize_begin(TokeData *const td) {
+  if (! td->be->maintained || NULL != td->maint.copy || ! handle_open(td) ||
+      ! (td->open_mode & HDBOWRITER) || 0 != td->df_unit ||
+      NULL != td->shared)
+    return FALSE;
+  char *const path = (char *)
+    driver_alloc(strlen(td->path) + sizeof(OPTIMIZE_SUFFIX));
+  if (NULL == path)
+    return FALSE;
+  strcpy(path, td->path);
+  strcat(path, OPTIMIZE_SUFFIX);
+
+  /* like tchdboptimize, twice as many buckets as records */
+  const uint64_t records = td->be->rnum(td->db);
+  const int64_t bnum = (0 == records) ? -1 : (int64_t)(records * 2);
+  TCHDB *const copy = tchdbnew();
+  tchdbsetcodecfunc(copy, lz_encode, NULL, lz_decode, NULL);
+  if (! (tchdbtune(copy, bnum, td->tune_apow, td->tune_fpow, td->tune_opts) &&
+         tchdbopen(copy, path,
+                   HDBOWRITER | HDBOCREAT | HDBOTRUNC | HDBONOLCK))) {
+    tchdbdel(copy);
+    driver_free(path);
+    return FALSE;
+  }
+  td->maint.copy = copy;
+  td->maint.copy_path = path;
+  td->maint.dirty = tcmapnew();
+  td->maint.copy_started = FALSE;
+  td->maint.copy_done = FALSE;
+  return TRUE;
+}
+
+void handle_forget(TokeData *const td);
+
+/* The swap closed the db, and neither file would reopen, so the
+   handle is left closed, keeping the error for the commands that
+   follow. TC's close shuts the file even when it fails. */
+void optimize_lost(TokeData *const td) {
+  td->maint.lost = td->be->ecode(td->db);
+  if (TCESUCCESS == td->maint.lost)
+    td->maint.lost = TCEMISC;
+  handle_forget(td);
+}
+
+/* Brings the new file up to date, and swaps it in. If the swap fails,
+   the old file is reopened. */
+void optimize_finish(TokeData *const td) {
+  TCHDB *const copy = td->maint.copy;
+  const char *key = NULL;
+  int keysize = 0;
+  int ok = TRUE;
+  tcmapiterinit(td->maint.dirty);
+  while (ok && NULL != (key = tcmapiternext(td->maint.dirty, &keysize))) {
+    int valuesize = 0;
+    char *const value = td->be->get(td->db, key, keysize, &valuesize);
+    if (NULL == value) {
+      ok = tchdbout(copy, key, keysize) || TCENOREC == tchdbecode(copy);
+    } else {
+      ok = tchdbput(copy, key, keysize, value, valuesize);
+      free(value);
+    }
+  }
+  if (ok && tchdbsync(copy) && tchdbclose(copy)) {
+    const int swapped =
+      td->be->close(td->db) && 0 == rename(td->maint.copy_path, td->path);
+    if (! td->be->open(td->db, td->path, td->open_mode & ~HDBOTRUNC)) {
+      optimize_lost(td);
+    } else if (swapped) {
+      ++(td->maint.optimizes);
+      maintenance_rebase(td);
+    }
+  }
+  optimize_end(td);
+}
+
+/* Copies up to step records. Once they're all copied, and no
+   transaction is open, finishes. */
+int optimize_step(TokeData *const td) {
+  if (NULL != td->cursors)
+    return FALSE; /* wait for them to be closed */
+  if (! td->maint.copy_started) {
+    if (! td->be->iterinit(td->db)) {
+      optimize_end(td);
+      return FALSE;
+    }
+    td->maint.copy_started = TRUE;
+  }
+
+  TCXSTR *const key = tcxstrnew();
+  TCXSTR *const value = tcxstrnew();
+  int ok = TRUE;
+  for (uint32_t copied = 0; ok && ! td->maint.copy_done &&
+         copied < td->maint.step; ++copied) {
+    if (td->be->iternext3(td->db, key, value))
+      ok = tchdbput(td->maint.copy, tcxstrptr(key), tcxstrsize(key),
+                    tcxstrptr(value), tcxstrsize(value));
+    else if (TCENOREC == td->be->ecode(td->db))
+      td->maint.copy_done = TRUE;
+    else
+      ok = FALSE;
+  }
+  tcxstrdel(value);
+  tcxstrdel(key);
+
+  if (! ok)
+    optimize_end(td);
+  else if (td->maint.copy_done)
+    optimize_finish(td);
+  return TRUE;
+}
+
+int defrag_step(TokeData *const td) {
+  const uint64_t before = td->be->fsiz(td->db);
+  if (! tchdbdefrag(td->db, td->maint.step))
+    return FALSE;
+  ++(td->maint.defrag_steps);
+  if (td->be->fsiz(td->db) < before)
+    td->maint.stalled = 0;
+  else if ((td->maint.stalled += td->maint.step) >= td->be->rnum(td->db))
+    maintenance_rebase(td); /* a pass has gained nothing */
+  return TRUE;
+}
+
+/* Whether command is refused, with the error, on a handle whose db an
+   optimize's swap lost. Closing, reopening or deleting it are the ways
+   on. */
+int maintenance_refuses(const TokeData *const td, const uint8_t command) {
+  if (TCESUCCESS == td->maint.lost)
+    return FALSE;
+  switch (command) {
+  case TOKE_DEL:
+  case TOKE_OPEN:
+  case TOKE_CLOSE:
+  case TOKE_STATS:
+  case TOKE_ADD_HANDLE:
+  case TOKE_REMOVE_HANDLE:
+    return FALSE;
+  default:
+    return TRUE;
+  }
+}
+
+/* Called from a tick, when no command is waiting. FALSE if there was
+   nothing to do. */
+int maintenance_step(TokeData *const td) {
+  if (0 == td->maint.interval || ! handle_open(td) ||
+      ! (td->open_mode & HDBOWRITER) || td->in_transaction)
+    return FALSE;
+  if (! td->be->maintained)
+    return NULL != td->be->idle && td->be->idle(td->db);
+  if (NULL != td->maint.copy)
+    return optimize_step(td);
+  if (0 != td->maint.target &&
+      maintenance_fragmentation(td) > td->maint.target)
+    return defrag_step(td);
+  /* TC suggests no more than 4 records per bucket */
+  if (td->be->rnum(td->db) > 4 * tchdbbnum(td->db))
+    return optimize_begin(td);
+  return FALSE;
+}
+
+/**********************
+ *  Cursor Functions  *
+ **********************/
+
+/* Each cursor keeps the last key it gave, and whichever cursor's
+   next finds TC's iterator elsewhere, after another cursor, a scan
+   of the whole db, or an optimize step, seeks back to that key and
+   skips it. A key deleted in the meantime is still found by the
+   ordered backends and the memory backend, but not by TC's hash db,
+   whose cursor is then lost. So is one that has begun on a memory
+   db that has since grown, as the records are in a new order. */
+
+Cursor *cursor_find(TokeData *const td, const uint64_t id) {
+  for (Cursor *cursor = td->cursors; NULL != cursor; cursor = cursor->next)
+    if (id == cursor->id)
+      return cursor;
+  return NULL;
+}
+
+void cursor_free(TokeData *const td, Cursor *const cursor) {
+  Cursor **link = &(td->cursors);
+  while (cursor != *link)
+    link = &((*link)->next);
+  *link = cursor->next;
+  if (td->cursor == cursor->id)
+    td->cursor = 0;
+  if (NULL != cursor->at)
+    tcxstrdel(cursor->at);
+  if (NULL != cursor->end)
+    tcxstrdel(cursor->end);
+  driver_free(cursor);
+}
+
+void cursors_clear(TokeData *const td) {
+  while (NULL != td->cursors)
+    cursor_free(td, td->cursors);
+}
+
+/* Puts TC's iterator at the cursor's place, if it's elsewhere. */
+int cursor_place(TokeData *const td, Cursor *const cursor,
+                 int *const skip) {
+  *skip = FALSE;
+  if (NULL != td->be->iterorder &&
+      cursor->order != td->be->iterorder(td->db)) {
+    if (NULL != cursor->at)
+      return FALSE;
+    cursor->order = td->be->iterorder(td->db); /* it's yet to begin */
+    td->cursor = 0;
+  }
+  if (td->cursor == cursor->id)
+    return TRUE;
+  optimize_restart(td);
+  td->cursor = 0;
+  if (NULL == cursor->at) {
+    if (! td->be->iterinit(td->db))
+      return FALSE;
+  } else if (! td->be->iterseek(td->db, tcxstrptr(cursor->at),
+                                tcxstrsize(cursor->at))) {
+    return FALSE;
+  }
+  td->cursor = cursor->id;
+  *skip = cursor->after;
+  return TRUE;
+}
+
+int cursor_is_at(const Cursor *const cursor, const TCXSTR *const key) {
+  return tcxstrsize(key) == tcxstrsize(cursor->at) &&
+    0 == memcmp(tcxstrptr(key), tcxstrptr(cursor->at), tcxstrsize(key));
+}
+
+/* Whether the cursor has reached its end. Ordered backends compare
+   keys as TC's B+ tree does: bytewise, then shorter first. */
+int cursor_at_end(const Cursor *const cursor, const TCXSTR *const key) {
+  if (NULL == cursor->end)
+    return FALSE;
+  const int keysize = tcxstrsize(key);
+  const int endsize = tcxstrsize(cursor->end);
+  const int cmp = memcmp(tcxstrptr(key), tcxstrptr(cursor->end),
+                         (keysize < endsize) ? keysize : endsize);
+  return 0 < cmp || (0 == cmp && keysize >= endsize);
+}
+
+/*************************
+ *  Shared Db Functions  *
+ *************************/
+
+/* A handle can share its db, by name, with handles on other ports,
+   which attach to it to read. Each port's jobs run on its own async
+   thread, so gets through readers run in parallel with each other
+   and with the owner's commands, TC's rwlock keeping them apart.
+   Only the owner writes, so writes stay in order. Readers see writes
+   once they reach TC, so not those still in the owner's memtable,
+   and have no Bloom filter. The db is deleted once the owner and
+   every reader have let go of it. */
+
+/* Called with shared_mutex held. */
+SharedDb *shared_find(const char *const name, const uint64_t name_size) {
+  for (SharedDb *sd = shared_dbs; NULL != sd; sd = sd->next)
+    if (name_size == sd->name_size && 0 == memcmp(name, sd->name, name_size))
+      return sd;
+  return NULL;
+}
+
+/* Once the owner lets go, no more readers can attach. Whoever lets
+   go last deletes the db. */
+void shared_release(TokeData *const td) {
+  SharedDb *const sd = td->shared;
+  erl_drv_mutex_lock(shared_mutex);
+  if (! td->reader) {
+    SharedDb **link = &shared_dbs;
+    while (sd != *link)
+      link = &((*link)->next);
+    *link = sd->next;
+  }
+  const uint32_t refs = --(sd->refs);
+  erl_drv_mutex_unlock(shared_mutex);
+  if (0 == refs) {
+    sd->be->destroy(sd->db);
+    driver_free(sd->name);
+    driver_free(sd);
+  }
+  td->shared = NULL;
+  td->reader = FALSE;
+}
+
+/* Whether any reader is attached to the handle's db. */
+int shared_read(const TokeData *const td) {
+  if (NULL == td->shared)
+    return FALSE;
+  erl_drv_mutex_lock(shared_mutex);
+  const int read = 1 < td->shared->refs;
+  erl_drv_mutex_unlock(shared_mutex);
+  return read;
+}
+
+/* Lets go of the handle's db, deleting it unless others share it. */
+void handle_del_db(TokeData *const td) {
+  if (NULL != td->shared)
+    shared_release(td);
+  else
+    td->be->destroy(td->db);
+  td->db = NULL;
+}
+
+/* A reader can only get, and let go. */
+int handle_accepts(const TokeData *const td, const uint8_t command) {
+  if (! td->reader)
+    return TRUE;
+  switch (command) {
+  case TOKE_DEL:
+  case TOKE_GET:
+  case TOKE_GET_MULTI:
+  case TOKE_STATS:
+  case TOKE_SET_GROUP_COMMIT:
+  case TOKE_ADD_HANDLE:
+  case TOKE_REMOVE_HANDLE:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+/* Whether the handle's db is of a backend with no way to carry out
+   command at all, as opposed to one not in a state to. */
+int backend_lacks(const TokeData *const td, const uint8_t command) {
+  if (NULL == td->db)
+    return FALSE;
+  switch (command) {
+  case TOKE_SHARE:
+    return NULL == td->be->setmutex;
+  case TOKE_OPTIMIZE:
+    return ! td->be->maintained && NULL == td->be->optimize;
+  case TOKE_ITER_RANGE:
+    return NULL == td->be->iterjump;
+  default:
+    return FALSE;
+  }
+}
+
+/*********************
+ *  Merge Functions  *
+ *********************/
+
+/* Returns a copy of value, malloc'd as TC wants, with one field
+   updated, or NULL if the field isn't there or isn't an integer we
+   can add to. */
+char *merge_apply(const char *const value, const int valuesize,
+                  const MergeOp *const op, int *const resultsize) {
+  const unsigned char *start = NULL;
+  const unsigned char *finish = NULL;
+  unsigned char encoded[ETF_INT_MAX_LEN];
+  const unsigned char *field = NULL;
+  int fieldsize = 0;
+
+  if (! etf_element(value, valuesize, op->position, &start, &finish))
+    return NULL;
+
+  if (TOKE_MERGE_ADD == op->op) {
+    int64_t n = 0;
+    if (! etf_get_int(start, &n))
+      return NULL;
+    if ((op->delta > 0 && n > INT64_MAX - op->delta) ||
+        (op->delta < 0 && n < INT64_MIN - op->delta))
+      return NULL;
+    fieldsize = etf_put_int(n + op->delta, encoded);
+    field = encoded;
+  } else {
+    field = (const unsigned char *)op->term;
+    fieldsize = op->term_size;
+  }
+
+  const int before = start - (const unsigned char *)value;
+  const int after = valuesize - (finish - (const unsigned char *)value);
+  char *const result = (char *)malloc(before + fieldsize + after);
+  if (NULL == result)
+    return NULL;
+  memcpy(result, value, before);
+  memcpy(result + before, field, fieldsize);
+  memcpy(result + before + fieldsize, finish, after);
+  *resultsize = before + fieldsize + after;
+  return result;
+}
+
+/* The TCPDPROC: runs under the record's lock, so the read, the
+   updates and the write are atomic. Returning NULL leaves the record
+   alone. */
+void *merge_proc(const void *vbuf, int vsiz, int *sp, void *op) {
+  MergeContext *const context = (MergeContext *)op;
+  char *value = NULL;
+  int valuesize = vsiz;
+  for (uint64_t idx = 0; idx < context->count; ++idx) {
+    char *const next =
+      merge_apply(NULL == value ? (const char *)vbuf : value, valuesize,
+                  &(context->ops[idx]), &valuesize);
+    free(value);
+    if (NULL == next) {
+      context->failed = TRUE;
+      return NULL;
+    }
+    value = next;
+  }
+  *sp = valuesize;
+  context->merged_size = valuesize;
+  return value;
+}
+
+static int toke_init() {
+  toke_crc32_init();
+  toke_reply_atom = driver_mk_atom("toke_reply");
+  not_found_atom = driver_mk_atom("not_found");
+  for (int idx = 0; idx < STAT_COUNT; ++idx)
+    stat_atoms[idx] = driver_mk_atom((char *)stat_names[idx]);
+  for (int idx = 0; idx < COMMAND_COUNT; ++idx)
+    command_atoms[idx] = driver_mk_atom((char *)command_names[idx]);
+  latency_atom = driver_mk_atom("latency");
+  shared_mutex = erl_drv_mutex_create("toke_shared");
+  if (NULL == shared_mutex)
+    return -1;
+
+  no_command_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == no_command_atom_spec)
+    return -1;
+
+  no_command_atom_spec[0] = ERL_DRV_ATOM;
+  no_command_atom_spec[1] = driver_mk_atom("toke_reply");
+  no_command_atom_spec[2] = ERL_DRV_ATOM;
+  no_command_atom_spec[3] = driver_mk_atom("no_command");
+  no_command_atom_spec[4] = ERL_DRV_TUPLE;
+  no_command_atom_spec[5] = 2;
+
+  invalid_command_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == invalid_command_atom_spec)
+    return -1;
+
+  invalid_command_atom_spec[0] = ERL_DRV_ATOM;
+  invalid_command_atom_spec[1] = driver_mk_atom("toke_reply");
+  invalid_command_atom_spec[2] = ERL_DRV_ATOM;
+  invalid_command_atom_spec[3] = driver_mk_atom("invalid_command");
+  invalid_command_atom_spec[4] = ERL_DRV_TUPLE;
+  invalid_command_atom_spec[5] = 2;
+
+  no_such_command_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == no_such_command_atom_spec)
+    return -1;
+
+  no_such_command_atom_spec[0] = ERL_DRV_ATOM;
+  no_such_command_atom_spec[1] = driver_mk_atom("toke_reply");
+  no_such_command_atom_spec[2] = ERL_DRV_ATOM;
+  no_such_command_atom_spec[3] = driver_mk_atom("no_such_command");
+  no_such_command_atom_spec[4] = ERL_DRV_TUPLE;
+  no_such_command_atom_spec[5] = 2;
+
+  no_such_handle_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == no_such_handle_atom_spec)
+    return -1;
+
+  no_such_handle_atom_spec[0] = ERL_DRV_ATOM;
+  no_such_handle_atom_spec[1] = driver_mk_atom("toke_reply");
+  no_such_handle_atom_spec[2] = ERL_DRV_ATOM;
+  no_such_handle_atom_spec[3] = driver_mk_atom("no_such_handle");
+  no_such_handle_atom_spec[4] = ERL_DRV_TUPLE;
+  no_such_handle_atom_spec[5] = 2;
+
+  ok_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == ok_atom_spec)
+    return -1;
+
+  ok_atom_spec[0] = ERL_DRV_ATOM;
+  ok_atom_spec[1] = driver_mk_atom("toke_reply");
+  ok_atom_spec[2] = ERL_DRV_ATOM;
+  ok_atom_spec[3] = driver_mk_atom("ok");
+  ok_atom_spec[4] = ERL_DRV_TUPLE;
+  ok_atom_spec[5] = 2;
+
+  invalid_state_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == invalid_state_atom_spec)
+    return -1;
+
+  invalid_state_atom_spec[0] = ERL_DRV_ATOM;
+  invalid_state_atom_spec[1] = driver_mk_atom("toke_reply");
+  invalid_state_atom_spec[2] = ERL_DRV_ATOM;
+  invalid_state_atom_spec[3] = driver_mk_atom("invalid_state");
+  invalid_state_atom_spec[4] = ERL_DRV_TUPLE;
+  invalid_state_atom_spec[5] = 2;
+
+  not_found_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == not_found_atom_spec)
+    return -1;
+
+  not_found_atom_spec[0] = ERL_DRV_ATOM;
+  not_found_atom_spec[1] = driver_mk_atom("toke_reply");
+  not_found_atom_spec[2] = ERL_DRV_ATOM;
+  not_found_atom_spec[3] = driver_mk_atom("not_found");
+  not_found_atom_spec[4] = ERL_DRV_TUPLE;
+  not_found_atom_spec[5] = 2;
+
+  bad_value_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == bad_value_atom_spec)
+    return -1;
+
+  bad_value_atom_spec[0] = ERL_DRV_ATOM;
+  bad_value_atom_spec[1] = driver_mk_atom("toke_reply");
+  bad_value_atom_spec[2] = ERL_DRV_ATOM;
+  bad_value_atom_spec[3] = driver_mk_atom("bad_value");
+  bad_value_atom_spec[4] = ERL_DRV_TUPLE;
+  bad_value_atom_spec[5] = 2;
+
+  unsupported_atom_spec =
+    (ErlDrvTermData*)driver_alloc(ATOM_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == unsupported_atom_spec)
+    return -1;
+
+  unsupported_atom_spec[0] = ERL_DRV_ATOM;
+  unsupported_atom_spec[1] = driver_mk_atom("toke_reply");
+  unsupported_atom_spec[2] = ERL_DRV_ATOM;
+  unsupported_atom_spec[3] = driver_mk_atom("unsupported");
+  unsupported_atom_spec[4] = ERL_DRV_TUPLE;
+  unsupported_atom_spec[5] = 2;
+
+  return 0;
+}
+
+/* Every port has let go of its shared dbs by now. */
+static void toke_finish() {
+  erl_drv_mutex_destroy(shared_mutex);
+}
+
+/* A handle with no db yet. */
+TokeData *handle_new(TokePort *const tp, const uint32_t id) {
+  TokeData *const td = (TokeData*)driver_alloc(sizeof(TokeData));
+
+  if (NULL == td)
+    return NULL;
+
+  td->tp = tp;
+  td->id = id;
+  td->be = &hash_backend;
+  td->db = NULL;
+  td->cursors = NULL;
+  td->cursor = 0;
+  td->cursor_serial = 0;
+  td->secondary_position = 0;
+  td->by_secondary = NULL;
+  td->by_primary = NULL;
+  td->in_transaction = FALSE;
+  td->in_group = FALSE;
+  td->memtable = NULL;
+  td->memtable_max = 0;
+  td->memtable_interval = 0;
+  td->bloom_bits_per_key = 0;
+  td->bloom_rebuild_percent = 0;
+  memset(&(td->bloom), 0, sizeof(td->bloom));
+  td->tune_apow = -1;                /* TC's defaults */
+  td->tune_fpow = -1;
+  td->tune_opts = 0;
+  td->bulk_records = 0;
+  td->df_unit = 0;
+  td->path = NULL;
+  td->open_mode = 0;
+  memset(&(td->maint), 0, sizeof(td->maint));
+  td->bytes_read = 0;
+  td->bytes_written = 0;
+  memset(td->latency, 0, sizeof(td->latency));
+  td->shared = NULL;
+  td->reader = FALSE;
+  return td;
+}
+
+static ErlDrvData toke_start(const ErlDrvPort port, char *const buff) {
+  TokePort *const tp = (TokePort*)driver_alloc(sizeof(TokePort));
+
+  if (NULL == tp)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->port = port;
+  tp->owner = driver_connected(port);
+  /* Ports with different keys may run on different async threads.
+     "libtoke N" picks the key, so that shards can be spread out. */
+  const char *const worker = strchr(buff, ' ');
+  tp->async_key = (NULL != worker) ?
+    (unsigned int)strtoul(worker + 1, NULL, 10) :
+    (unsigned int)((uintptr_t)port >> 4);
+  tp->outstanding = 0;
+  tp->group_open = FALSE;
+  tp->group_max = 0;
+  tp->group_window = 0;
+  tp->group_writes = 0;
+  tp->timer_armed = FALSE;
+  tp->timer_ms = 0;
+  tp->held_head = NULL;
+  tp->held_tail = NULL;
+
+  tp->handle_slots = 1;
+  tp->handles = (TokeData**)driver_alloc(sizeof(TokeData*));
+  if (NULL == tp->handles)
+    return ERL_DRV_ERROR_GENERAL;
+  tp->handles[0] = handle_new(tp, 0);
+  if (NULL == tp->handles[0])
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->mutex = erl_drv_mutex_create("toke outstanding mutex");
+  if (NULL == tp->mutex)
+    return ERL_DRV_ERROR_GENERAL;
+  tp->cond = erl_drv_cond_create("toke outstanding condition");
+  if (NULL == tp->cond)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->get_result_spec = (ErlDrvTermData*)
+    driver_alloc(GET_RESULT_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == tp->get_result_spec)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->get_result_spec[0] = ERL_DRV_ATOM;
+  tp->get_result_spec[1] = driver_mk_atom("toke_reply");
+  tp->get_result_spec[2] = ERL_DRV_BINARY;
+  tp->get_result_spec[3] = (ErlDrvTermData)NULL;
+  tp->get_result_spec[4] = 0;
+  tp->get_result_spec[5] = 0;
+  tp->get_result_spec[6] = ERL_DRV_TUPLE;
+  tp->get_result_spec[7] = 2;
+
+  tp->iter_result_spec = (ErlDrvTermData*)
+    driver_alloc(ITER_RESULT_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == tp->iter_result_spec)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->iter_result_spec[0] = ERL_DRV_ATOM;
+  tp->iter_result_spec[1] = driver_mk_atom("toke_reply");
+  tp->iter_result_spec[2] = ERL_DRV_BUF2BINARY;
+  tp->iter_result_spec[3] = (ErlDrvTermData)NULL;
+  tp->iter_result_spec[4] = 0;
+  tp->iter_result_spec[5] = ERL_DRV_BUF2BINARY;
+  tp->iter_result_spec[6] = (ErlDrvTermData)NULL;
+  tp->iter_result_spec[7] = 0;
+  tp->iter_result_spec[8] = ERL_DRV_TUPLE;
+  tp->iter_result_spec[9] = 3;
+
+  tp->reader_error_spec = (ErlDrvTermData*)
+    driver_alloc(READER_ERROR_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == tp->reader_error_spec)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->reader_error_spec[0] = ERL_DRV_ATOM;
+  tp->reader_error_spec[1] = driver_mk_atom("toke_reply");
+  tp->reader_error_spec[2] = ERL_DRV_ATOM;
+  tp->reader_error_spec[3] = driver_mk_atom("reader_error");
+  tp->reader_error_spec[4] = ERL_DRV_STRING;
+  tp->reader_error_spec[5] = (ErlDrvTermData)NULL;
+  tp->reader_error_spec[6] = 0;
+  tp->reader_error_spec[7] = ERL_DRV_TUPLE;
+  tp->reader_error_spec[8] = 2;
+  tp->reader_error_spec[9] = ERL_DRV_TUPLE;
+  tp->reader_error_spec[10] = 2;
+
+  tp->tokyo_error_spec = (ErlDrvTermData*)
+    driver_alloc(TOKYO_ERROR_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == tp->tokyo_error_spec)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->tokyo_error_spec[0] = ERL_DRV_ATOM;
+  tp->tokyo_error_spec[1] = driver_mk_atom("toke_reply");
+  tp->tokyo_error_spec[2] = ERL_DRV_ATOM;
+  tp->tokyo_error_spec[3] = driver_mk_atom("error_from_tokyo_cabinet");
+  tp->tokyo_error_spec[4] = ERL_DRV_STRING;
+  tp->tokyo_error_spec[5] = (ErlDrvTermData)NULL;
+  tp->tokyo_error_spec[6] = 0;
+  tp->tokyo_error_spec[7] = ERL_DRV_TUPLE;
+  tp->tokyo_error_spec[8] = 2;
+  tp->tokyo_error_spec[9] = ERL_DRV_TUPLE;
+  tp->tokyo_error_spec[10] = 2;
+
+  tp->cas_changed_spec = (ErlDrvTermData*)
+    driver_alloc(CAS_CHANGED_SPEC_LEN * sizeof(ErlDrvTermData));
+
+  if (NULL == tp->cas_changed_spec)
+    return ERL_DRV_ERROR_GENERAL;
+
+  tp->cas_changed_spec[0] = ERL_DRV_ATOM;
+  tp->cas_changed_spec[1] = driver_mk_atom("toke_reply");
+  tp->cas_changed_spec[2] = ERL_DRV_ATOM;
+  tp->cas_changed_spec[3] = driver_mk_atom("changed");
+  tp->cas_changed_spec[4] = ERL_DRV_BUF2BINARY;
+  tp->cas_changed_spec[5] = (ErlDrvTermData)NULL;
+  tp->cas_changed_spec[6] = 0;
+  tp->cas_changed_spec[7] = ERL_DRV_TUPLE;
+  tp->cas_changed_spec[8] = 2;
+  tp->cas_changed_spec[9] = ERL_DRV_TUPLE;
+  tp->cas_changed_spec[10] = 2;
+
+  return (ErlDrvData)tp;
+}
+
+void toke_job_free(void *const data);
+void bloom_clear(TokeData *const td);
+void optimize_end(TokeData *const td);
+
+/* Closes the handle's db, keeping any writes still in its
+   memtable. */
+void handle_free(TokeData *const td) {
+  if (NULL != td->db)
+    memtable_flush(td);
+  if (0 != td->secondary_position) {
+    secondary_clear(td);
+    tcmapdel(td->by_secondary);
+    tcmapdel(td->by_primary);
+  }
+  if (NULL != td->memtable)
+    tcmapdel(td->memtable);
+  cursors_clear(td);
+  bloom_clear(td);
+  optimize_end(td);
+  if (NULL != td->path)
+    driver_free(td->path);
+  if (NULL != td->db)
+    handle_del_db(td);
+  driver_free(td);
+}
+
+static void toke_stop(const ErlDrvData drv_data) {
+  TokePort *const tp = (TokePort*)drv_data;
+  /* Jobs still queued will run, though their replies will go
+     nowhere. Wait for them, so none of them is using a db when we
+     close it. */
+  erl_drv_mutex_lock(tp->mutex);
+  while (0 < tp->outstanding)
+    erl_drv_cond_wait(tp->cond, tp->mutex);
+  erl_drv_mutex_unlock(tp->mutex);
+  erl_drv_cond_destroy(tp->cond);
+  erl_drv_mutex_destroy(tp->mutex);
+
+  /* likewise the held replies, but their writes are kept */
+  if (tp->timer_armed)
+    driver_cancel_timer(tp->port);
+  for (uint32_t id = 0; id < tp->handle_slots; ++id) {
+    TokeData *const td = tp->handles[id];
+    if (NULL != td && NULL != td->db)
+      memtable_flush(td);
+    if (NULL != td && td->in_group)
+      td->be->trancommit(td->db);
+  }
+  while (NULL != tp->held_head) {
+    TokeJob *const job = tp->held_head;
+    tp->held_head = job->next;
+    toke_job_free(job);
+  }
+
+  for (uint32_t id = 0; id < tp->handle_slots; ++id)
+    if (NULL != tp->handles[id])
+      handle_free(tp->handles[id]);
+  driver_free(tp->handles);
+  driver_free((char*)tp->get_result_spec);
+  driver_free((char*)tp->iter_result_spec);
+  driver_free((char*)tp->reader_error_spec);
+  driver_free((char*)tp->tokyo_error_spec);
+  driver_free((char*)tp->cas_changed_spec);
+  driver_free((char*)drv_data);
+}
+
+/* Creates the handle's db, of the backend asked for. */
+void toke_new(TokeData *const td, ErlDrvTermData **const spec,
+              Reader *const reader, TokeJob *const job) {
+  const uint8_t *backend = NULL;
+  const uint32_t *width = NULL;
+  const Backend *be = NULL;
+  if (NULL != td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! read_uint8(reader, &backend) ||
+             (TOKE_BACKEND_FIXED == *backend &&
+              ! read_uint32(reader, &width))) {
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  switch (*backend) {
+  case TOKE_BACKEND_HASH:
+    be = &hash_backend;
+    break;
+  case TOKE_BACKEND_MEMORY:
+    be = &memory_backend;
+    break;
+  case TOKE_BACKEND_TREE:
+    be = &tree_backend;
+    break;
+  case TOKE_BACKEND_FIXED: /* then the width of its values */
+    if (0 == *width || INT32_MAX < *width) {
+      *spec = bad_value_atom_spec;
+      return;
+    }
+    be = &fixed_backend;
+    break;
+  default:
+    *spec = bad_value_atom_spec;
+    return;
+  }
+  if (NULL == (td->db = be->create())) {
+    job->failed = TRUE;
+  } else {
+    td->be = be;
+    if (NULL != width)
+      fixed_setwidth(td->db, (int32_t)*width);
+    *spec = ok_atom_spec;
+  }
+}
+
+void toke_del(TokeData *const td, ErlDrvTermData **const spec,
+              Reader *const reader, TokeJob *const job) {
+  if (NULL != td->db) {
+    handle_forget(td); /* it may not have been closed */
+    handle_del_db(td);
+    td->maint.lost = TCESUCCESS;
+  }
+  *spec = ok_atom_spec;
+}
+
+/* Replies with the new handle's id. Ids are reused once freed. */
+void toke_add_handle(TokeData *const td, ErlDrvTermData **const spec,
+                     Reader *const reader, TokeJob *const job) {
+  TokePort *const tp = td->tp;
+  uint32_t id = 0;
+  while (id < tp->handle_slots && NULL != tp->handles[id])
+    ++id;
+  if (id == tp->handle_slots) {
+    TokeData **const handles = (TokeData**)
+      driver_realloc(tp->handles, 2 * tp->handle_slots * sizeof(TokeData*));
+    if (NULL == handles) {
+      job->failed = TRUE;
+      return;
+    }
+    for (uint32_t idx = tp->handle_slots; idx < 2 * tp->handle_slots; ++idx)
+      handles[idx] = NULL;
+    tp->handles = handles;
+    tp->handle_slots *= 2;
+  }
+  tp->handles[id] = handle_new(tp, id);
+  if (NULL == tp->handles[id]) {
+    job->failed = TRUE;
+    return;
+  }
+  job->reply[0] = ERL_DRV_ATOM;
+  job->reply[1] = toke_reply_atom;
+  job->reply[2] = ERL_DRV_UINT;
+  job->reply[3] = (ErlDrvUInt)id;
+  job->reply[4] = ERL_DRV_TUPLE;
+  job->reply[5] = 2;
+  job->spec = job->reply;
+  job->spec_len = HANDLE_SPEC_LEN;
+}
+
+/* Closes the handle's db, if it's open, and frees the handle once
+   the job is done with it. Handle 0 stays. */
+void toke_remove_handle(TokeData *const td, ErlDrvTermData **const spec,
+                        Reader *const reader, TokeJob *const job) {
+  if (0 == td->id) {
+    *spec = invalid_state_atom_spec;
+  } else {
+    td->tp->handles[td->id] = NULL;
+    job->removed = td;
+    *spec = ok_atom_spec;
+  }
+}
+
+/* Shares the handle's db under a name, for handles on other ports to
+   attach to. TC only takes the lock readers need before the db is
+   opened, so it must not be open yet. */
+void toke_share(TokeData *const td, ErlDrvTermData **const spec,
+                Reader *const reader, TokeJob *const job) {
+  const uint64_t *namesize = NULL;
+  const char *name = NULL;
+  if (NULL == td->db || NULL != td->shared) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! read_binary(reader, &name, &namesize)) {
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  SharedDb *const sd = (SharedDb*)driver_alloc(sizeof(SharedDb));
+  char *const copy = (char*)driver_alloc(*namesize + 1);
+  if (NULL == sd || NULL == copy) {
+    if (NULL != sd)
+      driver_free(sd);
+    if (NULL != copy)
+      driver_free(copy);
+    job->failed = TRUE;
+    return;
+  }
+  memcpy(copy, name, *namesize);
+  sd->name = copy;
+  sd->name_size = *namesize;
+  sd->be = td->be;
+  sd->db = td->db;
+  sd->refs = 1;
+
+  erl_drv_mutex_lock(shared_mutex);
+  if (NULL != shared_find(name, *namesize)) {
+    *spec = invalid_state_atom_spec;
+  } else if (! td->be->setmutex(td->db)) {
+    return_tokyo_error(td, job, td->db);
+  } else {
+    sd->next = shared_dbs;
+    shared_dbs = sd;
+    td->shared = sd;
+    *spec = ok_atom_spec;
+  }
+  erl_drv_mutex_unlock(shared_mutex);
+  if (NULL == td->shared) {
+    driver_free(copy);
+    driver_free(sd);
+  }
+}
+
+/* Attaches a handle with no db to a db shared by name, to read. */
+void toke_attach(TokeData *const td, ErlDrvTermData **const spec,
+                 Reader *const reader, TokeJob *const job) {
+  const uint64_t *namesize = NULL;
+  const char *name = NULL;
+  if (NULL != td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! read_binary(reader, &name, &namesize)) {
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  erl_drv_mutex_lock(shared_mutex);
+  SharedDb *const sd = shared_find(name, *namesize);
+  if (NULL != sd)
+    ++(sd->refs);
+  erl_drv_mutex_unlock(shared_mutex);
+  if (NULL == sd) {
+    *spec = not_found_atom_spec;
+  } else {
+    td->be = sd->be;
+    td->db = sd->db;
+    td->shared = sd;
+    td->reader = TRUE;
+    *spec = ok_atom_spec;
+  }
+}
+
+void toke_with_db(TokeData *const td, ErlDrvTermData **const spec,
+                   Reader *const reader, TokeJob *const job,
+                   int (*const func)(TokeData *const td, Reader *const reader,
+                               TokeJob *const job)) {
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+  } else {
+    switch (func(td, reader, job)) {
+    case OK:
+      *spec = ok_atom_spec;
+      break;
+    case TOKYO_ERROR:
+      return_tokyo_error(td, job, td->db);
+      break;
+    case READER_ERROR:
+      return_reader_error(td, job, reader);
+      break;
+    }
+  }
+}
+
+int toke_tune(TokeData *const td, Reader *const reader, TokeJob *const job) {
+  const int64_t *bnum = NULL;
+  const int8_t *apow = NULL;
+  const int8_t *fpow = NULL;
+  const uint8_t *opts = NULL;
+  if (read_int64(reader, &bnum) && read_int8(reader, &apow) &&
+      read_int8(reader, &fpow) && read_uint8(reader, &opts)) {
+
+    int tkopts = 0;
+    if (*opts & TOKE_TUNE_LARGE)
+      tkopts |= HDBTLARGE;
+    if (*opts & TOKE_TUNE_DEFLATE)
+      tkopts |= HDBTDEFLATE;
+    if (*opts & TOKE_TUNE_BZIP)
+      tkopts |= HDBTBZIP;
+    if (*opts & TOKE_TUNE_TCBS)
+      tkopts |= HDBTTCBS;
+    if (*opts & TOKE_TUNE_EXCODEC)
+      tkopts |= HDBTEXCODEC;
+
+    td->tune_apow = *apow;
+    td->tune_fpow = *fpow;
+    td->tune_opts = tkopts;
+    return (td->be->tune(td->db, *bnum, *apow, *fpow, tkopts)) ?
+      OK : TOKYO_ERROR;
+  } else {
+    return READER_ERROR;
+  }
+}
+
+int toke_set_cache(TokeData *const td, Reader *const reader,
+                   TokeJob *const job) {
+  const int32_t *rcnum = NULL;
+  return (read_int32(reader, &rcnum)) ?
+    ((td->be->setcache(td->db, *rcnum)) ? OK : TOKYO_ERROR) : READER_ERROR;
+}
+
+int toke_set_xm_size(TokeData *const td, Reader *const reader,
+                     TokeJob *const job) {
+  const int64_t *xmsize = NULL;
+  return (read_int64(reader, &xmsize)) ?
+    ((td->be->setxmsiz(td->db, *xmsize)) ? OK : TOKYO_ERROR) : READER_ERROR;
+}
+
+int toke_set_df_unit(TokeData *const td, Reader *const reader,
+                     TokeJob *const job) {
+  const int32_t *dfunit = NULL;
+  if (! read_int32(reader, &dfunit))
+    return READER_ERROR;
+  td->df_unit = *dfunit;
+  return (td->be->setdfunit(td->db, *dfunit)) ? OK : TOKYO_ERROR;
+}
+
+int toke_open(TokeData *const td, Reader *const reader, TokeJob *const job) {
+  const char *path = NULL;
+  const uint64_t *path_len = NULL;
+  const uint8_t *mode = NULL;
+  if (read_binary(reader, &path, &path_len) && read_uint8(reader, &mode)) {
+    /* strings coming from Erlang are not zero terminated, and the
+       length won't include the 0 stop byte, so copy into a new array,
+       ensuring we have a stop byte at the end. */
+    char *const path2 = (char*) driver_alloc((*path_len)+1);
+
+    if (NULL == path2)
+      return READER_ERROR;
+
+    path2[(*path_len)] = '\0';
+    strncpy(path2, path, *path_len);
+
+    int tkmode = 0;
+    if (*mode & TOKE_OPEN_READER)
+      tkmode |= HDBOREADER;
+    if (*mode & TOKE_OPEN_WRITER)
+      tkmode |= HDBOWRITER;
+    if (*mode & TOKE_OPEN_CREAT)
+      tkmode |= HDBOCREAT;
+    if (*mode & TOKE_OPEN_TRUNC)
+      tkmode |= HDBOTRUNC;
+    if (*mode & TOKE_OPEN_NOLCK)
       tkmode |= HDBONOLCK;
     if (*mode & TOKE_OPEN_LCKNB)
       tkmode |= HDBOLCKNB;
     if (*mode & TOKE_OPEN_TSYNC)
       tkmode |= HDBOTSYNC;
 
-    const int return_code =
-      (tchdbopen(td->hdb, path2, tkmode)) ? OK : TOKYO_ERROR;
-    driver_free(path2);
-    return return_code;
-  } else {
+    if (! td->be->open(td->db, path2, tkmode)) {
+      driver_free(path2);
+      return TOKYO_ERROR;
+    }
+    if (NULL != td->path)
+      driver_free(td->path);
+    td->path = path2; /* kept for optimize */
+    td->open_mode = tkmode;
+    td->maint.lost = TCESUCCESS;
+    maintenance_rebase(td);
+    if (0 != td->bloom_bits_per_key)
+      bloom_build(td);
+    return (0 != td->secondary_position) ? secondary_build(td) : OK;
+  } else {
+    return READER_ERROR;
+  }
+}
+
+/* Drops what's kept about the open db, before it's closed. */
+void handle_forget(TokeData *const td) {
+  cursors_clear(td);
+  if (0 != td->secondary_position)
+    secondary_clear(td);
+  bloom_clear(td);
+  optimize_end(td);
+  if (NULL != td->path)
+    driver_free(td->path);
+  td->path = NULL;
+}
+
+int toke_close(TokeData *const td, Reader *const reader,
+               TokeJob *const job) {
+  handle_forget(td);
+  if (TCESUCCESS != td->maint.lost) { /* already closed */
+    td->maint.lost = TCESUCCESS;
+    return OK;
+  }
+  return td->be->close(td->db) ? OK : TOKYO_ERROR;
+}
+
+int toke_do_insert(TokeData *const td, Reader *const reader,
+                   TokeJob *const job,
+                   bool (*func)(void *db, const void *kbuf, int ksiz,
+                                const void *vbuf, int vsiz)) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  const uint64_t *valuesize = NULL;
+  const char *value = NULL;
+  if (! (read_binary(reader, &key, &keysize) &&
+         read_binary(reader, &value, &valuesize)))
+    return READER_ERROR;
+  if (NULL != td->memtable)
+    tcmapout(td->memtable, key, *keysize); /* superseded */
+  optimize_dirty(td, key, *keysize);
+  if (! func(td->db, key, *keysize, value, *valuesize))
+    return TOKYO_ERROR;
+  td->bytes_written += *keysize + *valuesize;
+  if (0 != td->secondary_position)
+    secondary_insert(td, func, key, *keysize, value, *valuesize);
+  bloom_add(td, key, *keysize);
+  return OK;
+}
+
+int toke_insert(TokeData *const td, Reader *const reader,
+                TokeJob *const job) {
+  return toke_do_insert(td, reader, job, td->be->put);
+}
+
+int toke_insert_new(TokeData *const td, Reader *const reader,
+                    TokeJob *const job) {
+  return toke_do_insert(td, reader, job, td->be->putkeep);
+}
+
+int toke_insert_concat(TokeData *const td, Reader *const reader,
+                       TokeJob *const job) {
+  return toke_do_insert(td, reader, job, td->be->putcat);
+}
+
+int toke_insert_async(TokeData *const td, Reader *const reader,
+                      TokeJob *const job) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  const uint64_t *valuesize = NULL;
+  const char *value = NULL;
+  if (NULL == td->memtable) {
+    toke_do_insert(td, reader, job, td->be->putasync);
+  } else if (read_binary(reader, &key, &keysize) &&
+             read_binary(reader, &value, &valuesize)) {
+    memtable_put(td, job, key, *keysize, MEMTABLE_PUT, value, *valuesize);
+    if (0 != td->secondary_position)
+      secondary_add(td, key, *keysize, value, *valuesize);
+    bloom_add(td, key, *keysize);
+    if (tcmapmsiz(td->memtable) >= td->memtable_max)
+      memtable_flush(td);
+  }
+  return OK; /* throw away any errors, because we're async throughout */
+}
+
+int toke_delete(TokeData *const td, Reader *const reader,
+                TokeJob *const job) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  int size = 0;
+  if (read_binary(reader, &key, &keysize)) {
+    if (NULL != td->memtable &&
+        NULL != tcmapget(td->memtable, key, *keysize, &size)) {
+      /* cancel it, though an older version may be in TC */
+      memtable_put(td, job, key, *keysize, MEMTABLE_DELETE, NULL, 0);
+      if (0 != td->secondary_position)
+        secondary_remove(td, key, *keysize);
+      bloom_deleted(td, 1);
+      return OK;
+    }
+    optimize_dirty(td, key, *keysize);
+    if (td->be->out(td->db, key, *keysize)) {
+      if (0 != td->secondary_position)
+        secondary_remove(td, key, *keysize);
+      bloom_deleted(td, 1);
+      return OK;
+    } else if (TCENOREC == td->be->ecode(td->db)) {
+      if (0 != td->secondary_position)
+        secondary_remove(td, key, *keysize);
+      return OK;
+    } else {
+      return TOKYO_ERROR;
+    }
+  } else {
+    return READER_ERROR;
+  }
+}
+
+int toke_delete_if_eq(TokeData *const td, Reader *const reader,
+                      TokeJob *const job) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  const uint64_t *valuesize = NULL;
+  const char *value = NULL;
+  if (read_binary(reader, &key, &keysize) &&
+      read_binary(reader, &value, &valuesize)) {
+    int found_valuesize = 0;
+    char *found_value = NULL;
+    const int cached = memtable_lookup(td, key, *keysize, &found_value,
+                                       &found_valuesize);
+    if (MEMTABLE_MISS == cached)
+      found_value = td->be->get(td->db, key, *keysize, &found_valuesize);
+    if (NULL == found_value) {
+      return OK;
+    } else {
+      const int eq = *valuesize == found_valuesize &&
+        0 == memcmp(value, found_value, found_valuesize);
+      free(found_value);
+      if (! eq)
+        return OK;
+      if (MEMTABLE_PUT == cached) {
+        memtable_put(td, job, key, *keysize, MEMTABLE_DELETE, NULL, 0);
+      } else {
+        optimize_dirty(td, key, *keysize);
+        if (! td->be->out(td->db, key, *keysize))
+          return TOKYO_ERROR;
+      }
+      if (0 != td->secondary_position)
+        secondary_remove(td, key, *keysize);
+      bloom_deleted(td, 1);
+      return OK;
+    }
+  } else {
+    return READER_ERROR;
+  }
+}
+
+/* Replaces the value iff the current one is as expected, either the
+   value itself or its CRC-32. Otherwise replies with the current
+   value, so that the caller can retry without another get. */
+void toke_cas(TokeData *const td, ErlDrvTermData **const spec,
+              Reader *const reader, TokeJob *const job) {
+  const uint8_t *expect = NULL;
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  const uint64_t *expectedsize = NULL;
+  const char *expected = NULL;
+  const uint64_t *valuesize = NULL;
+  const char *value = NULL;
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! (read_uint8(reader, &expect) &&
+                read_binary(reader, &key, &keysize) &&
+                read_binary(reader, &expected, &expectedsize) &&
+                read_binary(reader, &value, &valuesize))) {
+    return_reader_error(td, job, reader);
+    return;
+  } else if (TOKE_CAS_CRC32 == *expect && sizeof(uint32_t) != *expectedsize) {
+    reader->last_error = READER_PACKING_ERROR;
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  int foundsize = 0;
+  job->value = td->be->get(td->db, key, *keysize, &foundsize);
+  if (NULL == job->value) {
+    *spec = not_found_atom_spec;
+    return;
+  }
+  td->bytes_read += foundsize;
+
+  int matches = FALSE;
+  if (TOKE_CAS_CRC32 == *expect) {
+    uint32_t crc = 0;
+    memcpy(&crc, expected, sizeof(crc));
+    matches = crc == toke_crc32(job->value, foundsize);
+  } else {
+    matches = *expectedsize == foundsize &&
+      0 == memcmp(expected, job->value, foundsize);
+  }
+
+  optimize_dirty(td, key, *keysize);
+  if (! matches) {
+    ErlDrvTermData *const result =
+      job_reply_template(job, td->tp->cas_changed_spec, CAS_CHANGED_SPEC_LEN);
+    result[5] = (ErlDrvTermData)job->value;
+    result[6] = foundsize;
+  } else if (td->be->put(td->db, key, *keysize, value, *valuesize)) {
+    td->bytes_written += *keysize + *valuesize;
+    if (0 != td->secondary_position)
+      secondary_insert(td, td->be->put, key, *keysize, value, *valuesize);
+    *spec = ok_atom_spec;
+  } else {
+    return_tokyo_error(td, job, td->db);
+  }
+}
+
+/* Applies the field updates to the value in place, without a round
+   trip through Erlang. */
+void toke_merge(TokeData *const td, ErlDrvTermData **const spec,
+                Reader *const reader, TokeJob *const job) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  const uint64_t *count = NULL;
+  MergeOp ops[MERGE_OPS_MAX];
+  int indexed = FALSE;
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! (read_binary(reader, &key, &keysize) &&
+                read_count(reader, &count))) {
+    return_reader_error(td, job, reader);
+    return;
+  } else if (MERGE_OPS_MAX < *count) {
+    reader->last_error = READER_PACKING_ERROR;
+    return_reader_error(td, job, reader);
+    return;
+  } else if (0 == *count) {
+    *spec = ok_atom_spec;
+    return;
+  }
+
+  for (uint64_t idx = 0; idx < *count; ++idx) {
+    const uint8_t *op = NULL;
+    const uint8_t *position = NULL;
+    const int64_t *delta = NULL;
+    const uint64_t *term_size = NULL;
+    int ok = read_uint8(reader, &op) && read_uint8(reader, &position);
+    if (ok && TOKE_MERGE_ADD == *op) {
+      ok = read_int64(reader, &delta);
+      ops[idx].delta = ok ? *delta : 0;
+    } else if (ok && TOKE_MERGE_REPLACE == *op) {
+      ok = read_binary(reader, &(ops[idx].term), &term_size);
+      if (ok) {
+        /* the replacement must be exactly one term */
+        const unsigned char *const term =
+          (const unsigned char *)ops[idx].term;
+        ops[idx].term_size = *term_size;
+        if (etf_skip(term, term + *term_size) != term + *term_size) {
+          reader->last_error = READER_PACKING_ERROR;
+          ok = FALSE;
+        }
+      }
+    } else if (ok) {
+      reader->last_error = READER_PACKING_ERROR;
+      ok = FALSE;
+    }
+    if (! ok) {
+      return_reader_error(td, job, reader);
+      return;
+    }
+    ops[idx].op = *op;
+    ops[idx].position = *position;
+    indexed = indexed || (0 != td->secondary_position &&
+                          *position == td->secondary_position);
+  }
+
+  MergeContext context = { ops, *count, FALSE, 0 };
+  char *cached_value = NULL;
+  int cached_size = 0;
+  const int cached =
+    memtable_lookup(td, key, *keysize, &cached_value, &cached_size);
+  optimize_dirty(td, key, *keysize);
+  if (MEMTABLE_DELETE == cached) {
+    *spec = not_found_atom_spec;
+  } else if (MEMTABLE_PUT == cached) {
+    /* update it where it is, so that it still needn't reach TC */
+    int merged_size = 0;
+    char *const merged =
+      (char *)merge_proc(cached_value, cached_size, &merged_size, &context);
+    free(cached_value);
+    if (NULL == merged) {
+      *spec = bad_value_atom_spec;
+    } else {
+      memtable_put(td, job, key, *keysize, MEMTABLE_PUT, merged, merged_size);
+      if (indexed)
+        secondary_add(td, key, *keysize, merged, merged_size);
+      free(merged);
+      *spec = ok_atom_spec;
+    }
+  } else if (td->be->putproc(td->db, key, *keysize, NULL, 0, merge_proc,
+                             &context)) {
+    td->bytes_written += *keysize + context.merged_size;
+    if (indexed) {
+      int valuesize = 0;
+      char *const value = td->be->get(td->db, key, *keysize, &valuesize);
+      if (NULL != value) {
+        secondary_add(td, key, *keysize, value, valuesize);
+        free(value);
+      }
+    }
+    *spec = ok_atom_spec;
+  } else if (context.failed) {
+    *spec = bad_value_atom_spec;
+  } else if (TCENOREC == td->be->ecode(td->db)) {
+    *spec = not_found_atom_spec;
+  } else {
+    return_tokyo_error(td, job, td->db);
+  }
+}
+
+/* Explicit transactions. Writes in one aren't grouped. */
+void toke_tran_begin(TokeData *const td, ErlDrvTermData **const spec,
+                     Reader *const reader, TokeJob *const job) {
+  if (NULL == td->db || td->in_transaction) {
+    *spec = invalid_state_atom_spec;
+  } else if (td->be->tranbegin(td->db)) {
+    td->in_transaction = TRUE;
+    *spec = ok_atom_spec;
+  } else {
+    return_tokyo_error(td, job, td->db);
+  }
+}
+
+void toke_tran_end(TokeData *const td, ErlDrvTermData **const spec,
+                   TokeJob *const job, bool (*func)(void *db)) {
+  if (NULL == td->db || ! td->in_transaction) {
+    *spec = invalid_state_atom_spec;
+  } else {
+    /* TC ends the transaction even if this fails */
+    td->in_transaction = FALSE;
+    const int ok = func(td->db);
+    if (ok)
+      *spec = ok_atom_spec;
+    else
+      return_tokyo_error(td, job, td->db);
+    if (! ok || func != td->be->trancommit)
+      tran_aborted(td);
+  }
+}
+
+/* Gathers writes into one transaction until there are max of them,
+   or, if window is 0, until the queue empties; otherwise until window
+   ms have passed. max 0 turns grouping off. This is the port's
+   setting, whichever handle it's sent to. */
+int toke_set_group_commit(TokeData *const td, Reader *const reader,
+                          TokeJob *const job) {
+  const uint32_t *max = NULL;
+  const uint32_t *window = NULL;
+  if (! (read_uint32(reader, &max) && read_uint32(reader, &window)))
+    return READER_ERROR;
+  td->tp->group_max = *max;
+  td->tp->group_window = *window;
+  return OK;
+}
+
+/* Absorb async writes in a memtable of up to max bytes, flushed
+   every interval ms. max 0 turns it off. */
+int toke_set_memtable(TokeData *const td, Reader *const reader,
+                      TokeJob *const job) {
+  const uint64_t *max = NULL;
+  const uint32_t *interval = NULL;
+  if (! (read_uint64(reader, &max) && read_uint32(reader, &interval)))
+    return READER_ERROR;
+  /* already flushed, as this isn't memtable_aware */
+  if (0 == *max && NULL != td->memtable) {
+    tcmapdel(td->memtable);
+    td->memtable = NULL;
+  } else if (0 != *max && NULL == td->memtable) {
+    td->memtable = tcmapnew();
+  }
+  td->memtable_max = *max;
+  td->memtable_interval = *interval;
+  return OK;
+}
+
+/* Index the given element of each value. Position 0 drops the
+   index. Like tune, this must come before open. */
+int toke_set_secondary(TokeData *const td, Reader *const reader,
+                       TokeJob *const job) {
+  const uint8_t *position = NULL;
+  if (! read_uint8(reader, &position))
+    return READER_ERROR;
+  if (0 != td->secondary_position) {
+    secondary_clear(td);
+    tcmapdel(td->by_secondary);
+    tcmapdel(td->by_primary);
+    td->by_secondary = NULL;
+    td->by_primary = NULL;
+  }
+  td->secondary_position = *position;
+  if (0 != *position) {
+    td->by_secondary = tcmapnew();
+    td->by_primary = tcmapnew();
+  }
+  return OK;
+}
+
+/* Keep a Bloom filter of bits_per_key bits per key, rebuilt once
+   rebuild_percent of the keys in it have been deleted. bits_per_key 0
+   drops it. Like tune, this must come before open. */
+int toke_set_bloom(TokeData *const td, Reader *const reader,
+                   TokeJob *const job) {
+  const uint32_t *bits_per_key = NULL;
+  const uint32_t *rebuild_percent = NULL;
+  if (! (read_uint32(reader, &bits_per_key) &&
+         read_uint32(reader, &rebuild_percent)))
+    return READER_ERROR;
+  bloom_clear(td);
+  td->bloom_bits_per_key = *bits_per_key;
+  td->bloom_rebuild_percent = *rebuild_percent;
+  return OK;
+}
+
+/* The counters, in stat_names order. */
+void stats_collect(TokeData *const td, uint64_t *const stats,
+                   const uint64_t queued_jobs) {
+  stats[STAT_BLOOM_BITS] = (NULL == td->bloom.bits) ? 0 :
+    td->bloom.blocks * BLOOM_BLOCK_BITS;
+  stats[STAT_BLOOM_HASHES] = (NULL == td->bloom.bits) ? 0 : td->bloom.hashes;
+  stats[STAT_BLOOM_KEYS] = td->bloom.keys;
+  stats[STAT_BLOOM_LOOKUPS] = td->bloom.lookups;
+  stats[STAT_BLOOM_NEGATIVES] = td->bloom.negatives;
+  stats[STAT_BLOOM_FALSE_POSITIVES] = td->bloom.false_positives;
+  const int open = handle_open(td);
+  stats[STAT_FILE_SIZE] = open ? td->be->fsiz(td->db) : 0;
+  stats[STAT_FRAGMENTATION] = open ? maintenance_fragmentation(td) : 0;
+  stats[STAT_DEFRAG_STEPS] = td->maint.defrag_steps;
+  stats[STAT_OPTIMIZES] = td->maint.optimizes;
+  stats[STAT_RECORDS] = open ? td->be->rnum(td->db) : 0;
+  stats[STAT_BYTES_READ] = td->bytes_read;
+  stats[STAT_BYTES_WRITTEN] = td->bytes_written;
+  stats[STAT_QUEUED_JOBS] = queued_jobs;
+  stats[STAT_MEMTABLE_RECORDS] =
+    (NULL == td->memtable) ? 0 : tcmaprnum(td->memtable);
+}
+
+/* Replies with a proplist of counters. */
+void toke_stats(TokeData *const td, ErlDrvTermData **const spec,
+                Reader *const reader, TokeJob *const job) {
+  ErlDrvTermData *const result = (ErlDrvTermData *)
+    driver_alloc(STATS_SPEC_LEN * sizeof(ErlDrvTermData));
+  job->dynamic_spec = result; /* freed along with the job */
+  if (NULL == result) {
+    job->failed = TRUE;
+    return;
+  }
+
+  uint64_t stats[STAT_COUNT];
+  erl_drv_mutex_lock(td->tp->mutex);
+  const uint64_t queued_jobs = td->tp->outstanding - 1; /* not this one */
+  erl_drv_mutex_unlock(td->tp->mutex);
+  stats_collect(td, stats, queued_jobs);
+
+  size_t len = 0;
+  result[len++] = ERL_DRV_ATOM;
+  result[len++] = toke_reply_atom;
+  for (int idx = 0; idx < STAT_COUNT; ++idx) {
+    result[len++] = ERL_DRV_ATOM;
+    result[len++] = stat_atoms[idx];
+    result[len++] = ERL_DRV_UINT;
+    result[len++] = (ErlDrvUInt)stats[idx];
+    result[len++] = ERL_DRV_TUPLE;
+    result[len++] = 2;
+  }
+
+  /* only the commands that have run */
+  result[len++] = ERL_DRV_ATOM;
+  result[len++] = latency_atom;
+  int commands = 0;
+  for (int idx = 0; idx < COMMAND_COUNT; ++idx) {
+    const Latency *const latency = &(td->latency[idx]);
+    if (0 == latency->count)
+      continue;
+    result[len++] = ERL_DRV_ATOM;
+    result[len++] = command_atoms[idx];
+    result[len++] = ERL_DRV_UINT;
+    result[len++] = (ErlDrvUInt)latency->count;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+      result[len++] = ERL_DRV_UINT;
+      result[len++] = (ErlDrvUInt)latency->buckets[bucket];
+    }
+    result[len++] = ERL_DRV_NIL;
+    result[len++] = ERL_DRV_LIST;
+    result[len++] = LATENCY_BUCKETS + 1;
+    result[len++] = ERL_DRV_TUPLE;
+    result[len++] = 3;
+    ++commands;
+  }
+  result[len++] = ERL_DRV_NIL;
+  result[len++] = ERL_DRV_LIST;
+  result[len++] = commands + 1;
+  result[len++] = ERL_DRV_TUPLE;
+  result[len++] = 2;
+
+  result[len++] = ERL_DRV_NIL;
+  result[len++] = ERL_DRV_LIST;
+  result[len++] = STAT_COUNT + 2;
+  result[len++] = ERL_DRV_TUPLE;
+  result[len++] = 2;
+
+  job->spec = result;
+  job->spec_len = len;
+}
+
+/* Deletes every record whose secondary key is the one given. */
+void toke_delete_by_secondary(TokeData *const td, ErlDrvTermData **const spec,
+                              Reader *const reader, TokeJob *const job) {
+  const uint64_t *secsize = NULL;
+  const char *sec = NULL;
+  if (NULL == td->db || 0 == td->secondary_position) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! read_binary(reader, &sec, &secsize)) {
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  TCMAP *const keys = secondary_keys(td, sec, *secsize);
+  if (NULL == keys) {
+    *spec = ok_atom_spec;
+    return;
+  }
+
+  int ok = TRUE;
+  const char *key = NULL;
+  int keysize = 0;
+  tcmapiterinit(keys);
+  while (NULL != (key = tcmapiternext(keys, &keysize))) {
+    optimize_dirty(td, key, keysize);
+    if (! (td->be->out(td->db, key, keysize) ||
+           TCENOREC == td->be->ecode(td->db))) {
+      ok = FALSE;
+      break;
+    }
+    tcmapout(td->by_primary, key, keysize);
+  }
+
+  if (ok) {
+    const uint64_t deleted = tcmaprnum(keys);
+    tcmapdel(keys);
+    tcmapout(td->by_secondary, sec, *secsize);
+    bloom_deleted(td, deleted);
+    *spec = ok_atom_spec;
+  } else {
+    /* keep just the keys we didn't get to */
+    TCMAP *const left = tcmapnew();
+    int size = 0;
+    tcmapiterinit(keys);
+    while (NULL != (key = tcmapiternext(keys, &keysize)))
+      if (NULL != tcmapget(td->by_primary, key, keysize, &size))
+        tcmapput(left, key, keysize, "", 0);
+    tcmapdel(keys);
+    if (0 == tcmaprnum(left)) {
+      tcmapdel(left);
+      tcmapout(td->by_secondary, sec, *secsize);
+    } else {
+      tcmapput(td->by_secondary, sec, *secsize, &left, sizeof(left));
+    }
+    return_tokyo_error(td, job, td->db);
+  }
+}
+
+/* Reads the value straight into a binary, which the reply hands over
+   to the emulator, so that it is copied just the once. *binary is left
+   NULL if the key is missing. FALSE if out of memory. */
+int get_binary(TokeData *const td, const char *const key,
+               const int keysize, ErlDrvBinary **const binary) {
+  int size = 0;
+  *binary = NULL;
+  if (! bloom_may_contain(td, key, keysize))
+    return TRUE;
+  const char *const entry =
+    (NULL == td->memtable) ? NULL :
+    (const char *)tcmapget(td->memtable, key, keysize, &size);
+  if (NULL != entry) {
+    if (MEMTABLE_PUT != entry[0]) {
+      if (NULL != td->bloom.bits)
+        ++(td->bloom.false_positives);
+      return TRUE;
+    }
+    if (NULL == (*binary = driver_alloc_binary(size - 1)))
+      return FALSE;
+    memcpy((*binary)->orig_bytes, entry + 1, size - 1);
+    td->bytes_read += size - 1;
+    return TRUE;
+  }
+
+  if (NULL != td->shared) {
+    /* the owner of a shared db can resize the value between a vsiz
+       and a get3, which would then truncate it, so it's got whole */
+    char *const value = td->be->get(td->db, key, keysize, &size);
+    if (NULL == value)
+      return TRUE;
+    if (NULL == (*binary = driver_alloc_binary(size))) {
+      free(value);
+      return FALSE;
+    }
+    memcpy((*binary)->orig_bytes, value, size);
+    free(value);
+    td->bytes_read += size;
+    return TRUE;
+  }
+
+  size = td->be->vsiz(td->db, key, keysize);
+  if (0 > size) {
+    if (NULL != td->bloom.bits)
+      ++(td->bloom.false_positives);
+    return TRUE;
+  }
+  if (NULL == (*binary = driver_alloc_binary(size)))
+    return FALSE;
+  if (size != td->be->get3(td->db, key, keysize, (*binary)->orig_bytes,
+                           size)) {
+    driver_free_binary(*binary); /* not yet handed to the emulator */
+    *binary = NULL;
+    return TRUE;
+  }
+  td->bytes_read += size;
+  return TRUE;
+}
+
+void toke_get(TokeData *const td, ErlDrvTermData **const spec,
+              Reader *const reader, TokeJob *const job) {
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+  } else {
+    const uint64_t *keysize = NULL;
+    const char *key = NULL;
+    if (read_binary(reader, &key, &keysize)) {
+      if (! get_binary(td, key, *keysize, &(job->binary))) {
+        job->failed = TRUE;
+      } else if (NULL == job->binary) {
+        *spec = not_found_atom_spec;
+      } else {
+        ErlDrvTermData *const result =
+          job_reply_template(job, td->tp->get_result_spec, GET_RESULT_SPEC_LEN);
+        result[3] = (ErlDrvTermData)job->binary;
+        result[4] = job->binary->orig_size;
+      }
+    } else {
+      return_reader_error(td, job, reader);
+    }
+  }
+}
+
+/* Replies with all the values in one term, in the order of the keys,
+   with not_found for missing keys. */
+void toke_get_multi(TokeData *const td, ErlDrvTermData **const spec,
+                    Reader *const reader, TokeJob *const job) {
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  }
+
+  const uint64_t *count = NULL;
+  if (! read_count(reader, &count)) {
+    return_reader_error(td, job, reader);
+    return;
+  }
+
+  /* both are freed along with the job */
+  ErlDrvBinary **const binaries = (ErlDrvBinary **)
+    driver_alloc((*count + 1) * sizeof(ErlDrvBinary *));
+  job->binaries = binaries;
+  ErlDrvTermData *const result = (ErlDrvTermData *)
+    driver_alloc(GET_MULTI_SPEC_LEN(*count) * sizeof(ErlDrvTermData));
+  job->dynamic_spec = result;
+  if (NULL == binaries || NULL == result) {
+    job->failed = TRUE;
+    return;
+  }
+
+  int ok = TRUE;
+  uint64_t found = 0;
+  size_t len = 0;
+  result[len++] = ERL_DRV_ATOM;
+  result[len++] = toke_reply_atom;
+  for (; found < *count; ++found) {
+    const uint64_t *keysize = NULL;
+    const char *key = NULL;
+    if (! read_binary(reader, &key, &keysize)) {
+      ok = FALSE;
+      break;
+    }
+    if (! get_binary(td, key, *keysize, &(binaries[found]))) {
+      job->failed = TRUE;
+      return;
+    }
+    job->binary_count = found + 1;
+    if (NULL == binaries[found]) {
+      result[len++] = ERL_DRV_ATOM;
+      result[len++] = not_found_atom;
+    } else {
+      result[len++] = ERL_DRV_BINARY;
+      result[len++] = (ErlDrvTermData)binaries[found];
+      result[len++] = binaries[found]->orig_size;
+      result[len++] = 0;
+    }
+  }
+  result[len++] = ERL_DRV_NIL;
+  result[len++] = ERL_DRV_LIST;
+  result[len++] = *count + 1;
+  result[len++] = ERL_DRV_TUPLE;
+  result[len++] = 2;
+
+  if (ok) {
+    job->spec = result;
+    job->spec_len = len;
+  } else {
+    return_reader_error(td, job, reader);
+  }
+}
+
+int toke_insert_multi(TokeData *const td, Reader *const reader,
+                      TokeJob *const job) {
+  const uint64_t *count = NULL;
+  if (! read_count(reader, &count))
+    return READER_ERROR;
+  for (uint64_t idx = 0; idx < *count; ++idx) {
+    const int rc = toke_do_insert(td, reader, job, td->be->put);
+    if (OK != rc)
+      return rc;
+  }
+  return OK;
+}
+
+/* Prepares for loading about records records into a new db: sizes
+   the bucket array for them, and turns off auto defrag, which can't be
+   turned back on until the db is reopened. Like tune, this must come
+   before open. */
+int toke_bulk_begin(TokeData *const td, Reader *const reader,
+                    TokeJob *const job) {
+  const uint64_t *records = NULL;
+  if (! read_uint64(reader, &records))
     return READER_ERROR;
-  }
+  td->bulk_records = *records;
+  /* TC suggests 0.5 to 4 times as many buckets as records */
+  const int64_t bnum = (0 == *records) ? -1 : (int64_t)(*records * 2);
+  td->df_unit = 0;
+  return (td->be->tune(td->db, bnum, td->tune_apow, td->tune_fpow,
+                    td->tune_opts) &&
+          td->be->setdfunit(td->db, 0)) ? OK : TOKYO_ERROR;
 }
 
-int toke_close(TokeData *const td, Reader *const reader,
-               const ErlDrvPort port) {
-  return tchdbclose(td->hdb) ? OK : TOKYO_ERROR;
+/* A batch of records, written without syncing. Like insert_async,
+   there is no reply, so errors are thrown away. */
+int toke_bulk_insert(TokeData *const td, Reader *const reader,
+                     TokeJob *const job) {
+  const uint64_t *count = NULL;
+  if (read_count(reader, &count))
+    for (uint64_t idx = 0; idx < *count; ++idx)
+      if (READER_ERROR == toke_do_insert(td, reader, job, td->be->putasync))
+        break;
+  return OK;
 }
 
-int toke_do_insert(TokeData *const td, Reader *const reader,
-                   const ErlDrvPort port,
-                   bool (*func)(TCHDB *hdb, const void *kbuf, int ksiz,
-                                const void *vbuf, int vsiz)) {
-  const uint64_t *keysize = NULL;
-  const char *key = NULL;
-  const uint64_t *valuesize = NULL;
-  const char *value = NULL;
-  return (read_binary(reader, &key, &keysize) &&
-          read_binary(reader, &value, &valuesize)) ?
-    ((func(td->hdb, key, *keysize, value, *valuesize)) ? OK : TOKYO_ERROR) :
-    READER_ERROR;
+/* Writes out what bulk_insert left buffered, with one sync. */
+int toke_bulk_end(TokeData *const td, Reader *const reader,
+                  TokeJob *const job) {
+  td->bulk_records = 0;
+  return td->be->sync(td->db) ? OK : TOKYO_ERROR;
 }
 
-int toke_insert(TokeData *const td, Reader *const reader,
-                const ErlDrvPort port) {
-  return toke_do_insert(td, reader, port, tchdbput);
+/* Defrag and optimize every interval ms, when idle, by up to step
+   records a time. Defragging stops once fragmentation is down to
+   target percent, and 0 turns it off. interval 0 turns maintenance
+   off. */
+int toke_set_maintenance(TokeData *const td, Reader *const reader,
+                         TokeJob *const job) {
+  const uint32_t *interval = NULL;
+  const uint32_t *step = NULL;
+  const uint32_t *target = NULL;
+  if (! (read_uint32(reader, &interval) && read_uint32(reader, &step) &&
+         read_uint32(reader, &target)))
+    return READER_ERROR;
+  td->maint.interval = *interval;
+  td->maint.step = (0 == *step) ? 1 : *step;
+  td->maint.target = *target;
+  if (0 == *interval)
+    optimize_end(td);
+  return OK;
 }
 
-int toke_insert_new(TokeData *const td, Reader *const reader,
-                    const ErlDrvPort port) {
-  return toke_do_insert(td, reader, port, tchdbputkeep);
+/* Starts an online optimize, which maintenance carries out, or has
+   a backend that does its own do it there and then. */
+void toke_optimize(TokeData *const td, ErlDrvTermData **const spec,
+                   Reader *const reader, TokeJob *const job) {
+  if (NULL != td->db && NULL != td->be->optimize) {
+    if (! handle_open(td))
+      *spec = invalid_state_atom_spec;
+    else if (! td->be->optimize(td->db))
+      return_tokyo_error(td, job, td->db);
+    else
+      *spec = ok_atom_spec;
+  } else if (NULL == td->db || 0 == td->maint.interval ||
+             ! optimize_begin(td)) {
+    *spec = invalid_state_atom_spec;
+  } else {
+    *spec = ok_atom_spec;
+  }
 }
 
-int toke_insert_concat(TokeData *const td, Reader *const reader,
-                       const ErlDrvPort port) {
-  return toke_do_insert(td, reader, port, tchdbputcat);
+int toke_delete_multi(TokeData *const td, Reader *const reader,
+                      TokeJob *const job) {
+  const uint64_t *count = NULL;
+  if (! read_count(reader, &count))
+    return READER_ERROR;
+  for (uint64_t idx = 0; idx < *count; ++idx) {
+    const int rc = toke_delete(td, reader, job);
+    if (OK != rc)
+      return rc;
+  }
+  return OK;
 }
 
-int toke_insert_async(TokeData *const td, Reader *const reader,
-                      const ErlDrvPort port) {
-  toke_do_insert(td, reader, port, tchdbputasync);
-  return OK; /* throw away any errors, because we're async throughout */
+/* The records are sent straight from the async thread; the final ok
+   comes from toke_ready_async, and so arrives after them. */
+int toke_get_all1(TokeData *const td, TokeJob *const job) {
+  TCXSTR *const key = tcxstrnew();
+  TCXSTR *const value = tcxstrnew();
+  ErlDrvTermData spec[ITER_RESULT_SPEC_LEN];
+  memcpy(spec, td->tp->iter_result_spec, sizeof(spec));
+  while (td->be->iternext3(td->db, key, value)) {
+    spec[3] = (ErlDrvTermData)(tcxstrptr(key));
+    spec[4] = tcxstrsize(key);
+    spec[6] = (ErlDrvTermData)(tcxstrptr(value));
+    spec[7] = tcxstrsize(value);
+    td->bytes_read += tcxstrsize(key) + tcxstrsize(value);
+    driver_send_term(td->tp->port, td->tp->owner, spec, ITER_RESULT_SPEC_LEN);
+  }
+  tcxstrdel(value);
+  tcxstrdel(key);
+  return OK;
 }
 
-int toke_delete(TokeData *const td, Reader *const reader,
-                const ErlDrvPort port) {
-  const uint64_t *keysize = NULL;
-  const char *key = NULL;
-  if (read_binary(reader, &key, &keysize)) {
-    if (tchdbout(td->hdb, key, *keysize) || TCENOREC == tchdbecode(td->hdb)) {
-      return OK;
-    } else {
-      return TOKYO_ERROR;
-    }
-  } else {
-    return READER_ERROR;
+int toke_get_all(TokeData *const td, Reader *const reader,
+                 TokeJob *const job) {
+  td->cursor = 0; /* we're about to move the iterator from under it */
+  optimize_restart(td);
+  return (td->be->iterinit(td->db)) ? toke_get_all1(td, job) : TOKYO_ERROR;
+}
+
+/* Replies with a new cursor, which TC's iterator is now placed for.
+   It starts at start, or the start of the db if that's NULL, and
+   stops before end, or runs to the end of the db if end is NULL. */
+void iter_opened(TokeData *const td, TokeJob *const job,
+                 const char *const start, const uint64_t start_size,
+                 const char *const end, const uint64_t end_size) {
+  Cursor *const cursor = (Cursor *)driver_alloc(sizeof(Cursor));
+  if (NULL == cursor) {
+    job->failed = TRUE;
+    return;
+  }
+  cursor->id = ++(td->cursor_serial);
+  cursor->at = NULL;
+  cursor->after = FALSE;
+  cursor->end = NULL;
+  cursor->order =
+    (NULL == td->be->iterorder) ? 0 : td->be->iterorder(td->db);
+  if (NULL != start) {
+    cursor->at = tcxstrnew();
+    tcxstrcat(cursor->at, start, (int)start_size);
   }
+  if (NULL != end) {
+    cursor->end = tcxstrnew();
+    tcxstrcat(cursor->end, end, (int)end_size);
+  }
+  cursor->next = td->cursors;
+  td->cursors = cursor;
+  td->cursor = cursor->id;
+  job->reply[0] = ERL_DRV_ATOM;
+  job->reply[1] = toke_reply_atom;
+  job->reply[2] = ERL_DRV_UINT;
+  job->reply[3] = (ErlDrvUInt)cursor->id;
+  job->reply[4] = ERL_DRV_TUPLE;
+  job->reply[5] = 2;
+  job->spec = job->reply;
+  job->spec_len = CURSOR_SPEC_LEN;
 }
 
-int toke_delete_if_eq(TokeData *const td, Reader *const reader,
-                      const ErlDrvPort port) {
-  const uint64_t *keysize = NULL;
-  const char *key = NULL;
-  const uint64_t *valuesize = NULL;
-  const char *value = NULL;
-  if (read_binary(reader, &key, &keysize) &&
-      read_binary(reader, &value, &valuesize)) {
-    int found_valuesize = 0;
-    char *const found_value = tchdbget(td->hdb, key, *keysize, &found_valuesize);
-    if (NULL == found_value) {
-      return OK;
-    } else {
-      if (*valuesize == found_valuesize &&
-          0 == memcmp(value, found_value, found_valuesize)) {
-        return tchdbout(td->hdb, key, *keysize) ? OK : TOKYO_ERROR;
-      } else {
-        return OK;
-      }
-    }
+/* Replies with the new cursor. Other cursors stay open. */
+void toke_iter_open(TokeData *const td, ErlDrvTermData **const spec,
+                    Reader *const reader, TokeJob *const job) {
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+  } else if (optimize_restart(td), ! td->be->iterinit(td->db)) {
+    return_tokyo_error(td, job, td->db);
   } else {
-    return READER_ERROR;
+    iter_opened(td, job, NULL, 0, NULL, 0);
   }
 }
 
-void toke_get(TokeData *const td, ErlDrvTermData **const spec,
-              Reader *const reader, const ErlDrvPort port) {
-  if (NULL == td->hdb) {
+/* As toke_iter_open, but the cursor starts at the first key not less
+   than start, and if bounded, stops before the first not less than
+   end. Only the backends that keep their keys in order have them. */
+void toke_iter_range(TokeData *const td, ErlDrvTermData **const spec,
+                     Reader *const reader, TokeJob *const job) {
+  const char *start = NULL;
+  const uint64_t *start_size = NULL;
+  const uint8_t *bounded = NULL;
+  const char *end = NULL;
+  const uint64_t *end_size = NULL;
+  if (NULL == td->db || NULL == td->be->iterjump) {
     *spec = invalid_state_atom_spec;
+  } else if (! (read_binary(reader, &start, &start_size) &&
+                read_uint8(reader, &bounded) &&
+                read_binary(reader, &end, &end_size))) {
+    return_reader_error(td, job, reader);
+  } else if (optimize_restart(td),
+             ! td->be->iterjump(td->db, start, (int)*start_size)) {
+    return_tokyo_error(td, job, td->db);
   } else {
-    const uint64_t *keysize = NULL;
-    const char *key = NULL;
-    int valuesize = 0;
-    if (read_binary(reader, &key, &keysize)) {
-      char *const value = tchdbget(td->hdb, key, *keysize, &valuesize);
-      if (NULL == value) {
-        *spec = not_found_atom_spec;
-      } else {
-        td->get_result_spec[3] = (ErlDrvTermData)value;
-        td->get_result_spec[4] = valuesize;
-        driver_output_term(port, td->get_result_spec, GET_RESULT_SPEC_LEN);
-        td->get_result_spec[3] = (ErlDrvTermData)NULL;
-        td->get_result_spec[4] = 0;
-        free(value);
-      }
-    } else {
-      return_reader_error(td, port, reader);
-    }
+    iter_opened(td, job, start, *start_size,
+                *bounded ? end : NULL, *end_size);
   }
 }
 
-int toke_get_all1(TokeData *const td, const ErlDrvPort port) {
+/* The cursor is NULL if it has been closed, or its db has. */
+int read_cursor(TokeData *const td, Reader *const reader,
+                Cursor **const cursor) {
+  const uint64_t *id = NULL;
+  if (! read_uint64(reader, &id))
+    return FALSE;
+  *cursor = cursor_find(td, *id);
+  return TRUE;
+}
+
+/* Replies with up to n records, as one list. An empty list means the
+   cursor is exhausted. A cursor that has lost its place replies
+   invalid_state, as does one that's been closed. */
+void toke_iter_next(TokeData *const td, ErlDrvTermData **const spec,
+                    Reader *const reader, TokeJob *const job) {
+  Cursor *cursor = NULL;
+  const uint64_t *n = NULL;
+  int skip = FALSE;
+  if (NULL == td->db) {
+    *spec = invalid_state_atom_spec;
+    return;
+  } else if (! (read_cursor(td, reader, &cursor) &&
+                read_uint64(reader, &n))) {
+    return_reader_error(td, job, reader);
+    return;
+  } else if (NULL == cursor || ! cursor_place(td, cursor, &skip)) {
+    *spec = invalid_state_atom_spec;
+    return;
+  }
+
+  const uint64_t max = *n < ITER_NEXT_MAX ? *n : ITER_NEXT_MAX;
+  /* both are freed along with the job */
+  ErlDrvBinary **const binaries = (ErlDrvBinary **)
+    driver_alloc((max + 1) * sizeof(ErlDrvBinary *));
+  job->binaries = binaries;
+  ErlDrvTermData *const result = (ErlDrvTermData *)
+    driver_alloc(ITER_NEXT_SPEC_LEN(max) * sizeof(ErlDrvTermData));
+  job->dynamic_spec = result;
+  if (NULL == binaries || NULL == result) {
+    job->failed = TRUE;
+    return;
+  }
+
   TCXSTR *const key = tcxstrnew();
   TCXSTR *const value = tcxstrnew();
-  while (tchdbiternext3(td->hdb, key, value)) {
-    td->iter_result_spec[3] = (ErlDrvTermData)(tcxstrptr(key));
-    td->iter_result_spec[4] = tcxstrsize(key);
-    td->iter_result_spec[6] = (ErlDrvTermData)(tcxstrptr(value));
-    td->iter_result_spec[7] = tcxstrsize(value);
-    driver_output_term(port, td->iter_result_spec, ITER_RESULT_SPEC_LEN);
-  }
-  td->iter_result_spec[3] = (ErlDrvTermData)NULL;
-  td->iter_result_spec[4] = 0;
-  td->iter_result_spec[6] = (ErlDrvTermData)NULL;
-  td->iter_result_spec[7] = 0;
+  uint64_t found = 0;
+  int last_keysize = 0;
+  size_t len = 0;
+  result[len++] = ERL_DRV_ATOM;
+  result[len++] = toke_reply_atom;
+  while (found < max && td->be->iternext3(td->db, key, value)) {
+    if (skip) { /* it's been given already */
+      skip = FALSE;
+      if (cursor_is_at(cursor, key))
+        continue;
+    }
+    if (cursor_at_end(cursor, key))
+      break;
+    /* key and value are reused, so copy both out into one binary,
+       which the key and value then share */
+    const int keysize = tcxstrsize(key);
+    const int valuesize = tcxstrsize(value);
+    ErlDrvBinary *const record = driver_alloc_binary(keysize + valuesize);
+    if (NULL == record) {
+      job->failed = TRUE;
+      break;
+    }
+    memcpy(record->orig_bytes, tcxstrptr(key), keysize);
+    memcpy(record->orig_bytes + keysize, tcxstrptr(value), valuesize);
+    binaries[found++] = record;
+    job->binary_count = found;
+    last_keysize = keysize;
+    td->bytes_read += keysize + valuesize;
+
+    result[len++] = ERL_DRV_BINARY;
+    result[len++] = (ErlDrvTermData)record;
+    result[len++] = keysize;
+    result[len++] = 0;
+    result[len++] = ERL_DRV_BINARY;
+    result[len++] = (ErlDrvTermData)record;
+    result[len++] = valuesize;
+    result[len++] = keysize;
+    result[len++] = ERL_DRV_TUPLE;
+    result[len++] = 2;
+  }
   tcxstrdel(value);
   tcxstrdel(key);
-  return OK;
+  if (0 < found) {
+    if (NULL == cursor->at)
+      cursor->at = tcxstrnew();
+    tcxstrclear(cursor->at);
+    tcxstrcat(cursor->at, binaries[found - 1]->orig_bytes, last_keysize);
+    cursor->after = TRUE;
+  }
+  result[len++] = ERL_DRV_NIL;
+  result[len++] = ERL_DRV_LIST;
+  result[len++] = found + 1;
+  result[len++] = ERL_DRV_TUPLE;
+  result[len++] = 2;
+
+  job->spec = result;
+  job->spec_len = len;
 }
 
-int toke_get_all(TokeData *const td, Reader *const reader,
-                 const ErlDrvPort port) {
-  return (tchdbiterinit(td->hdb)) ? toke_get_all1(td, port) : TOKYO_ERROR;
+int toke_iter_close(TokeData *const td, Reader *const reader,
+                    TokeJob *const job) {
+  Cursor *cursor = NULL;
+  if (! read_cursor(td, reader, &cursor))
+    return READER_ERROR;
+  if (NULL != cursor)
+    cursor_free(td, cursor);
+  return OK; /* closing a stale cursor is harmless */
 }
 
-static void toke_outputv(ErlDrvData drv_data, ErlIOVec *const ev) {
+/*******************
+ *  Job Functions  *
+ *******************/
+
+/* The ErlIOVec we're given is only valid for the duration of
+   outputv, so the job takes its own refs on the binaries. */
+TokeJob *toke_job_alloc(TokePort *const tp) {
+  TokeJob *const job = (TokeJob *)driver_alloc(sizeof(TokeJob));
+  if (NULL == job)
+    return NULL;
+
+  job->tp = tp;
+  job->td = NULL;
+  job->ev.vsize = 0;
+  job->ev.size = 0;
+  job->ev.iov = NULL;
+  job->ev.binv = NULL;
+  job->spec = NULL;
+  job->spec_len = 0;
+  job->dynamic_spec = NULL;
+  job->value = NULL;
+  job->binary = NULL;
+  job->binaries = NULL;
+  job->binary_count = 0;
+  job->failed = FALSE;
+  job->deferred = FALSE;
+  job->committed = FALSE;
+  job->commit_error = NULL;
+  job->opened_group = FALSE;
+  job->filled_memtable = FALSE;
+  job->next = NULL;
+  job->wake_ms = 0;
+  job->removed = NULL;
+  job->queued = 0;
+  return job;
+}
+
+/* Microseconds, only ever differenced. */
+uint64_t now_us(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return ((uint64_t)now.tv_sec * 1000000) + now.tv_usec;
+}
+
+void latency_record(TokeData *const td, const uint8_t command,
+                    const uint64_t queued) {
+  if (COMMAND_COUNT <= command)
+    return;
+  const uint64_t now = now_us();
+  uint64_t us = (now > queued) ? now - queued : 0; /* the clock can step */
+  int bucket = 0;
+  for (; 0 < us && bucket < LATENCY_BUCKETS - 1; us >>= 1)
+    ++bucket;
+  ++(td->latency[command].count);
+  ++(td->latency[command].buckets[bucket]);
+}
+
+TokeJob *toke_job_new(TokePort *const tp, const ErlIOVec *const ev) {
+  TokeJob *const job = toke_job_alloc(tp);
+  if (NULL == job)
+    return NULL;
+  job->queued = now_us();
+
+  job->ev.vsize = ev->vsize;
+  job->ev.size = ev->size;
+  job->ev.iov = (SysIOVec *)driver_alloc(ev->vsize * sizeof(SysIOVec));
+  job->ev.binv =
+    (ErlDrvBinary **)driver_alloc(ev->vsize * sizeof(ErlDrvBinary *));
+  if (NULL == job->ev.iov || NULL == job->ev.binv) {
+    driver_free(job->ev.iov);
+    driver_free(job->ev.binv);
+    driver_free(job);
+    return NULL;
+  }
+
+  for (int idx = 0; idx < ev->vsize; ++idx) {
+    job->ev.iov[idx] = ev->iov[idx];
+    job->ev.binv[idx] = ev->binv[idx];
+    if (NULL != ev->binv[idx])
+      driver_binary_inc_refc(ev->binv[idx]);
+  }
+  return job;
+}
+
+/* Also the async_free callback: must not touch job->tp or job->td,
+   which may have gone. */
+void toke_job_free(void *const data) {
+  TokeJob *const job = (TokeJob *)data;
+  for (int idx = 0; idx < job->ev.vsize; ++idx)
+    if (NULL != job->ev.binv[idx])
+      driver_free_binary(job->ev.binv[idx]);
+  if (NULL != job->ev.iov)
+    driver_free(job->ev.iov);
+  if (NULL != job->ev.binv)
+    driver_free(job->ev.binv);
+
+  /* the emulator holds its own references to any binaries it was
+     sent */
+  free(job->value);
+  if (NULL != job->binary)
+    driver_free_binary(job->binary);
+  for (uint64_t idx = 0; idx < job->binary_count; ++idx)
+    if (NULL != job->binaries[idx]) /* not_found */
+      driver_free_binary(job->binaries[idx]);
+  if (NULL != job->binaries)
+    driver_free(job->binaries);
+  if (NULL != job->dynamic_spec)
+    driver_free(job->dynamic_spec);
+  driver_free(job);
+}
+
+/* Runs on an async thread, at the end of every job. */
+void toke_job_done(TokePort *const tp) {
+  erl_drv_mutex_lock(tp->mutex);
+  if (0 == --(tp->outstanding))
+    erl_drv_cond_signal(tp->cond);
+  erl_drv_mutex_unlock(tp->mutex);
+}
+
+void toke_job_queue(TokePort *const tp, TokeJob *const job,
+                    void (*const run)(void *)) {
+  erl_drv_mutex_lock(tp->mutex);
+  ++(tp->outstanding);
+  erl_drv_mutex_unlock(tp->mutex);
+  driver_async(tp->port, &(tp->async_key), run, job, toke_job_free);
+}
+
+/* The sooner of two timer delays, 0 being never. */
+uint32_t wake_min(const uint32_t a, const uint32_t b) {
+  return (0 == a || (0 != b && b < a)) ? b : a;
+}
+
+/* When the handle next wants a tick: to flush the memtable the job
+   started filling, to rebuild a stale Bloom filter, or for a
+   maintenance step. */
+uint32_t handle_wake(const TokeData *const td, const TokeJob *const job) {
+  return wake_min(wake_min(job->filled_memtable ? td->memtable_interval : 0,
+                           td->bloom.stale ? BLOOM_REBUILD_MS : 0),
+                  td->maint.interval);
+}
+
+/****************************
+ *  Group Commit Functions  *
+ ****************************/
+
+int group_write(const uint8_t command) {
+  switch (command) {
+  case TOKE_INSERT:
+  case TOKE_INSERT_NEW:
+  case TOKE_INSERT_CONCAT:
+  case TOKE_INSERT_ASYNC:
+  case TOKE_DELETE:
+  case TOKE_DELETE_IF_EQ:
+  case TOKE_INSERT_MULTI:
+  case TOKE_DELETE_MULTI:
+  case TOKE_DELETE_BY_SECONDARY:
+  case TOKE_CAS:
+  case TOKE_MERGE:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+/* Reads and writes may join an open group transaction, and have their
+   replies held until it commits, so that replies still arrive in
+   order. Only writes start one. Anything else commits it first. */
+int group_joinable(const uint8_t command) {
+  switch (command) {
+  case TOKE_GET:
+  case TOKE_GET_MULTI:
+  case TOKE_ITER_OPEN:
+  case TOKE_ITER_RANGE:
+  case TOKE_ITER_NEXT:
+  case TOKE_ITER_CLOSE:
+  case TOKE_STATS:
+    return TRUE;
+  default:
+    return group_write(command);
+  }
+}
+
+/* Runs on an async thread. Commits every handle in the group; if
+   any fail, the first failure is the group's. */
+void group_commit(TokePort *const tp, TokeJob *const job) {
+  job->committed = TRUE;
+  for (uint32_t id = 0; id < tp->handle_slots; ++id) {
+    TokeData *const td = tp->handles[id];
+    if (NULL == td || ! td->in_group)
+      continue;
+    if (! td->be->trancommit(td->db)) {
+      if (NULL == job->commit_error)
+        job->commit_error = tcerrmsg(td->be->ecode(td->db));
+      td->be->tranabort(td->db);
+      tran_aborted(td);
+    }
+    td->in_group = FALSE;
+  }
+  tp->group_open = FALSE;
+  tp->group_writes = 0;
+}
+
+/* Whether job is the only one queued. */
+int group_queue_empty(TokePort *const tp) {
+  erl_drv_mutex_lock(tp->mutex);
+  const int empty = 1 == tp->outstanding;
+  erl_drv_mutex_unlock(tp->mutex);
+  return empty;
+}
+
+/* A write to a handle not yet in the group brings it in. */
+void group_before(TokeData *const td, TokeJob *const job,
+                  const uint8_t command) {
+  TokePort *const tp = td->tp;
+  if (tp->group_open && ! group_joinable(command)) {
+    group_commit(tp, job);
+  } else if (! td->in_group && 0 != tp->group_max && ! td->in_transaction &&
+             NULL != td->db && group_write(command) &&
+             td->be->tranbegin(td->db)) {
+    td->in_group = TRUE;
+    job->opened_group = ! tp->group_open;
+    tp->group_open = TRUE;
+  }
+}
+
+void group_after(TokeData *const td, TokeJob *const job,
+                 const uint8_t command) {
+  TokePort *const tp = td->tp;
+  if (! tp->group_open)
+    return;
+  job->deferred = NULL != job->spec;
+  if (group_write(command))
+    ++(tp->group_writes);
+  if (tp->group_writes >= tp->group_max ||
+      (0 == tp->group_window && group_queue_empty(tp)))
+    group_commit(tp, job);
+}
+
+/* Runs on an async thread, when the timer fires. Maintenance and
+   Bloom filter rebuilds only run when nothing else is waiting. */
+void toke_tick_run(void *const data) {
+  TokeJob *const job = (TokeJob *)data;
+  TokePort *const tp = job->tp;
+  for (uint32_t id = 0; id < tp->handle_slots; ++id)
+    if (NULL != tp->handles[id] && NULL != tp->handles[id]->db)
+      memtable_flush(tp->handles[id]);
+  if (tp->group_open)
+    group_commit(tp, job);
+  if (group_queue_empty(tp)) {
+    for (uint32_t id = 0; id < tp->handle_slots; ++id) {
+      TokeData *const td = tp->handles[id];
+      if (NULL == td || NULL == td->db)
+        continue;
+      if (maintenance_step(td))
+        job->wake_ms = wake_min(job->wake_ms, td->maint.interval);
+      bloom_step(td);
+    }
+  }
+  /* one left stale, behind a cursor or the queue, waits for another */
+  for (uint32_t id = 0; id < tp->handle_slots; ++id)
+    if (NULL != tp->handles[id] && tp->handles[id]->bloom.stale)
+      job->wake_ms = wake_min(job->wake_ms, BLOOM_REBUILD_MS);
+  toke_job_done(tp);
+}
+
+/* The rest run in the emulator thread. */
+void group_hold(TokePort *const tp, TokeJob *const job) {
+  job->next = NULL;
+  if (NULL == tp->held_tail)
+    tp->held_head = job;
+  else
+    tp->held_tail->next = job;
+  tp->held_tail = job;
+}
+
+/* Sends the held replies, or if the commit failed, its error in
+   place of each. */
+void group_release(TokePort *const tp, const char *const error) {
+  while (NULL != tp->held_head) {
+    TokeJob *const job = tp->held_head;
+    tp->held_head = job->next;
+    if (NULL != error) {
+      ErlDrvTermData *const spec =
+        job_reply_template(job, tp->tokyo_error_spec, TOKYO_ERROR_SPEC_LEN);
+      spec[5] = (ErlDrvTermData)error;
+      spec[6] = (ErlDrvUInt)strlen(error);
+    }
+    driver_output_term(tp->port, job->spec, job->spec_len);
+    toke_job_free(job);
+  }
+  tp->held_tail = NULL;
+}
+
+/* Arms the timer for ms, unless it'll fire sooner anyway. Firing
+   early is harmless: there's just less to commit or flush. */
+void toke_arm_timer(TokePort *const tp, const uint32_t ms) {
+  if (0 == ms || (tp->timer_armed && tp->timer_ms <= ms))
+    return;
+  driver_set_timer(tp->port, ms);
+  tp->timer_armed = TRUE;
+  tp->timer_ms = ms;
+}
+
+/* Runs on an async thread. */
+void toke_job_run(void *const data) {
   Reader reader;
   ErlDrvTermData* spec = NULL;
   const uint8_t* command = &toke_invalid_command;
-  TokeData *const td = (TokeData*)drv_data;
-  ErlDrvPort port = td->port;
+  TokeJob *const job = (TokeJob *)data;
+  TokePort *const tp = job->tp;
+  TokeData *td = NULL;
+  const uint32_t *id = NULL;
+  ErlIOVec *const ev = &(job->ev);
   /* dump_ev(ev); */
   make_reader(ev, &reader);
-  if (read_uint8(&reader, &command)) {
+  if (! (read_uint32(&reader, &id) && read_uint8(&reader, &command))) {
+    return_reader_error(NULL, job, &reader);
+  } else if (tp->handle_slots <= *id || NULL == tp->handles[*id]) {
+    spec = no_such_handle_atom_spec;
+  } else if (! handle_accepts(tp->handles[*id], *command)) {
+    td = job->td = tp->handles[*id];
+    spec = invalid_state_atom_spec;
+  } else if (maintenance_refuses(tp->handles[*id], *command)) {
+    td = job->td = tp->handles[*id];
+    if (TOKE_INSERT_ASYNC != *command && TOKE_BULK_INSERT != *command)
+      return_tokyo_ecode(job, td->maint.lost);
+  } else if (backend_lacks(tp->handles[*id], *command)) {
+    td = job->td = tp->handles[*id];
+    spec = unsupported_atom_spec;
+  } else {
+    td = job->td = tp->handles[*id];
+    if (NULL != td->db)
+      memtable_before(td, *command);
+    group_before(td, job, *command);
     switch (*command) {
 
     case TOKE_NEW:
-      toke_new(td, &spec, &reader, port);
+      toke_new(td, &spec, &reader, job);
       break;
 
     case TOKE_DEL:
-      toke_del(td, &spec, &reader, port);
+      toke_del(td, &spec, &reader, job);
       break;
 
     case TOKE_TUNE:
-      toke_with_hdb(td, &spec, &reader, port, toke_tune);
+      toke_with_db(td, &spec, &reader, job, toke_tune);
       break;
 
     case TOKE_SET_CACHE:
-      toke_with_hdb(td, &spec, &reader, port, toke_set_cache);
+      toke_with_db(td, &spec, &reader, job, toke_set_cache);
       break;
 
     case TOKE_SET_XM_SIZE:
-      toke_with_hdb(td, &spec, &reader, port, toke_set_xm_size);
+      toke_with_db(td, &spec, &reader, job, toke_set_xm_size);
       break;
 
     case TOKE_SET_DF_UNIT:
-      toke_with_hdb(td, &spec, &reader, port, toke_set_df_unit);
+      toke_with_db(td, &spec, &reader, job, toke_set_df_unit);
       break;
 
     case TOKE_OPEN:
-      toke_with_hdb(td, &spec, &reader, port, toke_open);
+      toke_with_db(td, &spec, &reader, job, toke_open);
       break;
 
     case TOKE_CLOSE:
-      toke_with_hdb(td, &spec, &reader, port, toke_close);
+      if (shared_read(td)) /* it'd close under their gets */
+        spec = invalid_state_atom_spec;
+      else
+        toke_with_db(td, &spec, &reader, job, toke_close);
       break;
 
     case TOKE_INSERT:
-      toke_with_hdb(td, &spec, &reader, port, toke_insert);
+      toke_with_db(td, &spec, &reader, job, toke_insert);
       break;
 
     case TOKE_INSERT_NEW:
-      toke_with_hdb(td, &spec, &reader, port, toke_insert_new);
+      toke_with_db(td, &spec, &reader, job, toke_insert_new);
       break;
 
     case TOKE_INSERT_CONCAT:
-      toke_with_hdb(td, &spec, &reader, port, toke_insert_concat);
+      toke_with_db(td, &spec, &reader, job, toke_insert_concat);
       break;
 
     case TOKE_INSERT_ASYNC:
-      toke_with_hdb(td, &spec, &reader, port, toke_insert_async);
-      return; /* return immediately because it's async */
+      toke_with_db(td, &spec, &reader, job, toke_insert_async);
+      spec = NULL; /* no reply because it's async */
+      break;
 
     case TOKE_DELETE:
-      toke_with_hdb(td, &spec, &reader, port, toke_delete);
+      toke_with_db(td, &spec, &reader, job, toke_delete);
       break;
 
     case TOKE_DELETE_IF_EQ:
-      toke_with_hdb(td, &spec, &reader, port, toke_delete_if_eq);
+      toke_with_db(td, &spec, &reader, job, toke_delete_if_eq);
       break;
 
     case TOKE_GET:
-      toke_get(td, &spec, &reader, port);
+      toke_get(td, &spec, &reader, job);
       break;
 
     case TOKE_GET_ALL:
-      toke_with_hdb(td, &spec, &reader, port, toke_get_all);
+      toke_with_db(td, &spec, &reader, job, toke_get_all);
+      break;
+
+    case TOKE_GET_MULTI:
+      toke_get_multi(td, &spec, &reader, job);
+      break;
+
+    case TOKE_INSERT_MULTI:
+      toke_with_db(td, &spec, &reader, job, toke_insert_multi);
+      break;
+
+    case TOKE_DELETE_MULTI:
+      toke_with_db(td, &spec, &reader, job, toke_delete_multi);
+      break;
+
+    case TOKE_ITER_OPEN:
+      toke_iter_open(td, &spec, &reader, job);
+      break;
+
+    case TOKE_ITER_NEXT:
+      toke_iter_next(td, &spec, &reader, job);
+      break;
+
+    case TOKE_ITER_CLOSE:
+      toke_with_db(td, &spec, &reader, job, toke_iter_close);
+      break;
+
+    case TOKE_SET_SECONDARY:
+      toke_with_db(td, &spec, &reader, job, toke_set_secondary);
+      break;
+
+    case TOKE_DELETE_BY_SECONDARY:
+      toke_delete_by_secondary(td, &spec, &reader, job);
+      break;
+
+    case TOKE_CAS:
+      toke_cas(td, &spec, &reader, job);
+      break;
+
+    case TOKE_MERGE:
+      toke_merge(td, &spec, &reader, job);
+      break;
+
+    case TOKE_TRAN_BEGIN:
+      toke_tran_begin(td, &spec, &reader, job);
+      break;
+
+    case TOKE_TRAN_COMMIT:
+      toke_tran_end(td, &spec, job, td->be->trancommit);
+      break;
+
+    case TOKE_TRAN_ABORT:
+      toke_tran_end(td, &spec, job, td->be->tranabort);
+      break;
+
+    case TOKE_SET_GROUP_COMMIT:
+      toke_with_db(td, &spec, &reader, job, toke_set_group_commit);
+      break;
+
+    case TOKE_SET_MEMTABLE:
+      toke_with_db(td, &spec, &reader, job, toke_set_memtable);
+      break;
+
+    case TOKE_SET_BLOOM:
+      toke_with_db(td, &spec, &reader, job, toke_set_bloom);
+      break;
+
+    case TOKE_STATS:
+      toke_stats(td, &spec, &reader, job);
+      break;
+
+    case TOKE_BULK_BEGIN:
+      toke_with_db(td, &spec, &reader, job, toke_bulk_begin);
+      break;
+
+    case TOKE_BULK_INSERT:
+      toke_with_db(td, &spec, &reader, job, toke_bulk_insert);
+      spec = NULL; /* no reply because it's async */
+      break;
+
+    case TOKE_BULK_END:
+      toke_with_db(td, &spec, &reader, job, toke_bulk_end);
+      break;
+
+    case TOKE_SET_MAINTENANCE:
+      toke_with_db(td, &spec, &reader, job, toke_set_maintenance);
+      break;
+
+    case TOKE_OPTIMIZE:
+      toke_optimize(td, &spec, &reader, job);
+      break;
+
+    case TOKE_ADD_HANDLE:
+      toke_add_handle(td, &spec, &reader, job);
+      break;
+
+    case TOKE_REMOVE_HANDLE:
+      toke_remove_handle(td, &spec, &reader, job);
+      break;
+
+    case TOKE_SHARE:
+      toke_share(td, &spec, &reader, job);
+      break;
+
+    case TOKE_ATTACH:
+      toke_attach(td, &spec, &reader, job);
+      break;
+
+    case TOKE_ITER_RANGE:
+      toke_iter_range(td, &spec, &reader, job);
       break;
 
     default:
       spec = no_such_command_atom_spec;
     }
+  }
+
+  if (NULL != spec)
+    job_reply(job, spec);
+  if (NULL != td) {
+    group_after(td, job, *command);
+    latency_record(td, *command, job->queued);
+    if (NULL != job->removed)
+      handle_free(job->removed);
+    else
+      job->wake_ms = handle_wake(td, job);
+  }
+
+  toke_job_done(tp);
+}
+
+/********************
+ *  Call Functions  *
+ ********************/
+
+/* erlang:port_call runs gets, multi-gets and stats there and then,
+   in the calling process, and returns what the job would have sent,
+   without the trip through the owner's mailbox. That's only safe
+   while the port has no job queued or running, as a job could be
+   using the handle, and no group transaction open, as a get would
+   see writes yet to be replied to. Otherwise, and for any other
+   command, it returns busy, and the caller sends the command as
+   usual. Errors are left to that path too. */
+
+void call_value(EtfBuffer *const eb, ErlDrvBinary *const binary) {
+  if (NULL == binary) {
+    etf_write_atom(eb, "not_found");
   } else {
-    return_reader_error(td, port, &reader);
+    etf_write_binary(eb, binary->orig_bytes, binary->orig_size);
+    driver_free_binary(binary);
+  }
+}
+
+int call_get(TokeData *const td, Reader *const reader,
+             EtfBuffer *const eb) {
+  const uint64_t *keysize = NULL;
+  const char *key = NULL;
+  ErlDrvBinary *binary = NULL;
+  if (NULL == td->db || ! read_binary(reader, &key, &keysize) ||
+      ! get_binary(td, key, *keysize, &binary))
+    return FALSE;
+  call_value(eb, binary);
+  return TRUE;
+}
+
+int call_get_multi(TokeData *const td, Reader *const reader,
+                   EtfBuffer *const eb) {
+  const uint64_t *count = NULL;
+  if (NULL == td->db || ! read_count(reader, &count) || UINT32_MAX < *count)
+    return FALSE;
+  if (0 < *count)
+    etf_write_header(eb, ETF_LIST, *count, 4);
+  for (uint64_t idx = 0; idx < *count; ++idx) {
+    const uint64_t *keysize = NULL;
+    const char *key = NULL;
+    ErlDrvBinary *binary = NULL;
+    if (! (read_binary(reader, &key, &keysize) &&
+           get_binary(td, key, *keysize, &binary)))
+      return FALSE;
+    call_value(eb, binary);
+  }
+  etf_write_header(eb, ETF_NIL, 0, 0);
+  return TRUE;
+}
+
+/* As toke_stats. */
+int call_stats(TokeData *const td, Reader *const reader,
+               EtfBuffer *const eb) {
+  uint64_t stats[STAT_COUNT];
+  stats_collect(td, stats, 0);
+  etf_write_header(eb, ETF_LIST, STAT_COUNT + 1, 4);
+  for (int idx = 0; idx < STAT_COUNT; ++idx) {
+    etf_write_header(eb, ETF_SMALL_TUPLE, 2, 1);
+    etf_write_atom(eb, stat_names[idx]);
+    etf_write_uint(eb, stats[idx]);
+  }
+
+  uint32_t commands = 0;
+  for (int idx = 0; idx < COMMAND_COUNT; ++idx)
+    if (0 != td->latency[idx].count)
+      ++commands;
+  etf_write_header(eb, ETF_SMALL_TUPLE, 2, 1);
+  etf_write_atom(eb, "latency");
+  if (0 < commands)
+    etf_write_header(eb, ETF_LIST, commands, 4);
+  for (int idx = 0; idx < COMMAND_COUNT; ++idx) {
+    const Latency *const latency = &(td->latency[idx]);
+    if (0 == latency->count)
+      continue;
+    etf_write_header(eb, ETF_SMALL_TUPLE, 3, 1);
+    etf_write_atom(eb, command_names[idx]);
+    etf_write_uint(eb, latency->count);
+    etf_write_header(eb, ETF_LIST, LATENCY_BUCKETS, 4);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+      etf_write_uint(eb, latency->buckets[bucket]);
+    etf_write_header(eb, ETF_NIL, 0, 0);
+  }
+  etf_write_header(eb, ETF_NIL, 0, 0);
+  etf_write_header(eb, ETF_NIL, 0, 0);
+  return TRUE;
+}
+
+/* The data is term_to_binary of a binary holding the command, encoded
+   as for outputv. FALSE if it's to go the usual way. */
+int call_run(TokePort *const tp, const char *const buf,
+             const ErlDrvSizeT len, EtfBuffer *const eb) {
+  const unsigned char *const data = (const unsigned char *)buf;
+  if (CALL_HEADER_SIZE > len || ETF_VERSION != data[0] ||
+      ETF_BINARY != data[1] ||
+      etf_uint32(data + 2) != (uint64_t)len - CALL_HEADER_SIZE)
+    return FALSE;
+  /* no job can be queued meanwhile: port locking keeps outputv out */
+  erl_drv_mutex_lock(tp->mutex);
+  const int idle = 0 == tp->outstanding;
+  erl_drv_mutex_unlock(tp->mutex);
+  if (! idle || tp->group_open)
+    return FALSE;
+
+  /* the reader wants the command in a binary, after a header row */
+  const ErlDrvSizeT size = len - CALL_HEADER_SIZE;
+  ErlDrvBinary *binv[2] = { NULL, driver_alloc_binary(size) };
+  if (NULL == binv[1])
+    return FALSE;
+  memcpy(binv[1]->orig_bytes, data + CALL_HEADER_SIZE, size);
+  SysIOVec iov[2];
+  iov[0].iov_base = NULL;
+  iov[0].iov_len = 0;
+  iov[1].iov_base = binv[1]->orig_bytes;
+  iov[1].iov_len = size;
+  ErlIOVec ev;
+  ev.vsize = 2;
+  ev.size = size;
+  ev.iov = iov;
+  ev.binv = binv;
+
+  Reader reader;
+  const uint32_t *id = NULL;
+  const uint8_t *command = NULL;
+  int ok = FALSE;
+  make_reader(&ev, &reader);
+  if (read_uint32(&reader, &id) && read_uint8(&reader, &command) &&
+      *id < tp->handle_slots && NULL != tp->handles[*id] &&
+      handle_accepts(tp->handles[*id], *command) &&
+      ! maintenance_refuses(tp->handles[*id], *command)) {
+    TokeData *const td = tp->handles[*id];
+    const uint64_t started = now_us();
+    switch (*command) {
+    case TOKE_GET:
+      ok = call_get(td, &reader, eb);
+      break;
+    case TOKE_GET_MULTI:
+      ok = call_get_multi(td, &reader, eb);
+      break;
+    case TOKE_STATS:
+      ok = call_stats(td, &reader, eb);
+      break;
+    }
+    if (ok)
+      latency_record(td, *command, started);
+  }
+  driver_free_binary(binv[1]);
+  return ok && ! eb->failed;
+}
+
+static void toke_outputv(ErlDrvData drv_data, ErlIOVec *const ev) {
+  TokePort *const tp = (TokePort*)drv_data;
+  TokeJob *const job = toke_job_new(tp, ev);
+  if (NULL == job) {
+    driver_failure(tp->port, -1);
+    return;
+  }
+  toke_job_queue(tp, job, toke_job_run);
+}
+
+/* The reply is driver_alloc'd, and the emulator frees it. */
+static ErlDrvSSizeT toke_call(ErlDrvData drv_data, unsigned int command,
+                              char *buf, ErlDrvSizeT len, char **rbuf,
+                              ErlDrvSizeT rlen, unsigned int *flags) {
+  TokePort *const tp = (TokePort*)drv_data;
+  const unsigned char version = ETF_VERSION;
+  EtfBuffer eb = { (char *)driver_alloc(CALL_REPLY_SIZE), CALL_REPLY_SIZE,
+                   0, FALSE };
+  if (NULL == eb.buf)
+    return -1;
+  etf_write(&eb, &version, 1);
+  if (! call_run(tp, buf, len, &eb)) {
+    eb.len = 1;
+    eb.failed = FALSE;
+    etf_write_atom(&eb, "busy");
+  }
+  *rbuf = eb.buf;
+  return eb.len;
+}
+
+static void toke_ready_async(ErlDrvData drv_data,
+                             ErlDrvThreadData thread_data) {
+  TokePort *const tp = (TokePort*)drv_data;
+  TokeJob *const job = (TokeJob *)thread_data;
+  const int deferred = job->deferred;
+  const int waiting = job->opened_group || deferred;
+  if (job->failed) {
+    driver_failure(tp->port, -1);
+    toke_job_free(job);
+    return;
+  }
+  toke_arm_timer(tp, job->wake_ms);
+  if (deferred)
+    group_hold(tp, job);
+  if (job->committed) {
+    group_release(tp, job->commit_error); /* frees job, if held */
+  } else if (waiting) {
+    toke_arm_timer(tp, tp->group_window);
   }
+  if (! deferred) {
+    if (NULL != job->spec)
+      driver_output_term(tp->port, job->spec, job->spec_len);
+    toke_job_free(job);
+  }
+}
 
-  if (NULL != spec) {
-    driver_output_term(port, spec, ATOM_SPEC_LEN);
+/* A group commit window has closed, a memtable is due a flush, or
+   it's time for a maintenance step. Every tick does all three, for
+   every handle. */
+static void toke_timeout(ErlDrvData drv_data) {
+  TokePort *const tp = (TokePort*)drv_data;
+  tp->timer_armed = FALSE;
+  tp->timer_ms = 0;
+  TokeJob *const job = toke_job_alloc(tp);
+  if (NULL == job) {
+    driver_failure(tp->port, -1);
+    return;
   }
+  toke_job_queue(tp, job, toke_tick_run);
 }
 
 static ErlDrvEntry toke_driver_entry =
@@ -720,6 +5949,10 @@ static ErlDrvEntry toke_driver_entry =
   .stop = toke_stop,
   .driver_name = (char*) "libtoke",
   .outputv = toke_outputv,
+  .ready_async = toke_ready_async,
+  .timeout = toke_timeout,
+  .call = toke_call,
+  .finish = toke_finish,
   .extended_marker = ERL_DRV_EXTENDED_MARKER,
   .major_version = ERL_DRV_EXTENDED_MAJOR_VERSION,
   .minor_version = ERL_DRV_EXTENDED_MINOR_VERSION,
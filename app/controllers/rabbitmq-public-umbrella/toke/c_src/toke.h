@@ -20,6 +20,7 @@
 #ifndef __TOKE_H_
 #define __TOKE_H_
 
+/* Each command follows the uint32_t id of the handle it's for. */
 enum _CommandType {
   TOKE_INVALID_COMMAND = 255,
   TOKE_NEW             = 0,
@@ -37,7 +38,34 @@ enum _CommandType {
   TOKE_DELETE          = 12,
   TOKE_DELETE_IF_EQ    = 13,
   TOKE_GET             = 14,
-  TOKE_GET_ALL         = 15
+  TOKE_GET_ALL         = 15,
+  TOKE_GET_MULTI       = 16,
+  TOKE_INSERT_MULTI    = 17,
+  TOKE_DELETE_MULTI    = 18,
+  TOKE_ITER_OPEN       = 19,
+  TOKE_ITER_NEXT       = 20,
+  TOKE_ITER_CLOSE      = 21,
+  TOKE_SET_SECONDARY   = 22,
+  TOKE_DELETE_BY_SECONDARY = 23,
+  TOKE_CAS             = 24,
+  TOKE_MERGE           = 25,
+  TOKE_TRAN_BEGIN      = 26,
+  TOKE_TRAN_COMMIT     = 27,
+  TOKE_TRAN_ABORT      = 28,
+  TOKE_SET_GROUP_COMMIT = 29,
+  TOKE_SET_MEMTABLE    = 30,
+  TOKE_SET_BLOOM       = 31,
+  TOKE_STATS           = 32,
+  TOKE_BULK_BEGIN      = 33,
+  TOKE_BULK_INSERT     = 34,
+  TOKE_BULK_END        = 35,
+  TOKE_SET_MAINTENANCE = 36,
+  TOKE_OPTIMIZE        = 37,
+  TOKE_ADD_HANDLE      = 38,
+  TOKE_REMOVE_HANDLE   = 39,
+  TOKE_SHARE           = 40,
+  TOKE_ATTACH          = 41,
+  TOKE_ITER_RANGE      = 42
 };
 typedef enum _CommandType CommandType;
 
@@ -68,5 +96,21 @@ enum _TuneOpts {              /* enumeration for tuning options */
   TOKE_TUNE_EXCODEC = 1 << 4  /* compress each record with custom functions */
 };
 
+enum _Backend {               /* what TOKE_NEW creates */
+  TOKE_BACKEND_HASH   = 0,    /* TC's hash database */
+  TOKE_BACKEND_MEMORY = 1,    /* the driver's in-memory table */
+  TOKE_BACKEND_TREE   = 2,    /* TC's B+ tree database */
+  TOKE_BACKEND_FIXED  = 3     /* TC's fixed-length database */
+};
+
+enum _CasExpect {             /* what TOKE_CAS compares against */
+  TOKE_CAS_VALUE = 0,         /* the current value itself */
+  TOKE_CAS_CRC32 = 1          /* erlang:crc32 of the current value */
+};
+
+enum _MergeOps {              /* field updates for TOKE_MERGE */
+  TOKE_MERGE_ADD     = 0,     /* add to the integer at a field */
+  TOKE_MERGE_REPLACE = 1      /* replace a field with a term */
+};
 
 #endif
@@ -1,3 +1,4 @@
+ERL_OPTS += +A10
 STANDALONE_TEST_COMMANDS:=test_toke:test()
 
 C_SOURCE_DIR:=$(PACKAGE_DIR)/c_src
@@ -17,12 +17,18 @@
 -module(toke_drv).
 -behaviour(gen_server).
 
--export([start_link/0]).
-
--export([new/1, delete/1, tune/5, set_cache/2, set_xm_size/2, set_df_unit/2,
-         open/3, close/1, insert/3, insert_new/3, insert_concat/3,
-         insert_async/3, delete/2, delete_if_value_eq/3, get/2, fold/3,
-         update_atomically/3, stop/1]).
+-export([start_link/0, start_link/1]).
+
+-export([new/1, new/2, delete/1, tune/5, set_cache/2, set_xm_size/2,
+         set_df_unit/2, open/3, close/1, insert/3, insert_new/3,
+         insert_concat/3, insert_async/3, delete/2, delete_if_value_eq/3,
+         get/2, fold/3, update_atomically/3, get_multi/2, insert_multi/2,
+         delete_multi/2, iter_open/1, iter_open/2, iter_next/2, iter_close/1,
+         set_secondary/2, delete_by_secondary/2, compare_and_swap/4, merge/3,
+         tran_begin/1, tran_commit/1, tran_abort/1, set_group_commit/3,
+         set_memtable/3, set_bloom/3, stats/1, bulk_begin/2, bulk_insert/2,
+         bulk_end/1, set_maintenance/4, optimize/1, add_handle/1,
+         remove_handle/1, share/2, attach/2, direct/1, stop/1]).
 
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2, code_change/3,
          terminate/2]).
@@ -34,6 +40,10 @@
 %% attempt to check state. Thus if you, eg, call tune after opening
 %% the database, you will get an invalid state error from Tokyo
 %% Cabinet rather than something more meaningful.
+%%
+%% Commands run on the emulator's async thread pool, so start the
+%% emulator with some (+A). Each port's commands run in order, one at
+%% a time.
 
 -define(LIBNAME, "libtoke").
 
@@ -53,6 +63,48 @@
 -define(TOKE_DELETE_IF_EQ,  13).
 -define(TOKE_GET,           14).
 -define(TOKE_GET_ALL,       15).
+-define(TOKE_GET_MULTI,     16).
+-define(TOKE_INSERT_MULTI,  17).
+-define(TOKE_DELETE_MULTI,  18).
+-define(TOKE_ITER_OPEN,     19).
+-define(TOKE_ITER_NEXT,     20).
+-define(TOKE_ITER_CLOSE,    21).
+-define(TOKE_SET_SECONDARY, 22).
+-define(TOKE_DELETE_BY_SECONDARY, 23).
+-define(TOKE_CAS,           24).
+-define(TOKE_MERGE,         25).
+-define(TOKE_TRAN_BEGIN,    26).
+-define(TOKE_TRAN_COMMIT,   27).
+-define(TOKE_TRAN_ABORT,    28).
+-define(TOKE_SET_GROUP_COMMIT, 29).
+-define(TOKE_SET_MEMTABLE,  30).
+-define(TOKE_SET_BLOOM,     31).
+-define(TOKE_STATS,         32).
+-define(TOKE_BULK_BEGIN,    33).
+-define(TOKE_BULK_INSERT,   34).
+-define(TOKE_BULK_END,      35).
+-define(TOKE_SET_MAINTENANCE, 36).
+-define(TOKE_OPTIMIZE,      37).
+-define(TOKE_ADD_HANDLE,    38).
+-define(TOKE_REMOVE_HANDLE, 39).
+-define(TOKE_SHARE,         40).
+-define(TOKE_ATTACH,        41).
+-define(TOKE_ITER_RANGE,    42).
+
+-define(TOKE_CAS_VALUE,     0). %% KEEP IN SYNC WITH TOKE.H
+-define(TOKE_CAS_CRC32,     1).
+
+-define(TOKE_BACKEND_HASH,   0). %% KEEP IN SYNC WITH TOKE.H
+-define(TOKE_BACKEND_MEMORY, 1).
+-define(TOKE_BACKEND_TREE,   2).
+-define(TOKE_BACKEND_FIXED,  3).
+
+-define(TOKE_MERGE_ADD,     0). %% KEEP IN SYNC WITH TOKE.H
+-define(TOKE_MERGE_REPLACE, 1).
+
+-define(FOLD_BATCH,         1000).
+
+-record(state, { port, pending }).
 
 %% KEEP IN SYNC WITH TOKE.H
 -define(TUNE_KEYS,          [large, deflate, bzip, tcbs, excodec]).
@@ -66,76 +118,359 @@
 start_link() ->
     gen_server:start_link(?MODULE, [], []).
 
+%% As start_link/0, but run the driver's jobs on async thread Worker
+%% (modulo the number of threads), rather than one chosen by the port.
+start_link(Worker) when is_integer(Worker) andalso Worker >= 0 ->
+    gen_server:start_link(?MODULE, [Worker], []).
+
 %% Set up the driver with a new TCHDB object.
 new(Pid) ->
-    gen_server:call(Pid, new, infinity).
+    new(Pid, hash).
+
+%% Set up the driver with a new db of the given backend. Backend ::
+%% hash | memory | tree | {fixed, Width}. hash is TC's hash database.
+%%
+%% memory is the driver's own in-memory table, for indexes that fit
+%% in RAM: keys are at most 16 bytes, values of up to 104 bytes are
+%% stored inline, and the records are snapshotted to the file given
+%% to open/3, which loads them again. It's snapshotted on close/1 and
+%% bulk_end/1, and, when there have been writes, on idle maintenance
+%% ticks (see set_maintenance/4). tune/5's BNum is the records to
+%% size it for; the other settings don't apply to it. It has no lock
+%% and no key order, so share/2 and iter_open/2 return unsupported;
+%% optimize/1 compacts it at once.
+%%
+%% tree is TC's B+ tree database, which keeps keys in order, so folds
+%% and cursors see them in order, and iter_open/2 can scan a range.
+%% tune/5's BNum and set_cache/2's count are still in records.
+%%
+%% {fixed, Width} is TC's fixed-length database: an array of values
+%% of at most Width bytes, with no hashing or record headers. Keys
+%% must be <<Id:64>>, Id from 1 up, and come back in Id order. Wider
+%% values are refused. tune/5's BNum is the records to size the file
+%% for, which TC otherwise limits to 256MB; nothing else applies.
+%%
+%% Maintenance's steps (set_maintenance/4) are for hash only, and
+%% optimize/1 is for hash and memory; tree and fixed dbs return
+%% unsupported for it.
+new(Pid, Backend) when Backend =:= hash orelse Backend =:= memory orelse
+                       Backend =:= tree ->
+    call(Pid, {new, Backend});
+new(Pid, {fixed, Width} = Backend)
+  when is_integer(Width) andalso Width > 0 ->
+    call(Pid, {new, Backend}).
 
 %% Destroy the driver's TCHDB object.
 delete(Pid) ->
-    gen_server:call(Pid, delete, infinity).
+    call(Pid, delete).
 
 %% Tune the driver's TCHDB Object. Opts :: [ large, deflate, bzip,
 %%                                           tcbs, excodec ]
+%% excodec is the driver's own LZ4-style codec, which gives up some
+%% compression for speed; bench_toke:run/2 compares it with deflate.
 %% Don't do this after opening the db.
 tune(Pid, BNum, APow, FPow, Opts) ->
-    gen_server:call(Pid, {tune, BNum, APow, FPow, Opts}, infinity).
+    call(Pid, {tune, BNum, APow, FPow, Opts}).
 
 %% Set the number of records to cache. Don't do this after opening the db.
 set_cache(Pid, RecordsToCache) ->
-    gen_server:call(Pid, {set_cache, RecordsToCache}, infinity).
+    call(Pid, {set_cache, RecordsToCache}).
 
 %% Set the extra amount of memory mapped in. Don't do this after opening the db.
 set_xm_size(Pid, ExtraMappedMemory) ->
-    gen_server:call(Pid, {set_xm_size, ExtraMappedMemory}, infinity).
+    call(Pid, {set_xm_size, ExtraMappedMemory}).
 
 %% Set the steps between auto defrag. Don't do this after opening the db.
 set_df_unit(Pid, DefragStepUnit) ->
-    gen_server:call(Pid, {set_df_unit, DefragStepUnit}, infinity).
+    call(Pid, {set_df_unit, DefragStepUnit}).
 
 %% Open a db. Modes :: [ read, write, create, truncate, no_lock,
 %%                       lock_no_block, sync_on_transaction ]
 open(Pid, Path, Modes) ->
-    gen_server:call(Pid, {open, Path, Modes}, infinity).
+    call(Pid, {open, Path, Modes}).
 
 %% Close an open db.
 close(Pid) ->
-    gen_server:call(Pid, close, infinity).
+    call(Pid, close).
 
 %% Insert. If the key already exists, value is updated.
 insert(Pid, Key, Value) when is_binary(Key) andalso is_binary(Value) ->
-    gen_server:call(Pid, {insert, Key, Value}, infinity).
+    call(Pid, {insert, Key, Value}).
 
 %% Insert new. If the key already exists, the old value is silently kept.
 insert_new(Pid, Key, Value) when is_binary(Key) andalso is_binary(Value) ->
-    gen_server:call(Pid, {insert_new, Key, Value}, infinity).
+    call(Pid, {insert_new, Key, Value}).
 
 %% Concatenate the supplied value with an existing value for this key.
 insert_concat(Pid, Key, Value) when is_binary(Key) andalso is_binary(Value) ->
-    gen_server:call(Pid, {insert_concat, Key, Value}, infinity).
+    call(Pid, {insert_concat, Key, Value}).
 
 %% Asynchronously insert. If the key already exists, value is updated.
 insert_async(Pid, Key, Value) when is_binary(Key) andalso is_binary(Value) ->
-    gen_server:cast(Pid, {insert_async, Key, Value}).
+    cast(Pid, {insert_async, Key, Value}).
 
 %% Delete a key from the db.
 delete(Pid, Key) when is_binary(Key) ->
-    gen_server:call(Pid, {delete, Key}, infinity).
+    call(Pid, {delete, Key}).
 
 %% Delete the key iff the current value matches the supplied value.
 delete_if_value_eq(Pid, Key, Obj) when is_binary(Key) andalso is_binary(Obj) ->
-    gen_server:call(Pid, {delete_if_value_eq, Key, Obj}, infinity).
+    call(Pid, {delete_if_value_eq, Key, Obj}).
 
 %% Fetch a key from the db. Returns 'not_found' on occasion.
 get(Pid, Key) when is_binary(Key) ->
-    gen_server:call(Pid, {get, Key}, infinity).
+    call(Pid, {get, Key}).
 
-%% Fold over every value in the db.
+%% Fold over every value in the db. Fun runs in the caller, and
+%% records are fetched in batches through a cursor of its own, so
+%% folds can run alongside each other and other cursors. Returns the
+%% driver's error instead if the cursor can't be opened, or loses its
+%% place (see iter_open/1).
 fold(Fun, Init, Pid) ->
-    gen_server:call(Pid, {fold, Fun, Init}, infinity).
+    case iter_open(Pid) of
+        {ok, Cursor} ->
+            try
+                fold1(Fun, Init, Cursor)
+            after
+                ok = iter_close(Cursor)
+            end;
+        Err ->
+            Err
+    end.
 
-%% Atomically modify the specified value.
+%% Atomically modify the specified value. Fun runs in the caller, and
+%% is run again if the value changes underneath it.
 update_atomically(Pid, Key, Fun) ->
-    gen_server:call(Pid, {update_atomically, Key, Fun}, infinity).
+    case get(Pid, Key) of
+        not_found -> ok;
+        Value     -> update_atomically1(Pid, Key, Fun, Value)
+    end.
+
+%% Fetch many keys at once. Returns a list of values, in the same
+%% order as Keys, with 'not_found' for missing keys.
+get_multi(Pid, Keys) when is_list(Keys) ->
+    call(Pid, {get_multi, Keys}).
+
+%% Insert many [{Key, Value}] at once. Existing values are updated.
+insert_multi(Pid, KVs) when is_list(KVs) ->
+    call(Pid, {insert_multi, KVs}).
+
+%% Delete many keys at once.
+delete_multi(Pid, Keys) when is_list(Keys) ->
+    call(Pid, {delete_multi, Keys}).
+
+%% Open a cursor over the db. Any number can be open at once, folds
+%% included, each keeping its own place. Records inserted or deleted
+%% whilst the cursor is open may or may not be seen. On a hash db, a
+%% cursor whose last key is deleted, and then finds something else
+%% has moved through the db, loses its place, after which iter_next
+%% returns invalid_state. So does one that has begun on a memory db
+%% that has since grown or been optimized, which reorders the
+%% records.
+iter_open(Pid) ->
+    cursor(Pid, call(Pid, iter_open)).
+
+%% As iter_open/1, over part of a tree or fixed db, in key order.
+%% Range :: {range, From, To} | {prefix, Prefix}. From is inclusive,
+%% To exclusive, and may be infinity. Keys compare bytewise, shorter
+%% first. The other backends return unsupported.
+iter_open(Pid, {range, From, To})
+  when is_binary(From) andalso (is_binary(To) orelse To =:= infinity) ->
+    cursor(Pid, call(Pid, {iter_range, From, To}));
+iter_open(Pid, {prefix, Prefix}) when is_binary(Prefix) ->
+    iter_open(Pid, {range, Prefix, prefix_end(Prefix)}).
+
+%% Fetch up to N [{Key, Value}] from the cursor. [] means it's done.
+iter_next({Pid, Id}, N) when is_integer(N) andalso N > 0 ->
+    call(Pid, {iter_next, Id, N}).
+
+iter_close({Pid, Id}) ->
+    call(Pid, {iter_close, Id}).
+
+%% Index every value, which must then be term_to_binary of a tuple,
+%% by its element at Position (as for element/2). Don't do this after
+%% opening the db: the index is built by scanning the db on open, and
+%% is kept in memory only. Position 0 drops the index.
+set_secondary(Pid, Position)
+  when is_integer(Position) andalso 0 =< Position andalso Position < 256 ->
+    call(Pid, {set_secondary, Position}).
+
+%% Delete every record whose indexed element is Term. Values that
+%% aren't tuples, or are too short, are never deleted this way.
+delete_by_secondary(Pid, Term) ->
+    <<131, Secondary/binary>> = term_to_binary(Term),
+    call(Pid, {delete_by_secondary, Secondary}).
+
+%% Replace the value iff the current value is Expected, or has the
+%% given erlang:crc32/1. Returns ok, not_found, or {changed, Current}.
+compare_and_swap(Pid, Key, Expected, Value)
+  when is_binary(Key) andalso is_binary(Value) ->
+    call(Pid, {compare_and_swap, Key, Expected, Value}).
+
+%% Update fields of a value that is term_to_binary of a tuple, in
+%% place in the driver. Ops :: [{add, Position, Integer} |
+%%                              {replace, Position, Term}]
+%% Returns ok, not_found, or bad_value if a field isn't there, or
+%% isn't an integer to add to, in which case nothing is changed.
+merge(Pid, Key, Ops) when is_binary(Key) andalso is_list(Ops) ->
+    call(Pid, {merge, Key, Ops}).
+
+%% Begin, commit and abort a transaction. Only one may be open.
+tran_begin(Pid) ->
+    call(Pid, tran_begin).
+
+tran_commit(Pid) ->
+    call(Pid, tran_commit).
+
+tran_abort(Pid) ->
+    call(Pid, tran_abort).
+
+%% Gather writes into one transaction, and hold their replies (and
+%% those of reads between them) until it commits. It commits after
+%% MaxWrites writes, or, with a WindowMs of 0, as soon as no more
+%% commands are waiting; otherwise WindowMs after it began. Other
+%% commands commit it first. MaxWrites of 0 turns this off. Best with
+%% sync_on_transaction, so that one fsync covers many writers.
+set_group_commit(Pid, MaxWrites, WindowMs)
+  when is_integer(MaxWrites) andalso MaxWrites >= 0 andalso
+       is_integer(WindowMs) andalso WindowMs >= 0 ->
+    call(Pid, {set_group_commit, MaxWrites, WindowMs}).
+
+%% Hold insert_async writes, and deletes of the keys they wrote, in
+%% memory until there are MaxBytes of them, or IntervalMs has passed
+%% since the first, so that records that are soon rewritten or deleted
+%% reach the db once or not at all. get, get_multi, insert and delete
+%% see through it; any other command flushes it first. MaxBytes of 0
+%% turns it off; IntervalMs of 0 means no timed flushes.
+set_memtable(Pid, MaxBytes, IntervalMs)
+  when is_integer(MaxBytes) andalso MaxBytes >= 0 andalso
+       is_integer(IntervalMs) andalso IntervalMs >= 0 ->
+    call(Pid, {set_memtable, MaxBytes, IntervalMs}).
+
+%% Keep a Bloom filter of BitsPerKey bits per key (10 gives about 1%
+%% false positives), so that get and get_multi of missing keys needn't
+%% reach the db. It's built on open, and rebuilt once RebuildPercent
+%% of the keys in it have been deleted; 0 means never. BitsPerKey of 0
+%% turns it off. Don't do this after opening the db.
+set_bloom(Pid, BitsPerKey, RebuildPercent)
+  when is_integer(BitsPerKey) andalso BitsPerKey >= 0 andalso
+       is_integer(RebuildPercent) andalso RebuildPercent >= 0 ->
+    call(Pid, {set_bloom, BitsPerKey, RebuildPercent}).
+
+%% Returns a proplist of the driver's counters, along with the Bloom
+%% filter's observed false positive rate. bytes_read counts the values
+%% got and the records iterated over, and bytes_written the records
+%% put; queued_jobs and memtable_records are the writes yet to reach
+%% the db. {latency, [{Command, Count, Buckets}]} has, for each
+%% command that has run, how long it took from reaching the driver
+%% until it was done, including its wait behind earlier commands:
+%% element N of Buckets counts those under 2^N us, bar the last.
+stats(Pid) ->
+    Stats = call(Pid, stats),
+    Negatives = proplists:get_value(bloom_negatives, Stats),
+    FalsePositives = proplists:get_value(bloom_false_positives, Stats),
+    Rate = case Negatives + FalsePositives of
+               0      -> 0.0;
+               Absent -> FalsePositives / Absent
+           end,
+    Stats ++ [{bloom_false_positive_rate, Rate}].
+
+%% Bulk loading a new db: bulk_begin sizes the db for about
+%% ExpectedRecords records and turns off auto defrag until the db is
+%% next opened. It comes after tune, whose bnum it replaces, and
+%% before open. bulk_insert then streams batches of records in without
+%% waiting for them to be written, and bulk_end writes out the last of
+%% them with a single sync.
+bulk_begin(Pid, ExpectedRecords)
+  when is_integer(ExpectedRecords) andalso ExpectedRecords >= 0 ->
+    call(Pid, {bulk_begin, ExpectedRecords}).
+
+bulk_insert(Pid, KVs) when is_list(KVs) ->
+    cast(Pid, {bulk_insert, KVs}).
+
+bulk_end(Pid) ->
+    call(Pid, bulk_end).
+
+%% Every IntervalMs, when nothing else is waiting, the driver takes a
+%% maintenance step of up to StepRecords records: defragging the db
+%% in place whilst its estimated fragmentation is above
+%% TargetFragmentationPercent (0 means never), and rebuilding it with
+%% twice as many buckets as records once it has outgrown its bucket
+%% array. The memtable and group commit are flushed on the same
+%% ticks. IntervalMs of 0 turns maintenance off. The rebuild needs
+%% auto defrag off: set_df_unit(Pid, 0). For the memory backend,
+%% each tick writes a snapshot if there have been writes since the
+%% last, and that's all.
+set_maintenance(Pid, IntervalMs, StepRecords, TargetFragmentationPercent)
+  when is_integer(IntervalMs) andalso IntervalMs >= 0 andalso
+       is_integer(StepRecords) andalso StepRecords >= 0 andalso
+       is_integer(TargetFragmentationPercent) andalso
+       TargetFragmentationPercent >= 0 ->
+    call(Pid, {set_maintenance, IntervalMs, StepRecords,
+               TargetFragmentationPercent}).
+
+%% Start rebuilding the db now, online, through maintenance steps.
+%% Returns invalid_state if maintenance is off, auto defrag is on, a
+%% rebuild is under way, or the db isn't open for writing. A memory
+%% db is rebuilt there and then, without its deleted slots, and
+%% snapshotted, whether or not maintenance is on; like growing, that
+%% ends any cursor that has begun. Tree and fixed dbs return
+%% unsupported. Should
+%% the swap at the end leave the db closed, unable to reopen either
+%% file, every command but close/1, open/3, delete/1 and stats/1
+%% returns {error_from_tokyo_cabinet, Msg} with the reason.
+optimize(Pid) ->
+    call(Pid, optimize).
+
+%% Add a handle to the driver: another db, with a TCHDB object,
+%% memtable, Bloom filter and so on of its own, but sharing the port,
+%% its async thread and its group commits. Returns {ok, Handle}, and
+%% Handle goes in place of Pid in the rest of the API. Pid alone is
+%% the handle the driver starts with.
+add_handle(Pid) when is_pid(Pid) ->
+    case call(Pid, add_handle) of
+        Id when is_integer(Id) -> {ok, {toke_handle, Pid, Id}};
+        Err                    -> Err
+    end.
+
+%% Close the handle's db, if it's open, and remove the handle.
+remove_handle(Handle = {toke_handle, _Pid, _Id}) ->
+    call(Handle, remove_handle).
+
+%% Share the db under Name, so that handles on other ports can attach
+%% to it and read it in parallel, each port on its own async thread.
+%% Only this handle writes to it. Do this after new/1 but before
+%% opening the db. Readers don't see writes still in this handle's
+%% memtable, and the db can't be rebuilt by optimize/1 while shared.
+%% close/1 returns invalid_state while any reader is attached; it's
+%% for them to let go first. A memory db returns unsupported.
+share(Pid, Name) when is_binary(Name) ->
+    call(Pid, {share, Name}).
+
+%% Attach a handle with no db (so before new/1, or after delete/1) to
+%% the db shared under Name, to read. It takes get/2, get_multi/2,
+%% stats/1 and delete/1, which lets go of the db, and returns
+%% invalid_state for the rest. The db is deleted once its owner and
+%% every reader have let go of it. Returns not_found if nothing is
+%% shared under Name.
+attach(Pid, Name) when is_binary(Name) ->
+    call(Pid, {attach, Name}).
+
+%% Returns {ok, Direct}, which any process can pass in place of the
+%% handle to get/2, get_multi/2 and stats/1 to have the driver answer
+%% them there and then, through erlang:port_call/3, rather than queue
+%% them behind the gen_server and the async thread. The driver only
+%% does so when the port is idle and no group commit is open; when
+%% it's busy, and for the rest of the API, Direct goes through the
+%% handle as usual. The exceptions are insert_async/3 and
+%% bulk_insert/2, which Direct sends straight to the port, so that a
+%% get through Direct afterwards finds the port busy with them, or
+%% sees them. Those sent through the handle itself may still be with
+%% the gen_server, where a get through Direct can't see them.
+direct(Handle = {toke_handle, Pid, Id}) ->
+    {ok, {toke_direct, gen_server:call(Pid, port, infinity), Id, Handle}};
+direct(Pid) when is_pid(Pid) ->
+    {ok, {toke_direct, gen_server:call(Pid, port, infinity), 0, Pid}}.
 
 %% Stop the driver and close the port.
 stop(Pid) ->
@@ -145,7 +480,7 @@ stop(Pid) ->
 %% Gen_server callbacks
 %%----------------------------------------------------------------------------
 
-init([]) ->
+init(Args) ->
     erl_ddll:start(),
     {file, Path} = code:is_loaded(?MODULE),
     Dir = filename:join(filename:dirname(Path), "../priv"),
@@ -154,137 +489,318 @@ init([]) ->
         {error, permanent} -> ok %% it's already loaded
     end,
     ok = erl_ddll:load_driver(Dir, ?LIBNAME),
-    Port = open_port({spawn_driver, ?LIBNAME}, [binary, stream]),
-    {ok, Port}.
+    Command = case Args of
+                  []       -> ?LIBNAME;
+                  [Worker] -> ?LIBNAME ++ " " ++ integer_to_list(Worker)
+              end,
+    Port = open_port({spawn_driver, Command}, [binary, stream]),
+    {ok, #state { port = Port, pending = queue:new() }}.
+
+handle_call(stop, _From, State) ->
+    {stop, normal, ok, drain(State)}; %% gen_server now calls terminate/2
+handle_call(port, _From, State = #state { port = Port }) ->
+    {reply, Port, State};
+handle_call({Handle, Msg}, From, State = #state { port = Port }) ->
+    port_command(Port, [<<Handle:32/native>>, command(Msg)]),
+    reply_later(From, State).
+
+handle_cast({Handle, Msg}, State = #state { port = Port }) ->
+    port_command(Port, [<<Handle:32/native>>, command(Msg)]),
+    {noreply, State}.
+
+%% Replies come back in the order the commands were sent.
+handle_info({toke_reply, Result}, State = #state { pending = Pending }) ->
+    {{value, From}, Pending1} = queue:out(Pending),
+    gen_server:reply(From, Result),
+    {noreply, State #state { pending = Pending1 }};
+handle_info(_Msg, State) ->
+    {noreply, State}.
+
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+terminate(_Reason, #state { port = Port }) ->
+    port_close(Port).
+
+%%----------------------------------------------------------------------------
+%% Internal helpers
+%%----------------------------------------------------------------------------
 
-handle_call(new, _From, Port) ->
-    port_command(Port, <<?TOKE_NEW/native>>),
-    simple_reply(Port);
+build_bit_mask(Flags, Keys) ->
+    {Int, _Index} =
+        lists:foldl(fun (Key, {Acc, Index}) ->
+                            {case proplists:get_bool(Key, Flags) of
+                                 true  -> Acc bor (1 bsl Index);
+                                 false -> Acc
+                             end, 1 + Index}
+                    end, {0, 0}, Keys),
+    Int.
 
-handle_call(delete, _From, Port) ->
-    port_command(Port, <<?TOKE_DEL/native>>),
-    simple_reply(Port);
+%% Every command is prefixed by the handle it's for. A bare pid is
+%% the port's handle 0. port_call/3 hands the driver the command as
+%% term_to_binary of the binary, and busy means go the long way. A
+%% cast through Direct goes to the port from the caller, ahead of
+%% anything it then port_calls; casts have no reply for the
+%% gen_server to match up.
+call({toke_direct, Port, Handle, Fallback}, Msg) ->
+    case direct_call(Msg) of
+        true  -> Data = iolist_to_binary([<<Handle:32/native>>, command(Msg)]),
+                 case erlang:port_call(Port, 0, Data) of
+                     busy   -> call(Fallback, Msg);
+                     Result -> Result
+                 end;
+        false -> call(Fallback, Msg)
+    end;
+call({toke_handle, Pid, Handle}, Msg) ->
+    gen_server:call(Pid, {Handle, Msg}, infinity);
+call(Pid, Msg) ->
+    gen_server:call(Pid, {0, Msg}, infinity).
+
+cast({toke_direct, Port, Handle, _Fallback}, Msg) ->
+    true = port_command(Port, [<<Handle:32/native>>, command(Msg)]),
+    ok;
+cast({toke_handle, Pid, Handle}, Msg) ->
+    gen_server:cast(Pid, {Handle, Msg});
+cast(Pid, Msg) ->
+    gen_server:cast(Pid, {0, Msg}).
+
+direct_call({get, _Key})        -> true;
+direct_call({get_multi, _Keys}) -> true;
+direct_call(stats)              -> true;
+direct_call(_Msg)               -> false.
+
+%% The driver's encoding of each command, without the handle.
+command({new, hash}) ->
+    <<?TOKE_NEW/native, ?TOKE_BACKEND_HASH/native>>;
+
+command({new, memory}) ->
+    <<?TOKE_NEW/native, ?TOKE_BACKEND_MEMORY/native>>;
+
+command({new, tree}) ->
+    <<?TOKE_NEW/native, ?TOKE_BACKEND_TREE/native>>;
+
+%% uint32_t width
+command({new, {fixed, Width}}) ->
+    <<?TOKE_NEW/native, ?TOKE_BACKEND_FIXED/native, Width:32/native>>;
+
+command(delete) ->
+    <<?TOKE_DEL/native>>;
 
 %% int64_t bnum, int8_t apow, int8_t fpow, uint8_t opts
-handle_call({tune, BNum, APow, FPow, Opts}, _From, Port) ->
+command({tune, BNum, APow, FPow, Opts}) ->
     Opt = build_bit_mask(Opts, ?TUNE_KEYS),
-    port_command(Port, <<?TOKE_TUNE/native,
-                        BNum:64/signed-integer-native,
-                        APow:8/signed-integer-native,
-                        FPow:8/signed-integer-native,
-                        Opt:8/native>>),
-    simple_reply(Port);
+    <<?TOKE_TUNE/native,
+      BNum:64/signed-integer-native,
+      APow:8/signed-integer-native,
+      FPow:8/signed-integer-native,
+      Opt:8/native>>;
 
 %% int32_t rcnum
-handle_call({set_cache, RecordCacheNum}, _From, Port) ->
-    port_command(Port, <<?TOKE_SET_CACHE/native,
-                        RecordCacheNum:32/signed-integer-native>>),
-    simple_reply(Port);
+command({set_cache, RecordCacheNum}) ->
+    <<?TOKE_SET_CACHE/native,
+      RecordCacheNum:32/signed-integer-native>>;
 
 %% int64_t xmsiz
-handle_call({set_xm_size, ExtraMappedMemory}, _From, Port) ->
-    port_command(Port, <<?TOKE_SET_XM_SIZE/native,
-                        ExtraMappedMemory:64/signed-integer-native>>),
-    simple_reply(Port);
+command({set_xm_size, ExtraMappedMemory}) ->
+    <<?TOKE_SET_XM_SIZE/native,
+      ExtraMappedMemory:64/signed-integer-native>>;
 
 %% int32_t dfunit
-handle_call({set_df_unit, DefragStepUnit}, _From, Port) ->
-    port_command(Port, <<?TOKE_SET_DF_UNIT/native,
-                        DefragStepUnit:32/signed-integer-native>>),
-    simple_reply(Port);
+command({set_df_unit, DefragStepUnit}) ->
+    <<?TOKE_SET_DF_UNIT/native,
+      DefragStepUnit:32/signed-integer-native>>;
 
-handle_call({open, Path, Modes}, _From, Port) ->
+command({open, Path, Modes}) ->
     Mode = build_bit_mask(Modes, ?OPEN_KEYS),
-    port_command(Port, <<?TOKE_OPEN/native, (length(Path)):64/native,
-                        (list_to_binary(Path))/binary, Mode:8/native>>),
-    simple_reply(Port);
+    <<?TOKE_OPEN/native, (length(Path)):64/native,
+      (list_to_binary(Path))/binary, Mode:8/native>>;
 
-handle_call(close, _From, Port) ->
-    port_command(Port, <<?TOKE_CLOSE/native>>),
-    simple_reply(Port);
+command(close) ->
+    <<?TOKE_CLOSE/native>>;
 
-handle_call({insert, Key, Value}, _From, Port) ->
-    insert_sync(Port, ?TOKE_INSERT, Key, Value);
+command({insert, Key, Value}) ->
+    kv_command(?TOKE_INSERT, Key, Value);
 
-handle_call({insert_new, Key, Value}, _From, Port) ->
-    insert_sync(Port, ?TOKE_INSERT_NEW, Key, Value);
+command({insert_new, Key, Value}) ->
+    kv_command(?TOKE_INSERT_NEW, Key, Value);
 
-handle_call({insert_concat, Key, Value}, _From, Port) ->
-    insert_sync(Port, ?TOKE_INSERT_CONCAT, Key, Value);
+command({insert_concat, Key, Value}) ->
+    kv_command(?TOKE_INSERT_CONCAT, Key, Value);
 
-handle_call({delete, Key}, _From, Port) ->
+command({delete, Key}) ->
     KeySize = size(Key),
-    port_command(Port, <<?TOKE_DELETE/native, KeySize:64/native, Key/binary>>),
-    simple_reply(Port);
+    <<?TOKE_DELETE/native, KeySize:64/native, Key/binary>>;
 
-handle_call({delete_if_value_eq, Key, Obj}, _From, Port) ->
-    insert_sync(Port, ?TOKE_DELETE_IF_EQ, Key, Obj);
+command({delete_if_value_eq, Key, Obj}) ->
+    kv_command(?TOKE_DELETE_IF_EQ, Key, Obj);
 
-handle_call({get, Key}, _From, Port) ->
-    {reply, internal_get(Key, Port), Port};
+command({get, Key}) ->
+    KeySize = size(Key),
+    <<?TOKE_GET/native, KeySize:64/native, Key/binary>>;
 
-handle_call({fold, Fun, Init}, _From, Port) ->
-    port_command(Port, <<?TOKE_GET_ALL/native>>),
-    Result = receive_all(Fun, Init),
-    {reply, Result, Port};
+command(iter_open) ->
+    <<?TOKE_ITER_OPEN/native>>;
 
-handle_call({update_atomically, Key, Fun}, _From, Port) ->
-    case internal_get(Key, Port) of
-        not_found -> ok;
-        Entry -> insert_async(Port, ?TOKE_INSERT_ASYNC, Key, Fun(Entry))
-    end,
-    {reply, ok, Port};
+command({iter_next, Id, N}) ->
+    <<?TOKE_ITER_NEXT/native, Id:64/native, N:64/native>>;
 
-handle_call(stop, _From, Port) ->
-    {stop, normal, ok, Port}. %% gen_server now calls terminate/2
+command({iter_close, Id}) ->
+    <<?TOKE_ITER_CLOSE/native, Id:64/native>>;
 
-handle_cast({insert_async, Key, Value}, Port) ->
-    insert_async(Port, ?TOKE_INSERT_ASYNC, Key, Value).
+%% uint8_t bounded, then To, empty if it's not
+command({iter_range, From, infinity}) ->
+    [<<?TOKE_ITER_RANGE/native>>, sized(From), <<0:8>>, sized(<<>>)];
+command({iter_range, From, To}) ->
+    [<<?TOKE_ITER_RANGE/native>>, sized(From), <<1:8>>, sized(To)];
 
-handle_info(_Msg, State) ->
-    {noreply, State}.
+command({set_secondary, Position}) ->
+    <<?TOKE_SET_SECONDARY/native, Position:8/native>>;
 
-code_change(_OldVsn, State, _Extra) ->
-    {ok, State}.
+command({delete_by_secondary, Secondary}) ->
+    [<<?TOKE_DELETE_BY_SECONDARY/native>>, sized(Secondary)];
 
-terminate(_Reason, Port) ->
-    port_close(Port).
+command({compare_and_swap, Key, Expected, Value}) ->
+    {Expect, ExpectedBin} = case Expected of
+                                {crc32, Crc} -> {?TOKE_CAS_CRC32,
+                                                 <<Crc:32/native>>};
+                                _            -> {?TOKE_CAS_VALUE, Expected}
+                            end,
+    [<<?TOKE_CAS/native, Expect:8/native>>,
+     sized(Key), sized(ExpectedBin), sized(Value)];
 
-%%----------------------------------------------------------------------------
-%% Internal helpers
-%%----------------------------------------------------------------------------
+command({merge, Key, Ops}) ->
+    [<<?TOKE_MERGE/native>>, sized(Key),
+     <<(length(Ops)):64/native>>,
+     [merge_op(Op) || Op <- Ops]];
 
-internal_get(Key, Port) ->
-    KeySize = size(Key),
-    port_command(Port, <<?TOKE_GET/native, KeySize:64/native, Key/binary>>),
-    receive {toke_reply, Result} -> Result end.
+command({get_multi, Keys}) ->
+    [<<?TOKE_GET_MULTI/native, (length(Keys)):64/native>>,
+     [sized(Key) || Key <- Keys]];
 
-build_bit_mask(Flags, Keys) ->
-    {Int, _Index} =
-        lists:foldl(fun (Key, {Acc, Index}) ->
-                            {case proplists:get_bool(Key, Flags) of
-                                 true  -> Acc bor (1 bsl Index);
-                                 false -> Acc
-                             end, 1 + Index}
-                    end, {0, 0}, Keys),
-    Int.
+command({insert_multi, KVs}) ->
+    [<<?TOKE_INSERT_MULTI/native, (length(KVs)):64/native>>,
+     [[sized(Key), sized(Value)] || {Key, Value} <- KVs]];
 
-insert_async(Port, Command, Key, Value) ->
-    KeySize = size(Key),
-    ValueSize = size(Value),
-    port_command(Port, <<Command/native, KeySize:64/native,
-                        Key/binary, ValueSize:64/native, Value/binary>>),
-    {noreply, Port}.
-
-insert_sync(Port, Command, Key, Value) ->
-    insert_async(Port, Command, Key, Value),
-    simple_reply(Port).
-
-simple_reply(Port) ->
-    {reply, receive {toke_reply, Result} -> Result end, Port}.
-
-receive_all(Fun, Acc) ->
-    receive
-        {toke_reply, ok}         -> Acc;
-        {toke_reply, Key, Value} -> receive_all(Fun, Fun(Key, Value, Acc))
+command({delete_multi, Keys}) ->
+    [<<?TOKE_DELETE_MULTI/native, (length(Keys)):64/native>>,
+     [sized(Key) || Key <- Keys]];
+
+command(tran_begin) ->
+    <<?TOKE_TRAN_BEGIN/native>>;
+
+command(tran_commit) ->
+    <<?TOKE_TRAN_COMMIT/native>>;
+
+command(tran_abort) ->
+    <<?TOKE_TRAN_ABORT/native>>;
+
+%% uint32_t max, uint32_t window
+command({set_group_commit, MaxWrites, WindowMs}) ->
+    <<?TOKE_SET_GROUP_COMMIT/native, MaxWrites:32/native,
+      WindowMs:32/native>>;
+
+%% uint64_t max, uint32_t interval
+command({set_memtable, MaxBytes, IntervalMs}) ->
+    <<?TOKE_SET_MEMTABLE/native, MaxBytes:64/native,
+      IntervalMs:32/native>>;
+
+%% uint32_t bits_per_key, uint32_t rebuild_percent
+command({set_bloom, BitsPerKey, RebuildPercent}) ->
+    <<?TOKE_SET_BLOOM/native, BitsPerKey:32/native,
+      RebuildPercent:32/native>>;
+
+command(stats) ->
+    <<?TOKE_STATS/native>>;
+
+%% uint64_t records
+command({bulk_begin, ExpectedRecords}) ->
+    <<?TOKE_BULK_BEGIN/native, ExpectedRecords:64/native>>;
+
+command(bulk_end) ->
+    <<?TOKE_BULK_END/native>>;
+
+%% uint32_t interval_ms, uint32_t step_records, uint32_t target_percent
+command({set_maintenance, IntervalMs, StepRecords,
+         TargetFragmentationPercent}) ->
+    <<?TOKE_SET_MAINTENANCE/native, IntervalMs:32/native,
+      StepRecords:32/native,
+      TargetFragmentationPercent:32/native>>;
+
+command(optimize) ->
+    <<?TOKE_OPTIMIZE/native>>;
+
+command({insert_async, Key, Value}) ->
+    kv_command(?TOKE_INSERT_ASYNC, Key, Value);
+
+command({bulk_insert, KVs}) ->
+    [<<?TOKE_BULK_INSERT/native, (length(KVs)):64/native>>,
+     [[sized(Key), sized(Value)] || {Key, Value} <- KVs]];
+
+command(add_handle) ->
+    <<?TOKE_ADD_HANDLE/native>>;
+
+command(remove_handle) ->
+    <<?TOKE_REMOVE_HANDLE/native>>;
+
+command({share, Name}) ->
+    [<<?TOKE_SHARE/native>>, sized(Name)];
+
+command({attach, Name}) ->
+    [<<?TOKE_ATTACH/native>>, sized(Name)].
+
+kv_command(Command, Key, Value) ->
+    [<<Command/native>>, sized(Key), sized(Value)].
+
+merge_op({add, Position, N}) ->
+    <<?TOKE_MERGE_ADD/native, Position:8/native, N:64/signed-integer-native>>;
+merge_op({replace, Position, Term}) ->
+    <<131, Encoded/binary>> = term_to_binary(Term),
+    [<<?TOKE_MERGE_REPLACE/native, Position:8/native>>, sized(Encoded)].
+
+sized(Bin) when is_binary(Bin) ->
+    [<<(size(Bin)):64/native>>, Bin].
+
+cursor(Pid, Id) when is_integer(Id) -> {ok, {Pid, Id}};
+cursor(_Pid, Err)                   -> Err.
+
+%% The first key after every key starting with Prefix.
+prefix_end(<<>>) ->
+    infinity;
+prefix_end(Prefix) ->
+    Len = size(Prefix) - 1,
+    case Prefix of
+        <<Init:Len/binary, 255>>  -> prefix_end(Init);
+        <<Init:Len/binary, Last>> -> <<Init/binary, (Last + 1)>>
+    end.
+
+%% Rather than wait for the reply, which would stop the driver
+%% seeing any other command (and a group commit gathering any), let
+%% handle_info pass it on.
+reply_later(From, State = #state { pending = Pending }) ->
+    {noreply, State #state { pending = queue:in(From, Pending) }}.
+
+drain(State = #state { pending = Pending }) ->
+    case queue:out(Pending) of
+        {empty, _} ->
+            State;
+        {{value, From}, Pending1} ->
+            receive {toke_reply, Result} -> gen_server:reply(From, Result) end,
+            drain(State #state { pending = Pending1 })
+    end.
+
+update_atomically1(Pid, Key, Fun, Value) ->
+    case compare_and_swap(Pid, Key, Value, Fun(Value)) of
+        ok                 -> ok;
+        not_found          -> ok;
+        {changed, Value1}  -> update_atomically1(Pid, Key, Fun, Value1)
+    end.
+
+fold1(Fun, Acc, Cursor) ->
+    case iter_next(Cursor, ?FOLD_BATCH) of
+        []   -> Acc;
+        KVs when is_list(KVs) ->
+            fold1(Fun, lists:foldl(fun ({Key, Value}, Acc1) ->
+                                           Fun(Key, Value, Acc1)
+                                   end, Acc, KVs), Cursor);
+        Err  -> Err
     end.
@@ -0,0 +1,389 @@
+%%  The contents of this file are subject to the Mozilla Public License
+%%  Version 1.1 (the "License"); you may not use this file except in
+%%  compliance with the License. You may obtain a copy of the License
+%%  at http://www.mozilla.org/MPL/
+%%
+%%  Software distributed under the License is distributed on an "AS IS"
+%%  basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+%%  the License for the specific language governing rights and
+%%  limitations under the License.
+%%
+%%  The Original Code is Toke.
+%%
+%%  The Initial Developer of the Original Code is VMware, Inc.
+%%  Copyright (c) 2009-2011 VMware, Inc.  All rights reserved.
+%%
+
+-module(toke_shards).
+
+%% A db partitioned across N Tokyo Cabinet files. Each key is routed
+%% by its hash to one shard, which is a toke_drv of its own, running
+%% on its own async thread. Single key operations go to one shard;
+%% multi key operations, folds and the setup calls fan out across all
+%% of them, in parallel. Keys in different shards are independent:
+%% there are no transactions across shards.
+%%
+%% The API is toke_drv's, with Shards in place of Pid. Shard I of the
+%% db at Path is in Path.I, so N must not change between opens.
+
+-export([start_link/1, new/1, new/2, delete/1, tune/5, set_cache/2,
+         set_xm_size/2, set_df_unit/2, set_secondary/2, set_memtable/3,
+         set_group_commit/3, set_bloom/3, stats/1, bulk_begin/2,
+         bulk_insert/2, bulk_end/1, set_maintenance/4, optimize/1,
+         open/3, close/1, insert/3, insert_new/3, insert_concat/3,
+         insert_async/3, delete/2, delete_if_value_eq/3, get/2, fold/3,
+         update_atomically/3, compare_and_swap/4, merge/3, get_multi/2,
+         insert_multi/2, delete_multi/2, delete_by_secondary/2, stop/1]).
+
+-define(FOLD_BATCH, 1000).
+
+%%----------------------------------------------------------------------------
+%% Public API
+%%----------------------------------------------------------------------------
+
+%% Start N shards. Shard I runs on async thread I (modulo the number
+%% of threads), so start the emulator with at least N (+A).
+start_link(N) when is_integer(N) andalso N > 0 ->
+    start_link(N, []).
+
+new(Shards) ->
+    all(Shards, fun toke_drv:new/1).
+
+new(Shards, Backend) ->
+    all(Shards, fun (Pid) -> toke_drv:new(Pid, Backend) end).
+
+delete(Shards) ->
+    all(Shards, fun toke_drv:delete/1).
+
+%% BNum is for the whole db, and is split between the shards.
+tune(Shards, BNum, APow, FPow, Opts) ->
+    ShardBNum = lists:max([1, BNum div size(Shards)]),
+    all(Shards, fun (Pid) ->
+                        toke_drv:tune(Pid, ShardBNum, APow, FPow, Opts)
+                end).
+
+%% Likewise RecordsToCache, ExtraMappedMemory and MaxBytes.
+set_cache(Shards, RecordsToCache) ->
+    Split = RecordsToCache div size(Shards),
+    all(Shards, fun (Pid) -> toke_drv:set_cache(Pid, Split) end).
+
+set_xm_size(Shards, ExtraMappedMemory) ->
+    Split = ExtraMappedMemory div size(Shards),
+    all(Shards, fun (Pid) -> toke_drv:set_xm_size(Pid, Split) end).
+
+set_df_unit(Shards, DefragStepUnit) ->
+    all(Shards, fun (Pid) -> toke_drv:set_df_unit(Pid, DefragStepUnit) end).
+
+set_secondary(Shards, Position) ->
+    all(Shards, fun (Pid) -> toke_drv:set_secondary(Pid, Position) end).
+
+set_memtable(Shards, MaxBytes, IntervalMs) ->
+    Split = case MaxBytes of
+                0 -> 0;
+                _ -> lists:max([1, MaxBytes div size(Shards)])
+            end,
+    all(Shards, fun (Pid) ->
+                        toke_drv:set_memtable(Pid, Split, IntervalMs)
+                end).
+
+set_group_commit(Shards, MaxWrites, WindowMs) ->
+    all(Shards, fun (Pid) ->
+                        toke_drv:set_group_commit(Pid, MaxWrites, WindowMs)
+                end).
+
+set_bloom(Shards, BitsPerKey, RebuildPercent) ->
+    all(Shards, fun (Pid) ->
+                        toke_drv:set_bloom(Pid, BitsPerKey, RebuildPercent)
+                end).
+
+%% The counters and latency histograms are summed across the shards,
+%% and fragmentation is the worst of them.
+stats(Shards) ->
+    [First | Rest] = pmap(fun (Pid) ->
+                                  proplists:delete(bloom_false_positive_rate,
+                                                   toke_drv:stats(Pid))
+                          end, tuple_to_list(Shards)),
+    Stats = lists:foldl(
+              fun (ShardStats, Acc) ->
+                      [{Name, add_stat(Name, Stat,
+                                       proplists:get_value(Name, ShardStats))}
+                       || {Name, Stat} <- Acc]
+              end, First, Rest),
+    Negatives = proplists:get_value(bloom_negatives, Stats),
+    FalsePositives = proplists:get_value(bloom_false_positives, Stats),
+    Rate = case Negatives + FalsePositives of
+               0      -> 0.0;
+               Absent -> FalsePositives / Absent
+           end,
+    Stats ++ [{bloom_false_positive_rate, Rate}].
+
+bulk_begin(Shards, ExpectedRecords) ->
+    Split = ExpectedRecords div size(Shards),
+    all(Shards, fun (Pid) -> toke_drv:bulk_begin(Pid, Split) end).
+
+bulk_insert(Shards, KVs) when is_list(KVs) ->
+    Partitioned = partition_by(Shards, fun ({Key, _Value}) -> Key end, KVs),
+    [ok = toke_drv:bulk_insert(Pid, ShardKVs) ||
+        {Pid, ShardKVs} <- Partitioned],
+    ok.
+
+bulk_end(Shards) ->
+    all(Shards, fun toke_drv:bulk_end/1).
+
+set_maintenance(Shards, IntervalMs, StepRecords, TargetFragmentationPercent) ->
+    all(Shards, fun (Pid) ->
+                        toke_drv:set_maintenance(Pid, IntervalMs, StepRecords,
+                                                 TargetFragmentationPercent)
+                end).
+
+optimize(Shards) ->
+    all(Shards, fun toke_drv:optimize/1).
+
+open(Shards, Path, Modes) ->
+    all_indexed(Shards, fun (Pid, I) ->
+                                toke_drv:open(Pid, shard_path(Path, I), Modes)
+                        end).
+
+close(Shards) ->
+    all(Shards, fun toke_drv:close/1).
+
+insert(Shards, Key, Value) ->
+    toke_drv:insert(shard(Shards, Key), Key, Value).
+
+insert_new(Shards, Key, Value) ->
+    toke_drv:insert_new(shard(Shards, Key), Key, Value).
+
+insert_concat(Shards, Key, Value) ->
+    toke_drv:insert_concat(shard(Shards, Key), Key, Value).
+
+insert_async(Shards, Key, Value) ->
+    toke_drv:insert_async(shard(Shards, Key), Key, Value).
+
+delete(Shards, Key) ->
+    toke_drv:delete(shard(Shards, Key), Key).
+
+delete_if_value_eq(Shards, Key, Obj) ->
+    toke_drv:delete_if_value_eq(shard(Shards, Key), Key, Obj).
+
+get(Shards, Key) ->
+    toke_drv:get(shard(Shards, Key), Key).
+
+update_atomically(Shards, Key, Fun) ->
+    toke_drv:update_atomically(shard(Shards, Key), Key, Fun).
+
+compare_and_swap(Shards, Key, Expected, Value) ->
+    toke_drv:compare_and_swap(shard(Shards, Key), Key, Expected, Value).
+
+merge(Shards, Key, Ops) ->
+    toke_drv:merge(shard(Shards, Key), Key, Ops).
+
+%% Fold over every record. Fun runs in the caller, over batches from
+%% all the shards in whatever order they arrive; each shard fetches
+%% its next batch whilst Fun works through its last. The readers are
+%% monitored rather than linked, so a caller that traps exits gets no
+%% 'EXIT' from them.
+fold(Fun, Init, Shards) ->
+    Self = self(),
+    Ref = make_ref(),
+    Readers = [spawn_monitor(fun () -> fold_reader(Self, Ref, Pid) end) ||
+                  Pid <- tuple_to_list(Shards)],
+    [Reader ! {Ref, next} || {Reader, _MRef} <- Readers],
+    try
+        fold_batches(Fun, Init, Ref, Readers)
+    catch
+        Class:Reason ->
+            StackTrace = erlang:get_stacktrace(),
+            fold_stop(Ref, Readers),
+            erlang:raise(Class, Reason, StackTrace)
+    end.
+
+%% Returns the values in the same order as Keys.
+get_multi(Shards, Keys) when is_list(Keys) ->
+    Partitioned = partition(Shards, Keys),
+    Results = pmap(fun ({Pid, ShardKeys}) ->
+                           lists:zip(ShardKeys,
+                                     toke_drv:get_multi(Pid, ShardKeys))
+                   end, Partitioned),
+    Found = dict:from_list(lists:append(Results)),
+    [dict:fetch(Key, Found) || Key <- Keys].
+
+insert_multi(Shards, KVs) when is_list(KVs) ->
+    Partitioned = partition_by(Shards, fun ({Key, _Value}) -> Key end, KVs),
+    all_ok(pmap(fun ({Pid, ShardKVs}) ->
+                        toke_drv:insert_multi(Pid, ShardKVs)
+                end, Partitioned)).
+
+delete_multi(Shards, Keys) when is_list(Keys) ->
+    all_ok(pmap(fun ({Pid, ShardKeys}) ->
+                        toke_drv:delete_multi(Pid, ShardKeys)
+                end, partition(Shards, Keys))).
+
+delete_by_secondary(Shards, Term) ->
+    all(Shards, fun (Pid) -> toke_drv:delete_by_secondary(Pid, Term) end).
+
+stop(Shards) ->
+    all(Shards, fun toke_drv:stop/1).
+
+%%----------------------------------------------------------------------------
+%% Internal helpers
+%%----------------------------------------------------------------------------
+
+start_link(0, Pids) ->
+    {ok, list_to_tuple(Pids)};
+start_link(N, Pids) ->
+    case toke_drv:start_link(N - 1) of
+        {ok, Pid} -> start_link(N - 1, [Pid | Pids]);
+        Err       -> [toke_drv:stop(Pid) || Pid <- Pids],
+                     Err
+    end.
+
+add_stat(fragmentation, A, B) ->
+    lists:max([A, B]);
+add_stat(latency, A, B) ->
+    lists:foldl(
+      fun ({Command, Count, Buckets}, Acc) ->
+              case lists:keyfind(Command, 1, Acc) of
+                  false ->
+                      [{Command, Count, Buckets} | Acc];
+                  {Command, Count1, Buckets1} ->
+                      lists:keyreplace(
+                        Command, 1, Acc,
+                        {Command, Count + Count1,
+                         [N + N1 || {N, N1} <- lists:zip(Buckets, Buckets1)]})
+              end
+      end, A, B);
+add_stat(_Name, A, B) ->
+    A + B.
+
+shard(Shards, Key) ->
+    element(1 + erlang:phash2(Key, size(Shards)), Shards).
+
+shard_path(Path, I) ->
+    Path ++ "." ++ integer_to_list(I).
+
+%% [{Pid, [Elem]}], for the shards with anything to do, keeping the
+%% order of Elems within each.
+partition_by(Shards, KeyFun, Elems) ->
+    Dict = lists:foldr(fun (Elem, Acc) ->
+                               dict:append_list(shard(Shards, KeyFun(Elem)),
+                                                [Elem], Acc)
+                       end, dict:new(), Elems),
+    dict:to_list(Dict).
+
+partition(Shards, Keys) ->
+    partition_by(Shards, fun (Key) -> Key end, Keys).
+
+all(Shards, Fun) ->
+    all_ok(pmap(Fun, tuple_to_list(Shards))).
+
+all_indexed(Shards, Fun) ->
+    Pids = tuple_to_list(Shards),
+    all_ok(pmap(fun ({Pid, I}) -> Fun(Pid, I) end,
+                lists:zip(Pids, lists:seq(0, length(Pids) - 1)))).
+
+all_ok(Results) ->
+    case [Result || Result <- Results, Result =/= ok] of
+        []          -> ok;
+        [Err | _]   -> Err
+    end.
+
+%% The workers are monitored rather than linked, so a caller that
+%% traps exits gets no 'EXIT' from them. Every worker is waited for
+%% before a failure is passed on, leaving none of their messages
+%% behind.
+pmap(Fun, List) ->
+    Self = self(),
+    Ref = make_ref(),
+    Workers = [spawn_monitor(fun () -> Self ! {Ref, self(), Fun(Elem)} end) ||
+                  Elem <- List],
+    Results = [receive
+                   {Ref, Pid, Result} ->
+                       erlang:demonitor(MRef, [flush]),
+                       {ok, Result};
+                   {'DOWN', MRef, process, Pid, Reason} ->
+                       {exit, Reason}
+               end || {Pid, MRef} <- Workers],
+    case [Reason || {exit, Reason} <- Results] of
+        []           -> [Result || {ok, Result} <- Results];
+        [Reason | _] -> exit(Reason)
+    end.
+
+%% A reader sends a batch each time it is asked for one, until it
+%% sends [] or an error. It closes its cursor however it stops:
+%% having been told to, or on the caller going away.
+fold_reader(Parent, Ref, Pid) ->
+    MRef = erlang:monitor(process, Parent),
+    case toke_drv:iter_open(Pid) of
+        {ok, Cursor} ->
+            try
+                fold_reader1(Parent, MRef, Ref, Cursor)
+            after
+                ok = toke_drv:iter_close(Cursor)
+            end;
+        Err ->
+            fold_reader_send(Parent, MRef, Ref, Err)
+    end.
+
+fold_reader1(Parent, MRef, Ref, Cursor) ->
+    Batch = toke_drv:iter_next(Cursor, ?FOLD_BATCH),
+    case fold_reader_send(Parent, MRef, Ref, Batch) of
+        true  -> fold_reader1(Parent, MRef, Ref, Cursor);
+        false -> ok
+    end.
+
+%% Returns whether there is more to send.
+fold_reader_send(Parent, MRef, Ref, Batch) ->
+    receive
+        {Ref, next} ->
+            Parent ! {Ref, self(), Batch},
+            case Batch of
+                [_ | _] -> true;
+                _       -> false
+            end;
+        {Ref, stop} ->
+            false;
+        {'DOWN', MRef, process, Parent, _Reason} ->
+            false
+    end.
+
+%% Only the first of the Readers' 'DOWN's is looked for, as the
+%% others can't be picked out of the caller's mailbox. One of theirs
+%% is seen once the readers ahead of it have finished.
+fold_batches(_Fun, Acc, _Ref, []) ->
+    Acc;
+fold_batches(Fun, Acc, Ref, [{_First, FirstMRef} | _] = Readers) ->
+    receive
+        {Ref, Reader, []} ->
+            {value, {Reader, MRef}, Readers1} =
+                lists:keytake(Reader, 1, Readers),
+            erlang:demonitor(MRef, [flush]),
+            fold_batches(Fun, Acc, Ref, Readers1);
+        {Ref, Reader, [_ | _] = KVs} ->
+            Reader ! {Ref, next},
+            fold_batches(Fun, lists:foldl(fun ({Key, Value}, Acc1) ->
+                                                  Fun(Key, Value, Acc1)
+                                          end, Acc, KVs), Ref, Readers);
+        {Ref, _Reader, Err} ->
+            fold_stop(Ref, Readers),
+            Err;
+        {'DOWN', FirstMRef, process, _First, Reason} ->
+            exit(Reason)
+    end.
+
+%% Stop the Readers and wait for them to go, then drop whatever they
+%% sent in the meantime.
+fold_stop(Ref, Readers) ->
+    [Reader ! {Ref, stop} || {Reader, _MRef} <- Readers],
+    [begin
+         erlang:demonitor(MRef, [flush]),
+         MRef1 = erlang:monitor(process, Reader),
+         receive {'DOWN', MRef1, process, Reader, _Reason} -> ok end
+     end || {Reader, MRef} <- Readers],
+    fold_flush(Ref).
+
+fold_flush(Ref) ->
+    receive
+        {Ref, _Reader, _Batch} -> fold_flush(Ref)
+    after 0 ->
+            ok
+    end.
@@ -0,0 +1,85 @@
+%%  The contents of this file are subject to the Mozilla Public License
+%%  Version 1.1 (the "License"); you may not use this file except in
+%%  compliance with the License. You may obtain a copy of the License
+%%  at http://www.mozilla.org/MPL/
+%%
+%%  Software distributed under the License is distributed on an "AS IS"
+%%  basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+%%  the License for the specific language governing rights and
+%%  limitations under the License.
+%%
+%%  The Original Code is Toke.
+%%
+%%  The Initial Developer of the Original Code is VMware, Inc.
+%%  Copyright (c) 2009-2011 VMware, Inc.  All rights reserved.
+%%
+
+-module(bench_toke).
+
+-export([run/0, run/2]).
+
+-define(PATH, "/tmp/bench_toke").
+
+%% Inserts, gets and deletes Records records, each value padded out
+%% with ValueBytes of text, with no compression, deflate and the
+%% driver's excodec in turn, and reports ops/sec and the file's size.
+run() ->
+    run(200000, 200).
+
+run(Records, ValueBytes) ->
+    Keys = [erlang:md5(<<N:64>>) || N <- lists:seq(1, Records)],
+    Padding = padding(ValueBytes),
+    io:format("~-8s ~12s ~12s ~12s ~14s~n",
+              ["codec", "insert/s", "get/s", "delete/s", "file bytes"]),
+    [bench(Name, Opts, Keys, Padding) ||
+        {Name, Opts} <- [{none, []}, {deflate, [deflate]},
+                         {excodec, [excodec]}]],
+    ok.
+
+bench(Name, Opts, Keys, Padding) ->
+    Records = length(Keys),
+    {ok, Toke} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke),
+    ok = toke_drv:tune(Toke, 2 * Records, -1, -1, Opts),
+    ok = toke_drv:open(Toke, ?PATH, [read, write, create, truncate]),
+    Insert = rate(Records,
+                  fun () -> [ok = toke_drv:insert(Toke, Key,
+                                                  value(Key, Padding)) ||
+                                Key <- Keys]
+                  end),
+    Get = rate(Records,
+               fun () -> [true = is_binary(toke_drv:get(Toke, Key)) ||
+                             Key <- Keys]
+               end),
+    ok = toke_drv:close(Toke),
+    Size = filelib:file_size(?PATH),
+    ok = toke_drv:open(Toke, ?PATH, [read, write]),
+    Delete = rate(Records,
+                  fun () -> [ok = toke_drv:delete(Toke, Key) || Key <- Keys]
+                  end),
+    ok = toke_drv:close(Toke),
+    ok = toke_drv:delete(Toke),
+    ok = toke_drv:stop(Toke),
+    ok = file:delete(?PATH),
+    io:format("~-8s ~12b ~12b ~12b ~14b~n",
+              [Name, Insert, Get, Delete, Size]).
+
+%% Shaped like the msg store's index entries, then padded.
+value(Key, Padding) ->
+    term_to_binary({msg_location, Key, 1, 42, 1048576, 4096, Padding}).
+
+padding(Bytes) ->
+    Words = [<<"exchange">>, <<"routing">>, <<"key">>, <<"queue">>,
+             <<"durable">>, <<"persistent">>, <<"message">>],
+    padding(Bytes, Words, Words, <<>>).
+
+padding(Bytes, _Words, _All, Acc) when size(Acc) >= Bytes ->
+    binary:part(Acc, 0, Bytes);
+padding(Bytes, [], All, Acc) ->
+    padding(Bytes, All, All, Acc);
+padding(Bytes, [Word | Words], All, Acc) ->
+    padding(Bytes, Words, All, <<Acc/binary, Word/binary, " ">>).
+
+rate(Ops, Fun) ->
+    {Micros, _Result} = timer:tc(erlang, apply, [Fun, []]),
+    (Ops * 1000000) div lists:max([1, Micros]).
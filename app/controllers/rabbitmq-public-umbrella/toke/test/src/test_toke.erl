@@ -52,6 +52,30 @@ test() ->
     not_found = toke_drv:get(Toke, Ten),
     ok = toke_drv:delete_if_value_eq(Toke, Ten, Ten),
     ok = toke_drv:delete_if_value_eq(Toke, Ten, Nine),
+    Eleven = <<11:32/native>>,
+    [Nine, not_found, Eleven] = toke_drv:get_multi(Toke, [Nine, Ten, Eleven]),
+    ok = toke_drv:insert_multi(Toke, [{Ten, Ten}, {Eleven, Ten}]),
+    [Ten, Ten] = toke_drv:get_multi(Toke, [Ten, Eleven]),
+    ok = toke_drv:delete_multi(Toke, [Ten, Ten, Eleven]),
+    [not_found, not_found] = toke_drv:get_multi(Toke, [Ten, Eleven]),
+    ok = toke_drv:insert(Toke, Eleven, Eleven),
+    %% the not_found slots either side of a found value are skipped
+    %% when the job is freed, leaving the port up
+    [not_found, Eleven, not_found] =
+        toke_drv:get_multi(Toke, [Ten, Eleven, <<12:32/native>>]),
+    Eleven = toke_drv:get(Toke, Eleven),
+    [] = toke_drv:get_multi(Toke, []),
+    not_found = toke_drv:compare_and_swap(Toke, Ten, Ten, Nine),
+    {changed, Eleven} = toke_drv:compare_and_swap(Toke, Eleven, Ten, Nine),
+    ok = toke_drv:compare_and_swap(Toke, Eleven, Eleven, Ten),
+    {changed, Ten} = toke_drv:compare_and_swap(
+                       Toke, Eleven, {crc32, erlang:crc32(Eleven)}, Nine),
+    ok = toke_drv:compare_and_swap(
+           Toke, Eleven, {crc32, erlang:crc32(Ten)}, Eleven),
+    ok = toke_drv:update_atomically(
+           Toke, Eleven, fun (<<N:32/native>>) -> <<(N + 1):32/native>> end),
+    <<12:32/native>> = toke_drv:get(Toke, Eleven),
+    ok = toke_drv:insert(Toke, Eleven, Eleven),
     ok = toke_drv:close(Toke),
     ok = toke_drv:delete(Toke),
     ok = toke_drv:stop(Toke),
@@ -71,8 +95,431 @@ test() ->
     Sum = toke_drv:fold(fun (<<Key:32/native>>, <<Value:32/native>>, Acc)
                               when Key =:= Value ->
                                 Key + Value + Acc end, 0, Toke3),
+    {ok, Cursor} = toke_drv:iter_open(Toke3),
+    [{K1, K1}, {K2, K2}] = toke_drv:iter_next(Cursor, 2),
+    true = K1 =/= K2,
+    {ok, Cursor2} = toke_drv:iter_open(Toke3),
+    Batch = toke_drv:iter_next(Cursor2, 5000),
+    5000 = length(Batch),
+    [{K1, K1}, {K2, K2}, KV3, KV4 | _] = Batch,
+    [KV3, KV4] = toke_drv:iter_next(Cursor, 2), %% each keeps its place
+    ok = toke_drv:iter_close(Cursor2),
+    invalid_state = toke_drv:iter_next(Cursor2, 1),
+    ok = toke_drv:iter_close(Cursor),
     ok = toke_drv:close(Toke3),
     ok = toke_drv:delete(Toke3),
     ok = toke_drv:stop(Toke3),
 
+    {ok, Toke4} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke4),
+    ok = toke_drv:set_secondary(Toke4, 3),
+    ok = toke_drv:open(Toke4, "/tmp/test2", [read, write, create, truncate]),
+    ok = toke_drv:insert_multi(
+           Toke4, [{<<Num:32/native>>, term_to_binary({loc, Num, Num rem 3})}
+                   || Num <- lists:seq(1, 30)]),
+    ok = toke_drv:insert(Toke4, Ten, term_to_binary({loc, 10, 4})),
+    ok = toke_drv:insert(Toke4, Nine, <<"not a term">>),
+    ok = toke_drv:merge(Toke4, <<8:32/native>>, [{add, 2, 300}, {add, 2, -8}]),
+    {loc, 300, 2} = binary_to_term(toke_drv:get(Toke4, <<8:32/native>>)),
+    ok = toke_drv:merge(Toke4, <<8:32/native>>, [{add, 2, 1 bsl 40}]),
+    {loc, 300 + (1 bsl 40), 2} =
+        binary_to_term(toke_drv:get(Toke4, <<8:32/native>>)),
+    ok = toke_drv:merge(Toke4, <<8:32/native>>, [{replace, 2, 8}]),
+    bad_value = toke_drv:merge(Toke4, <<8:32/native>>, [{add, 1, 1}]),
+    bad_value = toke_drv:merge(Toke4, Nine, [{add, 2, 1}]),
+    not_found = toke_drv:merge(Toke4, <<31:32/native>>, [{add, 2, 1}]),
+    ok = toke_drv:merge(Toke4, <<13:32/native>>, [{replace, 3, 2}]),
+    true = term_to_binary({loc, 13, 2}) =:=
+        toke_drv:get(Toke4, <<13:32/native>>),
+    ok = toke_drv:delete_by_secondary(Toke4, 1),
+    true = not_found =/= toke_drv:get(Toke4, <<13:32/native>>),
+    not_found = toke_drv:get(Toke4, <<7:32/native>>),
+    true = not_found =/= toke_drv:get(Toke4, Ten),
+    ok = toke_drv:close(Toke4),
+    ok = toke_drv:open(Toke4, "/tmp/test2", [read, write]),
+    ok = toke_drv:delete_by_secondary(Toke4, 2),
+    ok = toke_drv:delete_by_secondary(Toke4, 4),
+    Left = lists:seq(3, 30, 3), %% including Nine, which isn't indexed
+    Left = lists:sort(toke_drv:fold(fun (<<Key:32/native>>, _Value, Acc) ->
+                                            [Key | Acc]
+                                    end, [], Toke4)),
+    ok = toke_drv:tran_begin(Toke4),
+    ok = toke_drv:insert(Toke4, Ten, Ten),
+    ok = toke_drv:tran_abort(Toke4),
+    not_found = toke_drv:get(Toke4, Ten),
+    invalid_state = toke_drv:tran_commit(Toke4),
+    ok = toke_drv:tran_begin(Toke4),
+    ok = toke_drv:merge(Toke4, <<3:32/native>>, [{replace, 3, 7}]),
+    ok = toke_drv:tran_abort(Toke4),
+    ok = toke_drv:delete_by_secondary(Toke4, 7), %% the index was rolled back
+    true = not_found =/= toke_drv:get(Toke4, <<3:32/native>>),
+    ok = toke_drv:set_group_commit(Toke4, 100, 0),
+    Self = self(),
+    Writers = [spawn_link(fun () ->
+                                  Key = <<Num:32/native>>,
+                                  ok = toke_drv:insert(Toke4, Key, Key),
+                                  Key = toke_drv:get(Toke4, Key),
+                                  Self ! {written, self()}
+                          end) || Num <- lists:seq(100, 199)],
+    [receive {written, Writer} -> ok end || Writer <- Writers],
+    ok = toke_drv:set_group_commit(Toke4, 10, 50),
+    ok = toke_drv:insert(Toke4, Ten, Ten),
+    Ten = toke_drv:get(Toke4, Ten),
+    ok = toke_drv:set_group_commit(Toke4, 0, 0),
+    ok = toke_drv:set_memtable(Toke4, 1000000, 0),
+    Twelve = <<12:32/native>>,
+    ok = toke_drv:insert_async(Toke4, Twelve, Twelve),
+    Twelve = toke_drv:get(Toke4, Twelve),
+    ok = toke_drv:delete(Toke4, Twelve),
+    [not_found, Ten] = toke_drv:get_multi(Toke4, [Twelve, Ten]),
+    ok = toke_drv:insert_async(Toke4, Twelve, Ten),
+    ok = toke_drv:insert_async(Toke4, Twelve, Twelve),
+    ok = toke_drv:insert_async(Toke4, Ten, Twelve),
+    ok = toke_drv:delete(Toke4, <<150:32/native>>),
+    ok = toke_drv:close(Toke4),
+    ok = toke_drv:open(Toke4, "/tmp/test2", [read]),
+    [Twelve, Twelve, not_found, <<151:32/native>>] =
+        toke_drv:get_multi(Toke4, [Ten, Twelve, <<150:32/native>>,
+                                   <<151:32/native>>]),
+    ok = toke_drv:close(Toke4),
+    ok = toke_drv:delete(Toke4),
+    ok = toke_drv:stop(Toke4),
+
+    {ok, Shards} = toke_shards:start_link(4),
+    ok = toke_shards:new(Shards),
+    ok = toke_shards:tune(Shards, 40000, 5, 15, []),
+    ok = toke_shards:open(Shards, "/tmp/test3",
+                          [read, write, create, truncate]),
+    ShardKeys = [<<Num:32/native>> || Num <- lists:seq(1, 1000)],
+    ok = toke_shards:insert_multi(Shards, [{Key, Key} || Key <- ShardKeys]),
+    ShardKeys = toke_shards:get_multi(Shards, ShardKeys),
+    ok = toke_shards:delete_multi(Shards, [Nine, Ten]),
+    [Eleven, not_found, not_found] =
+        toke_shards:get_multi(Shards, [Eleven, Ten, Nine]),
+    ok = toke_shards:insert(Shards, Ten, Nine),
+    Nine = toke_shards:get(Shards, Ten),
+    ok = toke_shards:close(Shards),
+    ok = toke_shards:set_bloom(Shards, 10, 50),
+    ok = toke_shards:open(Shards, "/tmp/test3", [read]),
+    Missing = [<<Num:32/native>> || Num <- lists:seq(1001, 2000)],
+    true = lists:all(fun (Result) -> Result =:= not_found end,
+                     toke_shards:get_multi(Shards, Missing)),
+    Nine = toke_shards:get(Shards, Ten),
+    Stats = toke_shards:stats(Shards),
+    true = 0 < proplists:get_value(bloom_bits, Stats),
+    999 = proplists:get_value(bloom_keys, Stats),
+    1001 = proplists:get_value(bloom_lookups, Stats),
+    1000 = proplists:get_value(bloom_negatives, Stats) +
+        proplists:get_value(bloom_false_positives, Stats),
+    true = 0.1 > proplists:get_value(bloom_false_positive_rate, Stats),
+    999 = proplists:get_value(records, Stats),
+    true = 0 < proplists:get_value(bytes_read, Stats),
+    {get_multi, GetMultis, GetMultiBuckets} =
+        lists:keyfind(get_multi, 1, proplists:get_value(latency, Stats)),
+    GetMultis = lists:sum(GetMultiBuckets),
+    true = GetMultis >= 4,
+    ShardSum = (1000 * 1001) div 2 - 9 - 10 + 9,
+    %% a fold, whether it finishes or not, leaves nothing behind in
+    %% the mailbox of a caller trapping exits
+    spawn_link(
+      fun () ->
+              process_flag(trap_exit, true),
+              ShardSum = toke_shards:fold(
+                           fun (_Key, <<Value:32/native>>, Acc) ->
+                                   Value + Acc
+                           end, 0, Shards),
+              stop = (catch toke_shards:fold(fun (_Key, _Value, _Acc) ->
+                                                     throw(stop)
+                                             end, 0, Shards)),
+              {messages, []} = process_info(self(), messages),
+              Self ! {shard_fold, ok}
+      end),
+    receive {shard_fold, ok} -> ok end,
+    ok = toke_shards:close(Shards),
+    ok = toke_shards:delete(Shards),
+    ok = toke_shards:stop(Shards),
+
+    {ok, Toke5} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke5),
+    ok = toke_drv:tune(Toke5, 1000, 5, 15, [large]),
+    ok = toke_drv:bulk_begin(Toke5, 100000),
+    ok = toke_drv:open(Toke5, "/tmp/test4", [read, write, create, truncate]),
+    [ok = toke_drv:bulk_insert(
+            Toke5, [{<<Num:32/native>>, <<Num:32/native>>} ||
+                       Num <- lists:seq(Base + 1, Base + 10000)])
+     || Base <- lists:seq(0, 90000, 10000)],
+    ok = toke_drv:bulk_end(Toke5),
+    ok = toke_drv:close(Toke5),
+    ok = toke_drv:open(Toke5, "/tmp/test4", [read]),
+    BulkSum = (100000 * 100001) div 2,
+    BulkSum = toke_drv:fold(fun (_Key, <<Value:32/native>>, Acc) ->
+                                    Value + Acc
+                            end, 0, Toke5),
+    ok = toke_drv:close(Toke5),
+    ok = toke_drv:delete(Toke5),
+    ok = toke_drv:stop(Toke5),
+
+    {ok, Toke6} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke6),
+    ok = toke_drv:tune(Toke6, 100, 5, 15, []),
+    ok = toke_drv:set_df_unit(Toke6, 0),
+    ok = toke_drv:open(Toke6, "/tmp/test5", [read, write, create, truncate]),
+    invalid_state = toke_drv:optimize(Toke6),
+    ok = toke_drv:set_maintenance(Toke6, 10, 100, 0),
+    ok = toke_drv:insert_multi(
+           Toke6, [{<<Num:32/native>>, <<Num:32/native>>} ||
+                      Num <- lists:seq(1, 1000)]),
+    ok = toke_drv:delete_multi(
+           Toke6, [<<Num:32/native>> || Num <- lists:seq(1, 200)]),
+    ok = wait_for_stat(Toke6, optimizes, 1), %% 800 records in ~100 buckets
+    ok = toke_drv:optimize(Toke6),
+    ok = toke_drv:insert(Toke6, Ten, Nine),
+    ok = wait_for_stat(Toke6, optimizes, 2),
+    Nine = toke_drv:get(Toke6, Ten),
+    MaintSum = (1000 * 1001) div 2 - (200 * 201) div 2 + 9,
+    MaintSum = toke_drv:fold(fun (_Key, <<Value:32/native>>, Acc) ->
+                                     Value + Acc
+                             end, 0, Toke6),
+    ok = toke_drv:close(Toke6),
+    ok = toke_drv:delete(Toke6),
+    ok = toke_drv:stop(Toke6),
+
+    {ok, Toke7} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke7),
+    ok = toke_drv:open(Toke7, "/tmp/test6", [read, write, create, truncate]),
+    {ok, Handle} = toke_drv:add_handle(Toke7),
+    ok = toke_drv:new(Handle),
+    ok = toke_drv:open(Handle, "/tmp/test7", [read, write, create, truncate]),
+    ok = toke_drv:set_group_commit(Toke7, 10, 50),
+    ok = toke_drv:insert(Toke7, Ten, Ten),
+    ok = toke_drv:insert(Handle, Ten, Nine),
+    Ten = toke_drv:get(Toke7, Ten),
+    [Nine, not_found] = toke_drv:get_multi(Handle, [Ten, Nine]),
+    ok = toke_drv:remove_handle(Handle),
+    no_such_handle = toke_drv:get(Handle, Ten),
+    {ok, Handle} = toke_drv:add_handle(Toke7), %% the id is reused
+    invalid_state = toke_drv:get(Handle, Ten), %% and the handle is new
+    ok = toke_drv:remove_handle(Handle),
+    invalid_state = toke_drv:remove_handle({toke_handle, Toke7, 0}),
+    ok = toke_drv:close(Toke7),
+    ok = toke_drv:delete(Toke7),
+    ok = toke_drv:stop(Toke7),
+
+    {ok, Toke8} = toke_drv:start_link(0),
+    ok = toke_drv:new(Toke8),
+    ok = toke_drv:share(Toke8, <<"test8">>),
+    ok = toke_drv:open(Toke8, "/tmp/test8", [read, write, create, truncate]),
+    ok = toke_drv:insert(Toke8, Ten, Ten),
+    Readers = [begin
+                   {ok, Reader} = toke_drv:start_link(Worker),
+                   ok = toke_drv:attach(Reader, <<"test8">>),
+                   Reader
+               end || Worker <- [1, 2]],
+    [[Ten, not_found] = toke_drv:get_multi(Reader, [Ten, Nine]) ||
+        Reader <- Readers],
+    [Reader1 | _] = Readers,
+    invalid_state = toke_drv:insert(Reader1, Nine, Nine),
+    invalid_state = toke_drv:attach(Reader1, <<"test8">>),
+    ok = toke_drv:insert(Toke8, Nine, Nine),
+    Nine = toke_drv:get(Reader1, Nine),
+    ok = toke_drv:insert(Toke8, Nine, <<0:8000>>), %% got whole
+    <<0:8000>> = toke_drv:get(Reader1, Nine),
+    invalid_state = toke_drv:close(Toke8), %% the readers are reading it
+    ok = toke_drv:delete(Toke8), %% the readers still have it
+    not_found = toke_drv:attach(Toke8, <<"test8">>),
+    Ten = toke_drv:get(Reader1, Ten),
+    [ok = toke_drv:stop(Reader) || Reader <- Readers],
+    ok = toke_drv:stop(Toke8),
+
+    {ok, Toke9} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke9),
+    ok = toke_drv:tune(Toke9, 1000, -1, -1, [excodec]),
+    ok = toke_drv:open(Toke9, "/tmp/test9", [read, write, create, truncate]),
+    Packed = list_to_binary(lists:duplicate(100, "toke")),
+    Small = <<1,2,3>>,
+    ok = toke_drv:insert(Toke9, Ten, Packed),
+    ok = toke_drv:insert(Toke9, Nine, Small),
+    ok = toke_drv:insert(Toke9, Small, <<>>),
+    [Packed, Small, <<>>] = toke_drv:get_multi(Toke9, [Ten, Nine, Small]),
+    ok = toke_drv:close(Toke9),
+    ok = toke_drv:open(Toke9, "/tmp/test9", [read]),
+    Packed = toke_drv:get(Toke9, Ten),
+    ok = toke_drv:close(Toke9),
+    ok = toke_drv:delete(Toke9),
+    ok = toke_drv:stop(Toke9),
+
+    {ok, Toke10} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke10, memory),
+    ok = toke_drv:tune(Toke10, 1000, -1, -1, []),
+    unsupported = toke_drv:share(Toke10, <<"test10">>),
+    ok = toke_drv:open(Toke10, "/tmp/test10", [read, write, create, truncate]),
+    MsgIds = [erlang:md5(<<N:32>>) || N <- lists:seq(1, 5000)],
+    ok = toke_drv:insert_multi(Toke10, [{MsgId, MsgId} || MsgId <- MsgIds]),
+    [MsgId1, MsgId2 | _] = MsgIds,
+    MsgId1 = toke_drv:get(Toke10, MsgId1),
+    Spilled = list_to_binary(lists:duplicate(200, 7)),
+    ok = toke_drv:insert(Toke10, MsgId2, Spilled),
+    Spilled = toke_drv:get(Toke10, MsgId2),
+    ok = toke_drv:delete(Toke10, MsgId1),
+    not_found = toke_drv:get(Toke10, MsgId1),
+    {error_from_tokyo_cabinet, _} = %% keys are at most 16 bytes
+        toke_drv:insert(Toke10, <<0:136>>, Ten),
+    ok = toke_drv:tran_begin(Toke10),
+    ok = toke_drv:insert(Toke10, MsgId1, Ten),
+    ok = toke_drv:delete(Toke10, MsgId2),
+    ok = toke_drv:tran_abort(Toke10),
+    not_found = toke_drv:get(Toke10, MsgId1),
+    Spilled = toke_drv:get(Toke10, MsgId2),
+    4999 = toke_drv:fold(fun (_Key, _Value, Acc) -> Acc + 1 end, 0, Toke10),
+    {4999, 4999} = %% a fold within a fold
+        toke_drv:fold(fun (_Key, _Value, {N, undefined}) ->
+                              {N + 1, toke_drv:fold(fun (_K, _V, M) ->
+                                                            M + 1
+                                                    end, 0, Toke10)};
+                          (_Key, _Value, {N, Inner}) ->
+                              {N + 1, Inner}
+                      end, {0, undefined}, Toke10),
+    unsupported = toke_drv:iter_open(Toke10, {prefix, MsgId2}),
+    ok = toke_drv:optimize(Toke10), %% drops MsgId1's slot, and snapshots
+    Spilled = toke_drv:get(Toke10, MsgId2),
+    ok = toke_drv:close(Toke10), %% snapshots
+    ok = toke_drv:open(Toke10, "/tmp/test10", [read, write]),
+    Spilled = toke_drv:get(Toke10, MsgId2),
+    4999 = proplists:get_value(records, toke_drv:stats(Toke10)),
+    {ok, Grown} = toke_drv:iter_open(Toke10),
+    [_] = toke_drv:iter_next(Grown, 1),
+    ok = toke_drv:insert_multi(Toke10, [{erlang:md5(<<N:32>>), <<>>} ||
+                                           N <- lists:seq(5001, 8000)]),
+    invalid_state = toke_drv:iter_next(Grown, 1), %% the table has grown
+    ok = toke_drv:iter_close(Grown),
+    ok = toke_drv:close(Toke10),
+    ok = toke_drv:delete(Toke10),
+    ok = toke_drv:stop(Toke10),
+
+    {ok, Toke11} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke11, tree),
+    ok = toke_drv:open(Toke11, "/tmp/test11", [read, write, create, truncate]),
+    ok = toke_drv:insert_multi(Toke11, [{<<"a">>, <<>>}, {<<"c">>, <<>>} |
+                                        [{<<"b", N>>, <<N>>} ||
+                                            N <- lists:seq(0, 255)]]),
+    Ordered = toke_drv:fold(fun (Key, _Value, Acc) -> [Key | Acc] end, [],
+                            Toke11),
+    Ordered = lists:reverse(lists:sort(Ordered)),
+    {ok, Prefixed} = toke_drv:iter_open(Toke11, {prefix, <<"b">>}),
+    InPrefix = toke_drv:iter_next(Prefixed, 1000),
+    256 = length(InPrefix),
+    [{<<"b", 0>>, <<0>>} | _] = InPrefix,
+    [] = toke_drv:iter_next(Prefixed, 1000),
+    {ok, Ranged} =
+        toke_drv:iter_open(Toke11, {range, <<"b", 10>>, <<"b", 20>>}),
+    InRange = toke_drv:iter_next(Ranged, 1000),
+    [{<<"b", 10>>, <<10>>} | _] = InRange,
+    10 = length(InRange),
+    ok = toke_drv:iter_close(Ranged),
+    {ok, Rest} = toke_drv:iter_open(Toke11, {range, <<"b", 255>>, infinity}),
+    [{<<"b", 255>>, _}, {<<"c">>, _}] = toke_drv:iter_next(Rest, 1000),
+    ok = toke_drv:close(Toke11),
+    ok = toke_drv:delete(Toke11),
+    ok = toke_drv:stop(Toke11),
+
+    {ok, Toke12} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke12, {fixed, 8}),
+    ok = toke_drv:open(Toke12, "/tmp/test12", [read, write, create, truncate]),
+    ok = toke_drv:insert_multi(Toke12, [{<<N:64>>, <<N:64>>} ||
+                                           N <- lists:seq(1, 100)]),
+    <<5:64>> = toke_drv:get(Toke12, <<5:64>>),
+    not_found = toke_drv:get(Toke12, <<"five">>),
+    {error_from_tokyo_cabinet, _} = %% ids start at 1
+        toke_drv:insert(Toke12, <<0:64>>, <<>>),
+    {error_from_tokyo_cabinet, _} = %% too wide
+        toke_drv:insert(Toke12, <<1:64>>, <<0:72>>),
+    ok = toke_drv:insert(Toke12, <<101:64>>, term_to_binary({1})),
+    {error_from_tokyo_cabinet, "invalid operation"} = %% merged too wide
+        toke_drv:merge(Toke12, <<101:64>>, [{replace, 1, 1 bsl 40}]),
+    {1} = binary_to_term(toke_drv:get(Toke12, <<101:64>>)),
+    {ok, Ids} = toke_drv:iter_open(Toke12, {range, <<50:64>>, <<60:64>>}),
+    InIds = toke_drv:iter_next(Ids, 1000),
+    [{<<50:64>>, <<50:64>>} | _] = InIds,
+    10 = length(InIds),
+    ok = toke_drv:close(Toke12),
+    ok = toke_drv:delete(Toke12),
+    ok = toke_drv:stop(Toke12),
+
+    {ok, Toke13} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke13),
+    ok = toke_drv:set_bloom(Toke13, 10, 50),
+    ok = toke_drv:open(Toke13, "/tmp/test13", [read, write, create, truncate]),
+    {ok, Handle13} = toke_drv:add_handle(Toke13),
+    ok = toke_drv:new(Handle13),
+    ok = toke_drv:open(Handle13, "/tmp/test13b",
+                       [read, write, create, truncate]),
+    ok = toke_drv:insert(Toke13, <<"a">>, <<"one">>),
+    ok = toke_drv:insert(Handle13, <<"a">>, <<"two">>),
+    {ok, Direct13} = toke_drv:direct(Toke13),
+    {ok, DirectHandle13} = toke_drv:direct(Handle13),
+    %% the port's idle, so the driver answers there and then: handle
+    %% 0, TOKE_GET, the key's size, the key
+    {toke_direct, Port13, 0, Toke13} = Direct13,
+    <<"one">> = erlang:port_call(Port13, 0,
+                                 <<0:32/native, 14:8/native, 1:64/native,
+                                   "a">>),
+    Self = self(),
+    spawn_link(fun () -> %% not the port's owner
+                       Self ! {direct, toke_drv:get(Direct13, <<"a">>),
+                               toke_drv:get(DirectHandle13, <<"a">>)}
+               end),
+    receive {direct, <<"one">>, <<"two">>} -> ok
+    after 5000 -> exit(direct_timeout)
+    end,
+    not_found = toke_drv:get(Direct13, <<"b">>),
+    [<<"one">>, not_found] =
+        toke_drv:get_multi(Direct13, [<<"a">>, <<"b">>]),
+    true = proplists:is_defined(latency, toke_drv:stats(Direct13)),
+    ok = toke_drv:insert(Direct13, <<"b">>, <<"three">>), %% the long way
+    <<"three">> = toke_drv:get(Direct13, <<"b">>),
+    %% Direct's casts go straight to the port, so its gets see them
+    ok = toke_drv:insert_async(Direct13, <<"c">>, <<"four">>),
+    <<"four">> = toke_drv:get(Direct13, <<"c">>),
+    %% enough deletes leave the filter stale, rather than rebuilding
+    %% it there and then, and a tick rebuilds it
+    Bloom13 = [<<N:32>> || N <- lists:seq(1, 100)],
+    ok = toke_drv:insert_multi(Toke13, [{Key, <<>>} || Key <- Bloom13]),
+    ok = toke_drv:delete_multi(Toke13, lists:sublist(Bloom13, 60)),
+    103 = proplists:get_value(bloom_keys, toke_drv:stats(Toke13)),
+    ok = wait_for_stat_eq(Toke13, bloom_keys, 43),
+    ok = toke_drv:remove_handle(Handle13),
+    ok = toke_drv:close(Toke13),
+    ok = toke_drv:delete(Toke13),
+    ok = toke_drv:stop(Toke13),
+
+    %% deleting an open db forgets it, for stats, ticks and gets alike
+    {ok, Toke14} = toke_drv:start_link(),
+    ok = toke_drv:new(Toke14),
+    ok = toke_drv:set_bloom(Toke14, 10, 50),
+    ok = toke_drv:set_maintenance(Toke14, 10, 100, 0),
+    ok = toke_drv:open(Toke14, "/tmp/test14", [read, write, create, truncate]),
+    ok = toke_drv:insert(Toke14, <<"a">>, <<"one">>),
+    ok = toke_drv:delete(Toke14),
+    Stats14 = toke_drv:stats(Toke14),
+    0 = proplists:get_value(records, Stats14),
+    0 = proplists:get_value(file_size, Stats14),
+    0 = proplists:get_value(bloom_keys, Stats14),
+    ok = timer:sleep(50), %% a few ticks
+    invalid_state = toke_drv:get(Toke14, <<"a">>),
+    ok = toke_drv:stop(Toke14),
+
     passed.
+
+wait_for_stat_eq(Pid, Name, Value) ->
+    case proplists:get_value(Name, toke_drv:stats(Pid)) =:= Value of
+        true  -> ok;
+        false -> timer:sleep(10),
+                 wait_for_stat_eq(Pid, Name, Value)
+    end.
+
+wait_for_stat(Pid, Name, Min) ->
+    case proplists:get_value(Name, toke_drv:stats(Pid)) >= Min of
+        true  -> ok;
+        false -> timer:sleep(10),
+                 wait_for_stat(Pid, Name, Min)
+    end.